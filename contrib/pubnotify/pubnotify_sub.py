@@ -0,0 +1,73 @@
+#!/usr/bin/env python2
+# Copyright (c) 2015 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+'''
+Example subscriber for the bitcoind -pub* notifications (see doc/pubnotify.md).
+
+Prints every message, and warns when the sequence number of a topic skips,
+which means messages were dropped because this subscriber fell behind.
+
+Usage: pubnotify_sub.py tcp://127.0.0.1:28332
+       pubnotify_sub.py unix:/path/to/socket
+'''
+
+import binascii
+import socket
+import struct
+import sys
+
+def read_exact(f, n):
+    data = f.read(n)
+    if len(data) != n:
+        raise EOFError()
+    return data
+
+def read_compact_size(f):
+    n = ord(read_exact(f, 1))
+    if n == 253:
+        n = struct.unpack("<H", read_exact(f, 2))[0]
+    elif n == 254:
+        n = struct.unpack("<I", read_exact(f, 4))[0]
+    elif n == 255:
+        n = struct.unpack("<Q", read_exact(f, 8))[0]
+    return n
+
+def read_string(f):
+    return read_exact(f, read_compact_size(f))
+
+def connect(address):
+    if address.startswith("tcp://"):
+        host, port = address[6:].rsplit(":", 1)
+        return socket.create_connection((host.strip("[]"), int(port)))
+    if address.startswith("unix:"):
+        s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        s.connect(address[5:])
+        return s
+    raise ValueError("unsupported address %s" % address)
+
+def main():
+    if len(sys.argv) != 2:
+        print __doc__
+        sys.exit(1)
+    f = connect(sys.argv[1]).makefile('rb')
+    next_sequence = {}
+    try:
+        while True:
+            topic = read_string(f)
+            payload = read_string(f)
+            sequence = struct.unpack("<I", read_exact(f, 4))[0]
+            expected = next_sequence.get(topic, sequence)
+            if sequence != expected:
+                print "WARNING: missed %d %s messages" % (sequence - expected, topic)
+            next_sequence[topic] = sequence + 1
+            if topic.startswith("hash"):
+                print "%s %d %s" % (topic, sequence, binascii.hexlify(payload))
+            else:
+                print "%s %d (%d bytes)" % (topic, sequence, len(payload))
+    except EOFError:
+        print "Disconnected"
+
+if __name__ == '__main__':
+    main()
@@ -24,6 +24,8 @@ testScripts=(
     'getchaintips.py'
     'rawtransactions.py'
     'rest.py'
+    'rest-blockrange.py'
+    'rest-getutxos-batch.py'
     'mempool_spendcoinbase.py'
     'mempool_coinbase_spends.py'
     'httpbasics.py'
@@ -36,6 +38,10 @@ testScripts=(
     'nodehandling.py'
     'reindex.py'
     'decodescript.py'
+    'p2p-compactblocks.py'
+    'p2p-sendheaders.py'
+    'pubnotify.py'
+    'metrics.py'
 );
 testScriptsExt=(
     'bipdersig-p2p.py'
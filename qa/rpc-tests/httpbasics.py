@@ -98,5 +98,22 @@ class HTTPBasicsTest (BitcoinTestFramework):
         assert_equal('"error":null' in out1, True)
         assert_equal(conn.sock!=None, True) #connection must be closed because bitcoind should use keep-alive by default
 
+        #idle keep-alive connections must not occupy the RPC worker threads
+        idle = []
+        for i in range(8): #more than the default -rpcthreads
+            c = httplib.HTTPConnection(urlNode2.hostname, urlNode2.port)
+            c.connect()
+            c.request('POST', '/', '{"method": "getbestblockhash"}', headers)
+            assert_equal('"error":null' in c.getresponse().read(), True)
+            idle.append(c)
+        conn = httplib.HTTPConnection(urlNode2.hostname, urlNode2.port, timeout=10)
+        conn.connect()
+        conn.request('POST', '/', '{"method": "getchaintips"}', headers)
+        out1 = conn.getresponse().read();
+        assert_equal('"error":null' in out1, True)
+        conn.close()
+        for c in idle:
+            c.close()
+
 if __name__ == '__main__':
     HTTPBasicsTest ().main ()
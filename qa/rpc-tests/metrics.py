@@ -0,0 +1,86 @@
+#!/usr/bin/env python2
+#
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+#
+# Test the -metrics HTTP endpoint
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+from test_framework.blocktools import create_block, create_coinbase
+import binascii
+import httplib
+import time
+import urlparse
+
+def http_get(url, path):
+    conn = httplib.HTTPConnection(url.hostname, url.port)
+    conn.request('GET', path)
+    response = conn.getresponse()
+    return response.status, response.getheader('Content-Type'), response.read()
+
+def parse_metrics(text):
+    '''Samples by name and labels, and the type of each metric name'''
+    samples = {}
+    types = {}
+    for line in text.splitlines():
+        if line.startswith('# TYPE '):
+            name, kind = line[7:].split(' ')
+            types[name] = kind
+        elif not line.startswith('#'):
+            key, value = line.rsplit(' ', 1)
+            samples[key] = float(value)
+    return samples, types
+
+class MetricsTest(BitcoinTestFramework):
+    def setup_chain(self):
+        print "Initializing test directory "+self.options.tmpdir
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self):
+        self.nodes = start_nodes(2, self.options.tmpdir, extra_args=[["-metrics"], []])
+        self.is_network_split = True
+
+    def run_test(self):
+        url = urlparse.urlparse(self.nodes[0].url)
+        # The test framework polls getblockcount while starting the node
+        calls_before = parse_metrics(http_get(url, "/metrics")[2])[0]['bitcoin_rpc_seconds_count{method="getblockcount"}']
+
+        tip = int(self.nodes[0].getbestblockhash(), 16)
+        block_time = int(time.time()) - 100
+        for i in range(10):
+            block = create_block(tip, create_coinbase(), block_time + i)
+            block.solve()
+            assert_equal(self.nodes[0].submitblock(binascii.hexlify(block.serialize())), None)
+            tip = block.sha256
+        self.nodes[0].getblockcount()
+        assert_raises(JSONRPCException, self.nodes[0].getblock, "00")
+
+        status, content_type, text = http_get(url, "/metrics")
+        assert_equal(status, 200)
+        assert content_type.startswith("text/plain")
+        samples, types = parse_metrics(text)
+
+        # The genesis block is connected at startup, too
+        assert_equal(types["bitcoin_block_connect_seconds"], "histogram")
+        assert_equal(samples['bitcoin_block_connect_seconds_count{phase="total"}'], 11)
+        assert_equal(samples['bitcoin_block_connect_seconds_bucket{phase="total",le="+Inf"}'], 11)
+        assert_equal(types["bitcoin_coins_cache_lookups_total"], "counter")
+        assert_greater_than(samples['bitcoin_coins_cache_lookups_total{result="miss"}'], 0)
+        assert_equal(samples['bitcoin_rpc_seconds_count{method="getblockcount"}'], calls_before + 1)
+        assert_equal(samples['bitcoin_rpc_errors_total{method="getblockcount"}'], 0)
+        assert_equal(samples['bitcoin_rpc_errors_total{method="getblock"}'], 1)
+        assert 'bitcoin_net_message_seconds_count{command="other"}' in samples
+        assert 'bitcoin_mempool_accept_total{result="accepted"}' in samples
+
+        # Only GET, and only with -metrics
+        conn = httplib.HTTPConnection(url.hostname, url.port)
+        conn.request('POST', "/metrics", "")
+        assert_equal(conn.getresponse().status, 405)
+        assert_equal(http_get(urlparse.urlparse(self.nodes[1].url), "/metrics")[0], 404)
+
+if __name__ == '__main__':
+    MetricsTest().main()
@@ -0,0 +1,294 @@
+#!/usr/bin/env python2
+#
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+from test_framework.mininode import *
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+from test_framework.blocktools import create_block, create_coinbase
+from test_framework.script import CScript, OP_TRUE
+import time
+
+'''
+CompactBlocksTest -- test relay of blocks as compact blocks (cmpctblock,
+getblocktxn, blocktxn and sendcmpct).
+
+Setup: one node, and three mininode peers:
+- test_node gives the node blocks, as compact blocks when testing reception;
+- cmpct_node asks for new blocks to be pushed to it as compact blocks;
+- legacy_node relies on inv/getdata.
+
+The test:
+1. The node offers compact blocks (low bandwidth) to every peer after verack.
+2. Build a mature chain, and put transactions in the node's mempool.
+3. A compact block of mempool transactions is rebuilt without any round trip,
+   and the peer that gave it is asked to push new blocks as compact blocks.
+4. A compact block with transactions the node lacks: the node asks for exactly
+   those with getblocktxn, and accepts the block once given them.
+5. A compact block that doesn't match its transactions is rejected.
+6. A block reaching the node is pushed whole to cmpct_node as a compact block
+   (half a round trip), while legacy_node has to fetch it after an inv. Reports
+   the bytes sent each way and the time until each peer has the block.
+7. The node serves getdata(MSG_CMPCT_BLOCK) and getblocktxn.
+'''
+
+MSG_CMPCT_BLOCK = 4
+
+class TestNode(NodeConnCB):
+    def __init__(self):
+        NodeConnCB.__init__(self)
+        self.create_callback_map()
+        self.connection = None
+        self.ping_counter = 1
+        self.last_pong = msg_pong()
+        self.last_sendcmpct = []
+        self.last_cmpctblock = None
+        self.last_getblocktxn = None
+        self.last_blocktxn = None
+        self.last_block = None
+        self.last_inv = None
+        self.block_received_time = {}
+
+    def add_connection(self, conn):
+        self.connection = conn
+
+    def wait_for_verack(self):
+        while True:
+            with mininode_lock:
+                if self.verack_received:
+                    return
+            time.sleep(0.05)
+
+    def send_message(self, message):
+        self.connection.send_message(message)
+
+    def on_pong(self, conn, message):
+        self.last_pong = message
+
+    def on_sendcmpct(self, conn, message):
+        self.last_sendcmpct.append(message)
+
+    def on_cmpctblock(self, conn, message):
+        self.last_cmpctblock = message
+        message.header_and_shortids.header.calc_sha256()
+        self.block_received_time.setdefault(message.header_and_shortids.header.sha256, time.time())
+
+    def on_getblocktxn(self, conn, message):
+        self.last_getblocktxn = message
+
+    def on_blocktxn(self, conn, message):
+        self.last_blocktxn = message
+
+    def on_block(self, conn, message):
+        self.last_block = message
+        message.block.calc_sha256()
+        self.block_received_time.setdefault(message.block.sha256, time.time())
+
+    def on_inv(self, conn, message):
+        self.last_inv = message
+        NodeConnCB.on_inv(self, conn, message)
+
+    def sync_with_ping(self, timeout=30):
+        self.connection.send_message(msg_ping(nonce=self.ping_counter))
+        received_pong = False
+        sleep_time = 0.05
+        while not received_pong and timeout > 0:
+            time.sleep(sleep_time)
+            timeout -= sleep_time
+            with mininode_lock:
+                if self.last_pong.nonce == self.ping_counter:
+                    received_pong = True
+        self.ping_counter += 1
+        return received_pong
+
+    def wait_for(self, predicate, timeout=30):
+        while timeout > 0:
+            with mininode_lock:
+                if predicate():
+                    return True
+            time.sleep(0.05)
+            timeout -= 0.05
+        return False
+
+
+class CompactBlocksTest(BitcoinTestFramework):
+    def setup_chain(self):
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self):
+        self.nodes = [start_node(0, self.options.tmpdir,
+                                 ["-debug", "-whitelist=127.0.0.1"])]
+
+    def tip(self):
+        return int(self.nodes[0].getbestblockhash(), 16)
+
+    def build_block(self, txs=[]):
+        # Every block built is eventually given to the node, so each builds on the last
+        block = create_block(self.last_block, create_coinbase(), self.block_time)
+        self.block_time += 1
+        block.vtx.extend(txs)
+        block.hashMerkleRoot = block.calc_merkle_root()
+        block.rehash()
+        block.solve()
+        self.last_block = block.sha256
+        return block
+
+    def spend(self, tx, value=None):
+        # Outputs are anyone-can-spend, and regtest relays non-standard transactions
+        spend = CTransaction()
+        spend.vin.append(CTxIn(COutPoint(tx.sha256, 0), CScript([OP_TRUE]), 0xffffffff))
+        spend.vout.append(CTxOut(tx.vout[0].nValue - 10000, ""))
+        spend.calc_sha256()
+        return spend
+
+    def send_to_mempool(self, txs):
+        for tx in txs:
+            self.test_node.send_message(msg_tx(tx))
+        self.test_node.sync_with_ping()
+        mempool = self.nodes[0].getrawmempool()
+        wait = 0
+        while not all(tx.hash in mempool for tx in txs) and wait < 30:
+            time.sleep(0.1)
+            wait += 0.1
+            mempool = self.nodes[0].getrawmempool()
+        assert(all(tx.hash in mempool for tx in txs))
+
+    def send_cmpctblock(self, node, block, prefill_list=[0]):
+        comp_block = HeaderAndShortIDs()
+        comp_block.initialize_from_block(block, nonce=random.getrandbits(64), prefill_list=prefill_list)
+        msg = msg_cmpctblock(comp_block.to_p2p())
+        node.send_message(msg)
+        return len(msg.serialize())
+
+    def run_test(self):
+        self.test_node = test_node = TestNode()
+        cmpct_node = TestNode()
+        legacy_node = TestNode()
+        for peer in [test_node, cmpct_node, legacy_node]:
+            peer.add_connection(NodeConn('127.0.0.1', p2p_port(0), self.nodes[0], peer))
+        NetworkThread().start()
+        for peer in [test_node, cmpct_node, legacy_node]:
+            peer.wait_for_verack()
+
+        # 1. Compact blocks are offered, but not pushed, to every peer
+        assert(test_node.wait_for(lambda: len(test_node.last_sendcmpct) > 0))
+        with mininode_lock:
+            assert_equal(test_node.last_sendcmpct[0].announce, False)
+            assert_equal(test_node.last_sendcmpct[0].version, 1)
+        test_node.send_message(msg_sendcmpct(announce=False, version=1))
+
+        # 2. A mature chain of anyone-can-spend coinbases
+        self.block_time = int(time.time()) - 200
+        self.last_block = self.tip()
+        coinbases = []
+        for i in xrange(200):
+            block = self.build_block()
+            coinbases.append(block.vtx[0])
+            test_node.send_message(msg_block(block))
+        test_node.sync_with_ping()
+        assert_equal(self.tip(), block.sha256)
+        assert_equal(self.nodes[0].getblockcount(), 200)
+
+        # 3. A block of mempool transactions is rebuilt from the compact block alone
+        txs = [self.spend(coinbases[i]) for i in xrange(20)]
+        self.send_to_mempool(txs)
+        block = self.build_block(txs)
+        cmpct_bytes = self.send_cmpctblock(test_node, block)
+        full_bytes = len(msg_block(block).serialize())
+        test_node.sync_with_ping()
+        assert_equal(self.tip(), block.sha256)
+        with mininode_lock:
+            assert(test_node.last_getblocktxn is None)
+            # Having given us the block first, test_node is now asked to push blocks to us
+            assert_equal(test_node.last_sendcmpct[-1].announce, True)
+        assert_equal(len(self.nodes[0].getrawmempool()), 0)
+        print "Block of %d transactions: %d bytes as a block, %d bytes as a compact block" % (
+            len(block.vtx), full_bytes, cmpct_bytes)
+
+        # 4. Transactions missing from the mempool are requested, and only those
+        in_mempool = [self.spend(coinbases[i]) for i in xrange(20, 30)]
+        self.send_to_mempool(in_mempool)
+        missing = [self.spend(coinbases[i]) for i in xrange(30, 35)]
+        block = self.build_block(in_mempool[:5] + missing[:3] + in_mempool[5:] + missing[3:])
+        self.send_cmpctblock(test_node, block)
+        assert(test_node.wait_for(lambda: test_node.last_getblocktxn is not None))
+        with mininode_lock:
+            request = test_node.last_getblocktxn.block_txn_request
+            assert_equal(request.blockhash, block.sha256)
+            assert_equal(request.to_absolute(), [6, 7, 8, 14, 15])
+            test_node.last_getblocktxn = None
+        response = msg_blocktxn()
+        response.block_transactions = BlockTransactions(block.sha256, [block.vtx[i] for i in [6, 7, 8, 14, 15]])
+        test_node.send_message(response)
+        test_node.sync_with_ping()
+        assert_equal(self.tip(), block.sha256)
+
+        # 5. Transactions that don't hash to the header's merkle root are
+        # rejected, and the full block is fetched instead
+        txs = [self.spend(coinbases[i]) for i in xrange(35, 37)]
+        block = self.build_block(txs)
+        self.send_cmpctblock(test_node, block)
+        assert(test_node.wait_for(lambda: test_node.last_getblocktxn is not None))
+        response = msg_blocktxn()
+        response.block_transactions = BlockTransactions(block.sha256, [txs[1], txs[0]])
+        with mininode_lock:
+            test_node.last_getblocktxn = None
+            test_node.last_getdata = None
+        test_node.send_message(response)
+        test_node.sync_with_ping()
+        assert(self.tip() != block.sha256)
+        test_node.send_message(msg_block(block))
+        test_node.sync_with_ping()
+        assert_equal(self.tip(), block.sha256)
+
+        # 6. Pushed compact blocks versus inv/getdata
+        cmpct_node.send_message(msg_sendcmpct(announce=True, version=1))
+        cmpct_node.sync_with_ping()
+        cmpct_times = []
+        legacy_times = []
+        for i in xrange(10):
+            txs = [self.spend(coinbases[j]) for j in xrange(40 + 5 * i, 45 + 5 * i)]
+            self.send_to_mempool(txs)
+            block = self.build_block(txs)
+            start = time.time()
+            test_node.send_message(msg_block(block))
+            assert(cmpct_node.wait_for(lambda: block.sha256 in cmpct_node.block_received_time))
+            assert(legacy_node.wait_for(lambda: block.sha256 in legacy_node.block_received_time))
+            with mininode_lock:
+                cmpct_times.append(cmpct_node.block_received_time[block.sha256] - start)
+                legacy_times.append(legacy_node.block_received_time[block.sha256] - start)
+                # The compact block came whole, without an inv
+                comp_block = HeaderAndShortIDs(cmpct_node.last_cmpctblock.header_and_shortids)
+                assert_equal(comp_block.header.sha256, block.sha256)
+                [k0, k1] = comp_block.get_siphash_keys()
+                assert_equal(comp_block.shortids, [calculate_shortid(k0, k1, tx.sha256) for tx in block.vtx[1:]])
+                assert_equal(len(comp_block.prefilled_txn), 1)
+                assert_equal(comp_block.prefilled_txn[0].index, 0)
+        cmpct_times.sort()
+        legacy_times.sort()
+        print "Time until a peer has a new block (median of %d): %.2fms pushed as a compact block, %.2fms after an inv" % (
+            len(cmpct_times), 1000 * cmpct_times[len(cmpct_times) / 2], 1000 * legacy_times[len(legacy_times) / 2])
+
+        # 7. Compact blocks and their transactions on request
+        msg = msg_getdata()
+        msg.inv.append(CInv(MSG_CMPCT_BLOCK, block.sha256))
+        with mininode_lock:
+            legacy_node.last_cmpctblock = None
+        legacy_node.send_message(msg)
+        assert(legacy_node.wait_for(lambda: legacy_node.last_cmpctblock is not None))
+        msg = msg_getblocktxn()
+        msg.block_txn_request = BlockTransactionsRequest(block.sha256)
+        msg.block_txn_request.from_absolute([1, 3, 5])
+        legacy_node.send_message(msg)
+        assert(legacy_node.wait_for(lambda: legacy_node.last_blocktxn is not None))
+        with mininode_lock:
+            response = legacy_node.last_blocktxn.block_transactions
+            assert_equal(response.blockhash, block.sha256)
+            for tx in response.transactions:
+                tx.calc_sha256()
+            assert_equal([tx.sha256 for tx in response.transactions], [block.vtx[i].sha256 for i in [1, 3, 5]])
+
+if __name__ == '__main__':
+    CompactBlocksTest().main()
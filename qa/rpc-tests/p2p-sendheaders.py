@@ -0,0 +1,259 @@
+#!/usr/bin/env python2
+#
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+from test_framework.mininode import *
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+from test_framework.blocktools import create_block, create_coinbase
+import time
+
+'''
+SendHeadersTest -- test announcing new blocks with headers (sendheaders), and
+measure how fast a block crosses a line of nodes.
+
+Setup: nodes node0 ... nodeN-1, each connected to the next, and three
+mininode peers of node0:
+- miner gives node0 new blocks;
+- header_peer sends sendheaders, and has node0's headers;
+- inv_peer doesn't send sendheaders.
+
+The test:
+1. Every peer of a recent enough version is asked for headers announcements.
+2. Leave IBD with a first block; header_peer fetches node0's headers.
+3. New blocks are announced to header_peer with headers, and to inv_peer with
+   inv. Reports the time the blocks take to reach each node of the line.
+4. Several blocks connected at once are announced in one headers message.
+5. A block announced with headers is requested right away, with no getheaders
+   round trip, and so are all of several blocks announced together.
+6. Headers that don't connect are answered with getheaders.
+'''
+
+class TestNode(NodeConnCB):
+    def __init__(self):
+        NodeConnCB.__init__(self)
+        self.create_callback_map()
+        self.connection = None
+        self.ping_counter = 1
+        self.last_pong = msg_pong()
+        self.sendheaders_received = False
+        self.last_headers = None
+        self.last_inv = None
+        self.last_getdata = None
+        self.last_getheaders = None
+
+    def add_connection(self, conn):
+        self.connection = conn
+
+    def wait_for_verack(self):
+        while True:
+            with mininode_lock:
+                if self.verack_received:
+                    return
+            time.sleep(0.05)
+
+    def send_message(self, message):
+        self.connection.send_message(message)
+
+    def on_pong(self, conn, message):
+        self.last_pong = message
+
+    def on_sendheaders(self, conn, message):
+        self.sendheaders_received = True
+
+    def on_headers(self, conn, message):
+        self.last_headers = message
+
+    def on_inv(self, conn, message):
+        # Don't fetch anything: only what is announced matters here
+        self.last_inv = message
+
+    def on_getdata(self, conn, message):
+        self.last_getdata = message
+
+    def on_getheaders(self, conn, message):
+        self.last_getheaders = message
+
+    def clear_last_announcement(self):
+        with mininode_lock:
+            self.last_headers = None
+            self.last_inv = None
+
+    def sync_with_ping(self, timeout=30):
+        self.connection.send_message(msg_ping(nonce=self.ping_counter))
+        received_pong = False
+        sleep_time = 0.05
+        while not received_pong and timeout > 0:
+            time.sleep(sleep_time)
+            timeout -= sleep_time
+            with mininode_lock:
+                if self.last_pong.nonce == self.ping_counter:
+                    received_pong = True
+        self.ping_counter += 1
+        return received_pong
+
+    def wait_for(self, predicate, timeout=30):
+        while timeout > 0:
+            with mininode_lock:
+                if predicate():
+                    return True
+            time.sleep(0.05)
+            timeout -= 0.05
+        return False
+
+
+class SendHeadersTest(BitcoinTestFramework):
+    def add_options(self, parser):
+        parser.add_option("--nodes", dest="num_nodes", type="int", default=4,
+                          help="Number of nodes in the line")
+        parser.add_option("--rounds", dest="rounds", type="int", default=20,
+                          help="Blocks to time across the line")
+
+    def setup_chain(self):
+        initialize_chain_clean(self.options.tmpdir, self.options.num_nodes)
+
+    def setup_network(self):
+        self.nodes = start_nodes(self.options.num_nodes, self.options.tmpdir,
+                                 [["-whitelist=127.0.0.1"]] * self.options.num_nodes)
+        for i in xrange(self.options.num_nodes - 1):
+            connect_nodes(self.nodes[i], i + 1)
+
+    def build_block(self):
+        block = create_block(self.last_block, create_coinbase(), self.block_time)
+        self.block_time += 1
+        block.solve()
+        self.last_block = block.sha256
+        return block
+
+    def wait_for_tip(self, hash, nodes=None, timeout=60):
+        # Returns the time at which each node had the block
+        if nodes is None:
+            nodes = self.nodes
+        hexhash = "%064x" % hash
+        arrival = [None] * len(nodes)
+        deadline = time.time() + timeout
+        while None in arrival and time.time() < deadline:
+            for i in xrange(len(nodes)):
+                if arrival[i] is None and nodes[i].getbestblockhash() == hexhash:
+                    arrival[i] = time.time()
+            time.sleep(0.002)
+        assert(None not in arrival)
+        return arrival
+
+    def check_announcement(self, header_peer, inv_peer, blocks):
+        # header_peer gets the headers of the blocks, inv_peer an inv of the last
+        assert(header_peer.wait_for(lambda: header_peer.last_headers is not None and
+                                    header_peer.last_headers.headers[-1].sha256 == blocks[-1].sha256))
+        assert(inv_peer.wait_for(lambda: inv_peer.last_inv is not None and
+                                 inv_peer.last_inv.inv[-1].hash == blocks[-1].sha256))
+        with mininode_lock:
+            assert_equal([h.sha256 for h in header_peer.last_headers.headers], [b.sha256 for b in blocks])
+            assert(header_peer.last_inv is None)
+
+    def run_test(self):
+        miner = TestNode()
+        header_peer = TestNode()
+        inv_peer = TestNode()
+        for peer in [miner, header_peer, inv_peer]:
+            peer.add_connection(NodeConn('127.0.0.1', p2p_port(0), self.nodes[0], peer))
+        NetworkThread().start()
+        for peer in [miner, header_peer, inv_peer]:
+            peer.wait_for_verack()
+
+        # 1. Headers announcements are asked for
+        assert(header_peer.wait_for(lambda: header_peer.sendheaders_received))
+        header_peer.send_message(msg_sendheaders())
+        header_peer.sync_with_ping()
+
+        # 2. Leave IBD, and have header_peer sync node0's headers
+        self.block_time = int(time.time()) - 1000
+        self.last_block = int(self.nodes[0].getbestblockhash(), 16)
+        block = self.build_block()
+        miner.send_message(msg_block(block))
+        self.wait_for_tip(block.sha256)
+        getheaders = msg_getheaders()
+        getheaders.locator.vHave = [block.sha256]
+        header_peer.send_message(getheaders)
+        header_peer.sync_with_ping()
+
+        # 3. Single blocks, timed across the line
+        hop_times = [[] for i in xrange(self.options.num_nodes)]
+        for r in xrange(self.options.rounds):
+            header_peer.clear_last_announcement()
+            inv_peer.clear_last_announcement()
+            block = self.build_block()
+            miner.send_message(msg_block(block))
+            arrival = self.wait_for_tip(block.sha256)
+            # From node0 on: the mininode's own send latency doesn't count
+            for i in xrange(self.options.num_nodes):
+                hop_times[i].append(arrival[i] - arrival[0])
+            self.check_announcement(header_peer, inv_peer, [block])
+        medians = []
+        for times in hop_times:
+            times.sort()
+            medians.append(1000 * times[len(times) / 2])
+        print "Median time for a block to go from node 0 to node 1..%d: %s ms" % (
+            self.options.num_nodes - 1, ", ".join("%.1f" % m for m in medians[1:]))
+        if self.options.num_nodes > 1:
+            print "Median time per hop: %.1f ms" % (medians[-1] / (self.options.num_nodes - 1))
+
+        # 4. A reorganization: the blocks of the new branch are announced together
+        fork_point = self.last_block
+        block = self.build_block()
+        miner.send_message(msg_block(block))
+        self.wait_for_tip(block.sha256)
+        self.last_block = fork_point
+        blocks = [self.build_block() for i in xrange(2)]
+        miner.send_message(msg_block(blocks[0]))
+        miner.sync_with_ping()
+        header_peer.clear_last_announcement()
+        inv_peer.clear_last_announcement()
+        miner.send_message(msg_block(blocks[1]))
+        self.check_announcement(header_peer, inv_peer, blocks)
+        self.wait_for_tip(blocks[-1].sha256)
+
+        # 5. Blocks announced with headers are fetched right away
+        block = self.build_block()
+        with mininode_lock:
+            header_peer.last_getdata = None
+            header_peer.last_getheaders = None
+        msg = msg_headers()
+        msg.headers = [CBlockHeader(block)]
+        header_peer.send_message(msg)
+        assert(header_peer.wait_for(lambda: header_peer.last_getdata is not None))
+        with mininode_lock:
+            assert_equal([(inv.type, inv.hash) for inv in header_peer.last_getdata.inv], [(2, block.sha256)])
+            header_peer.last_getdata = None
+        header_peer.send_message(msg_block(block))
+        self.wait_for_tip(block.sha256)
+
+        blocks = [self.build_block() for i in xrange(3)]
+        msg = msg_headers()
+        msg.headers = [CBlockHeader(b) for b in blocks]
+        header_peer.send_message(msg)
+        assert(header_peer.wait_for(lambda: header_peer.last_getdata is not None))
+        with mininode_lock:
+            assert_equal([inv.hash for inv in header_peer.last_getdata.inv], [b.sha256 for b in blocks])
+            assert(header_peer.last_getheaders is None)
+        for b in blocks:
+            header_peer.send_message(msg_block(b))
+        self.wait_for_tip(blocks[-1].sha256)
+
+        # 6. Headers that don't connect: node0 asks for the ones in between
+        blocks = [self.build_block() for i in xrange(2)]
+        msg = msg_headers()
+        msg.headers = [CBlockHeader(blocks[1])]
+        header_peer.send_message(msg)
+        assert(header_peer.wait_for(lambda: header_peer.last_getheaders is not None))
+        msg.headers = [CBlockHeader(b) for b in blocks]
+        header_peer.send_message(msg)
+        assert(header_peer.wait_for(lambda: header_peer.last_getdata is not None and
+                                    header_peer.last_getdata.inv[-1].hash == blocks[1].sha256))
+        for b in blocks:
+            header_peer.send_message(msg_block(b))
+        self.wait_for_tip(blocks[-1].sha256)
+
+if __name__ == '__main__':
+    SendHeadersTest().main()
@@ -0,0 +1,110 @@
+#!/usr/bin/env python2
+#
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+from test_framework.mininode import *
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+import os
+import time
+
+'''
+Benchmark of the socket handler loop, not part of the regular test suite.
+
+Opens a number of loopback peers to a single node and measures the CPU time
+the node spends while the peers sit idle, and while each peer exchanges
+ping/pong round trips with it. The reported figure of merit is node CPU time
+per message, which should stay roughly flat as the number of peers grows.
+'''
+
+def process_cpu_seconds(pid):
+    # utime + stime, fields 14 and 15 of /proc/<pid>/stat
+    with open("/proc/%d/stat" % pid) as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / float(os.sysconf("SC_CLK_TCK"))
+
+class PingPeer(NodeConnCB):
+    def __init__(self):
+        NodeConnCB.__init__(self)
+        self.create_callback_map()
+        self.pongs = 0
+
+    def add_connection(self, conn):
+        self.connection = conn
+
+    def on_pong(self, conn, message):
+        self.pongs += 1
+
+class SocketLoopBench(BitcoinTestFramework):
+    def add_options(self, parser):
+        parser.add_option("--peers", dest="peers", default="8,64,256",
+                          help="Comma separated peer counts to benchmark")
+        parser.add_option("--pings", dest="pings", type="int", default=200,
+                          help="Ping round trips per peer")
+        parser.add_option("--idletime", dest="idletime", type="int", default=5,
+                          help="Seconds to measure with idle peers")
+
+    def setup_chain(self):
+        print "Initializing test directory "+self.options.tmpdir
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self):
+        self.peer_counts = [int(n) for n in self.options.peers.split(",")]
+        self.nodes = start_nodes(1, self.options.tmpdir,
+                                 extra_args=[['-whitelist=127.0.0.1',
+                                              '-maxconnections=%d' % (max(self.peer_counts) + 16)]])
+
+    def wait_for(self, predicate, timeout=120):
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            with mininode_lock:
+                if predicate():
+                    return True
+            time.sleep(0.01)
+        return False
+
+    def run_round(self, npeers):
+        pid = bitcoind_processes[0].pid
+        peers = []
+        for i in range(npeers):
+            peer = PingPeer()
+            peer.add_connection(NodeConn('127.0.0.1', p2p_port(0), self.nodes[0], peer))
+            peers.append(peer)
+        NetworkThread().start()
+        if not self.wait_for(lambda: all(p.verack_received for p in peers)):
+            raise AssertionError("Not all %d peers completed the handshake" % npeers)
+
+        # Idle: cost of watching the connections
+        cpu_start = process_cpu_seconds(pid)
+        time.sleep(self.options.idletime)
+        idle = process_cpu_seconds(pid) - cpu_start
+
+        # Busy: every peer keeps one ping in flight
+        cpu_start = process_cpu_seconds(pid)
+        wall_start = time.time()
+        for round in range(self.options.pings):
+            for nonce, p in enumerate(peers):
+                p.connection.send_message(msg_ping(nonce + 1))
+            if not self.wait_for(lambda: all(p.pongs > round for p in peers)):
+                raise AssertionError("Timed out waiting for pongs")
+        busy = process_cpu_seconds(pid) - cpu_start
+        wall = time.time() - wall_start
+
+        nmessages = 2 * npeers * self.options.pings # ping in, pong out
+        print "peers=%d idle_cpu=%.3fs/s busy_cpu=%.3fs wall=%.3fs messages=%d cpu_per_message=%.2fus" % (
+            npeers, idle / self.options.idletime, busy, wall, nmessages, 1e6 * busy / nmessages)
+
+        for p in peers:
+            p.connection.disconnect_node()
+        self.wait_for(lambda: len(mininode_socket_map) == 0)
+        # Let the node notice the disconnects before the next round
+        time.sleep(1)
+
+    def run_test(self):
+        for npeers in self.peer_counts:
+            self.run_round(npeers)
+
+if __name__ == '__main__':
+    SocketLoopBench().main()
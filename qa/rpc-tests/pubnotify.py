@@ -0,0 +1,194 @@
+#!/usr/bin/env python2
+#
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+#
+# Test the -pub* block and transaction notifications
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+from test_framework.mininode import CTransaction, CTxIn, CTxOut, COutPoint, deser_string
+from test_framework.blocktools import create_block, create_coinbase
+from test_framework.script import CScript, OP_TRUE
+import binascii
+import os
+import socket
+import struct
+import threading
+import time
+
+class Subscriber(threading.Thread):
+    '''
+    Collects the messages sent by the publisher, and detects the ones it
+    missed from gaps in the sequence numbers of each topic.
+    '''
+    def __init__(self, sock):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.sock = sock
+        self.lock = threading.Lock()
+        self.messages = []
+        self.next_sequence = {}
+        self.missed = {}
+
+    def run(self):
+        f = self.sock.makefile('rb')
+        while True:
+            try:
+                topic = deser_string(f)
+                payload = deser_string(f)
+                sequence = struct.unpack("<I", f.read(4))[0]
+            except (struct.error, socket.error):
+                return
+            with self.lock:
+                expected = self.next_sequence.get(topic, sequence)
+                if sequence != expected:
+                    self.missed[topic] = self.missed.get(topic, 0) + sequence - expected
+                self.next_sequence[topic] = sequence + 1
+                self.messages.append((topic, payload, sequence))
+
+    def count(self):
+        with self.lock:
+            return len(self.messages)
+
+    def wait_for(self, n, timeout=60):
+        deadline = time.time() + timeout
+        while self.count() < n and time.time() < deadline:
+            time.sleep(0.05)
+        assert_equal(self.count(), n)
+
+    def wait_idle(self, interval=1):
+        last = -1
+        while self.count() != last:
+            last = self.count()
+            time.sleep(interval)
+
+    def pop(self, topic):
+        with self.lock:
+            for i, m in enumerate(self.messages):
+                if m[0] == topic:
+                    return self.messages.pop(i)
+        raise AssertionError("no %s message" % topic)
+
+def hash_hex(payload):
+    return binascii.hexlify(payload)
+
+class PubNotifyTest(BitcoinTestFramework):
+    def setup_chain(self):
+        print "Initializing test directory "+self.options.tmpdir
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self):
+        self.port = p2p_port(0) + 500
+        self.unix_path = os.path.join(self.options.tmpdir, "pubnotify.sock")
+        tcp = "tcp://127.0.0.1:%d" % self.port
+        self.nodes = start_nodes(1, self.options.tmpdir, extra_args=[[
+            "-pubhashblock=unix:" + self.unix_path,
+            "-pubrawblock=" + tcp, "-pubhashtx=" + tcp, "-pubrawtx=" + tcp,
+            "-pubmaxqueue=1000", "-debug=pubnotify"]])
+        self.is_network_split = False
+
+    def subscribe_tcp(self, rcvbuf=None):
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        if rcvbuf is not None:
+            s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, rcvbuf)
+        s.connect(("127.0.0.1", self.port))
+        return s
+
+    def mine(self, txs=[]):
+        block = create_block(self.tip, create_coinbase(), self.block_time)
+        self.block_time += 1
+        block.vtx.extend(txs)
+        block.hashMerkleRoot = block.calc_merkle_root()
+        block.rehash()
+        block.solve()
+        assert_equal(self.nodes[0].submitblock(binascii.hexlify(block.serialize())), None)
+        self.tip = block.sha256
+        self.blocks.append(block)
+        return block
+
+    def big_spend(self, coinbase, nOutputs=20, nScriptSize=10000):
+        # Anyone-can-spend coinbase to large non-standard outputs
+        tx = CTransaction()
+        tx.vin.append(CTxIn(COutPoint(coinbase.sha256, 0), CScript([OP_TRUE]), 0xffffffff))
+        value = (coinbase.vout[0].nValue - 10000000) // nOutputs
+        for i in range(nOutputs):
+            tx.vout.append(CTxOut(value, chr(OP_TRUE) * nScriptSize))
+        tx.calc_sha256()
+        return tx
+
+    def run_test(self):
+        node = self.nodes[0]
+        self.tip = int(node.getbestblockhash(), 16)
+        self.block_time = int(time.time()) - 200
+        self.blocks = []
+
+        fast = Subscriber(self.subscribe_tcp())
+        fast.start()
+        unix_sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        unix_sock.connect(self.unix_path)
+        unix = Subscriber(unix_sock)
+        unix.start()
+        # Never reads until the end, with a small receive window
+        slow_sock = self.subscribe_tcp(rcvbuf=4096)
+        time.sleep(1)
+
+        print "Mining 101 blocks..."
+        for i in range(101):
+            self.mine()
+        assert_equal(node.getblockcount(), 101)
+
+        # Coinbase transaction, raw block and raw coinbase for each block over
+        # tcp. The genesis coinbase was published before anyone subscribed.
+        fast.wait_for(101 * 3)
+        unix.wait_for(101)
+        for i, block in enumerate(self.blocks):
+            topic, payload, sequence = unix.pop("hashblock")
+            assert_equal((hash_hex(payload), sequence), (block.hash, i))
+            topic, payload, sequence = fast.pop("rawblock")
+            assert_equal((payload, sequence), (block.serialize(), i))
+            topic, payload, sequence = fast.pop("hashtx")
+            assert_equal((hash_hex(payload), sequence), (block.vtx[0].hash, i + 1))
+            topic, payload, sequence = fast.pop("rawtx")
+            assert_equal((payload, sequence), (block.vtx[0].serialize(), i + 1))
+
+        # A subscriber that goes away does not disturb the others
+        unix_sock.shutdown(socket.SHUT_RDWR)
+        unix_sock.close()
+
+        print "Publishing large transactions and blocks..."
+        for i in range(6):
+            tx = self.big_spend(self.blocks[i].vtx[0])
+            assert_equal(node.sendrawtransaction(binascii.hexlify(tx.serialize()), True), tx.hash)
+            fast.wait_for(2)
+            assert_equal(hash_hex(fast.pop("hashtx")[1]), tx.hash)
+            assert_equal(fast.pop("rawtx")[1], tx.serialize())
+
+            block = self.mine([tx])
+            fast.wait_for(5)
+            assert_equal(fast.pop("rawblock")[1], block.serialize())
+            assert_equal(hash_hex(fast.pop("hashtx")[1]), block.vtx[0].hash)
+            assert_equal(hash_hex(fast.pop("hashtx")[1]), tx.hash)
+            assert_equal(fast.pop("rawtx")[1], block.vtx[0].serialize())
+            assert_equal(fast.pop("rawtx")[1], tx.serialize())
+        assert_equal(node.getblockcount(), 107)
+        assert_equal(fast.missed, {})
+
+        # The slow subscriber missed messages, and can tell from the sequence numbers
+        slow = Subscriber(slow_sock)
+        slow.start()
+        slow.wait_idle()
+        block = self.mine()
+        deadline = time.time() + 60
+        while slow.next_sequence.get("rawblock") != len(self.blocks) and time.time() < deadline:
+            time.sleep(0.05)
+        assert_equal(slow.next_sequence["rawblock"], len(self.blocks))
+        assert_greater_than(sum(slow.missed.values()), 0)
+        print "Slow subscriber missed %s" % slow.missed
+        assert_equal(fast.missed, {})
+
+if __name__ == '__main__':
+    PubNotifyTest().main()
@@ -0,0 +1,154 @@
+#!/usr/bin/env python2
+#
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+#
+# Test the REST /rest/blockrange/ endpoints
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+from test_framework.mininode import CTransaction, CTxIn, CTxOut, COutPoint
+from test_framework.blocktools import create_block, create_coinbase
+from test_framework.script import CScript, OP_TRUE
+import binascii
+import httplib
+import socket
+import struct
+import time
+import urlparse
+
+def http_get(url, path):
+    conn = httplib.HTTPConnection(url.hostname, url.port)
+    conn.request('GET', path)
+    response = conn.getresponse()
+    return response.status, response.read()
+
+def split_records(data):
+    '''Split a response into its size-prefixed records'''
+    records = []
+    pos = 0
+    while pos < len(data):
+        size = struct.unpack("<I", data[pos:pos+4])[0]
+        records.append(data[pos+4:pos+4+size])
+        pos += 4 + size
+    assert_equal(pos, len(data))
+    return records
+
+class RESTBlockRangeTest(BitcoinTestFramework):
+    def setup_chain(self):
+        print "Initializing test directory "+self.options.tmpdir
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self):
+        self.nodes = start_nodes(1, self.options.tmpdir, extra_args=[["-rest"]])
+        self.is_network_split = False
+
+    def mine(self, txs=[]):
+        block = create_block(self.tip, create_coinbase(), self.block_time)
+        self.block_time += 1
+        block.vtx.extend(txs)
+        block.hashMerkleRoot = block.calc_merkle_root()
+        block.rehash()
+        block.solve()
+        assert_equal(self.nodes[0].submitblock(binascii.hexlify(block.serialize())), None)
+        self.tip = block.sha256
+        self.blocks.append(block.serialize())
+        return block
+
+    def big_spend(self, coinbase, nOutputs=20, nScriptSize=10000):
+        # Anyone-can-spend coinbase to large non-standard outputs
+        tx = CTransaction()
+        tx.vin.append(CTxIn(COutPoint(coinbase.sha256, 0), CScript([OP_TRUE]), 0xffffffff))
+        value = (coinbase.vout[0].nValue - 10000000) // nOutputs
+        for i in range(nOutputs):
+            tx.vout.append(CTxOut(value, chr(OP_TRUE) * nScriptSize))
+        tx.calc_sha256()
+        return tx
+
+    def run_test(self):
+        node = self.nodes[0]
+        url = urlparse.urlparse(node.url)
+        self.tip = int(node.getbestblockhash(), 16)
+        self.block_time = int(time.time()) - 200
+        genesis = http_get(url, "/rest/block/%s.bin" % node.getbestblockhash())[1]
+        self.blocks = [genesis]
+
+        print "Mining blocks..."
+        coinbases = [self.mine() for i in range(101)]
+        # Blocks of about 200 KB, so that the replies take several chunks
+        for i in range(10):
+            self.mine([self.big_spend(coinbases[i].vtx[0])])
+        assert_equal(node.getblockcount(), 111)
+
+        # Whole chain, and a range past the tip
+        for path in ["/rest/blockrange/0/112.bin", "/rest/blockrange/0/100000.bin"]:
+            status, data = http_get(url, path)
+            assert_equal(status, 200)
+            assert_equal(split_records(data), self.blocks)
+
+        # Part of the chain
+        status, data = http_get(url, "/rest/blockrange/100/5.bin")
+        assert_equal(status, 200)
+        assert_equal(split_records(data), self.blocks[100:105])
+
+        # With undo data: none for the genesis block, an empty list of
+        # transactions for coinbase-only blocks, the spent coinbases otherwise
+        status, data = http_get(url, "/rest/blockrange/undo/0/112.bin")
+        assert_equal(status, 200)
+        records = split_records(data)
+        assert_equal(records[0::2], self.blocks)
+        undo = records[1::2]
+        assert_equal(undo[0], "")
+        assert_equal(undo[1:102], ["\x00"] * 101)
+        for u in undo[102:]:
+            assert_greater_than(len(u), 1)
+
+        # Errors
+        assert_equal(http_get(url, "/rest/blockrange/112/1.bin")[0], 404)
+        assert_equal(http_get(url, "/rest/blockrange/0/0.bin")[0], 400)
+        assert_equal(http_get(url, "/rest/blockrange/-1/5.bin")[0], 400)
+        assert_equal(http_get(url, "/rest/blockrange/5.bin")[0], 400)
+        assert_equal(http_get(url, "/rest/blockrange/0/5.json")[0], 404)
+
+        # A client that reads slowly gets the complete reply
+        print "Reading slowly..."
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        s.connect((url.hostname, url.port))
+        s.sendall("GET /rest/blockrange/undo/0/112.bin HTTP/1.0\r\n\r\n")
+        time.sleep(2)
+        reply = ""
+        while True:
+            part = s.recv(4096)
+            if not part:
+                break
+            reply += part
+        s.close()
+        headers, body = reply.split("\r\n\r\n", 1)
+        assert headers.startswith("HTTP/1.0 200")
+        assert_equal(split_records(body), records)
+
+        # A client that goes away early does not disturb the node
+        for i in range(5):
+            s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+            s.connect((url.hostname, url.port))
+            s.sendall("GET /rest/blockrange/undo/0/112.bin HTTP/1.1\r\nHost: localhost\r\n\r\n")
+            s.recv(4096)
+            s.shutdown(socket.SHUT_RDWR)
+            s.close()
+        assert_equal(node.getblockcount(), 111)
+        # Their export slots are freed once the node notices they are gone
+        for i in range(100):
+            status, data = http_get(url, "/rest/blockrange/0/112.bin")
+            if status != 503:
+                break
+            time.sleep(0.1)
+        assert_equal(status, 200)
+        assert_equal(split_records(data), self.blocks)
+
+if __name__ == '__main__':
+    RESTBlockRangeTest().main()
@@ -0,0 +1,130 @@
+#!/usr/bin/env python2
+#
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+#
+# Test large binary /rest/getutxos batches, against outputs in the coins
+# database, in the coins cache and in the mempool
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+from test_framework.mininode import CTransaction, CTxIn, CTxOut, COutPoint, ser_vector, deser_compact_size
+from test_framework.blocktools import create_block, create_coinbase
+from test_framework.script import CScript, OP_TRUE
+import binascii
+import httplib
+import StringIO
+import struct
+import time
+import urlparse
+
+def http_get(url, path, body=''):
+    conn = httplib.HTTPConnection(url.hostname, url.port)
+    conn.request('GET', path, body)
+    response = conn.getresponse()
+    return response.status, response.read()
+
+def spend(prevtx, indexes, nOutputs, scriptSig=CScript()):
+    # Anyone-can-spend outputs to anyone-can-spend outputs; coinbase outputs
+    # need a true scriptSig
+    tx = CTransaction()
+    value = 0
+    for n in indexes:
+        tx.vin.append(CTxIn(COutPoint(prevtx.sha256, n), scriptSig, 0xffffffff))
+        value += prevtx.vout[n].nValue
+    for i in range(nOutputs):
+        tx.vout.append(CTxOut((value - 100000) // nOutputs, CScript([OP_TRUE])))
+    tx.calc_sha256()
+    return tx
+
+class RESTGetUTXOsBatchTest(BitcoinTestFramework):
+    def setup_chain(self):
+        print "Initializing test directory "+self.options.tmpdir
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self):
+        self.nodes = start_nodes(1, self.options.tmpdir, extra_args=[["-rest"]])
+        self.is_network_split = False
+
+    def mine(self, txs=[]):
+        block = create_block(self.tip, create_coinbase(), self.block_time)
+        self.block_time += 1
+        block.vtx.extend(txs)
+        block.hashMerkleRoot = block.calc_merkle_root()
+        block.rehash()
+        block.solve()
+        assert_equal(self.nodes[0].submitblock(binascii.hexlify(block.serialize())), None)
+        self.tip = block.sha256
+        return block
+
+    def getutxos(self, checkmempool, outpoints):
+        body = struct.pack("<?", checkmempool) + ser_vector(outpoints)
+        status, data = http_get(self.url, "/rest/getutxos.bin", body)
+        assert_equal(status, 200)
+        f = StringIO.StringIO(data)
+        height, = struct.unpack("<i", f.read(4))
+        f.read(32)
+        bitmap = f.read(deser_compact_size(f))
+        hits = [bool(ord(bitmap[i // 8]) & (1 << (i % 8))) for i in range(len(outpoints))]
+        values = []
+        for i in range(deser_compact_size(f)):
+            f.read(8)
+            out = CTxOut()
+            out.deserialize(f)
+            values.append(out.nValue)
+        assert_equal(f.read(), "")
+        assert_equal(height, self.nodes[0].getblockcount())
+        return hits, values
+
+    def check(self, checkmempool, outpoints, expected):
+        hits, values = self.getutxos(checkmempool, [o[0] for o in outpoints])
+        assert_equal(hits, expected)
+        assert_equal(values, [o[1] for o, hit in zip(outpoints, expected) if hit])
+
+    def run_test(self):
+        self.url = urlparse.urlparse(self.nodes[0].url)
+        self.tip = int(self.nodes[0].getbestblockhash(), 16)
+        self.block_time = int(time.time()) - 200
+
+        print "Mining blocks..."
+        coinbases = [self.mine().vtx[0] for i in range(101)]
+        fanout = spend(coinbases[0], [0], 2000, CScript([OP_TRUE]))
+        self.mine([fanout])
+        spent_in_block = spend(fanout, range(10), 1)
+        self.mine([spent_in_block])
+
+        # Outpoints with their values: the fan-out transaction, coinbases,
+        # and outputs that do not exist
+        outpoints = [(COutPoint(fanout.sha256, n), fanout.vout[n].nValue) for n in range(2000)]
+        outpoints += [(COutPoint(fanout.sha256, 2000), 0)]
+        outpoints += [(COutPoint(cb.sha256, 0), cb.vout[0].nValue) for cb in coinbases[1:]]
+        outpoints += [(COutPoint(1, 0), 0)]
+        in_chain = [n >= 10 and n < 2000 for n in range(2001)] + [True] * 100 + [False]
+
+        # Restart, so that the coins are read from the database
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, ["-rest"])
+        self.check(False, outpoints, in_chain)
+        self.check(True, outpoints, in_chain)
+
+        # Spend some of the outputs in the mempool; it now caches them too
+        spent_in_mempool = spend(fanout, range(10, 20), 5)
+        self.nodes[0].sendrawtransaction(binascii.hexlify(spent_in_mempool.serialize()), True)
+        self.check(False, outpoints, in_chain)
+        mempool_outpoints = outpoints + [(COutPoint(spent_in_mempool.sha256, n), spent_in_mempool.vout[n].nValue) for n in range(5)]
+        self.check(True, mempool_outpoints, [hit and not (n >= 10 and n < 20) for n, hit in enumerate(in_chain)] + [True] * 5)
+        self.check(False, mempool_outpoints, in_chain + [False] * 5)
+
+        # Large batches, repeating outpoints, as long as they are posted in binary
+        hits, values = self.getutxos(True, [o[0] for o in outpoints] * 40)
+        assert_equal(len(hits), len(outpoints) * 40)
+        assert_equal(sum(hits), 1980 * 40 + 100 * 40)
+        assert_equal(http_get(self.url, "/rest/getutxos.bin", struct.pack("<?", True) + ser_vector([outpoints[0][0]] * 100001))[0], 500)
+        uri = "/rest/getutxos/checkmempool/" + "/".join(["%064x-%d" % (fanout.sha256, n) for n in range(16)]) + ".json"
+        assert_equal(http_get(self.url, uri)[0], 500)
+
+if __name__ == '__main__':
+    RESTGetUTXOsBatchTest().main()
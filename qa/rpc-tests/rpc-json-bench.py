@@ -0,0 +1,91 @@
+#!/usr/bin/env python2
+#
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+import base64
+import hashlib
+import json
+import time
+
+try:
+    import http.client as httplib
+except ImportError:
+    import httplib
+try:
+    import urllib.parse as urlparse
+except ImportError:
+    import urlparse
+
+'''
+Benchmark of JSON parsing and serialization in the RPC server, not part of
+the regular test suite.
+
+Sends createrawtransaction calls with wide input lists and output objects,
+which exercise request parsing and object key lookups, and decodes the
+resulting transactions, which exercises reply serialization. Reported is the
+mean wall time per call as seen by the client, with the request and reply
+sizes.
+'''
+
+B58_DIGITS = '123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz'
+
+def b58check(version, payload):
+    data = chr(version) + payload
+    data += hashlib.sha256(hashlib.sha256(data).digest()).digest()[:4]
+    n = int(data.encode('hex'), 16)
+    res = ''
+    while n > 0:
+        n, r = divmod(n, 58)
+        res = B58_DIGITS[r] + res
+    pad = len(data) - len(data.lstrip('\0'))
+    return B58_DIGITS[0] * pad + res
+
+def regtest_address(i):
+    # P2PKH address on an arbitrary key hash
+    return b58check(111, hashlib.sha256(str(i)).digest()[:20])
+
+class RPCJSONBench(BitcoinTestFramework):
+    def add_options(self, parser):
+        parser.add_option("--entries", dest="entries", default="10,100,1000,5000",
+                          help="Comma separated numbers of inputs and outputs per transaction")
+        parser.add_option("--calls", dest="calls", type="int", default=20,
+                          help="Calls per measurement")
+
+    def setup_chain(self):
+        print "Initializing test directory "+self.options.tmpdir
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self):
+        self.nodes = start_nodes(1, self.options.tmpdir)
+
+    def call(self, method, params):
+        body = json.dumps({"id": 0, "method": method, "params": params})
+        start = time.time()
+        for i in range(self.options.calls):
+            self.conn.request('POST', '/', body, self.headers)
+            resp = self.conn.getresponse()
+            reply = resp.read()
+            assert_equal(resp.status, 200)
+        elapsed = (time.time() - start) / self.options.calls
+        return json.loads(reply)["result"], len(body), len(reply), elapsed
+
+    def run_test(self):
+        url = urlparse.urlparse(self.nodes[0].url)
+        self.headers = {"Authorization": "Basic " + base64.b64encode(url.username + ':' + url.password)}
+        self.conn = httplib.HTTPConnection(url.hostname, url.port)
+
+        for n in [int(e) for e in self.options.entries.split(",")]:
+            inputs = [{"txid": hashlib.sha256(str(i)).hexdigest(), "vout": i % 4} for i in range(n)]
+            outputs = dict((regtest_address(i), float("%.8f" % (0.0001 + i * 1e-8))) for i in range(n))
+            txhex, req, rep, t = self.call("createrawtransaction", [inputs, outputs])
+            print "entries=%d createrawtransaction request=%dB reply=%dB %.2fms/call" % (n, req, rep, t * 1e3)
+            result, req, rep, t = self.call("decoderawtransaction", [txhex])
+            assert_equal(len(result["vin"]), n)
+            print "entries=%d decoderawtransaction request=%dB reply=%dB %.2fms/call" % (n, req, rep, t * 1e3)
+
+if __name__ == '__main__':
+    RPCJSONBench().main()
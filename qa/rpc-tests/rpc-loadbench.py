@@ -0,0 +1,108 @@
+#!/usr/bin/env python2
+#
+# Distributed under the MIT/X11 software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+import base64
+import threading
+import time
+
+try:
+    import http.client as httplib
+except ImportError:
+    import httplib
+try:
+    import urllib.parse as urlparse
+except ImportError:
+    import urlparse
+
+'''
+Load benchmark of the HTTP RPC server, not part of the regular test suite.
+
+For each concurrency level a number of client threads each keep one
+persistent connection open and issue back-to-back getblockcount calls for a
+fixed time. Reported are the completed requests per second and the number of
+requests that were refused with 503 because the work queue was full.
+'''
+
+class LoadClient(threading.Thread):
+    def __init__(self, url, headers, deadline):
+        threading.Thread.__init__(self)
+        self.url = url
+        self.headers = headers
+        self.deadline = deadline
+        self.ok = 0
+        self.busy = 0
+        self.errors = 0
+
+    def run(self):
+        conn = None
+        while time.time() < self.deadline:
+            try:
+                if conn is None:
+                    conn = httplib.HTTPConnection(self.url.hostname, self.url.port, timeout=30)
+                    conn.connect()
+                conn.request('POST', '/', '{"method": "getblockcount"}', self.headers)
+                resp = conn.getresponse()
+                resp.read()
+                if resp.status == 200:
+                    self.ok += 1
+                elif resp.status == 503:
+                    self.busy += 1
+                else:
+                    self.errors += 1
+                if resp.getheader('connection', '').lower() == 'close':
+                    conn.close()
+                    conn = None
+            except (httplib.HTTPException, IOError):
+                self.errors += 1
+                if conn is not None:
+                    conn.close()
+                conn = None
+        if conn is not None:
+            conn.close()
+
+class RPCLoadBench(BitcoinTestFramework):
+    def add_options(self, parser):
+        parser.add_option("--clients", dest="clients", default="1,4,16,64",
+                          help="Comma separated concurrent connection counts to benchmark")
+        parser.add_option("--duration", dest="duration", type="int", default=5,
+                          help="Seconds to run each concurrency level")
+        parser.add_option("--rpcthreads", dest="rpcthreads", type="int", default=4,
+                          help="-rpcthreads to start the node with")
+        parser.add_option("--rpcworkqueue", dest="rpcworkqueue", type="int", default=16,
+                          help="-rpcworkqueue to start the node with")
+
+    def setup_chain(self):
+        print "Initializing test directory "+self.options.tmpdir
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self):
+        self.nodes = start_nodes(1, self.options.tmpdir,
+                                 extra_args=[['-rpcthreads=%d' % self.options.rpcthreads,
+                                              '-rpcworkqueue=%d' % self.options.rpcworkqueue]])
+
+    def run_round(self, nclients):
+        url = urlparse.urlparse(self.nodes[0].url)
+        headers = {"Authorization": "Basic " + base64.b64encode(url.username + ':' + url.password)}
+        start = time.time()
+        clients = [LoadClient(url, headers, start + self.options.duration) for i in range(nclients)]
+        for c in clients:
+            c.start()
+        for c in clients:
+            c.join()
+        wall = time.time() - start
+
+        ok = sum(c.ok for c in clients)
+        print "clients=%d requests=%d req/s=%.1f rejected_503=%d errors=%d" % (
+            nclients, ok, ok / wall, sum(c.busy for c in clients), sum(c.errors for c in clients))
+
+    def run_test(self):
+        for nclients in [int(n) for n in self.options.clients.split(",")]:
+            self.run_round(nclients)
+
+if __name__ == '__main__':
+    RPCLoadBench().main()
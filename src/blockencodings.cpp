@@ -0,0 +1,159 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "consensus/consensus.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <map>
+
+#include <boost/foreach.hpp>
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+        nNonce(GetRand(std::numeric_limits<uint64_t>::max())),
+        header(block.GetBlockHeader())
+{
+    assert(!block.vtx.empty());
+    FillShortTxIDSelector();
+    // The receiver can't have the coinbase, so send it in full
+    vPrefilledTxn.resize(1);
+    vPrefilledTxn[0].nIndex = 0;
+    vPrefilledTxn[0].tx = block.vtx[0];
+    vShortTxIDs.resize(block.vtx.size() - 1);
+    for (size_t i = 1; i < block.vtx.size(); i++)
+        vShortTxIDs[i - 1] = GetShortID(block.vtx[i]->GetHash());
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    // The SipHash key is the single SHA256 of the header and nonce, so that
+    // short IDs collide differently for every peer and block
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << header << nNonce;
+    CSHA256 hasher;
+    hasher.Write((unsigned char*)&(*stream.begin()), stream.end() - stream.begin());
+    uint256 hashSelector;
+    hasher.Finalize(hashSelector.begin());
+    nShortTxIDk0 = hashSelector.GetUint64(0);
+    nShortTxIDk1 = hashSelector.GetUint64(1);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(nShortTxIDk0, nShortTxIDk1, txhash) & 0xffffffffffffULL;
+}
+
+ReadStatus CPartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool)
+{
+    static const size_t nMinTransactionSize = ::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION);
+
+    if (cmpctblock.header.IsNull() || (cmpctblock.vShortTxIDs.empty() && cmpctblock.vPrefilledTxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE / nMinTransactionSize)
+        return READ_STATUS_INVALID;
+
+    assert(header.IsNull() && vtxAvailable.empty());
+    header = cmpctblock.header;
+    vtxAvailable.resize(cmpctblock.BlockTxCount());
+
+    int32_t nLastPrefilledIndex = -1;
+    for (size_t i = 0; i < cmpctblock.vPrefilledTxn.size(); i++) {
+        if (!cmpctblock.vPrefilledTxn[i].tx || cmpctblock.vPrefilledTxn[i].tx->IsNull())
+            return READ_STATUS_INVALID;
+
+        nLastPrefilledIndex += cmpctblock.vPrefilledTxn[i].nIndex + 1; // nIndex is a uint16_t, so this can't overflow
+        if (nLastPrefilledIndex > std::numeric_limits<uint16_t>::max())
+            return READ_STATUS_INVALID;
+        if ((uint32_t)nLastPrefilledIndex > cmpctblock.vShortTxIDs.size() + i) {
+            // The index is past what the short IDs and the prefilled
+            // transactions so far can account for
+            return READ_STATUS_INVALID;
+        }
+        vtxAvailable[nLastPrefilledIndex] = cmpctblock.vPrefilledTxn[i].tx;
+    }
+    nPrefilled = cmpctblock.vPrefilledTxn.size();
+
+    // Map the short IDs to the positions left free by the prefilled
+    // transactions. Two equal short IDs can't be told apart, so have the
+    // caller fetch the whole block instead.
+    std::map<uint64_t, uint16_t> mapShortIDs;
+    uint16_t nIndexOffset = 0;
+    for (size_t i = 0; i < cmpctblock.vShortTxIDs.size(); i++) {
+        while (vtxAvailable[i + nIndexOffset])
+            nIndexOffset++;
+        if (!mapShortIDs.insert(std::make_pair(cmpctblock.vShortTxIDs[i], (uint16_t)(i + nIndexOffset))).second)
+            return READ_STATUS_FAILED;
+    }
+
+    // Read the mempool from a snapshot, which doesn't hold its lock while we hash
+    std::vector<bool> vHave(vtxAvailable.size());
+    CTxMemPoolSnapshotRef snapshot = pool.GetSnapshot();
+    BOOST_FOREACH(const CTxMemPoolEntry& entry, snapshot->vEntries) {
+        std::map<uint64_t, uint16_t>::const_iterator it = mapShortIDs.find(cmpctblock.GetShortID(entry.GetTx().GetHash()));
+        if (it != mapShortIDs.end()) {
+            if (!vHave[it->second]) {
+                vtxAvailable[it->second] = entry.GetSharedTx();
+                vHave[it->second] = true;
+                nFromMempool++;
+            } else if (vtxAvailable[it->second]) {
+                // Two mempool transactions match the short ID: request it instead of guessing
+                vtxAvailable[it->second].reset();
+                nFromMempool--;
+            }
+        }
+        // Stop early once everything is found, at the (small) risk of
+        // missing a second mempool transaction with the same short ID.
+        if (nFromMempool == cmpctblock.vShortTxIDs.size())
+            break;
+    }
+
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu\n",
+        cmpctblock.header.GetHash().ToString(), ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+
+    return READ_STATUS_OK;
+}
+
+bool CPartiallyDownloadedBlock::IsTxAvailable(size_t nIndex) const
+{
+    assert(!header.IsNull());
+    assert(nIndex < vtxAvailable.size());
+    return vtxAvailable[nIndex] ? true : false;
+}
+
+ReadStatus CPartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransactionRef>& vtxMissing) const
+{
+    assert(!header.IsNull());
+    block = CBlock(header);
+    block.vtx.resize(vtxAvailable.size());
+
+    size_t nMissing = 0;
+    for (size_t i = 0; i < vtxAvailable.size(); i++) {
+        if (vtxAvailable[i]) {
+            block.vtx[i] = vtxAvailable[i];
+        } else {
+            if (nMissing >= vtxMissing.size() || !vtxMissing[nMissing])
+                return READ_STATUS_INVALID;
+            block.vtx[i] = vtxMissing[nMissing++];
+        }
+    }
+    if (nMissing != vtxMissing.size())
+        return READ_STATUS_INVALID;
+
+    // A wrong transaction taken from the mempool because of a short ID
+    // collision shows as a merkle root mismatch; the full block is needed then
+    bool fMutated = false;
+    if (block.BuildMerkleTree(&fMutated) != header.hashMerkleRoot || fMutated)
+        return READ_STATUS_FAILED;
+
+    LogPrint("cmpctblock", "Successfully reconstructed block %s with %lu txn prefilled, %lu txn from mempool and %lu txn requested\n",
+        header.GetHash().ToString(), nPrefilled, nFromMempool, vtxMissing.size());
+
+    return READ_STATUS_OK;
+}
@@ -0,0 +1,204 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <algorithm>
+#include <ios>
+#include <limits>
+#include <vector>
+
+class CTxMemPool;
+
+/** Request for the transactions of a compact block that the receiver could not find in its mempool */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 hashBlock;
+    //! Indexes in the block, in increasing order; sent as the differences between consecutive indexes
+    std::vector<uint16_t> vIndexes;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(hashBlock);
+        uint64_t nIndexes = (uint64_t)vIndexes.size();
+        READWRITE(COMPACTSIZE(nIndexes));
+        if (ser_action.ForRead()) {
+            // Grow the vector as indexes actually arrive, not as announced
+            size_t i = 0;
+            while (vIndexes.size() < nIndexes) {
+                vIndexes.resize(std::min((uint64_t)(1000 + vIndexes.size()), nIndexes));
+                for (; i < vIndexes.size(); i++) {
+                    uint64_t nIndex = 0;
+                    READWRITE(COMPACTSIZE(nIndex));
+                    if (nIndex > std::numeric_limits<uint16_t>::max())
+                        throw std::ios_base::failure("index overflowed 16 bits");
+                    vIndexes[i] = nIndex;
+                }
+            }
+
+            uint16_t nOffset = 0;
+            for (size_t j = 0; j < vIndexes.size(); j++) {
+                if (uint64_t(vIndexes[j]) + uint64_t(nOffset) > std::numeric_limits<uint16_t>::max())
+                    throw std::ios_base::failure("indexes overflowed 16 bits");
+                vIndexes[j] = vIndexes[j] + nOffset;
+                nOffset = vIndexes[j] + 1;
+            }
+        } else {
+            for (size_t i = 0; i < vIndexes.size(); i++) {
+                uint64_t nIndex = vIndexes[i] - (i == 0 ? 0 : (vIndexes[i - 1] + 1));
+                READWRITE(COMPACTSIZE(nIndex));
+            }
+        }
+    }
+};
+
+/** The transactions of a block asked for by a CBlockTransactionsRequest, in the same order */
+class CBlockTransactions
+{
+public:
+    uint256 hashBlock;
+    std::vector<CTransactionRef> vtx;
+
+    CBlockTransactions() {}
+    explicit CBlockTransactions(const CBlockTransactionsRequest& req) :
+        hashBlock(req.hashBlock), vtx(req.vIndexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    }
+};
+
+/** A transaction sent in full within a compact block */
+struct CPrefilledTransaction
+{
+    //! On the wire, the difference from the previous prefilled transaction's index
+    //! (minus one); in CPartiallyDownloadedBlock, the index in the block
+    uint16_t nIndex;
+    CTransactionRef tx;
+
+    CPrefilledTransaction() : nIndex(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        uint64_t nIndexWide = nIndex;
+        READWRITE(COMPACTSIZE(nIndexWide));
+        if (nIndexWide > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("index overflowed 16 bits");
+        nIndex = nIndexWide;
+        READWRITE(tx);
+    }
+};
+
+enum ReadStatus {
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, //! Invalid object, peer is sending bogus crap
+    READ_STATUS_FAILED, //! Failed to process object, for instance a short ID collision
+};
+
+/**
+ * A block relayed as its header and salted 6-byte short IDs of its
+ * transactions, plus the few transactions the receiver is known to lack
+ * (the coinbase). The receiver finds the other transactions in its mempool.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    mutable uint64_t nShortTxIDk0, nShortTxIDk1;
+    uint64_t nNonce;
+
+    void FillShortTxIDSelector() const;
+
+    friend class CPartiallyDownloadedBlock;
+
+public:
+    static const int SHORTTXIDS_LENGTH = 6;
+
+    CBlockHeader header;
+    /** Public only for unit testing */
+    std::vector<uint64_t> vShortTxIDs;
+    std::vector<CPrefilledTransaction> vPrefilledTxn;
+
+    // Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() : nShortTxIDk0(0), nShortTxIDk1(0), nNonce(0) {}
+
+    explicit CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return vShortTxIDs.size() + vPrefilledTxn.size(); }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(header);
+        READWRITE(nNonce);
+
+        uint64_t nShortTxIDs = (uint64_t)vShortTxIDs.size();
+        READWRITE(COMPACTSIZE(nShortTxIDs));
+        if (ser_action.ForRead()) {
+            // Grow the vector as short IDs actually arrive, not as announced
+            size_t i = 0;
+            while (vShortTxIDs.size() < nShortTxIDs) {
+                vShortTxIDs.resize(std::min((uint64_t)(1000 + vShortTxIDs.size()), nShortTxIDs));
+                for (; i < vShortTxIDs.size(); i++) {
+                    uint32_t nLSB = 0; uint16_t nMSB = 0;
+                    READWRITE(nLSB);
+                    READWRITE(nMSB);
+                    vShortTxIDs[i] = (uint64_t(nMSB) << 32) | uint64_t(nLSB);
+                }
+            }
+        } else {
+            for (size_t i = 0; i < vShortTxIDs.size(); i++) {
+                uint32_t nLSB = vShortTxIDs[i] & 0xffffffff;
+                uint16_t nMSB = (vShortTxIDs[i] >> 32) & 0xffff;
+                READWRITE(nLSB);
+                READWRITE(nMSB);
+            }
+        }
+
+        READWRITE(vPrefilledTxn);
+
+        if (ser_action.ForRead())
+            FillShortTxIDSelector();
+    }
+};
+
+/** A block being rebuilt from a compact block, the mempool and the transactions requested from the peer */
+class CPartiallyDownloadedBlock
+{
+protected:
+    std::vector<CTransactionRef> vtxAvailable;
+    size_t nPrefilled;
+    size_t nFromMempool;
+
+public:
+    CBlockHeader header;
+
+    CPartiallyDownloadedBlock() : nPrefilled(0), nFromMempool(0) {}
+
+    /** Place the prefilled transactions, and those of pool matching a short ID */
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool);
+    bool IsTxAvailable(size_t nIndex) const;
+    size_t GetPrefilledCount() const { return nPrefilled; }
+    size_t GetMempoolCount() const { return nFromMempool; }
+    /** Assemble the block, taking the transactions still missing from vtxMissing, in order */
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransactionRef>& vtxMissing) const;
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
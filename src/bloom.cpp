@@ -6,6 +6,7 @@
 
 #include "primitives/transaction.h"
 #include "hash.h"
+#include "memusage.h"
 #include "script/script.h"
 #include "script/standard.h"
 #include "random.h"
@@ -216,57 +217,102 @@ void CBloomFilter::UpdateEmptyFull()
     isEmpty = empty;
 }
 
-CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate) :
-    b1(nElements * 2, fpRate, 0), b2(nElements * 2, fpRate, 0)
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
 {
-    // Implemented using two bloom filters of 2 * nElements each.
-    // We fill them up, and clear them, staggered, every nElements
-    // inserted, so at least one always contains the last nElements
-    // inserted.
-    nInsertions = 0;
-    nBloomSize = nElements * 2;
-
+    double logFpRate = log(fpRate);
+    // The optimal number of hash functions is log(fpRate) / log(0.5), kept to 1-50
+    nHashFuncs = max(1, min((int)round(logFpRate / log(0.5)), 50));
+    // Between two and three generations of nElements / 2 entries are kept
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    uint32_t nMaxElements = nEntriesPerGeneration * 3;
+    // Solving fpRate = (1 - exp(-nHashFuncs * nMaxElements / nFilterBits)) ^ nHashFuncs
+    // for nFilterBits gives the size that keeps the filter at its fullest within budget
+    nFilterBits = (uint32_t)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs)));
+    nFilterBits = max(nFilterBits, (uint32_t)64);
+    data.resize(((nFilterBits + 63) / 64) * 2);
     reset();
 }
 
-void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+uint64_t CRollingBloomFilter::Digest(const std::vector<unsigned char>& vKey) const
 {
-    if (nInsertions == 0) {
-        b1.clear();
-    } else if (nInsertions == nBloomSize / 2) {
-        b2.clear();
+    return ((uint64_t)MurmurHash3((uint32_t)nKey0, vKey) << 32) | MurmurHash3((uint32_t)nKey1, vKey);
+}
+
+void CRollingBloomFilter::InsertDigest(uint64_t nDigest)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration) {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4) {
+            nGeneration = 1;
+        }
+        // Wipe the entries of the generation whose number is being reused
+        uint64_t nGenerationMask1 = -(uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = -(uint64_t)(nGeneration >> 1);
+        for (size_t p = 0; p < data.size(); p += 2) {
+            uint64_t p1 = data[p], p2 = data[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
     }
-    b1.insert(vKey);
-    b2.insert(vKey);
-    if (++nInsertions == nBloomSize) {
-        nInsertions = 0;
+    nEntriesThisGeneration++;
+
+    // Double hashing: the i-th position is h1 + i * h2
+    uint32_t h1 = (uint32_t)nDigest, h2 = (uint32_t)(nDigest >> 32) | 1;
+    for (int n = 0; n < nHashFuncs; n++) {
+        uint32_t nPos = (h1 + n * h2) % nFilterBits;
+        size_t nWord = (nPos >> 6) * 2;
+        int nBit = nPos & 63;
+        data[nWord] = (data[nWord] & ~((uint64_t)1 << nBit)) | ((uint64_t)(nGeneration & 1)) << nBit;
+        data[nWord + 1] = (data[nWord + 1] & ~((uint64_t)1 << nBit)) | ((uint64_t)(nGeneration >> 1)) << nBit;
+    }
+}
+
+bool CRollingBloomFilter::ContainsDigest(uint64_t nDigest) const
+{
+    uint32_t h1 = (uint32_t)nDigest, h2 = (uint32_t)(nDigest >> 32) | 1;
+    for (int n = 0; n < nHashFuncs; n++) {
+        uint32_t nPos = (h1 + n * h2) % nFilterBits;
+        size_t nWord = (nPos >> 6) * 2;
+        int nBit = nPos & 63;
+        if (!(((data[nWord] | data[nWord + 1]) >> nBit) & 1)) {
+            return false;
+        }
     }
+    return true;
+}
+
+void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
+{
+    InsertDigest(Digest(vKey));
 }
 
 void CRollingBloomFilter::insert(const uint256& hash)
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    insert(data);
+    InsertDigest(SipHashUint256(nKey0, nKey1, hash));
 }
 
 bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
 {
-    if (nInsertions < nBloomSize / 2) {
-        return b2.contains(vKey);
-    }
-    return b1.contains(vKey);
+    return ContainsDigest(Digest(vKey));
 }
 
 bool CRollingBloomFilter::contains(const uint256& hash) const
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    return contains(data);
+    return ContainsDigest(SipHashUint256(nKey0, nKey1, hash));
 }
 
 void CRollingBloomFilter::reset()
 {
-    unsigned int nNewTweak = GetRand(std::numeric_limits<unsigned int>::max());
-    b1.reset(nNewTweak);
-    b2.reset(nNewTweak);
-    nInsertions = 0;
+    nKey0 = GetRand(std::numeric_limits<uint64_t>::max());
+    nKey1 = GetRand(std::numeric_limits<uint64_t>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
+
+size_t CRollingBloomFilter::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(data);
 }
@@ -112,6 +112,11 @@ public:
  *
  * contains(item) will always return true if item was one of the last N things
  * insert()'ed ... but may also return true for items that were not inserted.
+ *
+ * The filter holds between two and three generations of N/2 items in a
+ * fixed-size table, sized so that the false positive rate stays below the
+ * requested one even when it is at its fullest. It is not subject to the
+ * protocol limits of CBloomFilter, and never allocates after construction.
  */
 class CRollingBloomFilter
 {
@@ -128,10 +133,26 @@ public:
 
     void reset();
 
+    //! Heap memory used by the filter, in bytes
+    size_t DynamicMemoryUsage() const;
+
 private:
-    unsigned int nBloomSize;
-    unsigned int nInsertions;
-    CBloomFilter b1, b2;
+    void InsertDigest(uint64_t nDigest);
+    bool ContainsDigest(uint64_t nDigest) const;
+    uint64_t Digest(const std::vector<unsigned char>& vKey) const;
+
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    int nHashFuncs;
+    uint32_t nFilterBits;
+    uint64_t nKey0, nKey1;
+    /**
+     * Every bit of the filter takes two bits here: 00 is unset, and 01, 10
+     * and 11 mean set in generation 1, 2 or 3. Bit P of the filter is stored
+     * as bit (P & 63) of data[(P >> 6) * 2] and data[(P >> 6) * 2 + 1].
+     */
+    std::vector<uint64_t> data;
 };
 
 
@@ -5,6 +5,7 @@
 #include "coins.h"
 
 #include "memusage.h"
+#include "metrics.h"
 #include "random.h"
 
 #include <assert.h>
@@ -46,6 +47,7 @@ bool CCoinsView::HaveCoins(const uint256 &txid) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(); }
 bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return false; }
 bool CCoinsView::GetStats(CCoinsStats &stats) const { return false; }
+CCoinsView* CCoinsView::CreateSnapshot() const { return NULL; }
 
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView *viewIn) : base(viewIn) { }
@@ -55,10 +57,16 @@ uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
 bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return base->BatchWrite(mapCoins, hashBlock); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) const { return base->GetStats(stats); }
+CCoinsView* CCoinsViewBacked::CreateSnapshot() const { return base->CreateSnapshot(); }
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0), pmetricHits(NULL), pmetricMisses(NULL) { }
+
+void CCoinsViewCache::SetLookupMetrics(CMetricCounter* pmetricHitsIn, CMetricCounter* pmetricMissesIn) {
+    pmetricHits = pmetricHitsIn;
+    pmetricMisses = pmetricMissesIn;
+}
 
 CCoinsViewCache::~CCoinsViewCache()
 {
@@ -71,8 +79,13 @@ size_t CCoinsViewCache::DynamicMemoryUsage() const {
 
 CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const {
     CCoinsMap::iterator it = cacheCoins.find(txid);
-    if (it != cacheCoins.end())
+    if (it != cacheCoins.end()) {
+        if (pmetricHits)
+            pmetricHits->Inc();
         return it;
+    }
+    if (pmetricMisses)
+        pmetricMisses->Inc();
     CCoins tmp;
     if (!base->GetCoins(txid, tmp))
         return cacheCoins.end();
@@ -100,6 +113,9 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
     size_t cachedCoinUsage = 0;
+    CMetricCounter* pmetric = ret.second ? pmetricMisses : pmetricHits;
+    if (pmetric)
+        pmetric->Inc();
     if (ret.second) {
         if (!base->GetCoins(txid, ret.first->second.coins)) {
             // The parent view does not have this entry; mark it as fresh.
@@ -126,6 +142,14 @@ const CCoins* CCoinsViewCache::AccessCoins(const uint256 &txid) const {
     }
 }
 
+bool CCoinsViewCache::GetCachedCoins(const uint256 &txid, CCoins &coins) const {
+    CCoinsMap::const_iterator it = cacheCoins.find(txid);
+    if (it == cacheCoins.end())
+        return false;
+    coins = it->second.coins;
+    return true;
+}
+
 bool CCoinsViewCache::HaveCoins(const uint256 &txid) const {
     CCoinsMap::const_iterator it = FetchCoins(txid);
     // We're using vtx.empty() instead of IsPruned here for performance reasons,
@@ -332,6 +332,12 @@ public:
     //! Calculate statistics about the unspent transaction output set
     virtual bool GetStats(CCoinsStats &stats) const;
 
+    //! Create a read-only view of the current state that later changes do not
+    //! affect, or NULL if not supported. The caller takes ownership. Views that
+    //! layer changes over a backend (caches, the mempool view) return a
+    //! snapshot of the backend only.
+    virtual CCoinsView* CreateSnapshot() const;
+
     //! As we use CCoinsViews polymorphically, have a virtual destructor
     virtual ~CCoinsView() {}
 };
@@ -351,10 +357,12 @@ public:
     void SetBackend(CCoinsView &viewIn);
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+    CCoinsView* CreateSnapshot() const;
 };
 
 
 class CCoinsViewCache;
+class CMetricCounter;
 
 /** 
  * A reference to a mutable cache entry. Encapsulating it allows us to run
@@ -394,10 +402,17 @@ protected:
     /* Cached dynamic memory usage for the inner CCoins objects. */
     mutable size_t cachedCoinsUsage;
 
+    /* Counters of lookups that found an entry in this cache, or went to the base; may be NULL. */
+    CMetricCounter* pmetricHits;
+    CMetricCounter* pmetricMisses;
+
 public:
     CCoinsViewCache(CCoinsView *baseIn);
     ~CCoinsViewCache();
 
+    //! Count lookups in these counters from now on (NULL to stop counting)
+    void SetLookupMetrics(CMetricCounter* pmetricHitsIn, CMetricCounter* pmetricMissesIn);
+
     // Standard CCoinsView methods
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
@@ -412,6 +427,12 @@ public:
      */
     const CCoins* AccessCoins(const uint256 &txid) const;
 
+    /**
+     * Like GetCoins, but only looks at what is in the cache already, and does
+     * not fetch anything from the backend. Returns false if txid is not cached.
+     */
+    bool GetCachedCoins(const uint256 &txid, CCoins &coins) const;
+
     /**
      * Return a modifiable reference to a CCoins. If no entry with the given
      * txid exists, a new one is created. Simultaneous modifications are not
@@ -43,6 +43,10 @@
 #include <limits.h>
 #include <netdb.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#define USE_EPOLL 1
+#endif
 #endif
 
 #ifdef WIN32
@@ -0,0 +1,289 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "httprpc.h"
+
+#include "httpserver.h"
+#include "metrics.h"
+#include "netbase.h"
+#include "rpcprotocol.h"
+#include "rpcserver.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "utilstrencodings.h"
+
+#include <event2/util.h> // struct timeval
+
+#include <boost/algorithm/string.hpp> // boost::trim
+
+/** Simple one-shot callback timer to be used by the RPC mechanism to e.g.
+ * re-lock the wallet.
+ */
+class HTTPRPCTimer : public RPCTimerBase
+{
+public:
+    HTTPRPCTimer(struct event_base* eventBase, boost::function<void(void)>& func, int64_t millis) :
+        ev(eventBase, false, func)
+    {
+        struct timeval tv;
+        tv.tv_sec = millis/1000;
+        tv.tv_usec = (millis%1000)*1000;
+        ev.trigger(&tv);
+    }
+private:
+    HTTPEvent ev;
+};
+
+class HTTPRPCTimerInterface : public RPCTimerInterface
+{
+public:
+    HTTPRPCTimerInterface(struct event_base* base) : base(base)
+    {
+    }
+    const char* Name()
+    {
+        return "HTTP";
+    }
+    RPCTimerBase* NewTimer(boost::function<void(void)>& func, int64_t millis)
+    {
+        return new HTTPRPCTimer(base, func, millis);
+    }
+private:
+    struct event_base* base;
+};
+
+
+/* Pre-base64-encoded authentication token */
+static std::string strRPCUserColonPass;
+/* Stored RPC timer interface (for unregistration) */
+static HTTPRPCTimerInterface* httpRPCTimerInterface = 0;
+
+static void JSONErrorReply(HTTPRequest* req, const UniValue& objError, const UniValue& id)
+{
+    // Send error reply from json-rpc error object
+    int nStatus = HTTP_INTERNAL_SERVER_ERROR;
+    int code = find_value(objError, "code").get_int();
+
+    if (code == RPC_INVALID_REQUEST)
+        nStatus = HTTP_BAD_REQUEST;
+    else if (code == RPC_METHOD_NOT_FOUND)
+        nStatus = HTTP_NOT_FOUND;
+
+    std::string strReply = JSONRPCReply(NullUniValue, objError, id);
+
+    req->WriteHeader("Content-Type", "application/json");
+    req->WriteReply(nStatus, strReply);
+}
+
+void HTTPJSONStream::Write(const std::string& str)
+{
+    if (fClosed)
+        return;
+    strPending += str;
+    if (strPending.size() < HTTP_JSON_STREAM_CHUNK)
+        return;
+    if (!fStarted) {
+        req->WriteHeader("Content-Type", "application/json");
+        req->StartChunkedReply(HTTP_OK);
+        fStarted = true;
+    }
+    req->WriteReplyChunk(strPending);
+    strPending.clear();
+    if (!req->WaitForReplyChunks(HTTP_JSON_STREAM_MAX_PENDING))
+        fClosed = true;
+}
+
+void HTTPJSONStream::Discard()
+{
+    assert(!fStarted);
+    strPending.clear();
+}
+
+void HTTPJSONStream::Finish()
+{
+    if (!fStarted) {
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strPending);
+    } else {
+        req->WriteReplyChunk(strPending);
+        req->EndChunkedReply();
+    }
+    strPending.clear();
+}
+
+void HTTPJSONStream::Abort()
+{
+    assert(fStarted);
+    strPending.clear();
+    req->AbortChunkedReply();
+}
+
+static bool RPCAuthorized(const std::string& strAuth)
+{
+    if (strRPCUserColonPass.empty()) // Belt-and-suspenders measure if InitRPCAuthentication was not called
+        return false;
+    if (strAuth.substr(0, 6) != "Basic ")
+        return false;
+    std::string strUserPass64 = strAuth.substr(6);
+    boost::trim(strUserPass64);
+    std::string strUserPass = DecodeBase64(strUserPass64);
+    return TimingResistantEqual(strUserPass, strRPCUserColonPass);
+}
+
+static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
+{
+    // JSONRPC handles only POST
+    if (req->GetRequestMethod() != HTTPRequest::POST) {
+        req->WriteReply(HTTP_BAD_METHOD, "JSONRPC server handles only POST requests");
+        return false;
+    }
+    // Check authorization
+    std::pair<bool, std::string> authHeader = req->GetHeader("authorization");
+    if (!authHeader.first) {
+        req->WriteHeader("WWW-Authenticate", "Basic realm=\"jsonrpc\"");
+        req->WriteReply(HTTP_UNAUTHORIZED);
+        return false;
+    }
+
+    if (!RPCAuthorized(authHeader.second)) {
+        LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", req->GetPeer().ToString());
+
+        /* Deter brute-forcing
+           We don't support exposing the RPC port, so this shouldn't result
+           in a DoS. */
+        MilliSleep(250);
+
+        req->WriteHeader("WWW-Authenticate", "Basic realm=\"jsonrpc\"");
+        req->WriteReply(HTTP_UNAUTHORIZED);
+        return false;
+    }
+
+    JSONRequest jreq;
+    try {
+        // Parse request
+        UniValue valRequest;
+        if (!valRequest.read(req->ReadBody()))
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+
+        std::string strReply;
+        // singleton request
+        if (valRequest.isObject()) {
+            jreq.parse(valRequest);
+
+            // Large results are sent while they are being serialized
+            HTTPJSONStream stream(req);
+            stream.Write("{\"result\":");
+            try {
+                tableRPC.executeStream(jreq.strMethod, jreq.params, stream);
+            } catch (...) {
+                if (!stream.Started()) {
+                    stream.Discard();
+                    throw;
+                }
+                // Too late for an error reply; close the connection instead
+                LogPrintf("%s: %s failed while its result was being sent\n", __func__, jreq.strMethod);
+                stream.Abort();
+                return false;
+            }
+            stream.Write(",\"error\":null,\"id\":" + jreq.id.write() + "}\n");
+            stream.Finish();
+            return true;
+
+        // array of requests
+        } else if (valRequest.isArray()) {
+            if (valRequest.size() > (size_t)GetArg("-rpcbatchmaxsize", DEFAULT_RPC_BATCH_MAXSIZE))
+                throw JSONRPCError(RPC_INVALID_REQUEST, "Batch too large");
+            // This worker runs the batch; idle workers may help with read-only calls
+            int nHelpers = std::max((int)GetArg("-rpcthreads", DEFAULT_HTTP_THREADS), 1) - 1;
+            strReply = JSONRPCExecBatch(valRequest.get_array(), QueueHTTPTask, nHelpers,
+                                        GetArg("-rpcbatchtimeout", DEFAULT_RPC_BATCH_TIMEOUT));
+        } else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strReply);
+    } catch (const UniValue& objError) {
+        JSONErrorReply(req, objError, jreq.id);
+        return false;
+    } catch (const std::exception& e) {
+        JSONErrorReply(req, JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
+        return false;
+    }
+    return true;
+}
+
+static bool InitRPCAuthentication()
+{
+    if (mapArgs["-rpcpassword"] == "")
+    {
+        LogPrintf("No rpcpassword set - using random cookie authentication\n");
+        if (!GenerateAuthCookie(&strRPCUserColonPass)) {
+            uiInterface.ThreadSafeMessageBox(
+                _("Error: A fatal internal error occured, see debug.log for details"), // Same message as AbortNode
+                "", CClientUIInterface::MSG_ERROR);
+            return false;
+        }
+    } else {
+        strRPCUserColonPass = mapArgs["-rpcuser"] + ":" + mapArgs["-rpcpassword"];
+    }
+    return true;
+}
+
+static bool HTTPReq_Metrics(HTTPRequest* req, const std::string &)
+{
+    if (req->GetRequestMethod() != HTTPRequest::GET) {
+        req->WriteReply(HTTP_BAD_METHOD, "Metrics are only available through GET requests");
+        return false;
+    }
+    req->WriteHeader("Content-Type", "text/plain; version=0.0.4");
+    req->WriteReply(HTTP_OK, RenderMetrics());
+    return true;
+}
+
+bool StartHTTPRPC()
+{
+    LogPrint("rpc", "Starting HTTP RPC server\n");
+    if (!InitRPCAuthentication())
+        return false;
+
+    RegisterHTTPHandler("/", true, HTTPReq_JSONRPC);
+
+    assert(EventBase());
+    httpRPCTimerInterface = new HTTPRPCTimerInterface(EventBase());
+    RPCSetTimerInterface(httpRPCTimerInterface);
+    return true;
+}
+
+void InterruptHTTPRPC()
+{
+    LogPrint("rpc", "Interrupting HTTP RPC server\n");
+}
+
+void StopHTTPRPC()
+{
+    LogPrint("rpc", "Stopping HTTP RPC server\n");
+    UnregisterHTTPHandler("/", true);
+    if (httpRPCTimerInterface) {
+        RPCUnsetTimerInterface(httpRPCTimerInterface);
+        delete httpRPCTimerInterface;
+        httpRPCTimerInterface = 0;
+    }
+    DeleteAuthCookie();
+}
+
+bool StartHTTPMetrics()
+{
+    LogPrint("http", "Starting HTTP metrics endpoint\n");
+    RegisterHTTPHandler("/metrics", true, HTTPReq_Metrics);
+    return true;
+}
+
+void InterruptHTTPMetrics()
+{
+}
+
+void StopHTTPMetrics()
+{
+    UnregisterHTTPHandler("/metrics", true);
+}
@@ -0,0 +1,85 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_HTTPRPC_H
+#define BITCOIN_HTTPRPC_H
+
+#include "rpcserver.h"
+
+#include <string>
+#include <map>
+
+class HTTPRequest;
+
+/** Chunk size in which streamed JSON replies are handed to the HTTP server */
+static const size_t HTTP_JSON_STREAM_CHUNK = 64 * 1024;
+/** Streamed JSON replies wait while this many bytes have not been written to the client */
+static const size_t HTTP_JSON_STREAM_MAX_PENDING = 256 * 1024;
+
+/**
+ * JSON stream that sends its text as the body of an HTTP reply.
+ * Output is collected until HTTP_JSON_STREAM_CHUNK bytes are pending, at
+ * which point a chunked 200 reply is started; replies that never grow that
+ * large are sent as one ordinary reply by Finish. Write blocks while the
+ * client falls behind, so it must not be called with cs_main held.
+ */
+class HTTPJSONStream : public CJSONStream
+{
+private:
+    HTTPRequest* req;
+    std::string strPending;
+    bool fStarted;
+    bool fClosed; //!< the client went away; further output is dropped
+
+public:
+    HTTPJSONStream(HTTPRequest* req) : req(req), fStarted(false), fClosed(false) {}
+
+    void Write(const std::string& str);
+    /** Whether part of the reply has already been sent */
+    bool Started() const { return fStarted; }
+    /** Drop unsent output; only valid before anything was sent */
+    void Discard();
+    /** Send the remaining output and complete the reply */
+    void Finish();
+    /** Break off a reply that was started, so that the client sees it failed */
+    void Abort();
+};
+
+/** Start HTTP RPC subsystem.
+ * Precondition; HTTP and RPC has been started.
+ */
+bool StartHTTPRPC();
+/** Interrupt HTTP RPC subsystem.
+ */
+void InterruptHTTPRPC();
+/** Stop HTTP RPC subsystem.
+ * Precondition; HTTP and RPC has been stopped.
+ */
+void StopHTTPRPC();
+
+/** Start HTTP REST subsystem.
+ * Precondition; HTTP and RPC has been started.
+ */
+bool StartREST();
+/** Interrupt RPC REST subsystem.
+ */
+void InterruptREST();
+/** Stop HTTP REST subsystem.
+ * Precondition; HTTP and RPC has been stopped.
+ */
+void StopREST();
+
+/** Start serving metrics at /metrics, without authentication.
+ * Precondition; HTTP has been started.
+ */
+bool StartHTTPMetrics();
+/** Interrupt the HTTP metrics endpoint.
+ */
+void InterruptHTTPMetrics();
+/** Stop serving metrics.
+ * Precondition; HTTP has been stopped.
+ */
+void StopHTTPMetrics();
+
+#endif
@@ -0,0 +1,856 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/bitcoin-config.h"
+#endif
+
+#include "httpserver.h"
+
+#include "chainparamsbase.h"
+#include "compat.h"
+#include "netbase.h"
+#include "rpcprotocol.h" // For HTTP status codes
+#include "serialize.h"
+#include "sync.h"
+#include "ui_interface.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <deque>
+#include <vector>
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/thread.h>
+#include <event2/buffer.h>
+#include <event2/util.h>
+#include <event2/keyvalq_struct.h>
+
+#include <boost/algorithm/string/case_conv.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+/** Maximum size of http request (request line + headers) */
+static const size_t MAX_HEADERS_SIZE = 8192;
+
+/** HTTP request work item */
+class HTTPWorkItem : public HTTPClosure
+{
+public:
+    HTTPWorkItem(HTTPRequest* req, const std::string &path, const HTTPRequestHandler& func):
+        req(req), path(path), func(func)
+    {
+    }
+    void operator()()
+    {
+        func(req.get(), path);
+    }
+
+    boost::scoped_ptr<HTTPRequest> req;
+
+private:
+    std::string path;
+    HTTPRequestHandler func;
+};
+
+/** Bounded work queue for distributing requests over the worker threads.
+ * The event thread only parses requests and puts them here; a request that
+ * takes long to handle holds up one worker, never the event loop or the
+ * other connections. Once maxDepth requests are waiting, Enqueue refuses
+ * new work instead of letting the backlog, and with it the latency of
+ * every queued caller, grow without limit.
+ */
+class WorkQueue
+{
+private:
+    /** Mutex protects entire object */
+    boost::mutex cs;
+    boost::condition_variable cond;
+    std::deque<HTTPClosure*> queue;
+    bool running;
+    size_t maxDepth;
+
+public:
+    WorkQueue(size_t maxDepth) : running(true), maxDepth(maxDepth)
+    {
+    }
+    /** Precondition: worker threads have all stopped */
+    ~WorkQueue()
+    {
+        while (!queue.empty()) {
+            delete queue.front();
+            queue.pop_front();
+        }
+    }
+    /** Enqueue a work item; returns false if the queue is full, or if fewer
+     * than nReserve slots would remain free for requests afterwards */
+    bool Enqueue(HTTPClosure* item, size_t nReserve = 0)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (!running || queue.size() + nReserve >= maxDepth)
+            return false;
+        queue.push_back(item);
+        cond.notify_one();
+        return true;
+    }
+    /** Thread function */
+    void Run()
+    {
+        while (true) {
+            HTTPClosure* i = NULL;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (running && queue.empty())
+                    cond.wait(lock);
+                if (!running)
+                    break;
+                i = queue.front();
+                queue.pop_front();
+            }
+            try {
+                (*i)();
+            } catch (const std::exception& e) {
+                // The request, if not replied to, is answered with an error when deleted
+                PrintExceptionContinue(&e, "HTTP worker");
+            }
+            delete i;
+        }
+    }
+    /** Interrupt and exit loops */
+    void Interrupt()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        running = false;
+        cond.notify_all();
+    }
+    /** Return maximum depth of queue */
+    size_t MaxDepth()
+    {
+        return maxDepth;
+    }
+    /** Return current depth of queue */
+    size_t Depth()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        return queue.size();
+    }
+};
+
+/** Work item that runs a plain function, see QueueHTTPTask */
+class HTTPTask : public HTTPClosure
+{
+public:
+    HTTPTask(const boost::function<void(void)>& func): func(func)
+    {
+    }
+    void operator()()
+    {
+        func();
+    }
+
+private:
+    boost::function<void(void)> func;
+};
+
+struct HTTPPathHandler
+{
+    HTTPPathHandler() {}
+    HTTPPathHandler(std::string prefix, bool exactMatch, HTTPRequestHandler handler):
+        prefix(prefix), exactMatch(exactMatch), handler(handler)
+    {
+    }
+    std::string prefix;
+    bool exactMatch;
+    HTTPRequestHandler handler;
+};
+
+/** HTTP module state */
+
+//! libevent event loop
+static struct event_base* eventBase = NULL;
+//! HTTP server
+static struct evhttp* eventHTTP = NULL;
+//! List of subnets to allow RPC connections from
+static std::vector<CSubNet> rpc_allow_subnets;
+//! Work queue for handling longer requests off the event loop thread
+static WorkQueue* workQueue = NULL;
+//! Handlers for (sub)paths
+static std::vector<HTTPPathHandler> pathHandlers;
+//! Bound listening sockets
+static std::vector<evhttp_bound_socket*> boundSockets;
+//! Event loop thread, and the threads serving workQueue
+static boost::thread* threadHTTP = NULL;
+static boost::thread_group* threadHTTPWorkers = NULL;
+//! Whether to keep connections open after a reply
+static bool fHTTPKeepAlive = true;
+//! Set when the server is interrupted, to release workers waiting on slow clients
+static volatile bool fHTTPInterrupted = false;
+
+/** Check if a network address is allowed to access the HTTP server */
+static bool ClientAllowed(const CNetAddr& netaddr)
+{
+    if (!netaddr.IsValid())
+        return false;
+    BOOST_FOREACH (const CSubNet& subnet, rpc_allow_subnets)
+        if (subnet.Match(netaddr))
+            return true;
+    return false;
+}
+
+/** Initialize ACL list for HTTP server */
+static bool InitHTTPAllowList()
+{
+    rpc_allow_subnets.clear();
+    rpc_allow_subnets.push_back(CSubNet("127.0.0.0/8")); // always allow IPv4 local subnet
+    rpc_allow_subnets.push_back(CSubNet("::1"));         // always allow IPv6 localhost
+    if (mapMultiArgs.count("-rpcallowip")) {
+        const std::vector<std::string>& vAllow = mapMultiArgs["-rpcallowip"];
+        BOOST_FOREACH (std::string strAllow, vAllow) {
+            CSubNet subnet(strAllow);
+            if (!subnet.IsValid()) {
+                uiInterface.ThreadSafeMessageBox(
+                    strprintf("Invalid -rpcallowip subnet specification: %s. Valid are a single IP (e.g. 1.2.3.4), a network/netmask (e.g. 1.2.3.4/255.255.255.0) or a network/CIDR (e.g. 1.2.3.4/24).", strAllow),
+                    "", CClientUIInterface::MSG_ERROR);
+                return false;
+            }
+            rpc_allow_subnets.push_back(subnet);
+        }
+    }
+    std::string strAllowed;
+    BOOST_FOREACH (const CSubNet& subnet, rpc_allow_subnets)
+        strAllowed += subnet.ToString() + " ";
+    LogPrint("http", "Allowing HTTP connections from: %s\n", strAllowed);
+    return true;
+}
+
+/** HTTP request method as string - use for logging only */
+static std::string RequestMethodString(HTTPRequest::RequestMethod m)
+{
+    switch (m) {
+    case HTTPRequest::GET:
+        return "GET";
+    case HTTPRequest::POST:
+        return "POST";
+    case HTTPRequest::HEAD:
+        return "HEAD";
+    case HTTPRequest::PUT:
+        return "PUT";
+    default:
+        return "unknown";
+    }
+}
+
+/** HTTP request callback, on the event thread */
+static void http_request_cb(struct evhttp_request* req, void* arg)
+{
+    HTTPRequest* hreq = new HTTPRequest(req);
+
+    LogPrint("http", "Received a %s request for %s from %s\n",
+             RequestMethodString(hreq->GetRequestMethod()), hreq->GetURI(), hreq->GetPeer().ToString());
+
+    if (!fHTTPKeepAlive)
+        hreq->WriteHeader("Connection", "close");
+
+    // Early address-based allow check
+    if (!ClientAllowed(hreq->GetPeer())) {
+        hreq->WriteReply(HTTP_FORBIDDEN);
+        delete hreq;
+        return;
+    }
+
+    // Early reject unknown HTTP methods
+    if (hreq->GetRequestMethod() == HTTPRequest::UNKNOWN) {
+        hreq->WriteReply(HTTP_BAD_METHOD);
+        delete hreq;
+        return;
+    }
+
+    // Find registered handler for prefix
+    std::string strURI = hreq->GetURI();
+    std::string path;
+    std::vector<HTTPPathHandler>::const_iterator i = pathHandlers.begin();
+    std::vector<HTTPPathHandler>::const_iterator iend = pathHandlers.end();
+    for (; i != iend; ++i) {
+        bool match = false;
+        if (i->exactMatch)
+            match = (strURI == i->prefix);
+        else
+            match = (strURI.substr(0, i->prefix.size()) == i->prefix);
+        if (match) {
+            path = strURI.substr(i->prefix.size());
+            break;
+        }
+    }
+
+    // Dispatch to worker thread
+    if (i != iend) {
+        HTTPWorkItem* item = new HTTPWorkItem(hreq, path, i->handler);
+        assert(workQueue);
+        if (!workQueue->Enqueue(item)) {
+            LogPrint("http", "Work queue depth exceeded, rejecting request from %s\n", item->req->GetPeer().ToString());
+            item->req->WriteReply(HTTP_SERVICE_UNAVAILABLE, "Work queue depth exceeded");
+            delete item;
+        }
+    } else {
+        hreq->WriteReply(HTTP_NOT_FOUND);
+        delete hreq;
+    }
+}
+
+/** Callback to reject HTTP requests after shutdown. */
+static void http_reject_request_cb(struct evhttp_request* req, void*)
+{
+    LogPrint("http", "Rejecting request while shutting down\n");
+    evhttp_send_error(req, HTTP_SERVICE_UNAVAILABLE, NULL);
+}
+
+/** Event dispatcher thread */
+static void ThreadHTTP(struct event_base* base, struct evhttp* http)
+{
+    RenameThread("bitcoin-http");
+    LogPrint("http", "Entering http event loop\n");
+    event_base_dispatch(base);
+    // Event loop will be interrupted by InterruptHTTPServer()
+    LogPrint("http", "Exited http event loop\n");
+}
+
+/** Bind HTTP server to specified addresses */
+static bool HTTPBindAddresses(struct evhttp* http)
+{
+    int defaultPort = GetArg("-rpcport", BaseParams().RPCPort());
+    std::vector<std::pair<std::string, uint16_t> > endpoints;
+    bool fBindAny = false;
+
+    // Determine what addresses to bind to
+    if (!mapArgs.count("-rpcallowip")) { // Default to loopback if not allowing external IPs
+        endpoints.push_back(std::make_pair("::1", defaultPort));
+        endpoints.push_back(std::make_pair("127.0.0.1", defaultPort));
+        if (mapArgs.count("-rpcbind")) {
+            LogPrintf("WARNING: option -rpcbind was ignored because -rpcallowip was not specified, refusing to allow everyone to connect\n");
+        }
+    } else if (mapArgs.count("-rpcbind")) { // Specific bind address
+        BOOST_FOREACH (const std::string& strBind, mapMultiArgs["-rpcbind"]) {
+            int port = defaultPort;
+            std::string host;
+            SplitHostPort(strBind, port, host);
+            endpoints.push_back(std::make_pair(host, port));
+        }
+    } else { // No specific bind address specified, bind to any
+        endpoints.push_back(std::make_pair("::", defaultPort));
+        endpoints.push_back(std::make_pair("0.0.0.0", defaultPort));
+        // The IPv6 "any" socket is dual IPv6/IPv4 where the OS allows it
+        fBindAny = true;
+    }
+
+    // Bind addresses
+    for (std::vector<std::pair<std::string, uint16_t> >::iterator i = endpoints.begin(); i != endpoints.end(); ++i) {
+        LogPrintf("Binding RPC on address %s port %i\n", i->first, i->second);
+        evhttp_bound_socket* bind_handle = evhttp_bind_socket_with_handle(http, i->first.empty() ? NULL : i->first.c_str(), i->second);
+        if (bind_handle) {
+            boundSockets.push_back(bind_handle);
+            // If the dual IPv6/IPv4 bind succeeded, skip binding to IPv4 separately
+            if (fBindAny && i->first == "::")
+                break;
+        } else {
+            LogPrintf("Binding RPC on address %s port %i failed.\n", i->first, i->second);
+        }
+    }
+    return !boundSockets.empty();
+}
+
+/** Simple wrapper to set thread name and run work queue */
+static void HTTPWorkQueueRun(WorkQueue* queue)
+{
+    RenameThread("bitcoin-httpworker");
+    queue->Run();
+}
+
+/** libevent event log callback */
+static void libevent_log_cb(int severity, const char *msg)
+{
+#ifndef EVENT_LOG_WARN
+// EVENT_LOG_WARN was added in 2.0.19; but before then _EVENT_LOG_WARN existed.
+# define EVENT_LOG_WARN _EVENT_LOG_WARN
+#endif
+    if (severity >= EVENT_LOG_WARN) // Log warn messages and higher without debug category
+        LogPrintf("libevent: %s\n", msg);
+    else
+        LogPrint("libevent", "libevent: %s\n", msg);
+}
+
+bool InitHTTPServer()
+{
+    struct evhttp* http = 0;
+    struct event_base* base = 0;
+
+    if (!InitHTTPAllowList())
+        return false;
+
+    if (GetBoolArg("-rpcssl", false)) {
+        uiInterface.ThreadSafeMessageBox(
+            "SSL mode for RPC (-rpcssl) is no longer supported.",
+            "", CClientUIInterface::MSG_ERROR);
+        return false;
+    }
+
+    // Redirect libevent's logging to our own log
+    event_set_log_callback(&libevent_log_cb);
+#if LIBEVENT_VERSION_NUMBER >= 0x02010100
+    // If -debug=libevent, set full libevent debugging.
+    // Otherwise, disable all libevent debugging.
+    if (LogAcceptCategory("libevent"))
+        event_enable_debug_logging(EVENT_DBG_ALL);
+    else
+        event_enable_debug_logging(EVENT_DBG_NONE);
+#endif
+#ifdef WIN32
+    evthread_use_windows_threads();
+#else
+    evthread_use_pthreads();
+#endif
+
+    base = event_base_new();
+    if (!base) {
+        LogPrintf("Couldn't create an event_base: exiting\n");
+        return false;
+    }
+
+    /* Create a new evhttp object to handle requests. */
+    http = evhttp_new(base);
+    if (!http) {
+        LogPrintf("couldn't create evhttp. Exiting.\n");
+        event_base_free(base);
+        return false;
+    }
+
+    evhttp_set_timeout(http, GetArg("-rpcservertimeout", DEFAULT_HTTP_SERVER_TIMEOUT));
+    evhttp_set_max_headers_size(http, MAX_HEADERS_SIZE);
+    evhttp_set_max_body_size(http, MAX_SIZE);
+    evhttp_set_gencb(http, http_request_cb, NULL);
+
+    if (!HTTPBindAddresses(http)) {
+        LogPrintf("Unable to bind any endpoint for RPC server\n");
+        evhttp_free(http);
+        event_base_free(base);
+        return false;
+    }
+
+    LogPrint("http", "Initialized HTTP server\n");
+    int workQueueDepth = std::max((long)GetArg("-rpcworkqueue", DEFAULT_HTTP_WORKQUEUE), 1L);
+    LogPrintf("HTTP: creating work queue of depth %d\n", workQueueDepth);
+
+    fHTTPKeepAlive = GetBoolArg("-rpckeepalive", true);
+    workQueue = new WorkQueue(workQueueDepth);
+    eventBase = base;
+    eventHTTP = http;
+    return true;
+}
+
+bool StartHTTPServer()
+{
+    LogPrint("http", "Starting HTTP server\n");
+    int rpcThreads = std::max((long)GetArg("-rpcthreads", DEFAULT_HTTP_THREADS), 1L);
+    LogPrintf("HTTP: starting %d worker threads\n", rpcThreads);
+    threadHTTP = new boost::thread(boost::bind(&ThreadHTTP, eventBase, eventHTTP));
+
+    threadHTTPWorkers = new boost::thread_group();
+    for (int i = 0; i < rpcThreads; i++)
+        threadHTTPWorkers->create_thread(boost::bind(&HTTPWorkQueueRun, workQueue));
+    return true;
+}
+
+void InterruptHTTPServer()
+{
+    LogPrint("http", "Interrupting HTTP server\n");
+    if (eventHTTP) {
+        // Unlisten sockets
+        BOOST_FOREACH (evhttp_bound_socket* socket, boundSockets) {
+            evhttp_del_accept_socket(eventHTTP, socket);
+        }
+        boundSockets.clear();
+        // Reject requests on current connections
+        evhttp_set_gencb(eventHTTP, http_reject_request_cb, NULL);
+    }
+    fHTTPInterrupted = true;
+    if (workQueue)
+        workQueue->Interrupt();
+}
+
+void StopHTTPServer()
+{
+    LogPrint("http", "Stopping HTTP server\n");
+    if (threadHTTPWorkers) {
+        LogPrint("http", "Waiting for HTTP worker threads to exit\n");
+        threadHTTPWorkers->join_all();
+        delete threadHTTPWorkers;
+        threadHTTPWorkers = NULL;
+    }
+    // Requests still queued are answered with an error as they are deleted
+    delete workQueue;
+    workQueue = NULL;
+    if (threadHTTP) {
+        LogPrint("http", "Waiting for HTTP event thread to exit\n");
+        // The event loop exits by itself once the last connection is closed.
+        // Give it a moment to send back the last replies, then break it off,
+        // as idle keep-alive clients would hold it open until they time out.
+        if (!threadHTTP->timed_join(boost::posix_time::milliseconds(2000))) {
+            LogPrintf("HTTP event loop did not exit within allotted time, sending loopbreak\n");
+            event_base_loopbreak(eventBase);
+            threadHTTP->join();
+        }
+        delete threadHTTP;
+        threadHTTP = NULL;
+    }
+    if (eventHTTP) {
+        evhttp_free(eventHTTP);
+        eventHTTP = NULL;
+    }
+    if (eventBase) {
+        event_base_free(eventBase);
+        eventBase = NULL;
+    }
+    LogPrint("http", "Stopped HTTP server\n");
+}
+
+struct event_base* EventBase()
+{
+    return eventBase;
+}
+
+bool QueueHTTPTask(const boost::function<void(void)>& func)
+{
+    if (!workQueue)
+        return false;
+    HTTPTask* task = new HTTPTask(func);
+    if (!workQueue->Enqueue(task, workQueue->MaxDepth() / 2)) {
+        delete task;
+        return false;
+    }
+    return true;
+}
+
+static void httpevent_callback_fn(evutil_socket_t, short, void* data)
+{
+    // Static handler: simply call inner handler
+    HTTPEvent* self = ((HTTPEvent*)data);
+    self->handler();
+    if (self->deleteWhenTriggered)
+        delete self;
+}
+
+HTTPEvent::HTTPEvent(struct event_base* base, bool deleteWhenTriggered, const boost::function<void(void)>& handler):
+    deleteWhenTriggered(deleteWhenTriggered), handler(handler)
+{
+    ev = event_new(base, -1, 0, httpevent_callback_fn, this);
+    assert(ev);
+}
+HTTPEvent::~HTTPEvent()
+{
+    event_free(ev);
+}
+void HTTPEvent::trigger(struct timeval* tv)
+{
+    if (tv == NULL)
+        event_active(ev, 0, 0); // immediately trigger event in main thread
+    else
+        evtimer_add(ev, tv); // trigger after timeval passed
+}
+
+/** Progress of a chunked reply, shared between the worker producing it and
+ * the main thread sending it. The main thread deletes it when the reply ends.
+ */
+struct HTTPReplyProgress
+{
+    boost::mutex cs;
+    boost::condition_variable cond;
+    size_t nQueued;  //!< bytes queued by the worker
+    size_t nHanded;  //!< bytes handed to evhttp by the main thread
+    size_t nSent;    //!< bytes written to the connection
+    bool fClosed;    //!< the connection was closed
+
+    HTTPReplyProgress() : nQueued(0), nHanded(0), nSent(0), fClosed(false) {}
+};
+
+HTTPRequest::HTTPRequest(struct evhttp_request* req) : req(req),
+                                                       replySent(false),
+                                                       replyStarted(false),
+                                                       progress(NULL)
+{
+}
+HTTPRequest::~HTTPRequest()
+{
+    if (replyStarted && !replySent) {
+        // Don't let a chunked reply that its handler gave up on look complete
+        LogPrintf("%s: Unfinished chunked reply\n", __func__);
+        AbortChunkedReply();
+    } else if (!replySent) {
+        // Keep track of whether reply was sent to avoid request leaks
+        LogPrintf("%s: Unhandled request\n", __func__);
+        WriteReply(HTTP_INTERNAL_SERVER_ERROR, "Unhandled request");
+    }
+    // evhttpd cleans up the request, as long as a reply was sent.
+}
+
+std::pair<bool, std::string> HTTPRequest::GetHeader(const std::string& hdr)
+{
+    const struct evkeyvalq* headers = evhttp_request_get_input_headers(req);
+    assert(headers);
+    const char* val = evhttp_find_header(headers, hdr.c_str());
+    if (val)
+        return std::make_pair(true, val);
+    else
+        return std::make_pair(false, "");
+}
+
+std::string HTTPRequest::ReadBody()
+{
+    struct evbuffer* buf = evhttp_request_get_input_buffer(req);
+    if (!buf)
+        return "";
+    size_t size = evbuffer_get_length(buf);
+    /** Trivial implementation: if this is ever a performance bottleneck,
+     * internal copying can be avoided in multi-segment buffers by using
+     * evbuffer_peek and an awkward loop. Though in that case, it'd be even
+     * better to not copy into an intermediate string but use a stream
+     * abstraction to consume the evbuffer on the fly in the parsing algorithm.
+     */
+    const char* data = (const char*)evbuffer_pullup(buf, size);
+    if (!data) // returns NULL in case of empty buffer
+        return "";
+    std::string rv(data, size);
+    evbuffer_drain(buf, size);
+    return rv;
+}
+
+void HTTPRequest::WriteHeader(const std::string& hdr, const std::string& value)
+{
+    struct evkeyvalq* headers = evhttp_request_get_output_headers(req);
+    assert(headers);
+    evhttp_add_header(headers, hdr.c_str(), value.c_str());
+}
+
+/** Closure sent to main thread to request a reply to be sent to
+ * a HTTP request.
+ * Replies must be sent in the main loop in the main http thread,
+ * this cannot be done from worker threads.
+ */
+void HTTPRequest::WriteReply(int nStatus, const std::string& strReply)
+{
+    assert(!replySent && req);
+    // Send event to main http thread to send reply message
+    struct evbuffer* evb = evhttp_request_get_output_buffer(req);
+    assert(evb);
+    evbuffer_add(evb, strReply.data(), strReply.size());
+    HTTPEvent* ev = new HTTPEvent(eventBase, true,
+        boost::bind(evhttp_send_reply, req, nStatus, (const char*)NULL, (struct evbuffer *)NULL));
+    ev->trigger(0);
+    replySent = true;
+    req = 0; // transferred back to main thread
+}
+
+/** The connection of a chunked reply went away. Runs on the main http thread. */
+static void http_reply_closed(struct evhttp_connection*, void* arg)
+{
+    HTTPReplyProgress* progress = (HTTPReplyProgress*)arg;
+    boost::unique_lock<boost::mutex> lock(progress->cs);
+    progress->fClosed = true;
+    progress->cond.notify_all();
+}
+
+#ifdef HAVE_EVHTTP_SEND_REPLY_CHUNK_WITH_CB
+/** Everything handed to evhttp so far has been written. Runs on the main http thread. */
+static void http_reply_chunks_sent(struct evhttp_connection*, void* arg)
+{
+    HTTPReplyProgress* progress = (HTTPReplyProgress*)arg;
+    boost::unique_lock<boost::mutex> lock(progress->cs);
+    progress->nSent = progress->nHanded;
+    progress->cond.notify_all();
+}
+#endif
+
+static void http_send_reply_start(struct evhttp_request* req, int nStatus, HTTPReplyProgress* progress)
+{
+    struct evhttp_connection* evcon = evhttp_request_get_connection(req);
+    if (evcon)
+        evhttp_connection_set_closecb(evcon, http_reply_closed, progress);
+    else
+        http_reply_closed(NULL, progress);
+    evhttp_send_reply_start(req, nStatus, NULL);
+}
+
+/** Hand a chunk to evhttp and release it. Runs on the main http thread. */
+static void http_send_reply_chunk(struct evhttp_request* req, struct evbuffer* evb, HTTPReplyProgress* progress)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(progress->cs);
+        progress->nHanded += evbuffer_get_length(evb);
+#ifndef HAVE_EVHTTP_SEND_REPLY_CHUNK_WITH_CB
+        // No way to learn when the data is written; only bound our own queue
+        progress->nSent = progress->nHanded;
+        progress->cond.notify_all();
+#endif
+    }
+#ifdef HAVE_EVHTTP_SEND_REPLY_CHUNK_WITH_CB
+    evhttp_send_reply_chunk_with_cb(req, evb, http_reply_chunks_sent, progress);
+#else
+    evhttp_send_reply_chunk(req, evb);
+#endif
+    evbuffer_free(evb);
+}
+
+static void http_send_reply_end(struct evhttp_request* req, HTTPReplyProgress* progress)
+{
+    struct evhttp_connection* evcon = evhttp_request_get_connection(req);
+    if (evcon)
+        evhttp_connection_set_closecb(evcon, NULL, NULL);
+    // Replaces the write callback that refers to progress, if any
+    evhttp_send_reply_end(req);
+    delete progress;
+}
+
+static void http_send_reply_abort(struct evhttp_request* req, HTTPReplyProgress* progress)
+{
+    struct evhttp_connection* evcon = evhttp_request_get_connection(req);
+    if (evcon) {
+        evhttp_connection_set_closecb(evcon, NULL, NULL);
+        // Frees the request as well, and no terminating chunk is sent
+        evhttp_connection_free(evcon);
+    } else {
+        // The connection is gone already; this only frees the request
+        evhttp_send_reply_end(req);
+    }
+    delete progress;
+}
+
+void HTTPRequest::StartChunkedReply(int nStatus)
+{
+    assert(!replySent && !replyStarted && req);
+    progress = new HTTPReplyProgress();
+    HTTPEvent* ev = new HTTPEvent(eventBase, true,
+        boost::bind(http_send_reply_start, req, nStatus, progress));
+    ev->trigger(0);
+    replyStarted = true;
+}
+
+void HTTPRequest::WriteReplyChunk(const std::string& strChunk)
+{
+    assert(replyStarted && !replySent && req);
+    if (strChunk.empty()) // an empty chunk would terminate the reply
+        return;
+    // The request's own output buffer belongs to the main thread once the
+    // reply has started, so every chunk travels in a buffer of its own.
+    struct evbuffer* evb = evbuffer_new();
+    assert(evb);
+    evbuffer_add(evb, strChunk.data(), strChunk.size());
+    {
+        boost::unique_lock<boost::mutex> lock(progress->cs);
+        progress->nQueued += strChunk.size();
+    }
+    HTTPEvent* ev = new HTTPEvent(eventBase, true, boost::bind(http_send_reply_chunk, req, evb, progress));
+    ev->trigger(0);
+}
+
+bool HTTPRequest::CanWaitForClient()
+{
+#ifdef HAVE_EVHTTP_SEND_REPLY_CHUNK_WITH_CB
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool HTTPRequest::WaitForReplyChunks(size_t nMaxPending)
+{
+    assert(replyStarted && !replySent && req);
+    boost::unique_lock<boost::mutex> lock(progress->cs);
+    while (!progress->fClosed && !fHTTPInterrupted && progress->nQueued - progress->nSent > nMaxPending)
+        progress->cond.timed_wait(lock, boost::posix_time::milliseconds(100));
+    return !progress->fClosed && !fHTTPInterrupted;
+}
+
+void HTTPRequest::EndChunkedReply()
+{
+    assert(replyStarted && !replySent && req);
+    HTTPEvent* ev = new HTTPEvent(eventBase, true, boost::bind(http_send_reply_end, req, progress));
+    ev->trigger(0);
+    replySent = true;
+    req = 0; // transferred back to main thread
+    progress = NULL;
+}
+
+void HTTPRequest::AbortChunkedReply()
+{
+    assert(replyStarted && !replySent && req);
+    HTTPEvent* ev = new HTTPEvent(eventBase, true, boost::bind(http_send_reply_abort, req, progress));
+    ev->trigger(0);
+    replySent = true;
+    req = 0; // transferred back to main thread
+    progress = NULL;
+}
+
+CService HTTPRequest::GetPeer()
+{
+    evhttp_connection* con = evhttp_request_get_connection(req);
+    CService peer;
+    if (con) {
+        // evhttp retains ownership over returned address string
+        const char* address = "";
+        uint16_t port = 0;
+        evhttp_connection_get_peer(con, (char**)&address, &port);
+        peer = CService(address, port);
+    }
+    return peer;
+}
+
+std::string HTTPRequest::GetURI()
+{
+    return evhttp_request_get_uri(req);
+}
+
+HTTPRequest::RequestMethod HTTPRequest::GetRequestMethod()
+{
+    switch (evhttp_request_get_command(req)) {
+    case EVHTTP_REQ_GET:
+        return GET;
+        break;
+    case EVHTTP_REQ_POST:
+        return POST;
+        break;
+    case EVHTTP_REQ_HEAD:
+        return HEAD;
+        break;
+    case EVHTTP_REQ_PUT:
+        return PUT;
+        break;
+    default:
+        return UNKNOWN;
+        break;
+    }
+}
+
+void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler)
+{
+    LogPrint("http", "Registering HTTP handler for %s (exactmatch %d)\n", prefix, exactMatch);
+    pathHandlers.push_back(HTTPPathHandler(prefix, exactMatch, handler));
+}
+
+void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch)
+{
+    std::vector<HTTPPathHandler>::iterator i = pathHandlers.begin();
+    std::vector<HTTPPathHandler>::iterator iend = pathHandlers.end();
+    for (; i != iend; ++i)
+        if (i->prefix == prefix && i->exactMatch == exactMatch)
+            break;
+    if (i != iend)
+    {
+        LogPrint("http", "Unregistering HTTP handler for %s (exactmatch %d)\n", prefix, exactMatch);
+        pathHandlers.erase(i);
+    }
+}
@@ -0,0 +1,209 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_HTTPSERVER_H
+#define BITCOIN_HTTPSERVER_H
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+
+#include <boost/function.hpp>
+
+static const int DEFAULT_HTTP_THREADS=4;
+static const int DEFAULT_HTTP_WORKQUEUE=16;
+static const int DEFAULT_HTTP_SERVER_TIMEOUT=30;
+
+struct evhttp_request;
+struct event_base;
+class CService;
+class HTTPRequest;
+struct HTTPReplyProgress;
+
+/** Initialize HTTP server.
+ * Call this before RegisterHTTPHandler or EventBase().
+ */
+bool InitHTTPServer();
+/** Start HTTP server.
+ * This is separate from InitHTTPServer to give users race-condition-free time
+ * to register their handlers between InitHTTPServer and StartHTTPServer.
+ */
+bool StartHTTPServer();
+/** Interrupt HTTP server threads: stop accepting connections and requests */
+void InterruptHTTPServer();
+/** Stop HTTP server: wait for the worker threads and the event loop to finish */
+void StopHTTPServer();
+
+/** Handler for requests to a certain HTTP path */
+typedef boost::function<bool(HTTPRequest* req, const std::string &)> HTTPRequestHandler;
+/** Register handler for prefix.
+ * If multiple handlers match a prefix, the first-registered one will
+ * be invoked.
+ */
+void RegisterHTTPHandler(const std::string &prefix, bool exactMatch, const HTTPRequestHandler &handler);
+/** Unregister handler for prefix */
+void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch);
+
+/** Return evhttp event base. This can be used by submodules to
+ * queue timers or custom events.
+ */
+struct event_base* EventBase();
+
+/** Run func on one of the HTTP worker threads.
+ * Only uses the spare half of the work queue, so that background tasks
+ * cannot crowd out requests. Returns false if the task was not queued.
+ */
+bool QueueHTTPTask(const boost::function<void(void)>& func);
+
+/** In-flight HTTP request.
+ * Thin C++ wrapper around evhttp_request. A request is parsed on the event
+ * thread and handled on a worker thread; the reply is handed back to the
+ * event thread to be sent.
+ */
+class HTTPRequest
+{
+private:
+    struct evhttp_request* req;
+    bool replySent;
+    bool replyStarted;
+    HTTPReplyProgress* progress; //!< unsent data of a chunked reply
+
+public:
+    HTTPRequest(struct evhttp_request* req);
+    ~HTTPRequest();
+
+    enum RequestMethod {
+        UNKNOWN,
+        GET,
+        POST,
+        HEAD,
+        PUT
+    };
+
+    /** Get requested URI.
+     */
+    std::string GetURI();
+
+    /** Get CService (address:ip) for the origin of the http request.
+     */
+    CService GetPeer();
+
+    /** Get request method.
+     */
+    RequestMethod GetRequestMethod();
+
+    /**
+     * Get the request header specified by hdr, or an empty string.
+     * Return an pair (isPresent,string).
+     */
+    std::pair<bool, std::string> GetHeader(const std::string& hdr);
+
+    /**
+     * Read request body.
+     *
+     * @note As this consumes the underlying buffer, call this only once.
+     * Repeated calls will return an empty string.
+     */
+    std::string ReadBody();
+
+    /**
+     * Write output header.
+     *
+     * @note call this before calling WriteReply.
+     */
+    void WriteHeader(const std::string& hdr, const std::string& value);
+
+    /**
+     * Write HTTP reply.
+     * nStatus is the HTTP status code to send.
+     * strReply is the body of the reply. Keep it empty to send a standard message.
+     *
+     * @note Can be called only once. As this will give the request back to the
+     * main thread, do not call any other HTTPRequest methods after calling this.
+     */
+    void WriteReply(int nStatus, const std::string& strReply = "");
+
+    /**
+     * Start a chunked HTTP reply, for bodies that are produced piecewise.
+     * Headers must have been written before. Follow with any number of
+     * WriteReplyChunk calls and one EndChunkedReply, instead of WriteReply.
+     * Clients that only speak HTTP/1.0 get the body unchunked, followed by
+     * the connection being closed.
+     */
+    void StartChunkedReply(int nStatus);
+
+    /**
+     * Send the next part of a chunked reply. The data is copied and queued
+     * for the main thread, so the caller can go on producing the next part.
+     */
+    void WriteReplyChunk(const std::string& strChunk);
+
+    /**
+     * Wait until at most nMaxPending bytes of the chunked reply are still
+     * waiting to be sent to the client, so that a reply that is produced
+     * faster than the client reads it does not pile up in memory.
+     * Returns false if the client has gone away or the server is shutting
+     * down; the caller should then stop producing and end the reply.
+     */
+    bool WaitForReplyChunks(size_t nMaxPending);
+
+    /**
+     * Whether WaitForReplyChunks waits for the client. Before libevent 2.1.1
+     * it only waits until chunks are handed to libevent, which buffers all
+     * that the client has not read yet.
+     */
+    static bool CanWaitForClient();
+
+    /**
+     * Finish a chunked reply.
+     *
+     * @note As with WriteReply, do not call any other HTTPRequest methods
+     * afterwards.
+     */
+    void EndChunkedReply();
+
+    /**
+     * Abandon a chunked reply that cannot be completed, by closing the
+     * connection without sending the terminating chunk. The client then
+     * sees a transport error instead of a short reply that looks complete.
+     *
+     * @note As with WriteReply, do not call any other HTTPRequest methods
+     * afterwards.
+     */
+    void AbortChunkedReply();
+};
+
+/** Event handler closure.
+ */
+class HTTPClosure
+{
+public:
+    virtual void operator()() = 0;
+    virtual ~HTTPClosure() {}
+};
+
+/** Event class. This can be used either as an cross-thread trigger or as a timer.
+ */
+class HTTPEvent
+{
+public:
+    /** Create a new event.
+     * deleteWhenTriggered deletes this event object after the event is triggered (and the handler called)
+     * handler is the handler to call when the event is triggered.
+     */
+    HTTPEvent(struct event_base* base, bool deleteWhenTriggered, const boost::function<void(void)>& handler);
+    ~HTTPEvent();
+
+    /** Trigger the event. If tv is 0, trigger it immediately. Otherwise trigger it after
+     * the given time has elapsed.
+     */
+    void trigger(struct timeval* tv);
+
+    bool deleteWhenTriggered;
+    boost::function<void(void)> handler;
+private:
+    struct event* ev;
+};
+
+#endif // BITCOIN_HTTPSERVER_H
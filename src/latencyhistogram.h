@@ -0,0 +1,63 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_LATENCYHISTOGRAM_H
+#define BITCOIN_LATENCYHISTOGRAM_H
+
+#include <algorithm>
+#include <stdint.h>
+
+/**
+ * Histogram of latencies in microseconds, with power-of-two buckets:
+ * bucket 0 counts latencies below 1us, bucket i those in [2^(i-1), 2^i).
+ */
+class CLatencyHistogram
+{
+public:
+    static const unsigned int BUCKETS = 32;
+
+    CLatencyHistogram() : nCount(0), nTotal(0), nMax(0)
+    {
+        std::fill(vBuckets, vBuckets + BUCKETS, 0);
+    }
+
+    void Add(int64_t nMicros)
+    {
+        unsigned int nBucket = 0;
+        while (nBucket + 1 < BUCKETS && nMicros >= ((int64_t)1 << nBucket))
+            nBucket++;
+        vBuckets[nBucket]++;
+        nCount++;
+        nTotal += nMicros;
+        nMax = std::max(nMax, nMicros);
+    }
+
+    uint64_t GetCount() const { return nCount; }
+    int64_t GetTotal() const { return nTotal; }
+    int64_t GetMax() const { return nMax; }
+    uint64_t GetBucket(unsigned int nBucket) const { return vBuckets[nBucket]; }
+
+    /** Upper bound in microseconds of the given fraction of recorded latencies */
+    int64_t GetPercentile(double dFraction) const
+    {
+        if (nCount == 0)
+            return 0;
+        uint64_t nSeen = 0;
+        for (unsigned int i = 0; i + 1 < BUCKETS; i++) {
+            nSeen += vBuckets[i];
+            if (nSeen >= dFraction * nCount)
+                return std::min((int64_t)1 << i, nMax);
+        }
+        // The last bucket has no upper bound
+        return nMax;
+    }
+
+private:
+    uint64_t vBuckets[BUCKETS];
+    uint64_t nCount;
+    int64_t nTotal;
+    int64_t nMax;
+};
+
+#endif // BITCOIN_LATENCYHISTOGRAM_H
@@ -8,6 +8,7 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -16,6 +17,7 @@
 #include "hash.h"
 #include "init.h"
 #include "merkleblock.h"
+#include "metrics.h"
 #include "net.h"
 #include "policy/policy.h"
 #include "pow.h"
@@ -34,6 +36,7 @@
 #include "utilstrencodings.h"
 #include "validationinterface.h"
 
+#include <deque>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -59,6 +62,9 @@ CChain chainActive;
 CBlockIndex *pindexBestHeader = NULL;
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
+/** Only held to copy or replace the pointer, never while waiting on anything else */
+static CCriticalSection cs_tipSummary;
+static CChainTipSummaryRef tipSummary(new CChainTipSummary());
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
 bool fImporting = false;
@@ -80,11 +86,35 @@ CFeeRate minRelayTxFee = CFeeRate(1000);
 CTxMemPool mempool(::minRelayTxFee);
 
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
 };
-map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);;
+map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
+struct IteratorComparator
+{
+    template<typename I>
+    bool operator()(const I& a, const I& b) const
+    {
+        return &(*a) < &(*b);
+    }
+};
+/** Orphans indexed by the outpoints they spend, so a new parent only touches its own children. */
+map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
+struct COrphanPeer {
+    set<uint256> setOrphans;
+    size_t nOrphanBytes;
+    COrphanPeer() : nOrphanBytes(0) {}
+};
+/** Orphans indexed by the peer that sent them, with each peer's share of the byte budget. */
+map<NodeId, COrphanPeer> mapOrphanTransactionsByPeer GUARDED_BY(cs_main);
+size_t nOrphanTransactionsSize GUARDED_BY(cs_main) = 0;
+
+/** Relayed transactions waiting for batched mempool admission, and the (referenced) peers they came from. */
+CCriticalSection cs_txAdmissionQueue;
+std::vector<CTxAdmission> vTxAdmissionQueue GUARDED_BY(cs_txAdmissionQueue);
+std::vector<CNode*> vTxAdmissionFrom GUARDED_BY(cs_txAdmissionQueue);
+CTxAdmissionStats txAdmissionStats GUARDED_BY(cs_main);
 void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 /**
@@ -192,6 +222,7 @@ namespace {
         int64_t nTime;  //! Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //! Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //! The timeout for this block request (for disconnecting a slow peer)
+        boost::shared_ptr<CPartiallyDownloadedBlock> partialBlock;  //! Optional, for blocks being rebuilt from a compact block
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -206,8 +237,58 @@ namespace {
 
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
+
+    /**
+     * The "block" message for the most recent tip requested by a peer. A new tip
+     * is requested by many peers at once, so it is read and serialized only once.
+     */
+    uint256 hashRecentBlockMessage;
+    CSerializedMessageRef pRecentBlockMessage;
+
+    /** Peers we asked to push new blocks as compact blocks, least recently chosen first. */
+    list<NodeId> lNodesAnnouncingHeaderAndIDs;
 } // anon namespace
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// Block download pacing
+//
+
+/** Moving average of the time a peer takes to deliver a requested block once it
+ *  gets to it, after it delivered one at nNow that it could start on at nStart. */
+int64_t UpdateBlockServiceTime(int64_t nAverage, int64_t nStart, int64_t nNow)
+{
+    int64_t nServiceTime = std::max<int64_t>(nNow - nStart, 1);
+    if (nAverage == 0)
+        return nServiceTime;
+    return (nAverage * 7 + nServiceTime) / 8;
+}
+
+/** Number of blocks to keep requested from a peer: enough to cover its ping time and
+ *  BLOCK_DOWNLOAD_PIPELINE_TIME at the rate it has been delivering them. */
+int GetBlocksInTransitTarget(int64_t nBlockServiceTime, int64_t nPingUsecTime)
+{
+    if (nBlockServiceTime == 0)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nTarget = 1 + (nPingUsecTime + 1000000 * BLOCK_DOWNLOAD_PIPELINE_TIME) / nBlockServiceTime;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(nTarget, MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER));
+}
+
+/** Whether a block requested at nRequested from a staller, which last delivered a block at
+ *  nStallerLastReceived, should be requested from a peer with service time nServiceTime instead.
+ *  The staller gets half the stalling timeout, and at least twice what we expect the other
+ *  peer to need, and must be at least twice as slow as that peer. */
+bool ShouldReassignStalledBlock(int64_t nServiceTime, int64_t nStallerServiceTime, int64_t nStallerLastReceived, int64_t nRequested, int64_t nNow)
+{
+    if (nServiceTime == 0)
+        return false;
+    int64_t nWaiting = nNow - nRequested;
+    int64_t nWaitingTurn = nNow - std::max(nRequested, nStallerLastReceived);
+    if (nWaiting < 500000 * BLOCK_STALLING_TIMEOUT || nWaiting < 2 * nServiceTime)
+        return false;
+    return std::max(nStallerServiceTime, nWaitingTurn) >= 2 * nServiceTime;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // Registration of network node signals.
@@ -246,6 +327,10 @@ struct CNodeState {
     uint256 hashLastUnknownBlock;
     //! The last full block we both have.
     CBlockIndex *pindexLastCommonBlock;
+    //! The best header we have sent our peer.
+    CBlockIndex *pindexBestHeaderSent;
+    //! Length of the current streak of unconnecting headers announcements
+    int nUnconnectingHeaders;
     //! Whether we've started headers synchronization with this peer.
     bool fSyncStarted;
     //! Since when we're stalling block download progress (in microseconds), or 0.
@@ -253,8 +338,23 @@ struct CNodeState {
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! When the last block we requested from this peer arrived (in microseconds), or 0.
+    int64_t nLastBlockReceived;
+    //! Moving average of the time this peer takes to deliver a requested block once it
+    //! gets to it (in microseconds), or 0 before the first one.
+    int64_t nBlockServiceTime;
+    //! Number of blocks to keep requested from this peer, from its speed and ping time.
+    int nBlocksInTransitTarget;
+    //! Number of blocks requested from a faster peer instead, because this one held back the download window.
+    int nBlocksReassigned;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer wants invs or headers (when possible) for block announcements.
+    bool fPreferHeaders;
+    //! Whether this peer understands compact blocks (sent us sendcmpct).
+    bool fProvidesHeaderAndIDs;
+    //! Whether this peer wants new blocks pushed as cmpctblock rather than announced.
+    bool fPreferHeaderAndIDs;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -263,11 +363,20 @@ struct CNodeState {
         pindexBestKnownBlock = NULL;
         hashLastUnknownBlock.SetNull();
         pindexLastCommonBlock = NULL;
+        pindexBestHeaderSent = NULL;
+        nUnconnectingHeaders = 0;
         fSyncStarted = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nLastBlockReceived = 0;
+        nBlockServiceTime = 0;
+        nBlocksInTransitTarget = MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+        nBlocksReassigned = 0;
         fPreferredDownload = false;
+        fPreferHeaders = false;
+        fProvidesHeaderAndIDs = false;
+        fPreferHeaderAndIDs = false;
     }
 };
 
@@ -326,16 +435,26 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
 
 // Requires cs_main.
 // Returns a bool indicating whether we requested this block.
-bool MarkBlockAsReceived(const uint256& hash) {
+// If nodeFrom is the peer it was requested from, the delivery counts towards that peer's download speed.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1) {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
+        if (nodeFrom == itInFlight->second.first) {
+            // Blocks come in one at a time, so time this one from when the peer could
+            // start on it: its request, or the delivery of the previous block
+            int64_t nNow = GetTimeMicros();
+            state->nBlockServiceTime = UpdateBlockServiceTime(state->nBlockServiceTime,
+                std::max(itInFlight->second.second->nTime, state->nLastBlockReceived), nNow);
+            state->nLastBlockReceived = nNow;
+        }
         nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->vBlocksInFlight.erase(itInFlight->second.second);
@@ -348,20 +467,89 @@ bool MarkBlockAsReceived(const uint256& hash) {
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
+// Returns false, leaving the request as it was, if the block was already in flight from this peer.
+// If pit is non-NULL, it is set to the peer's request for the block.
+bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL, list<QueuedBlock>::iterator *pit = NULL) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == nodeid) {
+        if (pit)
+            *pit = itInFlight->second.second;
+        return false;
+    }
+
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
     int64_t nNow = GetTimeMicros();
-    QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams)};
+    QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams),
+                            boost::shared_ptr<CPartiallyDownloadedBlock>()};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    if (pit)
+        *pit = it;
+    return true;
+}
+
+// Requires cs_main.
+/** Request pindex, which holds back the download window while in flight from the slower peer staller,
+ *  from nodeid instead. Returns whether it was moved. */
+bool ReassignStalledBlock(NodeId nodeid, NodeId staller, CBlockIndex* pindex, int64_t nNow, const Consensus::Params& consensusParams)
+{
+    CNodeState *state = State(nodeid);
+    CNodeState *stateStaller = State(staller);
+    assert(state != NULL && stateStaller != NULL);
+
+    // Only peers that have proven themselves take over blocks
+    if (state->nBlocksInFlight >= state->nBlocksInTransitTarget)
+        return false;
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(pindex->GetBlockHash());
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != staller || itInFlight->second.second->partialBlock)
+        return false;
+
+    int64_t nRequested = itInFlight->second.second->nTime;
+    if (!ShouldReassignStalledBlock(state->nBlockServiceTime, stateStaller->nBlockServiceTime, stateStaller->nLastBlockReceived, nRequested, nNow))
+        return false;
+    int64_t nWaiting = nNow - nRequested;
+    int64_t nWaitingTurn = nNow - std::max(nRequested, stateStaller->nLastBlockReceived);
+
+    // The staller is at least as slow as this block shows, so ask less of it from now on
+    stateStaller->nBlockServiceTime = std::max(stateStaller->nBlockServiceTime, nWaitingTurn);
+    stateStaller->nBlocksReassigned++;
+    LogPrint("net", "Reassigning block %s (%d) from peer=%d, waiting for %dms, to peer=%d\n",
+        pindex->GetBlockHash().ToString(), pindex->nHeight, staller, nWaiting / 1000, nodeid);
+    MarkBlockAsInFlight(nodeid, pindex->GetBlockHash(), consensusParams, pindex);
+    return true;
+}
+
+// Requires cs_main.
+/** Ask pfrom to push us new blocks as compact blocks, instead of the least recently chosen such peer. */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom)
+{
+    if (!nodestate->fProvidesHeaderAndIDs)
+        return;
+    if (std::find(lNodesAnnouncingHeaderAndIDs.begin(), lNodesAnnouncingHeaderAndIDs.end(), pfrom->GetId()) != lNodesAnnouncingHeaderAndIDs.end())
+        return;
+    bool fAnnounceUsingCMPCTBLOCK = false;
+    uint64_t nCMPCTBLOCKVersion = 1;
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_HIGH_BANDWIDTH_CMPCT_PEERS) {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            if (pnode->GetId() == lNodesAnnouncingHeaderAndIDs.front()) {
+                pnode->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+                break;
+            }
+        }
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+    }
+    fAnnounceUsingCMPCTBLOCK = true;
+    pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -397,6 +585,24 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     }
 }
 
+// Requires cs_main.
+/** Whether our peer is known to have the header of pindex, from its announcements or ours. */
+bool PeerHasHeader(CNodeState *state, CBlockIndex *pindex)
+{
+    if (state->pindexBestKnownBlock && pindex == state->pindexBestKnownBlock->GetAncestor(pindex->nHeight))
+        return true;
+    if (state->pindexBestHeaderSent && pindex == state->pindexBestHeaderSent->GetAncestor(pindex->nHeight))
+        return true;
+    return false;
+}
+
+// Requires cs_main.
+/** Whether our tip is recent enough to download announced blocks directly, rather than through the headers sync. */
+bool CanDirectFetch(const Consensus::Params &consensusParams)
+{
+    return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - consensusParams.nPowTargetSpacing * 20;
+}
+
 /** Find the last common ancestor two blocks have.
  *  Both pa and pb must be non-NULL. */
 CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
@@ -417,8 +623,9 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
+ *  at most count entries. If the download window keeps us from fetching anything, nodeStaller and
+ *  pindexStalled are set to the peer and the in-flight block holding it back. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, CBlockIndex*& pindexStalled) {
     if (count == 0)
         return;
 
@@ -454,6 +661,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    CBlockIndex *pindexWaitingFor = NULL;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -485,6 +693,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStalled = pindexWaitingFor;
                     }
                     return;
                 }
@@ -495,6 +704,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -514,16 +724,32 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlocksInTransitTarget = state->nBlocksInTransitTarget;
+    stats.dBlockDownloadRate = state->nBlockServiceTime ? 1000000.0 / state->nBlockServiceTime : 0.0;
+    stats.nBlocksReassigned = state->nBlocksReassigned;
     return true;
 }
 
+/**
+ * Salts for the deterministic choice of peers to relay an address to, and of
+ * the transactions announced without trickling. Set once, before any message
+ * is handled, as the handlers of different peers run concurrently.
+ */
+static uint256 hashAddrRelaySalt;
+static uint256 hashTrickleSalt;
+
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
+    if (hashAddrRelaySalt.IsNull()) {
+        hashAddrRelaySalt = GetRandHash();
+        hashTrickleSalt = GetRandHash();
+    }
     nodeSignals.GetHeight.connect(&GetHeight);
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
     nodeSignals.InitializeNode.connect(&InitializeNode);
     nodeSignals.FinalizeNode.connect(&FinalizeNode);
+    nodeSignals.ProcessBatches.connect(&ProcessBatches);
 }
 
 void UnregisterNodeSignals(CNodeSignals& nodeSignals)
@@ -533,6 +759,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
     nodeSignals.SendMessages.disconnect(&SendMessages);
     nodeSignals.InitializeNode.disconnect(&InitializeNode);
     nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
+    nodeSignals.ProcessBatches.disconnect(&ProcessBatches);
 }
 
 CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& locator)
@@ -552,15 +779,19 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CMetricCounter& metricCoinsTipHits = RegisterMetric<CMetricCounter>("bitcoin_coins_cache_lookups_total",
+    "Lookups in the coins cache of the active chain, by whether they had to go to the database", "result=\"hit\"");
+CMetricCounter& metricCoinsTipMisses = RegisterMetric<CMetricCounter>("bitcoin_coins_cache_lookups_total",
+    "Lookups in the coins cache of the active chain, by whether they had to go to the database", "result=\"miss\"");
 
 //////////////////////////////////////////////////////////////////////////////
 //
 // mapOrphanTransactions
 //
 
-bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+bool AddOrphanTx(const CTransactionRef& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
-    uint256 hash = tx.GetHash();
+    const uint256& hash = tx->GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
 
@@ -571,20 +802,26 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(c
     // have been mined or received.
     // 10,000 orphans, each of which is at most 5,000 bytes big is
     // at most 500 megabytes of orphans:
-    unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
+    unsigned int sz = tx->GetTotalSize();
     if (sz > 5000)
     {
         LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.insert(std::make_pair(hash, COrphanTx())).first;
+    it->second.tx = tx;
+    it->second.fromPeer = peer;
+    it->second.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    BOOST_FOREACH(const CTxIn& txin, tx->vin)
+        mapOrphanTransactionsByPrev[txin.prevout].insert(it);
+    COrphanPeer& orphanPeer = mapOrphanTransactionsByPeer[peer];
+    orphanPeer.setOrphans.insert(hash);
+    orphanPeer.nOrphanBytes += sz;
+    nOrphanTransactionsSize += sz;
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u bytes %u)\n", hash.ToString(),
+             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanTransactionsSize);
     return true;
 }
 
@@ -593,51 +830,158 @@ void static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
         return;
-    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
+    BOOST_FOREACH(const CTxIn& txin, it->second.tx->vin)
     {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
+        map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
-        itPrev->second.erase(hash);
+        itPrev->second.erase(it);
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    size_t sz = it->second.tx->GetTotalSize();
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanTransactionsByPeer.find(it->second.fromPeer);
+    if (itPeer != mapOrphanTransactionsByPeer.end()) {
+        itPeer->second.setOrphans.erase(hash);
+        itPeer->second.nOrphanBytes -= sz;
+        if (itPeer->second.setOrphans.empty())
+            mapOrphanTransactionsByPeer.erase(itPeer);
+    }
+    nOrphanTransactionsSize -= sz;
     mapOrphanTransactions.erase(it);
 }
 
 void EraseOrphansFor(NodeId peer)
 {
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
-    {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
-    }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanTransactionsByPeer.find(peer);
+    if (itPeer == mapOrphanTransactionsByPeer.end())
+        return;
+    // Copy, as erasing the last orphan also erases the peer's index entry
+    const set<uint256> setErase = itPeer->second.setOrphans;
+    BOOST_FOREACH(const uint256& hash, setErase)
+        EraseOrphanTx(hash);
+    LogPrint("mempool", "Erased %d orphan tx from peer %d\n", setErase.size(), peer);
 }
 
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphanBytes) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    static int64_t nNextSweep;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        // Sweep out expired orphan pool entries:
+        int nErased = 0;
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end())
+        {
+            map<uint256, COrphanTx>::iterator maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                EraseOrphanTx(maybeErase->first);
+                ++nErased;
+            } else {
+                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+            }
+        }
+        // Sweeping again before the oldest remaining entry expires is pointless
+        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
+        nEvicted += nErased;
+    }
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsSize > nMaxOrphanBytes)
     {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+        // Evict a random orphan from the peer using the largest share of the
+        // pool, so one flooding peer can't push out everybody else's orphans:
+        map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanTransactionsByPeer.begin();
+        for (map<NodeId, COrphanPeer>::iterator mi = mapOrphanTransactionsByPeer.begin(); mi != mapOrphanTransactionsByPeer.end(); ++mi)
+            if (mi->second.nOrphanBytes > itPeer->second.nOrphanBytes)
+                itPeer = mi;
+        set<uint256>& setOrphans = itPeer->second.setOrphans;
+        set<uint256>::iterator it = setOrphans.lower_bound(GetRandHash());
+        if (it == setOrphans.end())
+            it = setOrphans.begin();
+        EraseOrphanTx(*it);
         ++nEvicted;
     }
     return nEvicted;
 }
 
+/** Queue the orphans spending any output of tx for reconsideration. */
+void static AddOrphanChildren(const CTransaction& tx, std::set<uint256>& setOrphanWork) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    const uint256& hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(COutPoint(hash, i));
+        if (itByPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        for (set<map<uint256, COrphanTx>::iterator, IteratorComparator>::iterator mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi)
+            setOrphanWork.insert((*mi)->first);
+    }
+}
+
+/**
+ * Reconsider orphans whose parents have been accepted, in batches of at most
+ * MAX_ORPHAN_RESOLUTION_BATCH mempool acceptance attempts per call, so a long
+ * chain of orphans can't stall the message handler for other peers.
+ */
+void static ProcessOrphanWork(std::set<uint256>& setOrphanWork) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    set<NodeId> setMisbehaving;
+    unsigned int nAttempts = 0;
+    while (!setOrphanWork.empty() && nAttempts < MAX_ORPHAN_RESOLUTION_BATCH)
+    {
+        const uint256 orphanHash = *setOrphanWork.begin();
+        setOrphanWork.erase(setOrphanWork.begin());
+
+        map<uint256, COrphanTx>::iterator itOrphan = mapOrphanTransactions.find(orphanHash);
+        if (itOrphan == mapOrphanTransactions.end())
+            continue;
+        const CTransactionRef orphanTx = itOrphan->second.tx;
+        NodeId fromPeer = itOrphan->second.fromPeer;
+        if (setMisbehaving.count(fromPeer))
+            continue;
+
+        bool fMissingInputs2 = false;
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        CValidationState stateDummy;
+        ++nAttempts;
+        if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+        {
+            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+            RelayTransaction(orphanTx);
+            AddOrphanChildren(*orphanTx, setOrphanWork);
+            EraseOrphanTx(orphanHash);
+        }
+        else if (!fMissingInputs2)
+        {
+            int nDos = 0;
+            if (stateDummy.IsInvalid(nDos) && nDos > 0)
+            {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(fromPeer, nDos);
+                setMisbehaving.insert(fromPeer);
+                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // Has inputs but not accepted to mempool
+            // Probably non-standard or insufficient fee/priority
+            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+            EraseOrphanTx(orphanHash);
+            assert(recentRejects);
+            recentRejects->insert(orphanHash);
+        }
+        mempool.check(pcoinsTip);
+    }
+}
+
+/** Publish whether pfrom has orphans left to reconsider, for the message scheduler */
+void static UpdateOrphanWork(CNode* pfrom) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    pfrom->SetOrphanWork(!pfrom->setOrphanWork.empty());
+}
+
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight, int64_t nBlockTime)
 {
     if (tx.nLockTime == 0)
@@ -778,10 +1122,17 @@ static std::string FormatStateMessage(const CValidationState &state)
         state.GetRejectCode());
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+/**
+ * Everything AcceptToMemoryPool checks, except that the transaction's scripts
+ * are queued into vChecks instead of being run: one check per input under the
+ * standard flags, followed by one per input under the mandatory flags. On
+ * success entry is ready to be stored once CheckQueuedScripts passes.
+ */
+static bool AcceptToMemoryPoolPrepare(CTxMemPool& pool, CValidationState &state, const CTransactionRef &ptx, bool fLimitFree,
+                                      bool* pfMissingInputs, bool fRejectAbsurdFee, std::vector<CScriptCheck>& vChecks, CTxMemPoolEntry& entry)
 {
     AssertLockHeld(cs_main);
+    const CTransaction& tx = *ptx;
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
@@ -879,7 +1230,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CAmount nFees = nValueIn-nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx));
+        entry = CTxMemPoolEntry(ptx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx));
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -921,35 +1272,98 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                 REJECT_HIGHFEE, "absurdly-high-fee",
                 strprintf("%d > %d", nFees, ::minRelayTxFee.GetFee(nSize) * 10000));
 
-        // Check against previous transactions
-        // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true))
+        // Queue the checks against previous transactions
+        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, &vChecks))
             return false;
+        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, &vChecks))
+            return false;
+    }
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
-        // transactions to pass as valid when they're actually invalid. For
-        // instance the STRICTENC flag was incorrectly allowing certain
-        // CHECKSIG NOT scripts to pass, even though they were invalid.
-        //
-        // There is a similar check in CreateNewBlock() to prevent creating
-        // invalid blocks, however allowing such transactions into the mempool
-        // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-        {
+    return true;
+}
+
+/**
+ * Run the script checks queued by AcceptToMemoryPoolPrepare, reporting
+ * failures exactly as CheckInputs would have. If fStandardVerified, the
+ * checks under the standard flags already passed, and filled the signature
+ * cache for the mandatory ones.
+ */
+static bool CheckQueuedScripts(const CTransaction& tx, CValidationState &state, std::vector<CScriptCheck>& vChecks, bool fStandardVerified)
+{
+    const size_t nInputs = tx.vin.size();
+    assert(vChecks.size() == 2 * nInputs);
+    for (size_t i = 0; i < nInputs && !fStandardVerified; i++) {
+        if (!vChecks[i]()) {
+            // Check whether the failure was caused by a non-mandatory script
+            // verification check, such as non-standard DER encodings or
+            // non-null dummy arguments; if so, don't trigger DoS protection.
+            CScriptCheck& checkMandatory = vChecks[nInputs + i];
+            if (checkMandatory())
+                return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(checkMandatory.GetScriptError())));
+            return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(checkMandatory.GetScriptError())));
+        }
+    }
+
+    // Check again against just the consensus-critical mandatory script
+    // verification flags, in case of bugs in the standard flags that cause
+    // transactions to pass as valid when they're actually invalid. For
+    // instance the STRICTENC flag was incorrectly allowing certain
+    // CHECKSIG NOT scripts to pass, even though they were invalid.
+    //
+    // There is a similar check in CreateNewBlock() to prevent creating
+    // invalid blocks, however allowing such transactions into the mempool
+    // can be exploited as a DoS attack.
+    for (size_t i = nInputs; i < vChecks.size(); i++) {
+        if (!vChecks[i]()) {
+            state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(vChecks[i].GetScriptError())));
             return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
-                __func__, hash.ToString(), FormatStateMessage(state));
+                __func__, tx.GetHash().ToString(), FormatStateMessage(state));
         }
-
-        // Store transaction in memory
-        pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
     }
+    return true;
+}
+
+static const char* const mempoolAcceptResults[] = { "accepted", "rejected" };
+static const CMetricFamily<CMetricCounter> metricMempoolAccept("bitcoin_mempool_accept_total",
+    "Transactions offered to the mempool, by result", "result",
+    std::vector<std::string>(mempoolAcceptResults, mempoolAcceptResults + ARRAYLEN(mempoolAcceptResults)));
+static const char* const mempoolAcceptPaths[] = { "single", "batch" };
+static const CMetricFamily<CMetricHistogram> metricMempoolAcceptTime("bitcoin_mempool_accept_seconds",
+    "Time spent admitting a transaction, or a batch of them, to the mempool", "path",
+    std::vector<std::string>(mempoolAcceptPaths, mempoolAcceptPaths + ARRAYLEN(mempoolAcceptPaths)));
+
+static bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const CTransactionRef &ptx, bool fLimitFree,
+                                     bool* pfMissingInputs, bool fRejectAbsurdFee)
+{
+    std::vector<CScriptCheck> vChecks;
+    CTxMemPoolEntry entry;
+    if (!AcceptToMemoryPoolPrepare(pool, state, ptx, fLimitFree, pfMissingInputs, fRejectAbsurdFee, vChecks, entry))
+        return false;
+
+    // Check against previous transactions
+    // This is done last to help prevent CPU exhaustion denial-of-service attacks.
+    if (!CheckQueuedScripts(*ptx, state, vChecks, false))
+        return false;
 
-    SyncWithWallets(tx, NULL);
+    // Store transaction in memory
+    pool.addUnchecked(ptx->GetHash(), entry, !IsInitialBlockDownload());
+
+    SyncWithWallets(*ptx, NULL);
 
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransactionRef &ptx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+{
+    AssertLockHeld(cs_main);
+    int64_t nTimeStart = GetTimeMicros();
+    bool fAccepted = AcceptToMemoryPoolWorker(pool, state, ptx, fLimitFree, pfMissingInputs, fRejectAbsurdFee);
+    metricMempoolAcceptTime[0].Observe(GetTimeMicros() - nTimeStart);
+    metricMempoolAccept[fAccepted ? 0 : 1].Inc();
+    return fAccepted;
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1000,9 +1414,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
     if (pindexSlow) {
         CBlock block;
         if (ReadBlockFromDisk(block, pindexSlow)) {
-            BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-                if (tx.GetHash() == hash) {
-                    txOut = tx;
+            BOOST_FOREACH(const CTransactionRef &tx, block.vtx) {
+                if (tx->GetHash() == hash) {
+                    txOut = *tx;
                     hashBlock = pindexSlow->GetBlockHash();
                     return true;
                 }
@@ -1193,6 +1607,7 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -1525,7 +1940,7 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
 
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
-        const CTransaction &tx = block.vtx[i];
+        const CTransaction &tx = *block.vtx[i];
         uint256 hash = tx.GetHash();
 
         // Check that all outputs are available and match the outputs in the block itself
@@ -1604,6 +2019,123 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+unsigned int AcceptToMemoryPoolBatch(CTxMemPool& pool, std::vector<CTxAdmission>& vBatch, bool fLimitFree)
+{
+    AssertLockHeld(cs_main);
+    int64_t nTimeStart = GetTimeMicros();
+    unsigned int nAccepted = 0;
+
+    // Members of the batch that spend other members wait until all of those
+    // have been decided on, so that every transaction is prepared once, after
+    // its parents are in the mempool or known to be rejected.
+    std::map<uint256, size_t> mapBatchIndex;
+    for (size_t i = 0; i < vBatch.size(); i++) {
+        vBatch[i].fAccepted = false;
+        mapBatchIndex.insert(std::make_pair(vBatch[i].tx->GetHash(), i));
+    }
+    std::vector<std::vector<size_t> > vChildren(vBatch.size());
+    std::vector<unsigned int> vWaitingFor(vBatch.size(), 0);
+    std::vector<size_t> vReady;
+    for (size_t i = 0; i < vBatch.size(); i++) {
+        std::set<size_t> setParents;
+        BOOST_FOREACH(const CTxIn& txin, vBatch[i].tx->vin) {
+            std::map<uint256, size_t>::const_iterator it = mapBatchIndex.find(txin.prevout.hash);
+            if (it != mapBatchIndex.end() && it->second != i && setParents.insert(it->second).second)
+                vChildren[it->second].push_back(i);
+        }
+        vWaitingFor[i] = setParents.size();
+        if (setParents.empty())
+            vReady.push_back(i);
+    }
+
+    // Admit the batch in waves. Each wave prepares the ready transactions
+    // against the current mempool, verifies all their scripts in one go on
+    // the script check threads, and stores the ones that passed. Ready
+    // members that conflict with another member of the wave are retried in
+    // the next one, which sees this wave in the mempool.
+    while (!vReady.empty())
+    {
+        std::vector<size_t> vWave;
+        std::vector<size_t> vNext;
+        std::vector<size_t> vDecided;
+        std::vector<std::vector<CScriptCheck> > vWaveChecks;
+        std::vector<CTxMemPoolEntry> vWaveEntries;
+        std::set<COutPoint> setWaveSpent;
+        BOOST_FOREACH(size_t i, vReady) {
+            CTxAdmission& admission = vBatch[i];
+            bool fConflict = false;
+            BOOST_FOREACH(const CTxIn& txin, admission.tx->vin)
+                fConflict |= setWaveSpent.count(txin.prevout) > 0;
+            if (fConflict) {
+                vNext.push_back(i);
+                continue;
+            }
+
+            admission.state = CValidationState();
+            std::vector<CScriptCheck> vChecks;
+            CTxMemPoolEntry entry;
+            if (!AcceptToMemoryPoolPrepare(pool, admission.state, admission.tx, fLimitFree, &admission.fMissingInputs, false, vChecks, entry)) {
+                vDecided.push_back(i);
+                continue;
+            }
+            BOOST_FOREACH(const CTxIn& txin, admission.tx->vin)
+                setWaveSpent.insert(txin.prevout);
+            vWave.push_back(i);
+            vWaveChecks.push_back(std::vector<CScriptCheck>());
+            vWaveChecks.back().swap(vChecks);
+            vWaveEntries.push_back(entry);
+        }
+
+        // Verify the whole wave at once under the standard flags. Only if that
+        // fails (or there are no script check threads) is each transaction
+        // verified on its own, to find out which ones are at fault. The
+        // mandatory flags are checked afterwards, so that they hit the
+        // signature cache rather than verifying every signature twice.
+        bool fWaveVerified = false;
+        if (!vWave.empty() && nScriptCheckThreads) {
+            std::vector<CScriptCheck> vAllChecks;
+            for (size_t j = 0; j < vWave.size(); j++) {
+                const std::vector<CScriptCheck>& vChecks = vWaveChecks[j];
+                vAllChecks.insert(vAllChecks.end(), vChecks.begin(), vChecks.begin() + vBatch[vWave[j]].tx->vin.size());
+            }
+            CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+            control.Add(vAllChecks);
+            fWaveVerified = control.Wait();
+        }
+
+        for (size_t j = 0; j < vWave.size(); j++) {
+            CTxAdmission& admission = vBatch[vWave[j]];
+            vDecided.push_back(vWave[j]);
+            if (!CheckQueuedScripts(*admission.tx, admission.state, vWaveChecks[j], fWaveVerified))
+                continue;
+            pool.addUnchecked(admission.tx->GetHash(), vWaveEntries[j], !IsInitialBlockDownload());
+            SyncWithWallets(*admission.tx, NULL);
+            admission.fAccepted = true;
+            nAccepted++;
+        }
+
+        // Children whose last parent was decided on are ready for the next
+        // wave. Those of rejected parents fail there with missing inputs.
+        BOOST_FOREACH(size_t i, vDecided)
+            BOOST_FOREACH(size_t nChild, vChildren[i])
+                if (--vWaitingFor[nChild] == 0)
+                    vNext.push_back(nChild);
+        std::sort(vNext.begin(), vNext.end());
+        vReady.swap(vNext);
+    }
+
+    metricMempoolAcceptTime[1].Observe(GetTimeMicros() - nTimeStart);
+    metricMempoolAccept[0].Inc(nAccepted);
+    metricMempoolAccept[1].Inc(vBatch.size() - nAccepted);
+    return nAccepted;
+}
+
+void GetTxAdmissionStats(CTxAdmissionStats& stats)
+{
+    LOCK(cs_main);
+    stats = txAdmissionStats;
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -1672,10 +2204,35 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
+/**
+ * Phases of connecting a block, as timed by ConnectBlock and ConnectTip. They
+ * do not overlap: verify is only the wait for the script checks that did not
+ * finish while connecting, and total covers all of them.
+ */
+enum BlockConnectPhase {
+    BLOCK_PHASE_LOAD,
+    BLOCK_PHASE_CONNECT,
+    BLOCK_PHASE_VERIFY,
+    BLOCK_PHASE_INDEX,
+    BLOCK_PHASE_CALLBACKS,
+    BLOCK_PHASE_FLUSH,
+    BLOCK_PHASE_CHAINSTATE,
+    BLOCK_PHASE_POSTCONNECT,
+    BLOCK_PHASE_TOTAL,
+};
+static const char* const blockConnectPhaseNames[] = {
+    "load", "connect", "verify", "index", "callbacks", "flush", "chainstate", "postconnect", "total",
+};
+static const CMetricFamily<CMetricHistogram> metricBlockConnect("bitcoin_block_connect_seconds",
+    "Time spent connecting blocks to the active chain, by phase", "phase",
+    std::vector<std::string>(blockConnectPhaseNames, blockConnectPhaseNames + ARRAYLEN(blockConnectPhaseNames)));
+
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck,
+                  CBlockConnectStats* pstats)
 {
     const CChainParams& chainparams = Params();
     AssertLockHeld(cs_main);
+    uint64_t nCoinsMissesStart = metricCoinsTipMisses.Get();
     // Check it again in case a previous version let a bad block in
     if (!CheckBlock(block, state, !fJustCheck, !fJustCheck))
         return false;
@@ -1717,8 +2274,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                           !((pindex->nHeight==91842 && pindex->GetBlockHash() == uint256S("0x00000000000a4d0a398161ffc163c503763b1f4360639393e0e4c8e300e0caec")) ||
                            (pindex->nHeight==91880 && pindex->GetBlockHash() == uint256S("0x00000000000743f190a18c5577a3c2d2a1f610ae9601ac046a38084ccb7cd721")));
     if (fEnforceBIP30) {
-        BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-            const CCoins* coins = view.AccessCoins(tx.GetHash());
+        BOOST_FOREACH(const CTransactionRef& tx, block.vtx) {
+            const CCoins* coins = view.AccessCoins(tx->GetHash());
             if (coins && !coins->IsPruned())
                 return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
                                  REJECT_INVALID, "bad-txns-BIP30");
@@ -1740,6 +2297,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
+    uint64_t nSigCacheHitsStart, nSigCacheMissesStart;
+    GetSignatureCacheStats(nSigCacheHitsStart, nSigCacheMissesStart);
+    int64_t nTimeUTXOFetch = 0;
+
     int64_t nTimeStart = GetTimeMicros();
     CAmount nFees = 0;
     int nInputs = 0;
@@ -1750,7 +2311,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
-        const CTransaction &tx = block.vtx[i];
+        const CTransaction &tx = *block.vtx[i];
 
         nInputs += tx.vin.size();
         nSigOps += GetLegacySigOpCount(tx);
@@ -1760,7 +2321,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
         if (!tx.IsCoinBase())
         {
-            if (!view.HaveInputs(tx))
+            // Pulls the spent outputs into the view, for the checks below
+            int64_t nTimeFetchStart = GetTimeMicros();
+            bool fHaveInputs = view.HaveInputs(tx);
+            nTimeUTXOFetch += GetTimeMicros() - nTimeFetchStart;
+            if (!fHaveInputs)
                 return state.DoS(100, error("ConnectBlock(): inputs missing/spent"),
                                  REJECT_INVALID, "bad-txns-inputs-missingorspent");
 
@@ -1794,18 +2359,32 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
     int64_t nTime1 = GetTimeMicros(); nTimeConnect += nTime1 - nTimeStart;
+    if (!fJustCheck)
+        metricBlockConnect[BLOCK_PHASE_CONNECT].Observe(nTime1 - nTimeStart);
     LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime1 - nTimeStart), 0.001 * (nTime1 - nTimeStart) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime1 - nTimeStart) / (nInputs-1), nTimeConnect * 0.000001);
 
     CAmount blockReward = nFees + GetBlockSubsidy(pindex->nHeight, chainparams.GetConsensus());
-    if (block.vtx[0].GetValueOut() > blockReward)
+    if (block.vtx[0]->GetValueOut() > blockReward)
         return state.DoS(100,
                          error("ConnectBlock(): coinbase pays too much (actual=%d vs limit=%d)",
-                               block.vtx[0].GetValueOut(), blockReward),
+                               block.vtx[0]->GetValueOut(), blockReward),
                                REJECT_INVALID, "bad-cb-amount");
 
     if (!control.Wait())
         return state.DoS(100, false);
     int64_t nTime2 = GetTimeMicros(); nTimeVerify += nTime2 - nTimeStart;
+    if (!fJustCheck)
+        metricBlockConnect[BLOCK_PHASE_VERIFY].Observe(nTime2 - nTime1);
+    if (pstats) {
+        pstats->nInputs = nInputs - 1;
+        pstats->nConnectMicros = nTime1 - nTimeStart;
+        pstats->nUTXOFetchMicros = nTimeUTXOFetch;
+        pstats->nScriptCheckWaitMicros = nTime2 - nTime1;
+        uint64_t nSigCacheHits, nSigCacheMisses;
+        GetSignatureCacheStats(nSigCacheHits, nSigCacheMisses);
+        pstats->nSigCacheHits = nSigCacheHits - nSigCacheHitsStart;
+        pstats->nSigCacheMisses = nSigCacheMisses - nSigCacheMissesStart;
+    }
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs-1), nTimeVerify * 0.000001);
 
     if (fJustCheck)
@@ -1838,14 +2417,21 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     view.SetBestBlock(pindex->GetBlockHash());
 
     int64_t nTime3 = GetTimeMicros(); nTimeIndex += nTime3 - nTime2;
+    metricBlockConnect[BLOCK_PHASE_INDEX].Observe(nTime3 - nTime2);
     LogPrint("bench", "    - Index writing: %.2fms [%.2fs]\n", 0.001 * (nTime3 - nTime2), nTimeIndex * 0.000001);
 
     // Watch for changes to the previous coinbase transaction.
     static uint256 hashPrevBestCoinBase;
     GetMainSignals().UpdatedTransaction(hashPrevBestCoinBase);
-    hashPrevBestCoinBase = block.vtx[0].GetHash();
+    hashPrevBestCoinBase = block.vtx[0]->GetHash();
 
     int64_t nTime4 = GetTimeMicros(); nTimeCallbacks += nTime4 - nTime3;
+    metricBlockConnect[BLOCK_PHASE_CALLBACKS].Observe(nTime4 - nTime3);
+    if (pstats) {
+        pstats->nIndexMicros = nTime3 - nTime2;
+        pstats->nCallbacksMicros = nTime4 - nTime3;
+        pstats->nCoinsCacheMisses = metricCoinsTipMisses.Get() - nCoinsMissesStart;
+    }
     LogPrint("bench", "    - Callbacks: %.2fms [%.2fs]\n", 0.001 * (nTime4 - nTime3), nTimeCallbacks * 0.000001);
 
     return true;
@@ -1858,6 +2444,13 @@ enum FlushStateMode {
     FLUSH_STATE_ALWAYS
 };
 
+static const char* const flushParts[] = { "blockindex", "coins" };
+static const CMetricFamily<CMetricHistogram> metricFlush("bitcoin_flush_seconds",
+    "Time spent writing the block index and flushing the coins cache to disk", "part",
+    std::vector<std::string>(flushParts, flushParts + ARRAYLEN(flushParts)));
+static CMetricGauge& metricCoinsCacheBytes = RegisterMetric<CMetricGauge>("bitcoin_coins_cache_bytes",
+    "Memory used by the coins cache, as of the last check whether to flush it");
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed depending on the mode we're called with
@@ -1895,6 +2488,7 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         nLastSetChain = nNow;
     }
     size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    metricCoinsCacheBytes.Set(cacheSize);
     // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
     bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
     // The cache is over the limit, we have to write now.
@@ -1910,6 +2504,7 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         // Depend on nMinDiskSpace to ensure we can write block index
         if (!CheckDiskSpace(0))
             return state.Error("out of disk space");
+        int64_t nTimeStart = GetTimeMicros();
         // First make sure all block and undo data is flushed to disk.
         FlushBlockFile();
         // Then update all block file information (which may refer to block and undo files).
@@ -1934,6 +2529,7 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         if (fFlushForPrune)
             UnlinkPrunedFiles(setFilesToPrune);
         nLastWrite = nNow;
+        metricFlush[0].Observe(GetTimeMicros() - nTimeStart);
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
@@ -1945,9 +2541,11 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
+        int64_t nTimeStart = GetTimeMicros();
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
+        metricFlush[1].Observe(GetTimeMicros() - nTimeStart);
     }
     if ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000) {
         // Update best block in wallet (so we can detect restored wallets).
@@ -1971,10 +2569,37 @@ void PruneAndFlush() {
     FlushStateToDisk(state, FLUSH_STATE_NONE);
 }
 
+CChainTipSummaryRef GetChainTipSummary()
+{
+    LOCK(cs_tipSummary);
+    return tipSummary;
+}
+
+/** Publish a new summary of chainActive's tip and the best header (requires cs_main, except during startup). */
+static void PublishChainTipSummary()
+{
+    CChainTipSummary* summary = new CChainTipSummary();
+    CChainTipSummaryRef ref(summary);
+    CBlockIndex* pindex = chainActive.Tip();
+    if (pindex) {
+        summary->pindex = pindex;
+        summary->nHeight = pindex->nHeight;
+        summary->hashBlock = pindex->GetBlockHash();
+        summary->nChainWork = pindex->nChainWork;
+        summary->nTime = pindex->GetBlockTime();
+        summary->dVerificationProgress = Checkpoints::GuessVerificationProgress(Params().Checkpoints(), pindex);
+    }
+    summary->nHeadersHeight = pindexBestHeader ? pindexBestHeader->nHeight : -1;
+
+    LOCK(cs_tipSummary);
+    tipSummary.swap(ref);
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex *pindexNew) {
     const CChainParams& chainParams = Params();
     chainActive.SetTip(pindexNew);
+    PublishChainTipSummary();
 
     // New best block
     nTimeBestReceived = GetTime();
@@ -2011,11 +2636,133 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     }
 }
 
-/** Disconnect chainActive's tip. */
-bool static DisconnectTip(CValidationState &state) {
+/**
+ * Transactions of blocks disconnected during a reorg, kept out of the
+ * mempool until the new chain has been connected.
+ */
+struct CDisconnectedTransactions
+{
+    //! In topological order: oldest disconnected block first, block order within a block
+    std::deque<CTransactionRef> queuedTx;
+    //! Hashes of queuedTx which have not been confirmed again by the new chain
+    std::set<uint256> setUnconfirmed;
+
+    void AddBlock(const CBlock& block)
+    {
+        // Blocks are disconnected tip first, so each one goes in front
+        BOOST_REVERSE_FOREACH(const CTransactionRef& tx, block.vtx) {
+            queuedTx.push_front(tx);
+            setUnconfirmed.insert(tx->GetHash());
+        }
+    }
+
+    void RemoveForBlock(const CBlock& block)
+    {
+        if (setUnconfirmed.empty())
+            return;
+        BOOST_FOREACH(const CTransactionRef& tx, block.vtx)
+            setUnconfirmed.erase(tx->GetHash());
+    }
+
+    bool empty() const { return queuedTx.empty(); }
+
+    void clear()
+    {
+        queuedTx.clear();
+        setUnconfirmed.clear();
+    }
+};
+
+/**
+ * Return the transactions of blocks disconnected during a reorg to the
+ * mempool, now that the new chain is in place. They are admitted as one
+ * batch, in topological order, with their scripts verified in parallel
+ * (most signatures hit the cache from their first mempool visit). The sweep
+ * for spends of no longer mature coinbases, and the mempool consistency
+ * check, are done once for the whole reorg rather than once per block.
+ */
+void static UpdateMempoolForReorg(CDisconnectedTransactions& disconnected, bool fAddToMempool) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    AssertLockHeld(cs_main);
+    if (disconnected.empty())
+        return;
+    int64_t nTimeStart = GetTimeMicros();
+
+    std::vector<CTxAdmission> vBatch;
+    BOOST_FOREACH(const CTransactionRef& tx, disconnected.queuedTx) {
+        if (fAddToMempool && !tx->IsCoinBase() && disconnected.setUnconfirmed.count(tx->GetHash()))
+            vBatch.push_back(CTxAdmission(tx, -1, nTimeStart));
+    }
+    unsigned int nAccepted = AcceptToMemoryPoolBatch(mempool, vBatch, false);
+
+    // Anything in the mempool spending the outputs of a transaction that did
+    // not make it back in has to go too
+    std::set<uint256> setAccepted;
+    BOOST_FOREACH(const CTxAdmission& admission, vBatch)
+        if (admission.fAccepted)
+            setAccepted.insert(admission.tx->GetHash());
+    BOOST_FOREACH(const CTransactionRef& tx, disconnected.queuedTx) {
+        if (!disconnected.setUnconfirmed.count(tx->GetHash()) || setAccepted.count(tx->GetHash()))
+            continue;
+        list<CTransactionRef> removed;
+        mempool.remove(*tx, removed, true);
+    }
+    mempool.removeCoinbaseSpends(pcoinsTip, chainActive.Height() + 1);
+    mempool.check(pcoinsTip);
+
+    LogPrint("bench", "- Reorg mempool update: %.2fms (%u of %u txs resurrected)\n",
+        (GetTimeMicros() - nTimeStart) * 0.001, nAccepted, disconnected.queuedTx.size());
+    disconnected.clear();
+}
+
+/** Statistics of the last connected blocks of the active chain, by increasing height */
+static CCriticalSection cs_blockConnectStats;
+static std::deque<CBlockConnectStats> dequeBlockConnectStats GUARDED_BY(cs_blockConnectStats);
+
+static bool CompareBlockConnectStatsHeight(const CBlockConnectStats& stats, int nHeight)
+{
+    return stats.nHeight < nHeight;
+}
+
+/** Forget the statistics of blocks at nHeight and above, as they left the active chain */
+static void ForgetBlockConnectStats(int nHeight)
+{
+    LOCK(cs_blockConnectStats);
+    while (!dequeBlockConnectStats.empty() && dequeBlockConnectStats.back().nHeight >= nHeight)
+        dequeBlockConnectStats.pop_back();
+}
+
+static void RecordBlockConnectStats(const CBlockConnectStats& stats)
+{
+    LOCK(cs_blockConnectStats);
+    // Normally done by DisconnectTip already, but not when the chain state was unloaded
+    while (!dequeBlockConnectStats.empty() && dequeBlockConnectStats.back().nHeight >= stats.nHeight)
+        dequeBlockConnectStats.pop_back();
+    dequeBlockConnectStats.push_back(stats);
+    if (dequeBlockConnectStats.size() > BLOCK_CONNECT_STATS_SIZE)
+        dequeBlockConnectStats.pop_front();
+}
+
+void GetBlockConnectStats(int nStartHeight, int nEndHeight, std::vector<CBlockConnectStats>& vStats)
+{
+    vStats.clear();
+    LOCK(cs_blockConnectStats);
+    std::deque<CBlockConnectStats>::const_iterator it = std::lower_bound(dequeBlockConnectStats.begin(),
+        dequeBlockConnectStats.end(), nStartHeight, CompareBlockConnectStatsHeight);
+    for (; it != dequeBlockConnectStats.end() && it->nHeight < nEndHeight; ++it)
+        vStats.push_back(*it);
+}
+
+/**
+ * Disconnect chainActive's tip. The block's transactions are queued in
+ * disconnected, to be returned to the mempool by UpdateMempoolForReorg once
+ * the caller is done reorganizing.
+ */
+bool static DisconnectTip(CValidationState &state, CDisconnectedTransactions& disconnected) {
     CBlockIndex *pindexDelete = chainActive.Tip();
     assert(pindexDelete);
-    mempool.check(pcoinsTip);
+    if (disconnected.empty())
+        mempool.check(pcoinsTip);
     // Read block from disk.
     CBlock block;
     if (!ReadBlockFromDisk(block, pindexDelete))
@@ -2032,22 +2779,15 @@ bool static DisconnectTip(CValidationState &state) {
     // Write the chain state to disk, if necessary.
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
-    // Resurrect mempool transactions from the disconnected block.
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        // ignore validation errors in resurrected transactions
-        list<CTransaction> removed;
-        CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
-            mempool.remove(tx, removed, true);
-    }
-    mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
-    mempool.check(pcoinsTip);
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
+    ForgetBlockConnectStats(pindexDelete->nHeight);
+    // Queue the block's transactions for resurrection into the mempool.
+    disconnected.AddBlock(block);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        SyncWithWallets(tx, NULL);
+    BOOST_FOREACH(const CTransactionRef &tx, block.vtx) {
+        SyncWithWallets(*tx, NULL);
     }
     return true;
 }
@@ -2062,9 +2802,16 @@ static int64_t nTimePostConnect = 0;
  * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
  * corresponding to pindexNew, to bypass loading it again from disk.
  */
-bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, const CBlock *pblock) {
+bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, const CBlock *pblock, CDisconnectedTransactions& disconnected) {
     assert(pindexNew->pprev == chainActive.Tip());
-    mempool.check(pcoinsTip);
+    // The mempool is only consistent with the chain again once any reorg in
+    // progress has been reconciled
+    const bool fReorg = !disconnected.empty();
+    if (!fReorg)
+        mempool.check(pcoinsTip);
+    CBlockConnectStats stats;
+    stats.nHeight = pindexNew->nHeight;
+    stats.hash = pindexNew->GetBlockHash();
     // Read block from disk.
     int64_t nTime1 = GetTimeMicros();
     CBlock block;
@@ -2075,11 +2822,12 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, const CB
     }
     // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
+    metricBlockConnect[BLOCK_PHASE_LOAD].Observe(nTime2 - nTime1);
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
     {
         CCoinsViewCache view(pcoinsTip);
-        bool rv = ConnectBlock(*pblock, state, pindexNew, view);
+        bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, &stats);
         GetMainSignals().BlockChecked(*pblock, state);
         if (!rv) {
             if (state.IsInvalid())
@@ -2092,29 +2840,43 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, const CB
         assert(view.Flush());
     }
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
+    metricBlockConnect[BLOCK_PHASE_FLUSH].Observe(nTime4 - nTime3);
     LogPrint("bench", "  - Flush: %.2fms [%.2fs]\n", (nTime4 - nTime3) * 0.001, nTimeFlush * 0.000001);
     // Write the chain state to disk, if necessary.
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
     int64_t nTime5 = GetTimeMicros(); nTimeChainState += nTime5 - nTime4;
+    metricBlockConnect[BLOCK_PHASE_CHAINSTATE].Observe(nTime5 - nTime4);
     LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
     // Remove conflicting transactions from the mempool.
-    list<CTransaction> txConflicted;
+    list<CTransactionRef> txConflicted;
     mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted, !IsInitialBlockDownload());
-    mempool.check(pcoinsTip);
+    disconnected.RemoveForBlock(*pblock);
+    if (!fReorg)
+        mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
     // Tell wallet about transactions that went from mempool
     // to conflicted:
-    BOOST_FOREACH(const CTransaction &tx, txConflicted) {
-        SyncWithWallets(tx, NULL);
+    BOOST_FOREACH(const CTransactionRef &tx, txConflicted) {
+        SyncWithWallets(*tx, NULL);
     }
     // ... and about transactions that got confirmed:
-    BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
-        SyncWithWallets(tx, pblock);
+    BOOST_FOREACH(const CTransactionRef &tx, pblock->vtx) {
+        SyncWithWallets(*tx, pblock);
     }
 
     int64_t nTime6 = GetTimeMicros(); nTimePostConnect += nTime6 - nTime5; nTimeTotal += nTime6 - nTime1;
+    metricBlockConnect[BLOCK_PHASE_POSTCONNECT].Observe(nTime6 - nTime5);
+    metricBlockConnect[BLOCK_PHASE_TOTAL].Observe(nTime6 - nTime1);
+    stats.nTimeConnected = GetTime();
+    stats.nTx = pblock->vtx.size();
+    stats.nLoadMicros = nTime2 - nTime1;
+    stats.nFlushMicros = nTime4 - nTime3;
+    stats.nChainStateMicros = nTime5 - nTime4;
+    stats.nPostConnectMicros = nTime6 - nTime5;
+    stats.nTotalMicros = nTime6 - nTime1;
+    RecordBlockConnectStats(stats);
     LogPrint("bench", "  - Connect postprocess: %.2fms [%.2fs]\n", (nTime6 - nTime5) * 0.001, nTimePostConnect * 0.000001);
     LogPrint("bench", "- Connect block: %.2fms [%.2fs]\n", (nTime6 - nTime1) * 0.001, nTimeTotal * 0.000001);
     return true;
@@ -2201,9 +2963,13 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
     const CBlockIndex *pindexFork = chainActive.FindFork(pindexMostWork);
 
     // Disconnect active blocks which are no longer in the best chain.
+    CDisconnectedTransactions disconnected;
     while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
-        if (!DisconnectTip(state))
+        if (!DisconnectTip(state, disconnected)) {
+            // The mempool may hold spends of the disconnected transactions
+            UpdateMempoolForReorg(disconnected, false);
             return false;
+        }
     }
 
     // Build list of new blocks to connect.
@@ -2225,7 +2991,7 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
 
     // Connect new blocks.
     BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
-        if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL)) {
+        if (!ConnectTip(state, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL, disconnected)) {
             if (state.IsInvalid()) {
                 // The block violates a consensus rule.
                 if (!state.CorruptionPossible())
@@ -2236,6 +3002,7 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
                 break;
             } else {
                 // A system error occurred (disk space, database error, ...).
+                UpdateMempoolForReorg(disconnected, false);
                 return false;
             }
         } else {
@@ -2249,6 +3016,9 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
     }
     }
 
+    // Return what the reorg disconnected to the mempool in one go.
+    UpdateMempoolForReorg(disconnected, true);
+
     // Callbacks/notifications for a new best chain.
     if (fInvalidFound)
         CheckForkWarningConditionsOnNewFork(vpindexToConnect.back());
@@ -2271,6 +3041,9 @@ bool ActivateBestChain(CValidationState &state, const CBlock *pblock) {
         boost::this_thread::interruption_point();
 
         bool fInitialDownload;
+        std::set<NodeId> setCmpctPeers;
+        bool fCmpctAnnounce = false;
+        const CBlockIndex *pindexFork;
         {
             LOCK(cs_main);
             pindexMostWork = FindMostWorkChain();
@@ -2279,11 +3052,22 @@ bool ActivateBestChain(CValidationState &state, const CBlock *pblock) {
             if (pindexMostWork == NULL || pindexMostWork == chainActive.Tip())
                 return true;
 
+            CBlockIndex *pindexOldTip = chainActive.Tip();
             if (!ActivateBestChainStep(state, pindexMostWork, pblock && pblock->GetHash() == pindexMostWork->GetBlockHash() ? pblock : NULL))
                 return false;
 
             pindexNewTip = chainActive.Tip();
+            pindexFork = pindexOldTip ? chainActive.FindFork(pindexOldTip) : NULL;
             fInitialDownload = IsInitialBlockDownload();
+
+            // A block that just extended our tip is pushed whole, as a compact
+            // block, to the peers that asked for it with sendcmpct.
+            if (pblock && pblock->GetHash() == pindexNewTip->GetBlockHash() && pindexNewTip->pprev == pindexOldTip) {
+                fCmpctAnnounce = true;
+                for (map<NodeId, CNodeState>::const_iterator it = mapNodeState.begin(); it != mapNodeState.end(); it++)
+                    if (it->second.fPreferHeaderAndIDs)
+                        setCmpctPeers.insert(it->first);
+            }
         }
         // When we reach this point, we switched to a new tip (stored in pindexNewTip).
 
@@ -2297,13 +3081,59 @@ bool ActivateBestChain(CValidationState &state, const CBlock *pblock) {
             // Don't relay blocks if pruning -- could cause a peer to try to download, resulting
             // in a stalled download if the block file is pruned before the request.
             if (nLocalServices & NODE_NETWORK) {
+                // Find the hashes of all blocks that weren't previously in the
+                // best chain, to announce them oldest first. Peers that prefer
+                // headers get all of them in one headers message, which
+                // connects to what they have; see SendMessages.
+                std::vector<uint256> vHashes;
+                const CBlockIndex *pindexToAnnounce = pindexNewTip;
+                while (pindexToAnnounce != pindexFork) {
+                    vHashes.push_back(pindexToAnnounce->GetBlockHash());
+                    pindexToAnnounce = pindexToAnnounce->pprev;
+                    if (vHashes.size() == MAX_BLOCKS_TO_ANNOUNCE) {
+                        // Limit announcements in case of a huge reorganization.
+                        // Rely on the peer's synchronization mechanism in that case.
+                        break;
+                    }
+                }
+
+                CInv inv(MSG_BLOCK, hashNewTip);
+                // Serialized once, and shared by every peer it is sent to
+                CSerializedMessageRef msgCmpct;
+                if (fCmpctAnnounce && !setCmpctPeers.empty())
+                    msgCmpct = MakeSharedMessage("cmpctblock", CBlockHeaderAndShortTxIDs(*pblock));
+                std::vector<NodeId> vCmpctSent;
+                {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                BOOST_FOREACH(CNode* pnode, vNodes) {
+                    if (msgCmpct && setCmpctPeers.count(pnode->GetId()) && !pnode->IsInventoryKnown(inv)) {
+                        LogPrint("cmpctblock", "announcing block %s to peer=%d as a compact block\n", hashNewTip.ToString(), pnode->id);
+                        pnode->PushSharedMessage(msgCmpct);
+                        pnode->AddInventoryKnown(inv);
+                        vCmpctSent.push_back(pnode->GetId());
+                        continue;
+                    }
+                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate)) {
+                        BOOST_REVERSE_FOREACH(const uint256& hash, vHashes) {
+                            pnode->PushBlockHash(hash);
+                        }
+                    }
+                }
+                }
+                if (!vCmpctSent.empty()) {
+                    // The compact block carried the header, so later
+                    // announcements to these peers can build on it
+                    LOCK(cs_main);
+                    BOOST_FOREACH(NodeId nodeid, vCmpctSent) {
+                        CNodeState *nodestate = State(nodeid);
+                        if (nodestate && PeerHasHeader(nodestate, pindexNewTip->pprev))
+                            nodestate->pindexBestHeaderSent = pindexNewTip;
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             uiInterface.NotifyBlockTip(hashNewTip);
+            GetMainSignals().UpdatedBlockTip(pindexNewTip, pindexFork);
         }
     } while(pindexMostWork != chainActive.Tip());
     CheckBlockIndex();
@@ -2324,6 +3154,7 @@ bool InvalidateBlock(CValidationState& state, CBlockIndex *pindex) {
     setDirtyBlockIndex.insert(pindex);
     setBlockIndexCandidates.erase(pindex);
 
+    CDisconnectedTransactions disconnected;
     while (chainActive.Contains(pindex)) {
         CBlockIndex *pindexWalk = chainActive.Tip();
         pindexWalk->nStatus |= BLOCK_FAILED_CHILD;
@@ -2331,10 +3162,12 @@ bool InvalidateBlock(CValidationState& state, CBlockIndex *pindex) {
         setBlockIndexCandidates.erase(pindexWalk);
         // ActivateBestChain considers blocks already in chainActive
         // unconditionally valid already, so force disconnect away from it.
-        if (!DisconnectTip(state)) {
+        if (!DisconnectTip(state, disconnected)) {
+            UpdateMempoolForReorg(disconnected, false);
             return false;
         }
     }
+    UpdateMempoolForReorg(disconnected, true);
 
     // The resulting new best tip may not be in setBlockIndexCandidates anymore, so
     // add it again.
@@ -2409,8 +3242,10 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
     }
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
-    if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
+    if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork) {
         pindexBestHeader = pindexNew;
+        PublishChainTipSummary();
+    }
 
     setDirtyBlockIndex.insert(pindexNew);
 
@@ -2596,25 +3431,25 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
                          REJECT_INVALID, "bad-blk-length");
 
     // First transaction must be coinbase, the rest must not be
-    if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
+    if (block.vtx.empty() || !block.vtx[0]->IsCoinBase())
         return state.DoS(100, error("CheckBlock(): first tx is not coinbase"),
                          REJECT_INVALID, "bad-cb-missing");
     for (unsigned int i = 1; i < block.vtx.size(); i++)
-        if (block.vtx[i].IsCoinBase())
+        if (block.vtx[i]->IsCoinBase())
             return state.DoS(100, error("CheckBlock(): more than one coinbase"),
                              REJECT_INVALID, "bad-cb-multiple");
 
     // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-        if (!CheckTransaction(tx, state))
+    BOOST_FOREACH(const CTransactionRef& tx, block.vtx)
+        if (!CheckTransaction(*tx, state))
             return error("CheckBlock(): CheckTransaction of %s failed with %s",
-                tx.GetHash().ToString(),
+                tx->GetHash().ToString(),
                 FormatStateMessage(state));
 
     unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    BOOST_FOREACH(const CTransactionRef& tx, block.vtx)
     {
-        nSigOps += GetLegacySigOpCount(tx);
+        nSigOps += GetLegacySigOpCount(*tx);
     }
     if (nSigOps > MAX_BLOCK_SIGOPS)
         return state.DoS(100, error("CheckBlock(): out-of-bounds SigOpCount"),
@@ -2669,8 +3504,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     const Consensus::Params& consensusParams = Params().GetConsensus();
 
     // Check that all transactions are finalized
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-        if (!IsFinalTx(tx, nHeight, block.GetBlockTime())) {
+    BOOST_FOREACH(const CTransactionRef& tx, block.vtx)
+        if (!IsFinalTx(*tx, nHeight, block.GetBlockTime())) {
             return state.DoS(10, error("%s: contains a non-final transaction", __func__), REJECT_INVALID, "bad-txns-nonfinal");
         }
 
@@ -2679,8 +3514,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     if (block.nVersion >= 2 && IsSuperMajority(2, pindexPrev, consensusParams.nMajorityEnforceBlockUpgrade, consensusParams))
     {
         CScript expect = CScript() << nHeight;
-        if (block.vtx[0].vin[0].scriptSig.size() < expect.size() ||
-            !std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin())) {
+        if (block.vtx[0]->vin[0].scriptSig.size() < expect.size() ||
+            !std::equal(expect.begin(), expect.end(), block.vtx[0]->vin[0].scriptSig.begin())) {
             return state.DoS(100, error("%s: block height mismatch in coinbase", __func__), REJECT_INVALID, "bad-cb-height");
         }
     }
@@ -2820,7 +3655,7 @@ bool ProcessNewBlock(CValidationState &state, const CNode* pfrom, const CBlock*
 
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived(pblock->GetHash());
+        bool fRequested = MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1);
         fRequested |= fForceProcessing;
         if (!checked) {
             return error("%s: CheckBlock FAILED", __func__);
@@ -3141,6 +3976,7 @@ bool static LoadBlockIndexDB()
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    PublishChainTipSummary();
 
     PruneBlockIndexCandidates();
 
@@ -3247,9 +4083,12 @@ void UnloadBlockIndex()
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
+    PublishChainTipSummary();
     mempool.clear();
     mapOrphanTransactions.clear();
     mapOrphanTransactionsByPrev.clear();
+    mapOrphanTransactionsByPeer.clear();
+    nOrphanTransactionsSize = 0;
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -3730,7 +4569,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -3751,17 +4590,40 @@ void static ProcessGetData(CNode* pfrom)
                         }
                     }
                 }
+                // Disconnect peers asking for historical blocks once they would eat into the
+                // upload left for relaying new blocks. Filtered blocks count as historical
+                // as they are expensive to serve, and their peers can go elsewhere.
+                static const int nOneWeek = 7 * 24 * 60 * 60;
+                if (send && CNode::OutboundTargetReached(true) &&
+                    (((pindexBestHeader != NULL) && (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() > nOneWeek)) || inv.type == MSG_FILTERED_BLOCK) &&
+                    !pfrom->fWhitelisted)
+                {
+                    LogPrint("net", "historical block serving limit reached, disconnect peer=%d\n", pfrom->GetId());
+                    pfrom->fDisconnect = true;
+                    send = false;
+                }
                 // Pruned nodes may have deleted the block, so check whether
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
                     // Send block from disk
                     CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
+                    bool fShared = (inv.type == MSG_BLOCK && pRecentBlockMessage && inv.hash == hashRecentBlockMessage);
+                    if (!fShared && !ReadBlockFromDisk(block, (*mi).second))
                         assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    {
+                        if (!fShared && mi->second == chainActive.Tip()) {
+                            pRecentBlockMessage = MakeSharedMessage("block", block);
+                            hashRecentBlockMessage = inv.hash;
+                            fShared = true;
+                        }
+                        if (fShared)
+                            pfrom->PushSharedMessage(pRecentBlockMessage);
+                        else
+                            pfrom->PushMessage("block", block);
+                    }
+                    else if (inv.type == MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
@@ -3776,12 +4638,21 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->IsInventoryKnown(CInv(MSG_TX, pair.second)))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
                             // no response
                     }
+                    else // MSG_CMPCT_BLOCK
+                    {
+                        // A peer asking for an old block won't have a mempool
+                        // to rebuild it from, so send it in full
+                        if (mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH)
+                            pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                        else
+                            pfrom->PushMessage("block", block);
+                    }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3800,21 +4671,18 @@ void static ProcessGetData(CNode* pfrom)
             {
                 // Send stream from relay memory
                 bool pushed = false;
-                {
+                if (inv.type == MSG_TX) {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<uint256, CRelayedTransaction>::iterator mi = mapRelay.find(inv.hash);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSharedMessage((*mi).second.msg);
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_TX) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
+                    CTransactionRef tx = mempool.get(inv.hash);
+                    if (tx) {
+                        pfrom->PushMessage("tx", *tx);
                         pushed = true;
                     }
                 }
@@ -3826,7 +4694,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -3845,6 +4713,167 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/** Act on the outcome of admitting a transaction relayed by pfrom. */
+void static ProcessTxAdmissionResult(CNode* pfrom, const CTxAdmission& admission) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    const CTransactionRef& ptx = admission.tx;
+    const CTransaction& tx = *ptx;
+    const CValidationState& state = admission.state;
+    CInv inv(MSG_TX, tx.GetHash());
+
+    mapAlreadyAskedFor.erase(inv);
+
+    if (admission.fAccepted)
+    {
+        mempool.check(pcoinsTip);
+        RelayTransaction(ptx);
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
+            pfrom->id, pfrom->cleanSubVer,
+            tx.GetHash().ToString(),
+            mempool.mapTx.size());
+
+        // Orphans that depended on this one are reconsidered in bounded
+        // batches from ProcessMessages, starting with the first batch now
+        AddOrphanChildren(tx, pfrom->setOrphanWork);
+        ProcessOrphanWork(pfrom->setOrphanWork);
+        UpdateOrphanWork(pfrom);
+    }
+    else if (admission.fMissingInputs)
+    {
+        AddOrphanTx(ptx, pfrom->GetId());
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+        size_t nMaxOrphanBytes = (size_t)std::max((int64_t)0, GetArg("-maxorphansize", DEFAULT_MAX_ORPHAN_SIZE) * 1000);
+        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanBytes);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    } else {
+        // AcceptToMemoryPool() returned false, possibly because the tx is
+        // already in the mempool; if the tx isn't in the mempool that
+        // means it was rejected and we shouldn't ask for it again.
+        if (!mempool.exists(tx.GetHash())) {
+            assert(recentRejects);
+            recentRejects->insert(tx.GetHash());
+        }
+        if (pfrom->fWhitelisted) {
+            // Always relay transactions received from whitelisted peers, even
+            // if they were rejected from the mempool, allowing the node to
+            // function as a gateway for nodes hidden behind it.
+            //
+            // FIXME: This includes invalid transactions, which means a
+            // whitelisted peer could get us banned! We may want to change
+            // that.
+            RelayTransaction(ptx);
+        }
+    }
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+    {
+        LogPrint("mempoolrej", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->id, pfrom->cleanSubVer,
+            FormatStateMessage(state));
+        if (state.GetRejectCode() < REJECT_INTERNAL) // Never send AcceptToMemoryPool's internal codes over P2P
+            pfrom->PushMessage("reject", std::string("tx"), state.GetRejectCode(),
+                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
+/**
+ * Admit the queued relayed transactions to the mempool as one batch, under a
+ * single cs_main hold, and act on each outcome as the "tx" message handler
+ * used to.
+ */
+void static ProcessTxAdmissionQueue()
+{
+    std::vector<CTxAdmission> vBatch;
+    std::vector<CNode*> vFrom;
+    {
+        LOCK(cs_txAdmissionQueue);
+        vBatch.swap(vTxAdmissionQueue);
+        vFrom.swap(vTxAdmissionFrom);
+    }
+    if (vBatch.empty())
+        return;
+
+    {
+        LOCK(cs_main);
+        int64_t nTimeStart = GetTimeMicros();
+        unsigned int nAccepted = AcceptToMemoryPoolBatch(mempool, vBatch, true);
+        int64_t nTimeDone = GetTimeMicros();
+
+        txAdmissionStats.nBatches++;
+        txAdmissionStats.nTransactions += vBatch.size();
+        txAdmissionStats.nAccepted += nAccepted;
+        txAdmissionStats.nTimeBusy += nTimeDone - nTimeStart;
+        for (size_t i = 0; i < vBatch.size(); i++) {
+            txAdmissionStats.latency.Add(nTimeDone - vBatch[i].nTimeQueued);
+            ProcessTxAdmissionResult(vFrom[i], vBatch[i]);
+        }
+        LogPrint("bench", "    - Admit %u txs: %.2fms (%u accepted)\n", vBatch.size(), 0.001 * (nTimeDone - nTimeStart), nAccepted);
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vFrom)
+            pnode->Release();
+    }
+}
+
+void ProcessBatches()
+{
+    ProcessTxAdmissionQueue();
+}
+
+/** Complete a block being rebuilt from a compact block with the transactions pfrom sent for it, and process it */
+static void ProcessBlockTransactions(CNode* pfrom, const CBlockTransactions& resp)
+{
+    CBlock block;
+    {
+        LOCK(cs_main);
+
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.hashBlock);
+        if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+                it->second.first != pfrom->GetId()) {
+            LogPrint("net", "peer=%d sent us block transactions for a block we weren't expecting\n", pfrom->id);
+            return;
+        }
+
+        ReadStatus status = it->second.second->partialBlock->FillBlock(block, resp.vtx);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(resp.hashBlock); // Reset in-flight state in case of whitelist
+            Misbehaving(pfrom->GetId(), 100);
+            LogPrintf("peer=%d sent us an invalid compact block or non-matching block transactions\n", pfrom->id);
+            return;
+        } else if (status == READ_STATUS_FAILED) {
+            // Likely a short ID collision: fall back to fetching the full block
+            it->second.second->partialBlock.reset();
+            vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.hashBlock));
+            pfrom->PushMessage("getdata", vInv);
+            return;
+        }
+        MarkBlockAsReceived(resp.hashBlock, pfrom->GetId());
+    } // Don't hold cs_main when we call into ProcessNewBlock
+
+    // We asked for this block, so process it as if it were requested even
+    // though it is no longer marked in flight
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block, true, NULL);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        assert (state.GetRejectCode() < REJECT_INTERNAL); // Blocks are never rejected with internal reject codes
+        pfrom->PushMessage("reject", string("blocktxn"), state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), resp.hashBlock);
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -3920,7 +4949,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
 
         // Potentially mark this peer as a preferred download peer.
-        UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        {
+            LOCK(cs_main);
+            UpdatePreferredDownload(pfrom, State(pfrom->GetId()));
+        }
 
         // Change version
         pfrom->PushMessage("verack");
@@ -3997,6 +5029,43 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (pfrom->nVersion >= SENDHEADERS_VERSION) {
+            // Tell our peer we prefer to receive headers rather than inv's.
+            // We send this to non-NODE NETWORK peers as well, because even
+            // non-NODE NETWORK peers can announce blocks (such as pruning
+            // nodes)
+            pfrom->PushMessage("sendheaders");
+        }
+
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            // Tell the peer we understand compact blocks. It should keep
+            // announcing new blocks until we ask it to push them to us, see
+            // MaybeSetPeerAsAnnouncingHeaderAndIDs.
+            bool fAnnounceUsingCMPCTBLOCK = false;
+            uint64_t nCMPCTBLOCKVersion = 1;
+            pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+        }
+    }
+
+
+    else if (strCommand == "sendheaders")
+    {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fPreferHeaders = true;
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
     }
 
 
@@ -4033,11 +5102,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
                     // at a time so the addrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt.IsNull())
-                        hashSalt = GetRandHash();
                     uint64_t hashAddr = addr.GetHash();
-                    uint256 hashRand = ArithToUint256(UintToArith256(hashSalt) ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60)));
+                    uint256 hashRand = ArithToUint256(UintToArith256(hashAddrRelaySalt) ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60)));
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     multimap<uint256, CNode*> mapMix;
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -4107,9 +5173,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     // not a direct successor.
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
-                    if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 &&
-                        nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                    if (CanDirectFetch(chainparams.GetConsensus()) &&
+                        nodestate->nBlocksInFlight < nodestate->nBlocksInTransitTarget) {
+                        // A peer that understands compact blocks can send this one
+                        // as such: we likely have all but a few of its transactions.
+                        vToFetch.push_back(nodestate->fProvidesHeaderAndIDs ? CInv(MSG_CMPCT_BLOCK, inv.hash) : inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -4227,132 +5295,38 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
+        // pindex can be NULL either if we sent chainActive.Tip() OR
+        // if our peer has chainActive.Tip() (and thus we are sending an empty
+        // headers message). In both cases it's safe to update
+        // pindexBestHeaderSent to be our tip.
+        State(pfrom->GetId())->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
         pfrom->PushMessage("headers", vHeaders);
     }
 
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CTransaction tx;
-        vRecv >> tx;
+        CTransactionRef ptx;
+        vRecv >> ptx;
 
-        CInv inv(MSG_TX, tx.GetHash());
+        CInv inv(MSG_TX, ptx->GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-
-        bool fMissingInputs = false;
-        CValidationState state;
-
-        mapAlreadyAskedFor.erase(inv);
-
-        if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+        // Admitted together with the transactions other peers relay while
+        // the message handlers are busy, see ProcessTxAdmissionQueue
         {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
-                pfrom->id, pfrom->cleanSubVer,
-                tx.GetHash().ToString(),
-                mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        assert(recentRejects);
-                        recentRejects->insert(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        else if (fMissingInputs)
-        {
-            AddOrphanTx(tx, pfrom->GetId());
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else {
-            // AcceptToMemoryPool() returned false, possibly because the tx is
-            // already in the mempool; if the tx isn't in the mempool that
-            // means it was rejected and we shouldn't ask for it again.
-            if (!mempool.exists(tx.GetHash())) {
-                assert(recentRejects);
-                recentRejects->insert(tx.GetHash());
-            }
-            if (pfrom->fWhitelisted) {
-                // Always relay transactions received from whitelisted peers, even
-                // if they were rejected from the mempool, allowing the node to
-                // function as a gateway for nodes hidden behind it.
-                //
-                // FIXME: This includes invalid transactions, which means a
-                // whitelisted peer could get us banned! We may want to change
-                // that.
-                RelayTransaction(tx);
-            }
+            LOCK(cs_vNodes);
+            pfrom->AddRef();
         }
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
+        bool fBatchFull;
         {
-            LogPrint("mempoolrej", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                FormatStateMessage(state));
-            if (state.GetRejectCode() < REJECT_INTERNAL) // Never send AcceptToMemoryPool's internal codes over P2P
-                pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                                   state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+            LOCK(cs_txAdmissionQueue);
+            vTxAdmissionQueue.push_back(CTxAdmission(ptx, pfrom->GetId(), nTimeReceived));
+            vTxAdmissionFrom.push_back(pfrom);
+            fBatchFull = vTxAdmissionQueue.size() >= MAX_TX_ADMISSION_BATCH;
         }
+        if (fBatchFull)
+            ProcessTxAdmissionQueue();
     }
 
 
@@ -4379,6 +5353,29 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
+        CNodeState *nodestate = State(pfrom->GetId());
+
+        // An announcement that doesn't connect to our headers: we are
+        // probably missing a few blocks the peer announced while we were
+        // busy. Fetch the headers in between, and only punish the peer if
+        // it keeps doing this.
+        if (nCount <= MAX_BLOCKS_TO_ANNOUNCE && mapBlockIndex.find(headers[0].hashPrevBlock) == mapBlockIndex.end()) {
+            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            LogPrint("net", "received header %s: missing prev block %s, sending getheaders (%d) to end (peer=%d, nUnconnectingHeaders=%d)\n",
+                    headers[0].GetHash().ToString(),
+                    headers[0].hashPrevBlock.ToString(),
+                    pindexBestHeader->nHeight,
+                    pfrom->id, nodestate->nUnconnectingHeaders);
+            // Set hashLastUnknownBlock for this peer, so that if we
+            // eventually get the headers - even from a different peer -
+            // we can use this peer to download.
+            UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+
+            if (++nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0)
+                Misbehaving(pfrom->GetId(), 20);
+            return true;
+        }
+
         CBlockIndex *pindexLast = NULL;
         BOOST_FOREACH(const CBlockHeader& header, headers) {
             CValidationState state;
@@ -4396,10 +5393,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
-        if (pindexLast)
-            UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+        if (nodestate->nUnconnectingHeaders > 0)
+            LogPrint("net", "peer=%d: resetting nUnconnectingHeaders (%d -> 0)\n", pfrom->id, nodestate->nUnconnectingHeaders);
+        nodestate->nUnconnectingHeaders = 0;
 
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
+        assert(pindexLast);
+        UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+
+        if (nCount == MAX_HEADERS_RESULTS) {
             // Headers message had its maximum size; the peer may have more headers.
             // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
             // from there instead.
@@ -4407,6 +5408,60 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256());
         }
 
+        // If this set of headers is valid and ends in a block with at least as
+        // much work as our tip, download as much as possible, right away:
+        // waiting for FindNextBlocksToDownload would cost us a round trip for
+        // every block announced.
+        if (CanDirectFetch(chainparams.GetConsensus()) && pindexLast->IsValid(BLOCK_VALID_TREE) && chainActive.Tip()->nChainWork <= pindexLast->nChainWork) {
+            vector<CBlockIndex *> vToFetch;
+            CBlockIndex *pindexWalk = pindexLast;
+            // Calculate all the blocks we'd need to switch to pindexLast, up to a limit.
+            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= (size_t)nodestate->nBlocksInTransitTarget) {
+                if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) &&
+                        !mapBlocksInFlight.count(pindexWalk->GetBlockHash())) {
+                    // We don't have this block, and it's not yet in flight.
+                    vToFetch.push_back(pindexWalk);
+                }
+                pindexWalk = pindexWalk->pprev;
+            }
+            // If pindexWalk still isn't on our main chain, we're looking at a
+            // very large reorg at a time we think we're close to caught up to
+            // the main chain -- this shouldn't really happen.  Bail out on the
+            // direct fetch and rely on parallel download instead.
+            if (!chainActive.Contains(pindexWalk)) {
+                LogPrint("net", "Large reorg, won't direct fetch to %s (%d)\n",
+                        pindexLast->GetBlockHash().ToString(),
+                        pindexLast->nHeight);
+            } else {
+                vector<CInv> vGetData;
+                // Download as much as possible, from earliest to latest.
+                BOOST_REVERSE_FOREACH(CBlockIndex *pindex, vToFetch) {
+                    if (nodestate->nBlocksInFlight >= nodestate->nBlocksInTransitTarget) {
+                        // Can't download any more from this peer
+                        break;
+                    }
+                    vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                    MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex);
+                    LogPrint("net", "Requesting block %s from  peer=%d\n",
+                            pindex->GetBlockHash().ToString(), pfrom->id);
+                }
+                if (vGetData.size() > 1) {
+                    LogPrint("net", "Downloading blocks toward %s (%d) via headers direct fetch\n",
+                            pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
+                }
+                if (vGetData.size() > 0) {
+                    if (nodestate->fProvidesHeaderAndIDs && vGetData.size() == 1 && mapBlocksInFlight.size() == 1 && pindexLast->pprev->IsValid(BLOCK_VALID_CHAIN)) {
+                        // pfrom seems to be the first to tell us about this
+                        // block: have it push new blocks to us from now on,
+                        // and get this one as a compact block.
+                        MaybeSetPeerAsAnnouncingHeaderAndIDs(nodestate, pfrom);
+                        vGetData[0] = CInv(MSG_CMPCT_BLOCK, vGetData[0].hash);
+                    }
+                    pfrom->PushMessage("getdata", vGetData);
+                }
+            }
+        }
+
         CheckBlockIndex();
     }
 
@@ -4441,6 +5496,168 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        // Transactions waiting for admission would be missing from the mempool
+        ProcessTxAdmissionQueue();
+
+        CBlockTransactions resp;
+        bool fComplete = false;
+        {
+        LOCK(cs_main);
+
+        if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+            // Doesn't connect (or is genesis): fetch the headers leading up to it first
+            if (!IsInitialBlockDownload())
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            return true;
+        }
+
+        CBlockIndex *pindex = NULL;
+        CValidationState state;
+        if (!AcceptBlockHeader(cmpctblock.header, state, &pindex)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid header received in cmpctblock");
+            }
+        }
+        assert(pindex);
+        UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(pindex->GetBlockHash());
+        bool fAlreadyInFlight = itInFlight != mapBlocksInFlight.end();
+
+        if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+            return true;
+
+        if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+                pindex->nTx != 0) { // We had this block at some point, but pruned it
+            if (fAlreadyInFlight) {
+                // We asked for it, but the mempool is unlikely to help: get it in full
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                pfrom->PushMessage("getdata", vInv);
+            }
+            return true;
+        }
+
+        CNodeState *nodestate = State(pfrom->GetId());
+
+        // Only rebuild blocks close to our tip, which our mempool can help with
+        if (pindex->nHeight > chainActive.Height() + 2) {
+            if (fAlreadyInFlight) {
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                pfrom->PushMessage("getdata", vInv);
+            }
+            // Otherwise the header was all we needed, as for an announcement
+            return true;
+        }
+        if ((fAlreadyInFlight && itInFlight->second.first != pfrom->GetId()) ||
+            (!fAlreadyInFlight && nodestate->nBlocksInFlight >= nodestate->nBlocksInTransitTarget))
+            return true;
+
+        list<QueuedBlock>::iterator itQueued;
+        if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex, &itQueued) &&
+            itQueued->partialBlock) {
+            LogPrint("net", "peer=%d sent us a compact block we were already rebuilding\n", pfrom->id);
+            return true;
+        }
+        itQueued->partialBlock.reset(new CPartiallyDownloadedBlock());
+        CPartiallyDownloadedBlock& partialBlock = *itQueued->partialBlock;
+        ReadStatus status = partialBlock.InitData(cmpctblock, mempool);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
+            Misbehaving(pfrom->GetId(), 100);
+            return error("peer=%d sent us an invalid compact block", pfrom->id);
+        } else if (status == READ_STATUS_FAILED) {
+            // Duplicate short IDs; the block is in flight from this peer now, so get it in full
+            vector<CInv> vInv(1, CInv(MSG_BLOCK, pindex->GetBlockHash()));
+            pfrom->PushMessage("getdata", vInv);
+            return true;
+        }
+
+        if (!fAlreadyInFlight && mapBlocksInFlight.size() == 1 && pindex->pprev->IsValid(BLOCK_VALID_CHAIN)) {
+            // We seem to be well synced, and pfrom was the first to give us
+            // this block: have it push new blocks to us from now on.
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(nodestate, pfrom);
+        }
+
+        CBlockTransactionsRequest req;
+        req.hashBlock = pindex->GetBlockHash();
+        for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+            if (!partialBlock.IsTxAvailable(i))
+                req.vIndexes.push_back(i);
+        }
+        LogPrint("cmpctblock", "compact block %s from peer=%d: %u of %u transactions missing\n",
+            req.hashBlock.ToString(), pfrom->id, req.vIndexes.size(), cmpctblock.BlockTxCount());
+        if (req.vIndexes.empty()) {
+            resp.hashBlock = req.hashBlock;
+            fComplete = true;
+        } else {
+            pfrom->PushMessage("getblocktxn", req);
+        }
+
+        CheckBlockIndex();
+        } // Don't hold cs_main when we call into ProcessNewBlock
+
+        if (fComplete)
+            ProcessBlockTransactions(pfrom, resp);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator it = mapBlockIndex.find(req.hashBlock);
+        if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "peer=%d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // Don't let peers make us read old blocks from disk for a few of
+            // their transactions: they get the whole block, with the same
+            // checks as a getdata for it.
+            LogPrint("net", "peer=%d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.hashBlock));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, it->second))
+            assert(!"cannot load block from disk");
+
+        CBlockTransactions resp(req);
+        for (size_t i = 0; i < req.vIndexes.size(); i++) {
+            if (req.vIndexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us a getblocktxn with out-of-bounds tx indices", pfrom->id);
+            }
+            resp.vtx[i] = block.vtx[req.vIndexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        ProcessBlockTransactions(pfrom, resp);
+    }
+
+
     // This asymmetric behavior for inbound and outbound connections was introduced
     // to prevent a fingerprinting attack: an attacker can send specific fake addresses
     // to users' AddrMan and later request them by sending getaddr messages.
@@ -4448,7 +5665,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     // the getaddr message mitigates the attack.
     else if ((strCommand == "getaddr") && (pfrom->fInbound))
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_inventory);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -4457,16 +5677,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "mempool")
     {
-        LOCK2(cs_main, pfrom->cs_filter);
+        // Stream the inventory from a snapshot, without holding cs_main or
+        // the mempool lock while the peer's filter is matched
+        CTxMemPoolSnapshotRef snapshot = mempool.GetSnapshot();
+        LOCK(pfrom->cs_filter);
 
-        std::vector<uint256> vtxid;
-        mempool.queryHashes(vtxid);
         vector<CInv> vInv;
-        BOOST_FOREACH(uint256& hash, vtxid) {
-            CInv inv(MSG_TX, hash);
-            CTransaction tx;
-            bool fInMemPool = mempool.lookup(hash, tx);
-            if (!fInMemPool) continue; // another thread removed since queryHashes, maybe...
+        BOOST_FOREACH(const CTxMemPoolEntry& e, snapshot->vEntries) {
+            const CTransaction& tx = e.GetTx();
+            CInv inv(MSG_TX, tx.GetHash());
             if ((pfrom->pfilter && pfrom->pfilter->IsRelevantAndUpdate(tx)) ||
                (!pfrom->pfilter))
                 vInv.push_back(inv);
@@ -4565,12 +5784,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vRecv >> alert;
 
         uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
+        bool fKnown;
+        {
+            LOCK(pfrom->cs_inventory);
+            fKnown = pfrom->setKnown.count(alertHash) != 0;
+        }
+        if (!fKnown)
         {
             if (alert.ProcessAlert(Params().AlertKey()))
             {
                 // Relay
-                pfrom->setKnown.insert(alertHash);
+                {
+                    LOCK(pfrom->cs_inventory);
+                    pfrom->setKnown.insert(alertHash);
+                }
                 {
                     LOCK(cs_vNodes);
                     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -4692,8 +5919,16 @@ bool ProcessMessages(CNode* pfrom)
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom);
 
+    // The flag spares taking cs_main when there is nothing to do
+    if (pfrom->HasOrphanWork()) {
+        LOCK(cs_main);
+        ProcessOrphanWork(pfrom->setOrphanWork);
+        UpdateOrphanWork(pfrom);
+    }
+
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
+    if (pfrom->HasOrphanWork()) return fOk;
 
     std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
     while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
@@ -4713,7 +5948,9 @@ bool ProcessMessages(CNode* pfrom)
         if (!msg.complete())
             break;
 
-        // at this point, any failure means we can delete the current message
+        // at this point, any failure means we can delete the current message.
+        // Only this one message is handled per call, also when it is
+        // malformed, so the message handler can interleave peers fairly.
         it++;
 
         // Scan for message start
@@ -4728,7 +5965,7 @@ bool ProcessMessages(CNode* pfrom)
         if (!hdr.IsValid(Params().MessageStart()))
         {
             LogPrintf("PROCESSMESSAGE: ERRORS IN HEADER %s peer=%d\n", SanitizeString(hdr.GetCommand()), pfrom->id);
-            continue;
+            break;
         }
         string strCommand = hdr.GetCommand();
 
@@ -4743,11 +5980,12 @@ bool ProcessMessages(CNode* pfrom)
         {
             LogPrintf("%s(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n", __func__,
                SanitizeString(strCommand), nMessageSize, nChecksum, hdr.nChecksum);
-            continue;
+            break;
         }
 
         // Process message
         bool fRet = false;
+        int64_t nTimeStart = GetTimeMicros();
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
@@ -4783,6 +6021,7 @@ bool ProcessMessages(CNode* pfrom)
         if (!fRet)
             LogPrintf("%s(%s, %u bytes) FAILED peer=%d\n", __func__, SanitizeString(strCommand), nMessageSize, pfrom->id);
 
+        RecordMessageLatency(strCommand, nTimeStart - msg.nTime, GetTimeMicros() - nTimeStart);
         break;
     }
 
@@ -4843,8 +6082,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             BOOST_FOREACH(CNode* pnode, vNodes)
             {
                 // Periodically clear addrKnown to allow refresh broadcasts
-                if (nLastRebroadcast)
+                if (nLastRebroadcast) {
+                    LOCK(pnode->cs_inventory);
                     pnode->addrKnown.reset();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -4858,6 +6099,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
+            LOCK(pto->cs_inventory);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
@@ -4900,8 +6142,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         state.rejects.clear();
 
         // Start block sync
-        if (pindexBestHeader == NULL)
+        if (pindexBestHeader == NULL) {
             pindexBestHeader = chainActive.Tip();
+            PublishChainTipSummary();
+        }
         bool fFetch = state.fPreferredDownload || (nPreferredDownload == 0 && !pto->fClient && !pto->fOneShot); // Download if this is a nice peer, or we have no nice peers and this one might do.
         if (!state.fSyncStarted && !pto->fClient && !fImporting && !fReindex) {
             // Only actively request headers from a single peer, unless we're close to today.
@@ -4922,6 +6166,114 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             GetMainSignals().Broadcast(nTimeBestReceived);
         }
 
+        //
+        // Try sending block announcements via headers
+        //
+        {
+            // If we have less than MAX_BLOCKS_TO_ANNOUNCE in our
+            // list of block hashes we're relaying, and our peer wants
+            // headers announcements, then find the first header
+            // not yet known to our peer but would connect, and send.
+            // If no header would connect, or if we have too many
+            // blocks, or if the peer doesn't want headers, just
+            // add all to the inv queue.
+            LOCK(pto->cs_inventory);
+            vector<CBlock> vHeaders;
+            bool fRevertToInv = (!state.fPreferHeaders || pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
+            CBlockIndex *pBestIndex = NULL; // last header queued for delivery
+            ProcessBlockAvailability(pto->id); // ensure pindexBestKnownBlock is up-to-date
+
+            if (!fRevertToInv) {
+                bool fFoundStartingHeader = false;
+                // Try to find first header that our peer doesn't have, and
+                // then send all headers past that one.  If we come across any
+                // headers that aren't on chainActive, give up.
+                BOOST_FOREACH(const uint256 &hash, pto->vBlockHashesToAnnounce) {
+                    BlockMap::iterator mi = mapBlockIndex.find(hash);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        // Bail out if we reorged away from this block
+                        fRevertToInv = true;
+                        break;
+                    }
+                    if (pBestIndex != NULL && pindex->pprev != pBestIndex) {
+                        // This means that the list of blocks to announce don't
+                        // connect to each other.
+                        // This shouldn't really be possible to hit during
+                        // regular operation (because reorgs should take us to
+                        // a chain that has some block not on the prior chain,
+                        // which should be caught by the prior check), but one
+                        // way this could happen is by using invalidateblock /
+                        // reconsiderblock repeatedly on the tip, causing it to
+                        // be added multiple times to vBlockHashesToAnnounce.
+                        // Robustly deal with this rare situation by reverting
+                        // to an inv.
+                        fRevertToInv = true;
+                        break;
+                    }
+                    pBestIndex = pindex;
+                    if (fFoundStartingHeader) {
+                        // add this to the headers message
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else if (PeerHasHeader(&state, pindex)) {
+                        continue; // keep looking for the first new block
+                    } else if (pindex->pprev == NULL || PeerHasHeader(&state, pindex->pprev)) {
+                        // Peer doesn't have this header but they do have the prior one.
+                        // Start sending headers.
+                        fFoundStartingHeader = true;
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else {
+                        // Peer doesn't have this header or the prior one -- nothing will
+                        // connect, so bail out.
+                        fRevertToInv = true;
+                        break;
+                    }
+                }
+            }
+            if (fRevertToInv) {
+                // If falling back to using an inv, just try to inv the tip.
+                // The last entry in vBlockHashesToAnnounce was our tip at some point
+                // in the past.
+                if (!pto->vBlockHashesToAnnounce.empty()) {
+                    const uint256 &hashToAnnounce = pto->vBlockHashesToAnnounce.back();
+                    BlockMap::iterator mi = mapBlockIndex.find(hashToAnnounce);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+
+                    // Warn if we're announcing a block that is not on the main chain.
+                    // This should be very rare and could be optimized out.
+                    // Just log for now.
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        LogPrint("net", "Announcing block %s not on main chain (tip=%s)\n",
+                            hashToAnnounce.ToString(), chainActive.Tip()->GetBlockHash().ToString());
+                    }
+
+                    // If the peer announced this block to us, don't inv it back.
+                    // (Since block announcements may not be via inv's, we can't solely rely on
+                    // filterInventoryKnown to track this.)
+                    if (!PeerHasHeader(&state, pindex)) {
+                        pto->PushInventory(CInv(MSG_BLOCK, hashToAnnounce));
+                        LogPrint("net", "%s: sending inv peer=%d hash=%s\n", __func__,
+                            pto->id, hashToAnnounce.ToString());
+                    }
+                }
+            } else if (!vHeaders.empty()) {
+                if (vHeaders.size() > 1) {
+                    LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__,
+                            vHeaders.size(),
+                            vHeaders.front().GetHash().ToString(),
+                            vHeaders.back().GetHash().ToString(), pto->id);
+                } else {
+                    LogPrint("net", "%s: sending header %s to peer=%d\n", __func__,
+                            vHeaders.front().GetHash().ToString(), pto->id);
+                }
+                pto->PushMessage("headers", vHeaders);
+                state.pindexBestHeaderSent = pBestIndex;
+            }
+            pto->vBlockHashesToAnnounce.clear();
+        }
+
         //
         // Message: inventory
         //
@@ -4933,17 +6285,14 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 // trickle out tx inv to protect privacy
                 if (inv.type == MSG_TX && !fSendTrickle)
                 {
                     // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt.IsNull())
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = ArithToUint256(UintToArith256(inv.hash) ^ UintToArith256(hashSalt));
+                    uint256 hashRand = ArithToUint256(UintToArith256(inv.hash) ^ UintToArith256(hashTrickleSalt));
                     hashRand = Hash(BEGIN(hashRand), END(hashRand));
                     bool fTrickleWait = ((UintToArith256(hashRand) & 3) != 0);
 
@@ -4954,15 +6303,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -5006,17 +6352,22 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        state.nBlocksInTransitTarget = GetBlocksInTransitTarget(state.nBlockServiceTime, pto->nPingUsecTime);
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < state.nBlocksInTransitTarget) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            CBlockIndex *pindexStalled = NULL;
+            FindNextBlocksToDownload(pto->GetId(), state.nBlocksInTransitTarget - state.nBlocksInFlight, vToDownload, staller, pindexStalled);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), consensusParams, pindex);
                 LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
             }
-            if (state.nBlocksInFlight == 0 && staller != -1) {
+            if (staller != -1 && ReassignStalledBlock(pto->GetId(), staller, pindexStalled, nNow, consensusParams)) {
+                // Rather than wait for the staller, fetch the block holding back the window ourselves
+                vGetData.push_back(CInv(MSG_BLOCK, pindexStalled->GetBlockHash()));
+            } else if (state.nBlocksInFlight == 0 && staller != -1) {
                 if (State(staller)->nStallingSince == 0) {
                     State(staller)->nStallingSince = nNow;
                     LogPrint("net", "Stall started peer=%d\n", staller);
@@ -5070,5 +6421,7 @@ public:
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapOrphanTransactionsByPeer.clear();
+        nOrphanTransactionsSize = 0;
     }
 } instance_of_cmaincleanup;
@@ -13,6 +13,8 @@
 #include "amount.h"
 #include "chain.h"
 #include "coins.h"
+#include "consensus/validation.h"
+#include "latencyhistogram.h"
 #include "net.h"
 #include "script/script_error.h"
 #include "sync.h"
@@ -32,10 +34,10 @@ class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
 class CInv;
+class CMetricCounter;
 class CScriptCheck;
 class CTxMemPool;
 class CValidationInterface;
-class CValidationState;
 
 struct CNodeStateStats;
 
@@ -43,6 +45,16 @@ struct CNodeStateStats;
 static const bool DEFAULT_ALERTS = true;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphansize, maximum total size in kilobytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_SIZE = 500;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Maximum number of orphans reconsidered for one peer per message handler pass */
+static const unsigned int MAX_ORPHAN_RESOLUTION_BATCH = 10;
+/** Maximum number of relayed transactions admitted to the mempool under one cs_main hold */
+static const unsigned int MAX_TX_ADMISSION_BATCH = 64;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -53,8 +65,13 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Number of blocks that can be requested at any given time from a single peer, until its download speed is known. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds on the number of blocks requested at any given time from a peer whose download speed is known. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER = 64;
+/** Time in seconds, on top of its ping time, that the blocks requested from a peer should keep it busy for. */
+static const unsigned int BLOCK_DOWNLOAD_PIPELINE_TIME = 2;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -65,12 +82,24 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum depth of blocks we serve as compact blocks; older ones are sent in full. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of blocks we answer getblocktxn for; older ones are sent in full. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of peers asked to push new blocks to us as compact blocks, without announcing them first */
+static const unsigned int MAX_HIGH_BANDWIDTH_CMPCT_PEERS = 3;
+/** Maximum number of headers to announce when relaying blocks with headers message.*/
+static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
+/** Number of unconnecting headers announcements from a peer before it is punished */
+static const int MAX_UNCONNECTING_HEADERS = 10;
 /** Time to wait (in seconds) between writing blocks/block index to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
 static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
+/** Number of recently connected blocks whose validation statistics are kept */
+static const unsigned int BLOCK_CONNECT_STATS_SIZE = 2016;
 
 struct BlockHasher
 {
@@ -168,6 +197,8 @@ bool ProcessMessages(CNode* pfrom);
  * @param[in]   fSendTrickle    When true send the trickled data, otherwise trickle the data until true.
  */
 bool SendMessages(CNode* pto, bool fSendTrickle);
+/** Process work batched up across nodes during a message handler pass */
+void ProcessBatches();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
 /** Try to detect Partition (network isolation) attacks against us */
@@ -216,15 +247,54 @@ void FlushStateToDisk();
 void PruneAndFlush();
 
 /** (try to) add transaction to memory pool **/
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransactionRef &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectAbsurdFee=false);
 
+/** A relayed transaction waiting for, and then holding the outcome of, batched mempool admission */
+struct CTxAdmission
+{
+    CTransactionRef tx;
+    NodeId fromPeer;
+    int64_t nTimeQueued; //! GetTimeMicros() when the transaction was received
+    CValidationState state;
+    bool fMissingInputs;
+    bool fAccepted;
+
+    CTxAdmission(const CTransactionRef& txIn, NodeId fromPeerIn, int64_t nTimeQueuedIn) :
+        tx(txIn), fromPeer(fromPeerIn), nTimeQueued(nTimeQueuedIn), fMissingInputs(false), fAccepted(false) {}
+};
+
+/**
+ * Try to add a batch of transactions to the memory pool, with the same
+ * checks as AcceptToMemoryPool, verifying their scripts in parallel.
+ * Transactions in the batch may spend each other. Returns the number accepted.
+ */
+unsigned int AcceptToMemoryPoolBatch(CTxMemPool& pool, std::vector<CTxAdmission>& vBatch, bool fLimitFree);
+
+/** Throughput and latency of batched admission of relayed transactions */
+struct CTxAdmissionStats
+{
+    uint64_t nBatches;
+    uint64_t nTransactions;
+    uint64_t nAccepted;
+    int64_t nTimeBusy; //! Microseconds spent admitting batches
+    CLatencyHistogram latency; //! Receive-to-decision latencies
+
+    CTxAdmissionStats() : nBatches(0), nTransactions(0), nAccepted(0), nTimeBusy(0) {}
+};
+
+/** Get a copy of the transaction admission statistics */
+void GetTxAdmissionStats(CTxAdmissionStats& stats);
+
 
 struct CNodeStateStats {
     int nMisbehavior;
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlocksInTransitTarget;
+    double dBlockDownloadRate;
+    int nBlocksReassigned;
 };
 
 struct CDiskTxPos : public CDiskBlockPos
@@ -348,8 +418,50 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
  *  of problems. Note that in any case, coins may be modified. */
 bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
 
-/** Apply the effects of this block (with given index) on the UTXO set represented by coins */
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false);
+/**
+ * How long connecting a block to the active chain took, in microseconds, by
+ * phase (as in the "bench" debug log), and what it cost in cache lookups.
+ */
+struct CBlockConnectStats
+{
+    int nHeight;
+    uint256 hash;
+    int64_t nTimeConnected; //! When the block was connected
+    unsigned int nTx;
+    unsigned int nInputs;
+    int64_t nLoadMicros;
+    int64_t nConnectMicros;
+    int64_t nUTXOFetchMicros; //! Part of nConnectMicros spent fetching the outputs spent by the block
+    int64_t nScriptCheckWaitMicros; //! Waiting for the script check threads, after nConnectMicros
+    int64_t nIndexMicros;
+    int64_t nCallbacksMicros;
+    int64_t nFlushMicros;
+    int64_t nChainStateMicros;
+    int64_t nPostConnectMicros;
+    int64_t nTotalMicros;
+    uint64_t nCoinsCacheMisses; //! Coins that were not in pcoinsTip and were read from the database
+    uint64_t nSigCacheHits;
+    uint64_t nSigCacheMisses;
+
+    CBlockConnectStats() : nHeight(-1), nTimeConnected(0), nTx(0), nInputs(0), nLoadMicros(0), nConnectMicros(0),
+        nUTXOFetchMicros(0), nScriptCheckWaitMicros(0), nIndexMicros(0), nCallbacksMicros(0), nFlushMicros(0),
+        nChainStateMicros(0), nPostConnectMicros(0), nTotalMicros(0), nCoinsCacheMisses(0), nSigCacheHits(0),
+        nSigCacheMisses(0) {}
+};
+
+/**
+ * Apply the effects of this block (with given index) on the UTXO set represented by coins.
+ * If pstats is given, the ConnectBlock fields in it are filled in.
+ */
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false,
+                  CBlockConnectStats* pstats = NULL);
+
+/**
+ * Get the statistics of the blocks of the active chain from nStartHeight up
+ * to (excluding) nEndHeight, as far as they were connected since startup and
+ * are among the last BLOCK_CONNECT_STATS_SIZE. Does not take cs_main.
+ */
+void GetBlockConnectStats(int nStartHeight, int nEndHeight, std::vector<CBlockConnectStats>& vStats);
 
 /** Context-independent validity checks */
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
@@ -442,8 +554,36 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex *pindex);
 /** The currently-connected chain of blocks. */
 extern CChain chainActive;
 
+/**
+ * Immutable summary of the active chain tip. A new one is published whenever
+ * the tip or the best header changes, so that callers which only need these
+ * values do not have to take cs_main and wait for block validation.
+ */
+struct CChainTipSummary
+{
+    //! Tip of the active chain, NULL while no chain is loaded. Without cs_main
+    //! only its header fields and pprev may be read; they never change.
+    const CBlockIndex* pindex;
+    int nHeight;
+    uint256 hashBlock;
+    arith_uint256 nChainWork;
+    int64_t nTime;
+    double dVerificationProgress;
+    //! Height of the best known header, -1 if none
+    int nHeadersHeight;
+
+    CChainTipSummary() : pindex(NULL), nHeight(-1), nTime(0), dVerificationProgress(0), nHeadersHeight(-1) {}
+};
+typedef boost::shared_ptr<const CChainTipSummary> CChainTipSummaryRef;
+
+/** Return the most recently published chain tip summary. Does not take cs_main. */
+CChainTipSummaryRef GetChainTipSummary();
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
+/** Lookups in pcoinsTip that found the coins in memory, or had to go to the database */
+extern CMetricCounter& metricCoinsTipHits;
+extern CMetricCounter& metricCoinsTipMisses;
 
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
@@ -12,6 +12,7 @@
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/unordered_set.hpp>
 #include <boost/unordered_map.hpp>
 
@@ -107,6 +108,24 @@ static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+struct boost_shared_counter
+{
+    /* Various platforms use different sized counters here.
+     * Conservatively assume that they won't be larger than size_t. */
+    void* vtable;
+    size_t use_count;
+    size_t weak_count;
+    void* ptr;
+};
+
+template<typename X>
+static inline size_t DynamicUsage(const boost::shared_ptr<X>& p)
+{
+    // The object and the counter are allocated separately unless
+    // boost::make_shared is used; we can't tell which, so assume the worst.
+    return p ? MallocUsage(sizeof(X)) + MallocUsage(sizeof(boost_shared_counter)) : 0;
+}
+
 }
 
 #endif
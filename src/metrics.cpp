@@ -0,0 +1,150 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "metrics.h"
+
+#include "tinyformat.h"
+
+#include <algorithm>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+/** Upper bounds of the histogram buckets in microseconds, and as rendered */
+static const int64_t histogramBounds[CMetricHistogram::BUCKETS] = {
+    10, 25, 50, 100, 250, 500,
+    1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+static const char* const histogramBoundNames[CMetricHistogram::BUCKETS] = {
+    "0.00001", "0.000025", "0.00005", "0.0001", "0.00025", "0.0005",
+    "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05",
+    "0.1", "0.25", "0.5", "1", "2.5", "5", "10",
+};
+
+/** Append a sample line, with strLabels and strExtraLabel combined */
+static void RenderSample(const std::string& strName, const std::string& strLabels, const std::string& strExtraLabel,
+                         const std::string& strValue, std::string& strOut)
+{
+    strOut += strName;
+    if (!strLabels.empty() || !strExtraLabel.empty()) {
+        strOut += "{";
+        strOut += strLabels;
+        if (!strLabels.empty() && !strExtraLabel.empty())
+            strOut += ",";
+        strOut += strExtraLabel;
+        strOut += "}";
+    }
+    strOut += " ";
+    strOut += strValue;
+    strOut += "\n";
+}
+
+void CMetricCounter::Render(const std::string& strName, const std::string& strLabels, std::string& strOut) const
+{
+    RenderSample(strName, strLabels, "", strprintf("%u", Get()), strOut);
+}
+
+void CMetricGauge::Render(const std::string& strName, const std::string& strLabels, std::string& strOut) const
+{
+    RenderSample(strName, strLabels, "", strprintf("%d", Get()), strOut);
+}
+
+CMetricHistogram::CMetricHistogram() : nSum(0)
+{
+    std::fill(vCounts, vCounts + BUCKETS + 1, 0);
+}
+
+void CMetricHistogram::Observe(int64_t nMicros)
+{
+    if (nMicros < 0)
+        nMicros = 0;
+    unsigned int nBucket = std::lower_bound(histogramBounds, histogramBounds + BUCKETS, nMicros) - histogramBounds;
+    __sync_fetch_and_add(&vCounts[nBucket], 1);
+    __sync_fetch_and_add(&nSum, nMicros);
+}
+
+uint64_t CMetricHistogram::GetCount() const
+{
+    uint64_t nCount = 0;
+    for (unsigned int i = 0; i <= BUCKETS; i++)
+        nCount += __sync_fetch_and_add(&vCounts[i], 0);
+    return nCount;
+}
+
+void CMetricHistogram::Render(const std::string& strName, const std::string& strLabels, std::string& strOut) const
+{
+    // Buckets are cumulative. Observations that land while rendering may be
+    // missing from the sum or the buckets, but never make a bucket decrease.
+    uint64_t nCumulative = 0;
+    for (unsigned int i = 0; i < BUCKETS; i++) {
+        nCumulative += __sync_fetch_and_add(&vCounts[i], 0);
+        RenderSample(strName + "_bucket", strLabels, strprintf("le=\"%s\"", histogramBoundNames[i]), strprintf("%u", nCumulative), strOut);
+    }
+    nCumulative += __sync_fetch_and_add(&vCounts[BUCKETS], 0);
+    RenderSample(strName + "_bucket", strLabels, "le=\"+Inf\"", strprintf("%u", nCumulative), strOut);
+    uint64_t nSumMicros = __sync_fetch_and_add(&nSum, 0);
+    RenderSample(strName + "_sum", strLabels, "", strprintf("%u.%06u", nSumMicros / 1000000, nSumMicros % 1000000), strOut);
+    RenderSample(strName + "_count", strLabels, "", strprintf("%u", nCumulative), strOut);
+}
+
+namespace {
+
+/** All metrics of one name */
+struct CMetricEntry
+{
+    std::string strHelp;
+    std::string strType;
+    std::vector<std::pair<std::string, CMetric*> > vMetrics;
+};
+
+class CMetricsRegistry
+{
+public:
+    boost::mutex cs;
+    std::map<std::string, CMetricEntry> mapMetrics;
+
+    ~CMetricsRegistry()
+    {
+        for (std::map<std::string, CMetricEntry>::iterator it = mapMetrics.begin(); it != mapMetrics.end(); ++it)
+            for (unsigned int i = 0; i < it->second.vMetrics.size(); i++)
+                delete it->second.vMetrics[i].second;
+    }
+};
+
+/** Constructed on first use, as metrics are registered during static initialization */
+CMetricsRegistry& GetRegistry()
+{
+    static CMetricsRegistry registry;
+    return registry;
+}
+
+}
+
+void RegisterMetric(const std::string& strName, const std::string& strHelp, const std::string& strLabels, CMetric* pmetric)
+{
+    CMetricsRegistry& registry = GetRegistry();
+    boost::unique_lock<boost::mutex> lock(registry.cs);
+    CMetricEntry& entry = registry.mapMetrics[strName];
+    if (entry.vMetrics.empty()) {
+        entry.strHelp = strHelp;
+        entry.strType = pmetric->GetType();
+    }
+    entry.vMetrics.push_back(std::make_pair(strLabels, pmetric));
+}
+
+std::string RenderMetrics()
+{
+    CMetricsRegistry& registry = GetRegistry();
+    boost::unique_lock<boost::mutex> lock(registry.cs);
+    std::string strOut;
+    for (std::map<std::string, CMetricEntry>::const_iterator it = registry.mapMetrics.begin(); it != registry.mapMetrics.end(); ++it) {
+        const CMetricEntry& entry = it->second;
+        strOut += "# HELP " + it->first + " " + entry.strHelp + "\n";
+        strOut += "# TYPE " + it->first + " " + entry.strType + "\n";
+        for (unsigned int i = 0; i < entry.vMetrics.size(); i++)
+            entry.vMetrics[i].second->Render(it->first, entry.vMetrics[i].first, strOut);
+    }
+    return strOut;
+}
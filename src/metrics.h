@@ -0,0 +1,138 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_METRICS_H
+#define BITCOIN_METRICS_H
+
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ * Counters, gauges and histograms for operational monitoring, exported in the
+ * Prometheus text format by the -metrics HTTP endpoint.
+ *
+ * Metrics are registered once, normally during static initialization, and
+ * live until the process exits. Updating one takes no lock, only an atomic
+ * add (a few for a histogram), so they can sit on hot paths and cost next to
+ * nothing when nobody reads them. Only registering and rendering lock the
+ * registry.
+ */
+
+/** Base of all metrics, as seen by the registry */
+class CMetric
+{
+public:
+    virtual ~CMetric() {}
+    virtual const char* GetType() const = 0;
+    /** Append the samples of this metric, named strName and labelled with strLabels (empty or `key="value"`) */
+    virtual void Render(const std::string& strName, const std::string& strLabels, std::string& strOut) const = 0;
+};
+
+/** Count of events, that only goes up */
+class CMetricCounter : public CMetric
+{
+public:
+    CMetricCounter() : nValue(0) {}
+
+    void Inc(uint64_t n = 1) { __sync_fetch_and_add(&nValue, n); }
+    uint64_t Get() const { return __sync_fetch_and_add(&nValue, 0); }
+
+    const char* GetType() const { return "counter"; }
+    void Render(const std::string& strName, const std::string& strLabels, std::string& strOut) const;
+
+private:
+    mutable uint64_t nValue;
+};
+
+/** Value that is set to the current level of something */
+class CMetricGauge : public CMetric
+{
+public:
+    CMetricGauge() : nValue(0) {}
+
+    void Set(int64_t n)
+    {
+        int64_t nOld;
+        do {
+            nOld = nValue;
+        } while (!__sync_bool_compare_and_swap(&nValue, nOld, n));
+    }
+    void Add(int64_t n) { __sync_fetch_and_add(&nValue, n); }
+    int64_t Get() const { return __sync_fetch_and_add(&nValue, 0); }
+
+    const char* GetType() const { return "gauge"; }
+    void Render(const std::string& strName, const std::string& strLabels, std::string& strOut) const;
+
+private:
+    mutable int64_t nValue;
+};
+
+/** Histogram of durations, in fixed buckets from 10us to 10s, exported in seconds */
+class CMetricHistogram : public CMetric
+{
+public:
+    static const unsigned int BUCKETS = 19; //!< number of bounded buckets; one more takes longer durations
+
+    CMetricHistogram();
+
+    void Observe(int64_t nMicros);
+    uint64_t GetCount() const;
+
+    const char* GetType() const { return "histogram"; }
+    void Render(const std::string& strName, const std::string& strLabels, std::string& strOut) const;
+
+private:
+    mutable uint64_t vCounts[BUCKETS + 1];
+    mutable uint64_t nSum;
+};
+
+/** Register a metric; the registry owns it. strLabels is empty or `key="value"`. */
+void RegisterMetric(const std::string& strName, const std::string& strHelp, const std::string& strLabels, CMetric* pmetric);
+
+template <typename Metric>
+Metric& RegisterMetric(const std::string& strName, const std::string& strHelp, const std::string& strLabels = "")
+{
+    Metric* pmetric = new Metric();
+    RegisterMetric(strName, strHelp, strLabels, pmetric);
+    return *pmetric;
+}
+
+/**
+ * Metrics of one name that differ in the value of one label. The values are
+ * fixed when the family is registered, so that finding the metric for one
+ * takes no lock, by index or by value.
+ */
+template <typename Metric>
+class CMetricFamily
+{
+public:
+    CMetricFamily() {}
+    CMetricFamily(const std::string& strName, const std::string& strHelp, const std::string& strLabel, const std::vector<std::string>& vValues)
+    {
+        for (unsigned int i = 0; i < vValues.size(); i++) {
+            vMetrics.push_back(&RegisterMetric<Metric>(strName, strHelp, strLabel + "=\"" + vValues[i] + "\""));
+            mapIndex[vValues[i]] = i;
+        }
+    }
+
+    Metric& operator[](unsigned int nIndex) const { return *vMetrics.at(nIndex); }
+
+    /** The metric for a label value, or NULL if that value was not registered */
+    Metric* Find(const std::string& strValue) const
+    {
+        std::map<std::string, unsigned int>::const_iterator it = mapIndex.find(strValue);
+        return it == mapIndex.end() ? NULL : vMetrics[it->second];
+    }
+
+private:
+    std::vector<Metric*> vMetrics;
+    std::map<std::string, unsigned int> mapIndex;
+};
+
+/** Render all registered metrics in the Prometheus text exposition format */
+std::string RenderMetrics();
+
+#endif // BITCOIN_METRICS_H
@@ -12,8 +12,10 @@
 #include "addrman.h"
 #include "chainparams.h"
 #include "clientversion.h"
+#include "consensus/consensus.h"
 #include "crypto/common.h"
 #include "hash.h"
+#include "metrics.h"
 #include "primitives/transaction.h"
 #include "scheduler.h"
 #include "ui_interface.h"
@@ -23,6 +25,7 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -71,7 +74,7 @@ namespace {
 //
 bool fDiscover = true;
 bool fListen = true;
-uint64_t nLocalServices = NODE_NETWORK;
+uint64_t nLocalServices = NODE_NETWORK | NODE_BLOOM;
 CCriticalSection cs_mapLocalHost;
 map<CNetAddr, LocalServiceInfo> mapLocalHost;
 static bool vfReachable[NET_MAX] = {};
@@ -80,21 +83,38 @@ static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
+CRecvBufferPool recvBufferPool;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
+int nMaxSelectConnections = DEFAULT_MAX_PEER_CONNECTIONS;
 int nWhiteConnections = 0;
 bool fAddressesInitialized = false;
 std::string strSubVersion;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64_t, CInv> > vRelayExpiration;
+map<uint256, CRelayedTransaction> mapRelay;
+deque<pair<int64_t, uint256> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
 
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
 
+#ifdef USE_EPOLL
+/** Edge-triggered readiness notifications for the listening and peer sockets, or -1 to use select() */
+static int hEpoll = -1;
+#endif
+
+/** Whether the socket handler can wait on a peer's socket */
+static bool IsUsableSocket(SOCKET hSocket)
+{
+#ifdef USE_EPOLL
+    if (hEpoll != -1)
+        return true;
+#endif
+    return IsSelectableSocket(hSocket);
+}
+
 set<CNetAddr> setservAddNodeAddresses;
 CCriticalSection cs_setservAddNodeAddresses;
 
@@ -324,6 +344,10 @@ void AddressCurrentlyConnected(const CService& addr)
 
 uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
+uint64_t CNode::nMaxOutboundTotalBytesSentInCycle = 0;
+uint64_t CNode::nMaxOutboundCycleStartTime = 0;
+uint64_t CNode::nMaxOutboundLimit = 0;
+uint64_t CNode::nMaxOutboundTimeframe = MAX_UPLOAD_TIMEFRAME;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
 
@@ -363,6 +387,8 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+static void RegisterNodeSocket(CNode* pnode);
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 {
     if (pszDest == NULL) {
@@ -389,7 +415,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (!IsUsableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -405,6 +431,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        RegisterNodeSocket(pnode);
 
         pnode->nTimeConnected = GetTime();
 
@@ -633,6 +660,19 @@ void CNode::copyStats(CNodeStats &stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    {
+        LOCK(cs_inventory);
+        stats.nInvKnownBytes = filterInventoryKnown.DynamicMemoryUsage();
+    }
+
+    for (unsigned int i = 0; i < vSendTraffic.size(); i++) {
+        CMessageTraffic sent = vSendTraffic[i].Get(), received = vRecvTraffic[i].Get();
+        if (sent.nMessages)
+            stats.mapSendTraffic[GetMessageTypeName(i)] = sent;
+        if (received.nMessages)
+            stats.mapRecvTraffic[GetMessageTypeName(i)] = received;
+    }
 }
 #undef X
 
@@ -666,62 +706,172 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         pch += handled;
         nBytes -= handled;
 
-        if (msg.complete()) {
-            msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
-        }
+        if (msg.complete())
+            ReceivedMessage(msg);
     }
 
     return true;
 }
 
+// requires LOCK(cs_vRecvMsg)
+void CNode::ReceivedMessage(CNetMessage& msg)
+{
+    msg.nTime = GetTimeMicros();
+    vRecvTraffic[GetMessageTypeIndex(msg.hdr.pchCommand)].Add(CMessageHeader::HEADER_SIZE + msg.hdr.nMessageSize);
+    messageHandlerCondition.notify_one();
+}
+
+// requires LOCK(cs_vRecvMsg)
+char* CNode::GetReceiveWindow(unsigned int& nSize)
+{
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return NULL;
+    return vRecvMsg.back().GetDataWindow(nSize);
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::ReceivedInPlace(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.nDataPos += nBytes;
+    if (msg.complete())
+        ReceivedMessage(msg);
+}
+
+CNetMessage::~CNetMessage()
+{
+    CSerializeData vch;
+    vRecv.SwapData(vch);
+    recvBufferPool.Give(vch);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
     memcpy(&hdrbuf[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
         return nCopy;
 
     // deserialize to CMessageHeader
-    try {
-        hdrbuf >> hdr;
-    }
-    catch (const std::exception&) {
-        return -1;
-    }
+    memcpy(hdr.pchMessageStart, &hdrbuf[0], MESSAGE_START_SIZE);
+    memcpy(hdr.pchCommand, &hdrbuf[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE);
+    hdr.nMessageSize = ReadLE32((const unsigned char*)&hdrbuf[CMessageHeader::MESSAGE_SIZE_OFFSET]);
+    hdr.nChecksum = ReadLE32((const unsigned char*)&hdrbuf[CMessageHeader::CHECKSUM_OFFSET]);
 
     // reject messages larger than MAX_SIZE
     if (hdr.nMessageSize > MAX_SIZE)
             return -1;
 
+    // Receive larger payloads into a buffer from the pool. Its memory is in
+    // use already, so unlike a new buffer it can be sized in full up front.
+    if (hdr.nMessageSize >= (1U << RECV_BUFFER_POOL_MIN_CLASS)) {
+        CSerializeData vch;
+        if (recvBufferPool.Take(vch, hdr.nMessageSize)) {
+            vRecv.SwapData(vch);
+            vRecv.resize(hdr.nMessageSize);
+        }
+    }
+
     // switch state to reading message data
     in_data = true;
 
     return nCopy;
 }
 
-int CNetMessage::readData(const char *pch, unsigned int nBytes)
+char* CNetMessage::GetDataWindow(unsigned int& nSize)
 {
-    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
-    unsigned int nCopy = std::min(nRemaining, nBytes);
-
-    if (vRecv.size() < nDataPos + nCopy) {
+    if (vRecv.size() <= nDataPos) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        unsigned int nSize = std::min(hdr.nMessageSize, nDataPos + 256 * 1024);
+        if (hdr.nMessageSize >= (1U << RECV_BUFFER_POOL_MIN_CLASS)) {
+            // Round the capacity up to a power of two, so that the buffer can
+            // be reused for any message of this size class once pooled
+            size_t nCapacity = 1;
+            while (nCapacity < nSize)
+                nCapacity <<= 1;
+            vRecv.reserve(nCapacity);
+        }
+        vRecv.resize(nSize);
     }
+    nSize = vRecv.size() - nDataPos;
+    return &vRecv[nDataPos];
+}
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+int CNetMessage::readData(const char *pch, unsigned int nBytes)
+{
+    unsigned int nCopy;
+    char* pchData = GetDataWindow(nCopy);
+    nCopy = std::min(nCopy, nBytes);
+
+    memcpy(pchData, pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
 }
 
+bool CRecvBufferPool::Take(CSerializeData& vch, size_t nSize)
+{
+    unsigned int nClass = RECV_BUFFER_POOL_MIN_CLASS;
+    while (nClass <= RECV_BUFFER_POOL_MAX_CLASS && ((size_t)1 << nClass) < nSize)
+        nClass++;
+    if (nClass > RECV_BUFFER_POOL_MAX_CLASS)
+        return false;
+
+    LOCK(cs);
+    for (; nClass <= RECV_BUFFER_POOL_MAX_CLASS; nClass++) {
+        std::deque<CSerializeData>& vClass = vPool[nClass - RECV_BUFFER_POOL_MIN_CLASS];
+        if (!vClass.empty()) {
+            vch.swap(vClass.back());
+            vClass.pop_back();
+            nPooledBytes -= vch.capacity();
+            nReused++;
+            return true;
+        }
+    }
+    nAllocated++;
+    return false;
+}
+
+void CRecvBufferPool::Give(CSerializeData& vch)
+{
+    size_t nCapacity = vch.capacity();
+    if (nCapacity < ((size_t)1 << RECV_BUFFER_POOL_MIN_CLASS)) {
+        CSerializeData().swap(vch);
+        return;
+    }
+    unsigned int nClass = RECV_BUFFER_POOL_MIN_CLASS;
+    while (nClass < RECV_BUFFER_POOL_MAX_CLASS && ((size_t)1 << (nClass + 1)) <= nCapacity)
+        nClass++;
+
+    {
+        LOCK(cs);
+        if (nPooledBytes + nCapacity <= RECV_BUFFER_POOL_MAX_BYTES) {
+            std::deque<CSerializeData>& vClass = vPool[nClass - RECV_BUFFER_POOL_MIN_CLASS];
+            vClass.push_back(CSerializeData());
+            vClass.back().swap(vch);
+            vClass.back().clear();
+            nPooledBytes += nCapacity;
+            return;
+        }
+    }
+    // Pool is full: free it, outside the lock
+    CSerializeData().swap(vch);
+}
+
+void CRecvBufferPool::GetStats(uint64_t& nReusedOut, uint64_t& nAllocatedOut, size_t& nPooledBytesOut)
+{
+    LOCK(cs);
+    nReusedOut = nReused;
+    nAllocatedOut = nAllocated;
+    nPooledBytesOut = nPooledBytes;
+}
+
 
 
 
@@ -733,23 +883,51 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSendMessage>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert(it->GetData().size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData &data = it->GetData();
+        size_t nRequested = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nRequested, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Hand as many queued messages as possible to the kernel in one call
+        struct iovec vIov[MAX_SEND_IOVECS];
+        int nIov = 0;
+        size_t nRequested = 0;
+        for (std::deque<CSendMessage>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; ++itIov, ++nIov) {
+            const CSerializeData &data = itIov->GetData();
+            size_t nOffset = (nIov == 0 ? pnode->nSendOffset : 0);
+            vIov[nIov].iov_base = (void*)&data[nOffset];
+            vIov[nIov].iov_len = data.size() - nOffset;
+            nRequested += vIov[nIov].iov_len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vIov;
+        msg.msg_iovlen = nIov;
+        ssize_t nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // Drop the messages that went out completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0) {
+                size_t nSize = it->GetData().size();
+                if (nLeft < nSize - pnode->nSendOffset) {
+                    pnode->nSendOffset += nLeft;
+                    break;
+                }
+                nLeft -= nSize - pnode->nSendOffset;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= nSize;
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nRequested) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -774,75 +952,487 @@ void SocketSendData(CNode *pnode)
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
+/** Nodes removed from vNodes, until nothing refers to them any more. Only changed
+ *  by the socket handler thread, under cs_vNodes. */
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+/** Traffic of the deleted peers, by message type. Requires cs_vNodes. */
+static std::vector<CMessageTraffic> vRetiredSendTraffic;
+static std::vector<CMessageTraffic> vRetiredRecvTraffic;
+
+// Requires cs_vNodes. Only once nothing can send to pnode any more.
+static void RetireMessageTraffic(const CNode* pnode)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
+    vRetiredSendTraffic.resize(GetMessageTypeCount());
+    vRetiredRecvTraffic.resize(GetMessageTypeCount());
+    for (unsigned int i = 0; i < GetMessageTypeCount(); i++) {
+        vRetiredSendTraffic[i] += pnode->vSendTraffic[i].Get();
+        vRetiredRecvTraffic[i] += pnode->vRecvTraffic[i].Get();
+    }
+}
+
+// Requires cs_vNodes.
+static void AddMessageTraffic(const CNode* pnode, std::vector<CMessageTraffic>& vSent, std::vector<CMessageTraffic>& vRecv)
+{
+    for (unsigned int i = 0; i < vSent.size(); i++) {
+        vSent[i] += pnode->vSendTraffic[i].Get();
+        vRecv[i] += pnode->vRecvTraffic[i].Get();
+    }
+}
+
+void GetTotalMessageTraffic(msgtrafficmap_t& mapSent, msgtrafficmap_t& mapRecv)
+{
+    std::vector<CMessageTraffic> vSent(GetMessageTypeCount()), vRecv(GetMessageTypeCount());
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        if (!vRetiredSendTraffic.empty()) {
+            vSent = vRetiredSendTraffic;
+            vRecv = vRetiredRecvTraffic;
+        }
+        // Disconnected peers may still be sent messages until they are deleted
+        BOOST_FOREACH(const CNode* pnode, vNodes)
+            AddMessageTraffic(pnode, vSent, vRecv);
+        BOOST_FOREACH(const CNode* pnode, vNodesDisconnected)
+            AddMessageTraffic(pnode, vSent, vRecv);
+    }
+
+    mapSent.clear();
+    mapRecv.clear();
+    for (unsigned int i = 0; i < vSent.size(); i++) {
+        if (vSent[i].nMessages)
+            mapSent[GetMessageTypeName(i)] = vSent[i];
+        if (vRecv[i].nMessages)
+            mapRecv[GetMessageTypeName(i)] = vRecv[i];
+    }
+}
+
+/** Remove disconnected or unused nodes from vNodes, and delete them once nothing refers to them any more. */
+static void DisconnectNodes()
+{
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
+                }
+                if (fDelete)
+                {
                     {
+                        LOCK(cs_vNodes);
                         vNodesDisconnected.remove(pnode);
-                        delete pnode;
+                        RetireMessageTraffic(pnode);
                     }
+                    delete pnode;
+                }
+            }
+        }
+    }
+}
+
+static void NotifyNodeCountChanged(unsigned int& nPrevNodeCount)
+{
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+/** Accept a pending connection on a listening socket, if there is one. */
+static void AcceptConnection(const ListenSocket& hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+    int nMaxInbound = nMaxConnections - MAX_OUTBOUND_CONNECTIONS;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+    }
+    else if (!IsUsableSocket(hSocket))
+    {
+        LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
+        CloseSocket(hSocket);
+    }
+    else if (nInbound >= nMaxInbound)
+    {
+        LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
+        CloseSocket(hSocket);
+    }
+    else if (!whitelisted && (nInbound >= (nMaxInbound - nWhiteConnections)))
+    {
+        LogPrint("net", "connection from %s dropped (non-whitelisted)\n", addr.ToString());
+        CloseSocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr) && !whitelisted)
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        CloseSocket(hSocket);
+    }
+    else
+    {
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        pnode->fWhitelisted = whitelisted;
+
+        LogPrint("net", "connection from %s accepted\n", addr.ToString());
+
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+        RegisterNodeSocket(pnode);
+    }
+}
+
+/**
+ * Implement the following logic:
+ * * If there is data to send, wait for the socket to become writable. As this
+ *   only happens when optimistic write failed, we choose to first drain the
+ *   write buffer in this case before receiving more. This avoids needlessly
+ *   queueing received data, if the remote peer is not themselves receiving
+ *   data. This means properly utilizing TCP flow control signalling.
+ * * Otherwise, if there is no (complete) message in the receive buffer, or
+ *   there is space left in the buffer, receive data.
+ * * (if neither of the above applies, there is certainly one message in the
+ *   receiver buffer ready to be processed).
+ * Together, that means that at least one of the following is always possible,
+ * so we don't deadlock:
+ * * We send some data.
+ * * We wait for data to be received (and disconnect after timeout).
+ * * We process a message in the buffer (message handler thread).
+ *
+ * Requires pnode->cs_vRecvMsg; the caller has checked there is nothing to send.
+ */
+static bool CanReceive(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+/**
+ * Read what is available from a node's socket (requires pnode->cs_vRecvMsg).
+ * Returns true if the read filled the buffer, so more data may be waiting.
+ */
+static bool SocketRecvData(CNode* pnode)
+{
+    // The payload of a message being received is read straight into it,
+    // anything else goes through a buffer (typical socket buffer is 8K-64K)
+    char pchBuf[0x10000];
+    unsigned int nWindow = 0;
+    char* pchWindow = pnode->GetReceiveWindow(nWindow);
+    char* pchDest = pchWindow ? pchWindow : pchBuf;
+    unsigned int nDest = pchWindow ? nWindow : sizeof(pchBuf);
+    int nBytes = recv(pnode->hSocket, pchDest, nDest, MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (pchWindow)
+            pnode->ReceivedInPlace(nBytes);
+        else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return nBytes == (int)nDest;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+static void RegisterNodeSocket(CNode* pnode)
+{
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0)
+        LogPrintf("%s: epoll_ctl failed: %s\n", __func__, NetworkErrorString(errno));
+}
+
+static bool InitSocketEvents()
+{
+    if (hEpoll != -1)
+        return true;
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll == -1)
+        return error("%s: epoll_create1 failed: %s", __func__, NetworkErrorString(errno));
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        // Listening sockets are level-triggered and marked by a NULL node
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0) {
+            int nErr = errno;
+            close(hEpoll);
+            hEpoll = -1;
+            return error("%s: epoll_ctl failed: %s", __func__, NetworkErrorString(nErr));
+        }
+    }
+    return true;
+}
+
+/**
+ * Socket event loop. Sockets are registered once, when their node is
+ * created, and closing a socket unregisters it. Each node keeps the last
+ * readiness reported for its socket; only nodes with readiness not yet acted
+ * upon are visited, so the cost of an iteration follows socket activity, not
+ * the number of peers.
+ */
+static void ThreadSocketHandlerEpoll()
+{
+    unsigned int nPrevNodeCount = 0;
+    // Nodes which can make progress right away, and nodes with unread data
+    // held back by receive flood control, unsent data or a message handler
+    // using them. Both hold a reference.
+    std::set<CNode*> setReady, setBlocked;
+    std::vector<struct epoll_event> vEvents(MAX_SOCKET_EVENTS);
+    int64_t nLastInactivityCheck = 0;
+
+    while (true)
+    {
+        DisconnectNodes();
+        NotifyNodeCountChanged(nPrevNodeCount);
+
+        int nEvents = epoll_wait(hEpoll, &vEvents[0], vEvents.size(), setReady.empty() ? 50 : 0);
+        boost::this_thread::interruption_point();
+        if (nEvents < 0) {
+            if (errno != EINTR) {
+                LogPrintf("socket epoll error %s\n", NetworkErrorString(errno));
+                MilliSleep(50);
+            }
+            nEvents = 0;
+        }
+
+        for (int i = 0; i < nEvents; i++)
+        {
+            CNode* pnode = (CNode*)vEvents[i].data.ptr;
+            if (pnode == NULL) {
+                // Accept new connections
+                BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+                    if (hListenSocket.socket != INVALID_SOCKET)
+                        AcceptConnection(hListenSocket);
+                continue;
+            }
+            if (vEvents[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+                pnode->fRecvReady = true;
+            if (vEvents[i].events & (EPOLLOUT | EPOLLERR))
+                pnode->fSendReady = true;
+            if (!setReady.count(pnode)) {
+                if (!setBlocked.erase(pnode)) {
+                    LOCK(cs_vNodes);
+                    pnode->AddRef();
+                }
+                setReady.insert(pnode);
+            }
+        }
+
+        //
+        // Service each socket with pending readiness
+        //
+        std::vector<CNode*> vService(setReady.begin(), setReady.end());
+        vService.insert(vService.end(), setBlocked.begin(), setBlocked.end());
+        setReady.clear();
+        setBlocked.clear();
+        std::vector<CNode*> vDone;
+        BOOST_FOREACH(CNode* pnode, vService)
+        {
+            boost::this_thread::interruption_point();
+
+            if (pnode->hSocket == INVALID_SOCKET) {
+                vDone.push_back(pnode);
+                continue;
+            }
+
+            //
+            // Send
+            //
+            bool fSendPending = false;
+            bool fRetry = false;
+            // A node in use by a message handler is revisited after a wait
+            bool fContended = false;
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (!lockSend) {
+                    fContended = true;
+                } else if (!pnode->vSendMsg.empty()) {
+                    if (pnode->fSendReady)
+                        SocketSendData(pnode);
+                    // Data left over means the socket buffer is full again
+                    fSendPending = !pnode->vSendMsg.empty();
+                    if (fSendPending)
+                        pnode->fSendReady = false;
+                }
+            }
+
+            //
+            // Receive
+            //
+            if (pnode->fRecvReady && !fSendPending && pnode->hSocket != INVALID_SOCKET)
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (!lockRecv) {
+                    fContended = true;
+                } else if (CanReceive(pnode)) {
+                    // Edge-triggered: the socket stays readable until a read
+                    // comes up short
+                    pnode->fRecvReady = SocketRecvData(pnode);
+                    fRetry |= pnode->fRecvReady;
                 }
             }
+
+            if (pnode->hSocket == INVALID_SOCKET)
+                vDone.push_back(pnode);
+            else if (fRetry)
+                setReady.insert(pnode);
+            else if (pnode->fRecvReady || fContended)
+                setBlocked.insert(pnode);
+            else
+                vDone.push_back(pnode);
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+
+        //
+        // Inactivity checking
+        //
+        vector<CNode*> vNodesCopy;
+        if (GetTime() != nLastInactivityCheck) {
+            nLastInactivityCheck = GetTime();
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
         }
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            InactivityCheck(pnode);
+
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vDone)
+                pnode->Release();
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+    }
+}
+
+#else // USE_EPOLL
+
+static void RegisterNodeSocket(CNode* pnode) {}
+static bool InitSocketEvents() { return true; }
+
+#endif // USE_EPOLL
+
+/** Socket event loop for systems without epoll, or where it could not be set up */
+static void ThreadSocketHandlerSelect()
+{
+    unsigned int nPrevNodeCount = 0;
+    while (true)
+    {
+        DisconnectNodes();
+        NotifyNodeCountChanged(nPrevNodeCount);
 
         //
         // Find which sockets have data to receive
@@ -876,21 +1466,7 @@ void ThreadSocketHandler()
                 hSocketMax = max(hSocketMax, pnode->hSocket);
                 have_fds = true;
 
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
+                // See CanReceive
                 {
                     TRY_LOCK(pnode->cs_vSend, lockSend);
                     if (lockSend && !pnode->vSendMsg.empty()) {
@@ -900,9 +1476,7 @@ void ThreadSocketHandler()
                 }
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (lockRecv && CanReceive(pnode))
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
@@ -932,66 +1506,7 @@ void ThreadSocketHandler()
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
             if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
-                struct sockaddr_storage sockaddr;
-                socklen_t len = sizeof(sockaddr);
-                SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
-                CAddress addr;
-                int nInbound = 0;
-                int nMaxInbound = nMaxConnections - MAX_OUTBOUND_CONNECTIONS;
-
-                if (hSocket != INVALID_SOCKET)
-                    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                        LogPrintf("Warning: Unknown socket family\n");
-
-                bool whitelisted = hListenSocket.whitelisted || CNode::IsWhitelistedRange(addr);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                        if (pnode->fInbound)
-                            nInbound++;
-                }
-
-                if (hSocket == INVALID_SOCKET)
-                {
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK)
-                        LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                }
-                else if (!IsSelectableSocket(hSocket))
-                {
-                    LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else if (nInbound >= nMaxInbound)
-                {
-                    LogPrint("net", "connection from %s dropped (full)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else if (!whitelisted && (nInbound >= (nMaxInbound - nWhiteConnections)))
-                {
-                    LogPrint("net", "connection from %s dropped (non-whitelisted)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else if (CNode::IsBanned(addr) && !whitelisted)
-                {
-                    LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                    CloseSocket(hSocket);
-                }
-                else
-                {
-                    CNode* pnode = new CNode(hSocket, addr, "", true);
-                    pnode->AddRef();
-                    pnode->fWhitelisted = whitelisted;
-
-                    LogPrint("net", "connection from %s accepted\n", addr.ToString());
-
-                    {
-                        LOCK(cs_vNodes);
-                        vNodes.push_back(pnode);
-                    }
-                }
-            }
+                AcceptConnection(hListenSocket);
         }
 
         //
@@ -1017,39 +1532,7 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1067,30 +1550,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1100,6 +1560,17 @@ void ThreadSocketHandler()
     }
 }
 
+void ThreadSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (hEpoll != -1) {
+        ThreadSocketHandlerEpoll();
+        return;
+    }
+#endif
+    ThreadSocketHandlerSelect();
+}
+
 
 
 
@@ -1516,51 +1987,200 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
+//
+// Message handling is spread over a pool of worker threads. ThreadMessageHandler
+// queues nodes that have work; a node is queued at most once and handled by one
+// worker at a time. A worker handles one message of a node and gives it a turn
+// to send, then queues the node again at the back if it has more work, so
+// peers progress in turn and an expensive message (a block, a large getdata)
+// only holds up the peer that sent it. Nodes whose next message is handled
+// without cs_main go in a separate queue, which one worker serves exclusively
+// so that those messages are not held up by validation.
+//
+
+static boost::mutex csMessageQueue;
+static boost::condition_variable condMessageQueue;
+//! Nodes waiting for a worker, each holding a reference
+static std::deque<CNode*> vMessageQueue;
+//! Nodes waiting for a worker whose next message is cheap to handle
+static std::deque<CNode*> vMessageQueueCheap;
+//! Node that gets to send trickled inventory and addresses this round
+static CNode* pnodeTrickle = NULL;
+
+/** Commands whose handlers don't take cs_main */
+static const char* const pszCheapCommands[] = {
+    "ping", "pong", "addr", "getaddr", "filterload", "filteradd", "filterclear", "reject",
+};
+
+/** Whether ProcessMessages has something to do for a node (requires pnode->cs_vRecvMsg) */
+static bool HasMessageWork(CNode* pnode)
+{
+    if (pnode->fDisconnect || pnode->nSendSize >= SendBufferSize())
+        return false;
+    return !pnode->vRecvGetData.empty() || pnode->HasOrphanWork() ||
+           (!pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete());
+}
+
+/** Whether the next call to ProcessMessages stays clear of cs_main (requires pnode->cs_vRecvMsg) */
+static bool IsMessageWorkCheap(CNode* pnode)
+{
+    if (!pnode->vRecvGetData.empty() || pnode->HasOrphanWork())
+        return false;
+    if (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete())
+        return false;
+    std::string strCommand = pnode->vRecvMsg.front().hdr.GetCommand();
+    BOOST_FOREACH(const char* pszCommand, pszCheapCommands)
+        if (strCommand == pszCommand)
+            return true;
+    return false;
+}
+
+/**
+ * Queue the given nodes for the workers. A reference to each is handed over
+ * to the queue, except for nodes queued already, which are returned in
+ * vNodesQueued.
+ */
+static void QueueNodes(const std::vector<CNode*>& vNodesToQueue, const std::vector<bool>& vCheap, std::vector<CNode*>& vNodesQueued)
+{
+    unsigned int nQueued = 0;
+    {
+        boost::unique_lock<boost::mutex> lock(csMessageQueue);
+        for (unsigned int i = 0; i < vNodesToQueue.size(); i++) {
+            CNode* pnode = vNodesToQueue[i];
+            if (pnode->fScheduled) {
+                vNodesQueued.push_back(pnode);
+                continue;
+            }
+            pnode->fScheduled = true;
+            if (vCheap[i])
+                vMessageQueueCheap.push_back(pnode);
+            else
+                vMessageQueue.push_back(pnode);
+            nQueued++;
+        }
+    }
+    if (nQueued > 0)
+        condMessageQueue.notify_all();
+}
+
+/**
+ * Queue connected nodes for the workers: all of them, so that each gets to
+ * send, or only those with messages to process.
+ */
+static void ScheduleNodes(bool fAll)
+{
+    vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            pnode->AddRef();
+    }
+
+    vector<CNode*> vNodesToQueue, vNodesRelease;
+    vector<bool> vCheap;
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        bool fWork = false, fCheap = false;
+        if (!pnode->fDisconnect) {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            // When in use, leave it to the worker to find out
+            fWork = !lockRecv || HasMessageWork(pnode);
+            fCheap = lockRecv && fWork && IsMessageWorkCheap(pnode);
+        }
+        if (!pnode->fDisconnect && (fAll || fWork)) {
+            vNodesToQueue.push_back(pnode);
+            vCheap.push_back(fCheap);
+        } else {
+            vNodesRelease.push_back(pnode);
+        }
+    }
+
+    if (fAll) {
+        boost::unique_lock<boost::mutex> lock(csMessageQueue);
+        pnodeTrickle = vNodesCopy.empty() ? NULL : vNodesCopy[GetRand(vNodesCopy.size())];
+    }
+    QueueNodes(vNodesToQueue, vCheap, vNodesRelease);
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesRelease)
+            pnode->Release();
+    }
+}
+
 void ThreadMessageHandler()
 {
     boost::mutex condition_mutex;
     boost::unique_lock<boost::mutex> lock(condition_mutex);
 
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    int64_t nLastRound = 0;
     while (true)
     {
-        vector<CNode*> vNodesCopy;
+        // Every node gets to send at least every 100ms, and nodes are queued
+        // as soon as a new message for them comes in.
+        int64_t nNow = GetTimeMillis();
+        bool fAll = nNow - nLastRound >= 100;
+        if (fAll)
+            nLastRound = nNow;
+        ScheduleNodes(fAll);
+
+        messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+    }
+}
+
+void ThreadMessageWorker(bool fCheapOnly)
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        CNode* pnode = NULL;
+        bool fTrickle = false;
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
-                pnode->AddRef();
+            boost::unique_lock<boost::mutex> lock(csMessageQueue);
+            while (true) {
+                if (!vMessageQueueCheap.empty()) {
+                    pnode = vMessageQueueCheap.front();
+                    vMessageQueueCheap.pop_front();
+                    break;
+                }
+                if (!fCheapOnly && !vMessageQueue.empty()) {
+                    pnode = vMessageQueue.front();
+                    vMessageQueue.pop_front();
+                    break;
+                }
+                if (!fCheapOnly) {
+                    // Out of work: do what was queued up while handling
+                    // messages, such as relayed transactions awaiting mempool
+                    // admission, in one go. This may give nodes new work.
+                    lock.unlock();
+                    g_signals.ProcessBatches();
+                    ScheduleNodes(false);
+                    lock.lock();
+                    if (!vMessageQueueCheap.empty() || !vMessageQueue.empty())
+                        continue;
+                }
+                condMessageQueue.wait(lock);
             }
+            fTrickle = (pnode == pnodeTrickle);
         }
 
-        // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-
-        bool fSleep = true;
+        bool fHandle = true;
+        if (fCheapOnly) {
+            // Whether the next message is cheap can have changed since the
+            // node was queued; leave expensive work to the other workers.
+            LOCK(pnode->cs_vRecvMsg);
+            fHandle = IsMessageWorkCheap(pnode);
+        }
 
-        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        if (fHandle && !pnode->fDisconnect)
         {
-            if (pnode->fDisconnect)
-                continue;
-
             // Receive messages
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
-                }
+                LOCK(pnode->cs_vRecvMsg);
+                if (!g_signals.ProcessMessages(pnode))
+                    pnode->CloseSocketDisconnect();
             }
             boost::this_thread::interruption_point();
 
@@ -1568,20 +2188,92 @@ void ThreadMessageHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
+                    g_signals.SendMessages(pnode, fTrickle || pnode->fWhitelisted);
             }
             boost::this_thread::interruption_point();
         }
 
+        bool fWork, fCheap;
+        {
+            LOCK(pnode->cs_vRecvMsg);
+            fWork = HasMessageWork(pnode);
+            fCheap = fWork && IsMessageWorkCheap(pnode);
+        }
+        {
+            boost::unique_lock<boost::mutex> lock(csMessageQueue);
+            pnode->fScheduled = false;
+        }
+        // Back in the queue (at the end) if there is more to do. A message
+        // completed after the check above is seen by ThreadMessageHandler,
+        // as the node is no longer marked as queued.
+        std::vector<CNode*> vNodesToQueue(1, pnode), vNodesRelease;
+        if (fWork)
+            QueueNodes(vNodesToQueue, std::vector<bool>(1, fCheap), vNodesRelease);
+        else
+            vNodesRelease.push_back(pnode);
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->Release();
+            BOOST_FOREACH(CNode* p, vNodesRelease)
+                p->Release();
         }
+    }
+}
+
+//
+// Message statistics
+//
+
+/** Commands accounted separately in the message statistics, followed by "other" for the rest */
+static const char* const pszMessageTypes[] = {
+    "version", "verack", "addr", "inv", "getdata", "merkleblock", "getblocks", "getheaders",
+    "tx", "headers", "block", "getaddr", "mempool", "ping", "pong", "alert", "notfound",
+    "filterload", "filteradd", "filterclear", "reject", "sendheaders", "sendcmpct",
+    "cmpctblock", "getblocktxn", "blocktxn",
+    "other",
+};
+
+unsigned int GetMessageTypeCount()
+{
+    return ARRAYLEN(pszMessageTypes);
+}
 
-        if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+unsigned int GetMessageTypeIndex(const char* pchCommand)
+{
+    for (unsigned int i = 0; i < ARRAYLEN(pszMessageTypes) - 1; i++) {
+        if (strncmp(pchCommand, pszMessageTypes[i], CMessageHeader::COMMAND_SIZE) == 0)
+            return i;
     }
+    return ARRAYLEN(pszMessageTypes) - 1;
+}
+
+const char* GetMessageTypeName(unsigned int nIndex)
+{
+    assert(nIndex < ARRAYLEN(pszMessageTypes));
+    return pszMessageTypes[nIndex];
+}
+
+static CCriticalSection cs_mapMessageLatency;
+static std::map<std::string, CMessageLatencyStats> mapMessageLatency;
+static const CMetricFamily<CMetricHistogram> metricMessageHandled("bitcoin_net_message_seconds",
+    "Time spent processing received messages, by command", "command",
+    std::vector<std::string>(pszMessageTypes, pszMessageTypes + ARRAYLEN(pszMessageTypes)));
+
+void RecordMessageLatency(const std::string& strCommand, int64_t nQueuedMicros, int64_t nHandledMicros)
+{
+    unsigned int nType = GetMessageTypeIndex(strCommand.c_str());
+    const char* pszKey = GetMessageTypeName(nType);
+    metricMessageHandled[nType].Observe(nHandledMicros);
+
+    LOCK(cs_mapMessageLatency);
+    CMessageLatencyStats& stats = mapMessageLatency[pszKey];
+    stats.queued.Add(nQueuedMicros);
+    stats.handled.Add(nHandledMicros);
+}
+
+void GetMessageLatencyStats(std::map<std::string, CMessageLatencyStats>& mapStats)
+{
+    LOCK(cs_mapMessageLatency);
+    mapStats = mapMessageLatency;
 }
 
 
@@ -1782,6 +2474,13 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
     // Send and receive from sockets, accept connections
+    if (!InitSocketEvents()) {
+        LogPrintf("Using select() for socket events instead\n");
+        if (nMaxConnections > nMaxSelectConnections) {
+            LogPrintf("Reducing -maxconnections from %d to %d, because select() is used\n", nMaxConnections, nMaxSelectConnections);
+            nMaxConnections = nMaxSelectConnections;
+        }
+    }
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -1792,6 +2491,14 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nWorkers = GetArg("-msghandthreads", DEFAULT_MESSAGE_HANDLER_THREADS);
+    nWorkers = std::max(1, std::min(nWorkers, MAX_MESSAGE_HANDLER_THREADS));
+    for (int i = 0; i < nWorkers; i++) {
+        // With more than one worker, the first only handles cheap messages
+        bool fCheapOnly = (i == 0 && nWorkers > 1);
+        boost::function<void()> workerLoop = boost::bind(&ThreadMessageWorker, fCheapOnly);
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msgwork", workerLoop));
+    }
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -1829,6 +2536,11 @@ public:
             if (hListenSocket.socket != INVALID_SOCKET)
                 if (!CloseSocket(hListenSocket.socket))
                     LogPrintf("CloseSocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+            close(hEpoll);
+        hEpoll = -1;
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH(CNode *pnode, vNodes)
@@ -1859,15 +2571,16 @@ instance_of_cnetcleanup;
 
 void RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
+    RelayTransaction(MakeTransactionRef(tx));
 }
 
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+void RelayTransaction(const CTransactionRef& ptx)
 {
+    const CTransaction& tx = *ptx;
     CInv inv(MSG_TX, tx.GetHash());
+    CRelayedTransaction relayed;
+    relayed.tx = ptx;
+    relayed.msg = MakeSharedMessage("tx", tx);
     {
         LOCK(cs_mapRelay);
         // Expire old relay messages
@@ -1877,9 +2590,10 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+        // Keep a reference to the transaction and its serialized message, so
+        // getdata can be answered without copying or reserializing it.
+        mapRelay.insert(std::make_pair(inv.hash, relayed));
+        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv.hash));
     }
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -1906,6 +2620,92 @@ void CNode::RecordBytesSent(uint64_t bytes)
 {
     LOCK(cs_totalBytesSent);
     nTotalBytesSent += bytes;
+
+    uint64_t now = GetTime();
+    if (nMaxOutboundCycleStartTime + nMaxOutboundTimeframe < now)
+    {
+        // timeframe expired, reset cycle
+        nMaxOutboundCycleStartTime = now;
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+    nMaxOutboundTotalBytesSentInCycle += bytes;
+}
+
+void CNode::SetMaxOutboundTarget(uint64_t limit)
+{
+    LOCK(cs_totalBytesSent);
+    uint64_t recommendedMinimum = (nMaxOutboundTimeframe / 600) * MAX_BLOCK_SIZE;
+    nMaxOutboundLimit = limit;
+
+    if (limit > 0 && limit < recommendedMinimum)
+        LogPrintf("Max outbound target is very small (%s bytes) and will be overshot. Recommended minimum is %s bytes.\n", nMaxOutboundLimit, recommendedMinimum);
+}
+
+uint64_t CNode::GetMaxOutboundTarget()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundLimit;
+}
+
+void CNode::SetMaxOutboundTimeframe(uint64_t timeframe)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundTimeframe != timeframe)
+    {
+        // reset measure-cycle in case of changing the timeframe
+        nMaxOutboundCycleStartTime = GetTime();
+        nMaxOutboundTotalBytesSentInCycle = 0;
+    }
+    nMaxOutboundTimeframe = timeframe;
+}
+
+uint64_t CNode::GetMaxOutboundTimeframe()
+{
+    LOCK(cs_totalBytesSent);
+    return nMaxOutboundTimeframe;
+}
+
+bool CNode::OutboundTargetReached(bool historicalBlockServingLimit)
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return false;
+
+    if (historicalBlockServingLimit)
+    {
+        // keep a large enough buffer to at least relay each block once
+        uint64_t timeLeftInCycle = GetMaxOutboundTimeLeftInCycle();
+        uint64_t buffer = timeLeftInCycle / 600 * MAX_BLOCK_SIZE;
+        if (buffer >= nMaxOutboundLimit || nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit - buffer)
+            return true;
+    }
+    else if (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit)
+        return true;
+
+    return false;
+}
+
+uint64_t CNode::GetOutboundTargetBytesLeft()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    return (nMaxOutboundTotalBytesSentInCycle >= nMaxOutboundLimit) ? 0 : nMaxOutboundLimit - nMaxOutboundTotalBytesSentInCycle;
+}
+
+uint64_t CNode::GetMaxOutboundTimeLeftInCycle()
+{
+    LOCK(cs_totalBytesSent);
+    if (nMaxOutboundLimit == 0)
+        return 0;
+
+    if (nMaxOutboundCycleStartTime == 0)
+        return nMaxOutboundTimeframe;
+
+    uint64_t cycleEndTime = nMaxOutboundCycleStartTime + nMaxOutboundTimeframe;
+    uint64_t now = GetTime();
+    return (cycleEndTime < now) ? 0 : cycleEndTime - now;
 }
 
 uint64_t CNode::GetTotalBytesRecv()
@@ -2062,7 +2862,7 @@ unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNameIn, bool fInboundIn) :
     ssSend(SER_NETWORK, INIT_PROTO_VERSION),
     addrKnown(5000, 0.001),
-    setInventoryKnown(SendBufferSize() / 1000)
+    filterInventoryKnown(50000, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -2071,6 +2871,8 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nLastRecv = 0;
     nSendBytes = 0;
     nRecvBytes = 0;
+    vSendTraffic.resize(GetMessageTypeCount());
+    vRecvTraffic.resize(GetMessageTypeCount());
     nTimeConnected = GetTime();
     nTimeOffset = 0;
     addr = addrIn;
@@ -2096,6 +2898,10 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nPingUsecStart = 0;
     nPingUsecTime = 0;
     fPingQueued = false;
+    fRecvReady = false;
+    fSendReady = false;
+    fScheduled = false;
+    fOrphanWork = false;
 
     {
         LOCK(cs_nLastNodeId);
@@ -2154,6 +2960,58 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
+/** Fill in the size and checksum of a serialized message. Returns the payload size. */
+static unsigned int FinalizeMessageHeader(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    WriteLE32((uint8_t*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    return nSize;
+}
+
+void BeginSharedMessage(CDataStream& ss, const char* pszCommand)
+{
+    assert(ss.size() == 0);
+    ss << CMessageHeader(Params().MessageStart(), pszCommand, 0);
+}
+
+CSerializedMessageRef EndSharedMessage(CDataStream& ss)
+{
+    FinalizeMessageHeader(ss);
+    boost::shared_ptr<CSerializeData> msg(new CSerializeData());
+    ss.SwapData(*msg);
+    return msg;
+}
+
+void CNode::PushSharedMessage(const CSerializedMessageRef& msg)
+{
+    // Shared messages bypass ssSend, so the -*messagestest options do not apply to them
+    LOCK(cs_vSend);
+    assert(ssSend.size() == 0);
+    const CSerializeData& data = *msg;
+    const char* pchCommand = &data[MESSAGE_START_SIZE];
+    LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n",
+        SanitizeString(std::string(pchCommand, strnlen(pchCommand, CMessageHeader::COMMAND_SIZE))),
+        data.size() - CMessageHeader::HEADER_SIZE, id);
+    vSendTraffic[GetMessageTypeIndex(pchCommand)].Add(data.size());
+
+    std::deque<CSendMessage>::iterator it = vSendMsg.insert(vSendMsg.end(), CSendMessage());
+    it->pShared = msg;
+    nSendSize += data.size();
+
+    // If write queue empty, attempt "optimistic write"
+    if (it == vSendMsg.begin())
+        SocketSendData(this);
+}
+
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
@@ -2190,22 +3048,25 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         LEAVE_CRITICAL_SECTION(cs_vSend);
         return;
     }
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    WriteLE32((uint8_t*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
-
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    unsigned int nSize = FinalizeMessageHeader(ssSend);
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
-
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    vSendTraffic[GetMessageTypeIndex(&ssSend[MESSAGE_START_SIZE])].Add(ssSend.size());
+
+    // Move the serialized bytes into the queue, and give ssSend a buffer
+    // sized like the last message in their place. A message much smaller
+    // than the buffer, left over from a larger one, is copied out instead,
+    // so that queued messages never hold more than twice their size.
+    std::deque<CSendMessage>::iterator it = vSendMsg.insert(vSendMsg.end(), CSendMessage());
+    if (ssSend.capacity() > 2 * ssSend.size()) {
+        CSerializeData vchCopy(ssSend.begin(), ssSend.end());
+        it->vchOwned.swap(vchCopy);
+        ssSend.SwapData(vchCopy); // frees the large buffer
+    } else {
+        ssSend.SwapData(it->vchOwned);
+    }
+    ssSend.reserve(it->vchOwned.size());
+    nSendSize += it->vchOwned.size();
 
     // If write queue empty, attempt "optimistic write"
     if (it == vSendMsg.begin())
@@ -8,9 +8,11 @@
 
 #include "bloom.h"
 #include "compat.h"
+#include "latencyhistogram.h"
 #include "limitedmap.h"
-#include "mruset.h"
+#include "metrics.h"
 #include "netbase.h"
+#include "primitives/transaction.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
@@ -18,6 +20,7 @@
 #include "uint256.h"
 
 #include <deque>
+#include <map>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -26,6 +29,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -60,6 +64,24 @@ static const bool DEFAULT_UPNP = false;
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 /** The maximum number of peer connections to maintain. */
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
+/** The maximum number of socket events handled per wakeup of the socket handler thread. */
+static const int MAX_SOCKET_EVENTS = 256;
+/** -msghandthreads default: the number of threads processing messages from peers */
+static const int DEFAULT_MESSAGE_HANDLER_THREADS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MESSAGE_HANDLER_THREADS = 16;
+/** Message payloads at least this large (2^RECV_BUFFER_POOL_MIN_CLASS bytes) are received into pooled buffers */
+static const unsigned int RECV_BUFFER_POOL_MIN_CLASS = 10;
+/** Largest size class of pooled receive buffers, fitting MAX_PROTOCOL_MESSAGE_LENGTH */
+static const unsigned int RECV_BUFFER_POOL_MAX_CLASS = 21;
+/** Maximum total capacity of the receive buffers kept for reuse */
+static const size_t RECV_BUFFER_POOL_MAX_BYTES = 16 * 1024 * 1024;
+/** Maximum number of queued messages handed to the kernel in a single send call */
+static const int MAX_SEND_IOVECS = 64;
+/** The default for -maxuploadtarget. 0 = Unlimited */
+static const uint64_t DEFAULT_MAX_UPLOAD_TARGET = 0;
+/** The length of the -maxuploadtarget cycle, in seconds */
+static const uint64_t MAX_UPLOAD_TIMEFRAME = 60 * 60 * 24;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -79,6 +101,91 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
 
+/** A message serialized once, header included, that can be queued to any number of peers without copying */
+typedef boost::shared_ptr<const CSerializeData> CSerializedMessageRef;
+
+void BeginSharedMessage(CDataStream& ss, const char* pszCommand);
+CSerializedMessageRef EndSharedMessage(CDataStream& ss);
+
+template<typename T>
+CSerializedMessageRef MakeSharedMessage(const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    BeginSharedMessage(ss, pszCommand);
+    ss << obj;
+    return EndSharedMessage(ss);
+}
+
+/** A message in a peer's send queue: either serialized for this peer alone, or shared with other peers */
+class CSendMessage
+{
+public:
+    CSerializeData vchOwned;
+    CSerializedMessageRef pShared;
+
+    const CSerializeData& GetData() const { return pShared ? *pShared : vchOwned; }
+};
+
+/** Latencies of handling one type of network message */
+struct CMessageLatencyStats
+{
+    CLatencyHistogram queued;  //! From receipt of the message until its handler started
+    CLatencyHistogram handled; //! Time spent in the handler
+};
+
+/** Number of messages of one type, and their size on the wire with headers */
+struct CMessageTraffic
+{
+    uint64_t nMessages;
+    uint64_t nBytes;
+
+    CMessageTraffic() : nMessages(0), nBytes(0) {}
+
+    CMessageTraffic& operator+=(const CMessageTraffic& other)
+    {
+        nMessages += other.nMessages;
+        nBytes += other.nBytes;
+        return *this;
+    }
+};
+
+/** Running count of the traffic of one message type, updated and read without a lock */
+struct CMessageTrafficCounter
+{
+    CMetricCounter nMessages;
+    CMetricCounter nBytes;
+
+    void Add(uint64_t nSize)
+    {
+        nMessages.Inc();
+        nBytes.Inc(nSize);
+    }
+
+    CMessageTraffic Get() const
+    {
+        CMessageTraffic traffic;
+        traffic.nMessages = nMessages.Get();
+        traffic.nBytes = nBytes.Get();
+        return traffic;
+    }
+};
+
+typedef std::map<std::string, CMessageTraffic> msgtrafficmap_t;
+
+/** Number of message types accounted separately in the message statistics, "other" included */
+unsigned int GetMessageTypeCount();
+/** Index of a command (up to COMMAND_SIZE characters) in the message statistics; unknown ones share the index of "other" */
+unsigned int GetMessageTypeIndex(const char* pchCommand);
+/** Name of a message type, by its index in the message statistics */
+const char* GetMessageTypeName(unsigned int nIndex);
+/** Get the traffic of all peers, past and present, by command */
+void GetTotalMessageTraffic(msgtrafficmap_t& mapSent, msgtrafficmap_t& mapRecv);
+
+/** Account the latency of a handled message; unknown commands are counted together as "other" */
+void RecordMessageLatency(const std::string& strCommand, int64_t nQueuedMicros, int64_t nHandledMicros);
+/** Get a copy of the message latency statistics, by command */
+void GetMessageLatencyStats(std::map<std::string, CMessageLatencyStats>& mapStats);
+
 typedef int NodeId;
 
 struct CombinerAll
@@ -104,6 +211,7 @@ struct CNodeSignals
     boost::signals2::signal<bool (CNode*, bool), CombinerAll> SendMessages;
     boost::signals2::signal<void (NodeId, const CNode*)> InitializeNode;
     boost::signals2::signal<void (NodeId)> FinalizeNode;
+    boost::signals2::signal<void ()> ProcessBatches;
 };
 
 
@@ -143,6 +251,32 @@ extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 
+/**
+ * Message receive buffers kept for reuse across messages and peers, in
+ * power-of-two size classes: a buffer in class k has room for at least 2^k
+ * bytes. Buffers change hands by swapping storage, never by copying.
+ */
+class CRecvBufferPool
+{
+public:
+    CRecvBufferPool() : nPooledBytes(0), nReused(0), nAllocated(0) {}
+
+    /** Swap a pooled buffer with room for nSize bytes into the empty vch. Returns false if none is available. */
+    bool Take(CSerializeData& vch, size_t nSize);
+    /** Swap vch's storage into the pool, or free it if it is small or the pool is full. Leaves vch empty. */
+    void Give(CSerializeData& vch);
+
+    void GetStats(uint64_t& nReusedOut, uint64_t& nAllocatedOut, size_t& nPooledBytesOut);
+
+private:
+    CCriticalSection cs;
+    std::deque<CSerializeData> vPool[RECV_BUFFER_POOL_MAX_CLASS - RECV_BUFFER_POOL_MIN_CLASS + 1];
+    size_t nPooledBytes;
+    uint64_t nReused;    //! Buffers handed out from the pool
+    uint64_t nAllocated; //! Requests the pool could not serve
+};
+extern CRecvBufferPool recvBufferPool;
+
 // The allocation of connections against the maximum allowed (nMaxConnections)
 // is prioritized as follows:
 // 1st: Outbound connections (MAX_OUTBOUND_CONNECTIONS)
@@ -154,13 +288,22 @@ extern CAddrMan addrman;
 
 /** Maximum number of connections to simultaneously allow (aka connection slots) */
 extern int nMaxConnections;
+/** Most connections the select() socket loop can serve, for sockets below FD_SETSIZE */
+extern int nMaxSelectConnections;
 /** Number of connection slots to reserve for inbound from whitelisted peers */
 extern int nWhiteConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
+/** A transaction kept for relay, with its "tx" message serialized once for all peers asking for it */
+struct CRelayedTransaction
+{
+    CTransactionRef tx;
+    CSerializedMessageRef msg;
+};
+
+extern std::map<uint256, CRelayedTransaction> mapRelay;
+extern std::deque<std::pair<int64_t, uint256> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
 
@@ -201,6 +344,9 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    size_t nInvKnownBytes;
+    msgtrafficmap_t mapSendTraffic;
+    msgtrafficmap_t mapRecvTraffic;
 };
 
 
@@ -210,7 +356,7 @@ class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    char hdrbuf[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
@@ -219,14 +365,15 @@ public:
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
+    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
     }
 
+    ~CNetMessage();
+
     bool complete() const
     {
         if (!in_data)
@@ -236,12 +383,13 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+    /** Where the next payload bytes go, with room for nSize of them (in_data and not complete()) */
+    char* GetDataWindow(unsigned int& nSize);
 };
 
 
@@ -317,10 +465,20 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendMessage> vSendMsg;
     CCriticalSection cs_vSend;
+    // Traffic by message type, indexed by GetMessageTypeIndex. Sized once at construction,
+    // updated under cs_vSend and cs_vRecvMsg, and read without locking through Get().
+    std::vector<CMessageTrafficCounter> vSendTraffic;
+    std::vector<CMessageTrafficCounter> vRecvTraffic;
 
     std::deque<CInv> vRecvGetData;
+    // Orphans whose parents this peer supplied, awaiting reconsideration (protected by cs_main)
+    std::set<uint256> setOrphanWork;
+    // Whether setOrphanWork is non-empty, for the message scheduler, which
+    // does not take cs_main (protected by cs_orphanWork)
+    bool fOrphanWork;
+    mutable CCriticalSection cs_orphanWork;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
@@ -376,15 +534,18 @@ public:
     uint256 hashContinue;
     int nStartingHeight;
 
-    // flood relay
+    // flood relay, guarded by cs_inventory as other peers' message handlers push to it
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    // Hashes the peer is known to have, or that we announced to it. Requires cs_inventory.
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    // Blocks to announce, as headers if the peer prefers them. Requires cs_inventory.
+    std::vector<uint256> vBlockHashesToAnnounce;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
 
@@ -398,6 +559,14 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
+    // Socket readiness reported by the event loop and not yet used up (socket handler thread only)
+    bool fRecvReady;
+    bool fSendReady;
+
+    // Whether the node is queued for, or being handled by, a message handler
+    // thread (guarded by the message queue lock in net.cpp)
+    bool fScheduled;
+
     CNode(SOCKET hSocketIn, const CAddress &addrIn, const std::string &addrNameIn = "", bool fInboundIn = false);
     ~CNode();
 
@@ -408,6 +577,12 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    // Outbound limit, and the traffic of the current cycle. Requires cs_totalBytesSent.
+    static uint64_t nMaxOutboundTotalBytesSentInCycle;
+    static uint64_t nMaxOutboundCycleStartTime;
+    static uint64_t nMaxOutboundLimit;
+    static uint64_t nMaxOutboundTimeframe;
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
@@ -435,6 +610,19 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // Payload data of a message being received can be read from the socket
+    // straight into the message, see ReceivedInPlace.
+    // requires LOCK(cs_vRecvMsg)
+    char* GetReceiveWindow(unsigned int& nSize);
+
+    // Account for nBytes read into the window from GetReceiveWindow.
+    // requires LOCK(cs_vRecvMsg)
+    void ReceivedInPlace(unsigned int nBytes);
+
+    // Account for a completely received message, and wake the message handlers for it.
+    // requires LOCK(cs_vRecvMsg)
+    void ReceivedMessage(CNetMessage& msg);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -443,6 +631,18 @@ public:
             msg.SetVersion(nVersionIn);
     }
 
+    void SetOrphanWork(bool fWork)
+    {
+        LOCK(cs_orphanWork);
+        fOrphanWork = fWork;
+    }
+
+    bool HasOrphanWork() const
+    {
+        LOCK(cs_orphanWork);
+        return fOrphanWork;
+    }
+
     CNode* AddRef()
     {
         nRefCount++;
@@ -458,11 +658,13 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_inventory);
         addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
     {
+        LOCK(cs_inventory);
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
@@ -480,19 +682,31 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
+    bool IsInventoryKnown(const CInv& inv)
+    {
+        LOCK(cs_inventory);
+        return filterInventoryKnown.contains(inv.hash);
+    }
+
     void PushInventory(const CInv& inv)
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
 
+    void PushBlockHash(const uint256 &hash)
+    {
+        LOCK(cs_inventory);
+        vBlockHashesToAnnounce.push_back(hash);
+    }
+
     void AskFor(const CInv& inv);
 
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
@@ -506,6 +720,9 @@ public:
 
     void PushVersion();
 
+    /** Queue a message serialized by MakeSharedMessage, sharing its bytes rather than copying them */
+    void PushSharedMessage(const CSerializedMessageRef& msg);
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -709,13 +926,30 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    //! Set the target for the bytes sent per timeframe, 0 for no limit
+    static void SetMaxOutboundTarget(uint64_t limit);
+    static uint64_t GetMaxOutboundTarget();
+
+    //! Set the length of the cycles the target applies to, in seconds; a change starts a new cycle
+    static void SetMaxOutboundTimeframe(uint64_t timeframe);
+    static uint64_t GetMaxOutboundTimeframe();
+
+    //! Whether the target is reached in this cycle. With historicalBlockServingLimit, whether
+    //! historical blocks would eat into what is left to relay a new block every 10 minutes.
+    static bool OutboundTargetReached(bool historicalBlockServingLimit);
+
+    //! Bytes left in the current cycle, or 0 if there is no limit
+    static uint64_t GetOutboundTargetBytesLeft();
+
+    //! Seconds left in the current cycle, or 0 if there is no limit
+    static uint64_t GetMaxOutboundTimeLeftInCycle();
 };
 
 
 
-class CTransaction;
+void RelayTransaction(const CTransactionRef& tx);
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
 
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
@@ -0,0 +1,469 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "notificationpublisher.h"
+
+#include "chain.h"
+#include "main.h"
+#include "netbase.h"
+#include "primitives/block.h"
+#include "primitives/transaction.h"
+#include "streams.h"
+#include "sync.h"
+#include "util.h"
+#include "validationinterface.h"
+#include "version.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifndef WIN32
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <event2/thread.h>
+#include <event2/util.h>
+
+#include <boost/algorithm/string/join.hpp>
+#include <boost/algorithm/string/predicate.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+class CNotificationPublisher;
+
+/** An address that is listened on, and the topics published at it */
+struct PubEndpoint
+{
+    CNotificationPublisher* publisher;
+    std::string strAddress;
+    std::set<std::string> setTopics;
+    struct evconnlistener* listener;
+    //! Path of a unix socket, removed again on shutdown
+    std::string strUnixPath;
+
+    PubEndpoint(CNotificationPublisher* publisher, const std::string& strAddress) :
+        publisher(publisher), strAddress(strAddress), listener(NULL) {}
+};
+
+/**
+ * A message waiting for the publisher thread. Blocks are only read from disk
+ * there, so that the validation thread does not wait for it.
+ */
+struct PubMessage
+{
+    std::string strTopic;
+    //! The serialized message, or empty if the block at posBlock is still to be read
+    std::string strMessage;
+    CDiskBlockPos posBlock;
+    uint256 hashBlock;
+    uint32_t nSequence;
+};
+
+/** A connected subscriber. Only used on the publisher thread. */
+struct PubSubscriber
+{
+    CNotificationPublisher* publisher;
+    const PubEndpoint* endpoint;
+    struct bufferevent* bev;
+    //! Messages not sent because the send queue was full
+    uint64_t nDropped;
+};
+
+class CNotificationPublisher : public CValidationInterface
+{
+public:
+    CNotificationPublisher(size_t nMaxQueue);
+    ~CNotificationPublisher();
+
+    void AddTopic(const std::string& strTopic, const std::string& strAddress);
+    bool Start();
+    void Stop();
+
+    // Called on the publisher thread
+    void Accept(const PubEndpoint* endpoint, evutil_socket_t fd);
+    void Disconnect(PubSubscriber* subscriber);
+    void SendQueued();
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork);
+    void SyncTransaction(const CTransaction &tx, const CBlock *pblock);
+
+private:
+    bool IsPublished(const std::string& strTopic) const { return setPublished.count(strTopic) > 0; }
+    void Publish(const std::string& strTopic, const std::vector<unsigned char>& vPayload);
+    void PublishBlock(const std::string& strTopic, const CDiskBlockPos& pos, const uint256& hash);
+    bool Bind(PubEndpoint& endpoint);
+
+    const size_t nMaxQueue;
+    std::list<PubEndpoint> lEndpoints;
+    std::set<std::string> setPublished;
+
+    struct event_base* base;
+    struct event* evWake;
+    boost::thread* threadPublish;
+    std::set<PubSubscriber*> setSubscribers;
+
+    /** Messages waiting for the publisher thread */
+    CCriticalSection cs;
+    std::deque<PubMessage> queue;
+    size_t nQueuedBytes;
+    std::map<std::string, uint32_t> mapSequence;
+};
+
+static CNotificationPublisher* notificationPublisher = NULL;
+
+/** Hashes are published in the byte order they are displayed in */
+static std::vector<unsigned char> HashPayload(const uint256& hash)
+{
+    std::vector<unsigned char> vPayload(hash.begin(), hash.end());
+    std::reverse(vPayload.begin(), vPayload.end());
+    return vPayload;
+}
+
+static std::string SerializeMessage(const std::string& strTopic, const std::vector<unsigned char>& vPayload, uint32_t nSequence)
+{
+    CDataStream ssMessage(SER_NETWORK, PROTOCOL_VERSION);
+    ssMessage << strTopic << vPayload << nSequence;
+    return std::string(ssMessage.begin(), ssMessage.end());
+}
+
+static void pubnotify_wake_cb(evutil_socket_t, short, void* ctx)
+{
+    static_cast<CNotificationPublisher*>(ctx)->SendQueued();
+}
+
+static void pubnotify_accept_cb(struct evconnlistener*, evutil_socket_t fd, struct sockaddr*, int, void* ctx)
+{
+    const PubEndpoint* endpoint = static_cast<const PubEndpoint*>(ctx);
+    endpoint->publisher->Accept(endpoint, fd);
+}
+
+static void pubnotify_read_cb(struct bufferevent* bev, void*)
+{
+    // Subscribers have nothing to say; reading only serves to notice when they go away
+    struct evbuffer* input = bufferevent_get_input(bev);
+    evbuffer_drain(input, evbuffer_get_length(input));
+}
+
+static void pubnotify_event_cb(struct bufferevent*, short events, void* ctx)
+{
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        PubSubscriber* subscriber = static_cast<PubSubscriber*>(ctx);
+        subscriber->publisher->Disconnect(subscriber);
+    }
+}
+
+/** Event loop of the publisher thread */
+static void ThreadPublish(struct event_base* base)
+{
+    RenameThread("bitcoin-pubnotify");
+    LogPrint("pubnotify", "Entering notification publisher event loop\n");
+    event_base_dispatch(base);
+    LogPrint("pubnotify", "Exited notification publisher event loop\n");
+}
+
+CNotificationPublisher::CNotificationPublisher(size_t nMaxQueue) :
+    nMaxQueue(nMaxQueue), base(NULL), evWake(NULL), threadPublish(NULL), nQueuedBytes(0)
+{
+}
+
+CNotificationPublisher::~CNotificationPublisher()
+{
+    Stop();
+}
+
+void CNotificationPublisher::AddTopic(const std::string& strTopic, const std::string& strAddress)
+{
+    std::list<PubEndpoint>::iterator it = lEndpoints.begin();
+    while (it != lEndpoints.end() && it->strAddress != strAddress)
+        it++;
+    if (it == lEndpoints.end())
+        it = lEndpoints.insert(lEndpoints.end(), PubEndpoint(this, strAddress));
+    it->setTopics.insert(strTopic);
+    setPublished.insert(strTopic);
+}
+
+bool CNotificationPublisher::Bind(PubEndpoint& endpoint)
+{
+    const unsigned int flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE;
+    if (boost::starts_with(endpoint.strAddress, "tcp://")) {
+        CService addr;
+        if (!Lookup(endpoint.strAddress.substr(6).c_str(), addr, 0, false) || addr.GetPort() == 0)
+            return error("%s: invalid address %s", __func__, endpoint.strAddress);
+        struct sockaddr_storage sockaddr;
+        socklen_t len = sizeof(sockaddr);
+        if (!addr.GetSockAddr((struct sockaddr*)&sockaddr, &len))
+            return error("%s: invalid address %s", __func__, endpoint.strAddress);
+        endpoint.listener = evconnlistener_new_bind(base, pubnotify_accept_cb, &endpoint, flags, -1, (struct sockaddr*)&sockaddr, len);
+#ifndef WIN32
+    } else if (boost::starts_with(endpoint.strAddress, "unix:")) {
+        std::string strPath = endpoint.strAddress.substr(5);
+        struct sockaddr_un sockaddr;
+        memset(&sockaddr, 0, sizeof(sockaddr));
+        sockaddr.sun_family = AF_UNIX;
+        if (strPath.empty() || strPath.size() >= sizeof(sockaddr.sun_path))
+            return error("%s: invalid socket path in %s", __func__, endpoint.strAddress);
+        strncpy(sockaddr.sun_path, strPath.c_str(), sizeof(sockaddr.sun_path) - 1);
+        // A socket left behind by an unclean shutdown would make bind fail
+        struct stat st;
+        if (stat(strPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+            unlink(strPath.c_str());
+        endpoint.listener = evconnlistener_new_bind(base, pubnotify_accept_cb, &endpoint, flags, -1, (struct sockaddr*)&sockaddr, sizeof(sockaddr));
+        if (endpoint.listener)
+            endpoint.strUnixPath = strPath;
+#endif
+    } else {
+        return error("%s: unsupported address %s", __func__, endpoint.strAddress);
+    }
+    if (!endpoint.listener)
+        return error("%s: unable to listen on %s", __func__, endpoint.strAddress);
+
+    std::vector<std::string> vTopics(endpoint.setTopics.begin(), endpoint.setTopics.end());
+    LogPrintf("Publishing %s on %s\n", boost::algorithm::join(vTopics, ", "), endpoint.strAddress);
+    return true;
+}
+
+bool CNotificationPublisher::Start()
+{
+#ifdef WIN32
+    evthread_use_windows_threads();
+#else
+    evthread_use_pthreads();
+#endif
+    base = event_base_new();
+    if (!base)
+        return error("%s: couldn't create an event_base", __func__);
+    evWake = event_new(base, -1, 0, pubnotify_wake_cb, this);
+    if (!evWake)
+        return error("%s: couldn't create an event", __func__);
+
+    BOOST_FOREACH(PubEndpoint& endpoint, lEndpoints) {
+        if (!Bind(endpoint))
+            return false;
+    }
+
+    threadPublish = new boost::thread(boost::bind(&ThreadPublish, base));
+    return true;
+}
+
+void CNotificationPublisher::Stop()
+{
+    if (threadPublish) {
+        event_base_loopbreak(base);
+        threadPublish->join();
+        delete threadPublish;
+        threadPublish = NULL;
+    }
+    BOOST_FOREACH(PubSubscriber* subscriber, setSubscribers) {
+        bufferevent_free(subscriber->bev);
+        delete subscriber;
+    }
+    setSubscribers.clear();
+    BOOST_FOREACH(PubEndpoint& endpoint, lEndpoints) {
+        if (endpoint.listener) {
+            evconnlistener_free(endpoint.listener);
+            endpoint.listener = NULL;
+        }
+#ifndef WIN32
+        if (!endpoint.strUnixPath.empty()) {
+            unlink(endpoint.strUnixPath.c_str());
+            endpoint.strUnixPath.clear();
+        }
+#endif
+    }
+    if (evWake) {
+        event_free(evWake);
+        evWake = NULL;
+    }
+    if (base) {
+        event_base_free(base);
+        base = NULL;
+    }
+}
+
+void CNotificationPublisher::Accept(const PubEndpoint* endpoint, evutil_socket_t fd)
+{
+    struct bufferevent* bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!bev) {
+        EVUTIL_CLOSESOCKET(fd);
+        return;
+    }
+    PubSubscriber* subscriber = new PubSubscriber();
+    subscriber->publisher = this;
+    subscriber->endpoint = endpoint;
+    subscriber->bev = bev;
+    subscriber->nDropped = 0;
+    bufferevent_setcb(bev, pubnotify_read_cb, NULL, pubnotify_event_cb, subscriber);
+    bufferevent_enable(bev, EV_READ | EV_WRITE);
+    setSubscribers.insert(subscriber);
+    LogPrint("pubnotify", "New subscriber on %s\n", endpoint->strAddress);
+}
+
+void CNotificationPublisher::Disconnect(PubSubscriber* subscriber)
+{
+    LogPrint("pubnotify", "Subscriber on %s disconnected, %u messages were dropped for it\n",
+        subscriber->endpoint->strAddress, subscriber->nDropped);
+    setSubscribers.erase(subscriber);
+    bufferevent_free(subscriber->bev);
+    delete subscriber;
+}
+
+void CNotificationPublisher::SendQueued()
+{
+    std::deque<PubMessage> vSend;
+    {
+        LOCK(cs);
+        vSend.swap(queue);
+        nQueuedBytes = 0;
+    }
+
+    for (size_t i = 0; i < vSend.size(); i++) {
+        const std::string& strTopic = vSend[i].strTopic;
+        std::string& strMessage = vSend[i].strMessage;
+        if (strMessage.empty()) {
+            // A pruned block is skipped; the sequence number shows the gap
+            CBlock block;
+            if (!ReadBlockFromDisk(block, vSend[i].posBlock) || block.GetHash() != vSend[i].hashBlock) {
+                LogPrintf("%s: can't read block %s from disk\n", __func__, vSend[i].hashBlock.ToString());
+                continue;
+            }
+            CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+            ssBlock << block;
+            strMessage = SerializeMessage(strTopic, std::vector<unsigned char>(ssBlock.begin(), ssBlock.end()), vSend[i].nSequence);
+        }
+        BOOST_FOREACH(PubSubscriber* subscriber, setSubscribers) {
+            if (!subscriber->endpoint->setTopics.count(strTopic))
+                continue;
+            // A message is always accepted into an empty queue, however large
+            size_t nPending = evbuffer_get_length(bufferevent_get_output(subscriber->bev));
+            if (nPending > 0 && nPending + strMessage.size() > nMaxQueue) {
+                subscriber->nDropped++;
+                LogPrint("pubnotify", "Send queue of subscriber on %s is full, dropping %s message\n",
+                    subscriber->endpoint->strAddress, strTopic);
+                continue;
+            }
+            bufferevent_write(subscriber->bev, strMessage.data(), strMessage.size());
+        }
+    }
+}
+
+void CNotificationPublisher::Publish(const std::string& strTopic, const std::vector<unsigned char>& vPayload)
+{
+    LOCK(cs);
+    // The sequence number also counts messages that are dropped here, so
+    // that every subscriber sees the gap
+    PubMessage message;
+    message.strTopic = strTopic;
+    message.strMessage = SerializeMessage(strTopic, vPayload, mapSequence[strTopic]++);
+    if (nQueuedBytes > 0 && nQueuedBytes + message.strMessage.size() > nMaxQueue) {
+        LogPrint("pubnotify", "Publisher queue is full, dropping %s message\n", strTopic);
+        return;
+    }
+    nQueuedBytes += message.strMessage.size();
+    queue.push_back(message);
+    event_active(evWake, 0, 0);
+}
+
+void CNotificationPublisher::PublishBlock(const std::string& strTopic, const CDiskBlockPos& pos, const uint256& hash)
+{
+    LOCK(cs);
+    // Counted by the size of its hash until it is read; the subscriber
+    // send queues still bound the memory used for the block itself
+    PubMessage message;
+    message.strTopic = strTopic;
+    message.posBlock = pos;
+    message.hashBlock = hash;
+    message.nSequence = mapSequence[strTopic]++;
+    if (nQueuedBytes > 0 && nQueuedBytes + hash.size() > nMaxQueue) {
+        LogPrint("pubnotify", "Publisher queue is full, dropping %s message\n", strTopic);
+        return;
+    }
+    nQueuedBytes += hash.size();
+    queue.push_back(message);
+    event_active(evWake, 0, 0);
+}
+
+void CNotificationPublisher::UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork)
+{
+    // Every block the new tip connected, oldest first
+    std::vector<const CBlockIndex*> vConnected;
+    for (const CBlockIndex* pindex = pindexNew; pindex && pindex != pindexFork; pindex = pindex->pprev)
+        vConnected.push_back(pindex);
+
+    BOOST_REVERSE_FOREACH(const CBlockIndex* pindex, vConnected) {
+        if (IsPublished("hashblock"))
+            Publish("hashblock", HashPayload(pindex->GetBlockHash()));
+        if (IsPublished("rawblock")) {
+            // Read on the publisher thread, not while we hold up validation
+            CDiskBlockPos pos;
+            {
+                LOCK(cs_main);
+                pos = pindex->GetBlockPos();
+            }
+            PublishBlock("rawblock", pos, pindex->GetBlockHash());
+        }
+    }
+}
+
+void CNotificationPublisher::SyncTransaction(const CTransaction &tx, const CBlock *pblock)
+{
+    if (IsPublished("hashtx"))
+        Publish("hashtx", HashPayload(tx.GetHash()));
+    if (IsPublished("rawtx")) {
+        CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+        ssTx << tx;
+        Publish("rawtx", std::vector<unsigned char>(ssTx.begin(), ssTx.end()));
+    }
+}
+
+bool StartNotificationPublisher()
+{
+    static const char* const pszTopics[] = {"hashblock", "hashtx", "rawblock", "rawtx"};
+
+    size_t nMaxQueue = std::max(GetArg("-pubmaxqueue", DEFAULT_PUBNOTIFY_MAXQUEUE), (int64_t)1) * 1000;
+    CNotificationPublisher* publisher = new CNotificationPublisher(nMaxQueue);
+    bool fAny = false;
+    for (unsigned int i = 0; i < sizeof(pszTopics) / sizeof(pszTopics[0]); i++) {
+        std::string strArg = std::string("-pub") + pszTopics[i];
+        if (mapArgs.count(strArg)) {
+            publisher->AddTopic(pszTopics[i], mapArgs[strArg]);
+            fAny = true;
+        }
+    }
+    if (!fAny) {
+        delete publisher;
+        return true;
+    }
+    if (!publisher->Start()) {
+        delete publisher;
+        return false;
+    }
+
+    RegisterValidationInterface(publisher);
+    notificationPublisher = publisher;
+    return true;
+}
+
+void StopNotificationPublisher()
+{
+    if (notificationPublisher) {
+        UnregisterValidationInterface(notificationPublisher);
+        delete notificationPublisher;
+        notificationPublisher = NULL;
+    }
+}
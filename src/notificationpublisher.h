@@ -0,0 +1,33 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_NOTIFICATIONPUBLISHER_H
+#define BITCOIN_NOTIFICATIONPUBLISHER_H
+
+/** Default for -pubmaxqueue, the per-subscriber send queue limit in kilobytes */
+static const unsigned int DEFAULT_PUBNOTIFY_MAXQUEUE = 8192;
+
+/**
+ * Publishing of new blocks and transactions to local subscribers.
+ *
+ * Each of the -pubhashblock, -pubhashtx, -pubrawblock and -pubrawtx options
+ * names an address ("tcp://host:port" or "unix:/path") at which that topic
+ * is published; topics may share an address. Subscribers connect and only
+ * read. Every message is the serialized topic string, the serialized payload
+ * and a 4-byte little-endian sequence number that counts the messages of
+ * that topic, so that a subscriber can tell when it missed some.
+ *
+ * Validation only queues notifications. A thread of the publisher's own
+ * sends them, and drops messages for a subscriber whose send queue is over
+ * -pubmaxqueue rather than let it hold up validation.
+ */
+
+/** Bind the addresses given by the -pub* options and start publishing.
+ * Does nothing if none are set. Returns false if an address cannot be used.
+ */
+bool StartNotificationPublisher();
+/** Stop publishing and disconnect all subscribers */
+void StopNotificationPublisher();
+
+#endif // BITCOIN_NOTIFICATIONPUBLISHER_H
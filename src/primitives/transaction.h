@@ -11,6 +11,8 @@
 #include "serialize.h"
 #include "uint256.h"
 
+#include <boost/shared_ptr.hpp>
+
 /** An outpoint - a combination of a transaction hash and an index n into its vout */
 class COutPoint
 {
@@ -181,6 +183,7 @@ class CTransaction
 private:
     /** Memory only. */
     const uint256 hash;
+    const unsigned int nTotalSize;
     void UpdateHash() const;
 
 public:
@@ -225,6 +228,11 @@ public:
         return hash;
     }
 
+    /** Serialized size, cached together with the hash. */
+    unsigned int GetTotalSize() const {
+        return nTotalSize;
+    }
+
     // Return sum of txouts.
     CAmount GetValueOut() const;
     // GetValueIn() is a method on CCoinsViewCache, because
@@ -282,4 +290,14 @@ struct CMutableTransaction
     uint256 GetHash() const;
 };
 
+/**
+ * Immutable, reference-counted transaction. A transaction received from the
+ * network is allocated once and then shared between the mempool, the relay
+ * map, blocks and the validation interface instead of being copied.
+ */
+typedef boost::shared_ptr<const CTransaction> CTransactionRef;
+
+static inline CTransactionRef MakeTransactionRef() { return CTransactionRef(new CTransaction()); }
+template <typename Tx> static inline CTransactionRef MakeTransactionRef(const Tx& txIn) { return CTransactionRef(new CTransaction(txIn)); }
+
 #endif // BITCOIN_PRIMITIVES_TRANSACTION_H
@@ -14,6 +14,7 @@
 
 class ClientModel;
 class PlatformStyle;
+class RPCTimerInterface;
 
 namespace Ui {
     class RPCConsole;
@@ -103,6 +104,7 @@ private:
 
     Ui::RPCConsole *ui;
     ClientModel *clientModel;
+    RPCTimerInterface *rpcTimerInterface;
     QStringList history;
     int historyPtr;
     NodeId cachedNodeid;
@@ -4,24 +4,71 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "chain.h"
+#include "consensus/consensus.h"
+#include "crypto/common.h"
+#include "hash.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "main.h"
+#include "httpserver.h"
+#include "httprpc.h"
 #include "rpcserver.h"
 #include "streams.h"
 #include "sync.h"
 #include "txmempool.h"
+#include "util.h"
 #include "utilstrencodings.h"
 #include "version.h"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/dynamic_bitset.hpp>
+#include <boost/scoped_ptr.hpp>
 
 #include "univalue/univalue.h"
 
 using namespace std;
 
 static const size_t MAX_GETUTXOS_OUTPOINTS = 15; //allow a max of 15 outpoints to be queried at once
+static const size_t MAX_GETUTXOS_BATCH_OUTPOINTS = 100000; //unless they are posted in binary or hex
+static const unsigned int BLOCKRANGE_READAHEAD_SIZE = 0x800000; // 8 MiB read ahead of each block file being streamed
+static const size_t BLOCKRANGE_CHUNK_SIZE = 0x100000; // send block ranges in chunks of about 1 MiB
+static const size_t BLOCKRANGE_MAX_PENDING = 0x800000; // stop reading while 8 MiB are waiting to be sent
+static const int BLOCKRANGE_MAX_COUNT_UNTHROTTLED = 8; // blocks per range when we cannot wait for the client
+
+/** Block range exports in progress. Each holds a worker thread for as long as
+ * its client takes to read it, so only half of -rpcthreads may be used by them.
+ */
+static CCriticalSection cs_blockRangeExports;
+static int nBlockRangeExports = 0; //!< protected by cs_blockRangeExports
+
+/** Claim one of the block range export slots for the lifetime of this object */
+class CBlockRangeExportSlot
+{
+private:
+    bool fAcquired;
+
+public:
+    CBlockRangeExportSlot() : fAcquired(false) {}
+
+    bool Acquire()
+    {
+        int nMaxExports = std::max((int)GetArg("-rpcthreads", DEFAULT_HTTP_THREADS) / 2, 1);
+        LOCK(cs_blockRangeExports);
+        if (nBlockRangeExports >= nMaxExports)
+            return false;
+        nBlockRangeExports++;
+        fAcquired = true;
+        return true;
+    }
+
+    ~CBlockRangeExportSlot()
+    {
+        if (fAcquired) {
+            LOCK(cs_blockRangeExports);
+            nBlockRangeExports--;
+        }
+    }
+};
 
 enum RetFormat {
     RF_UNDEF,
@@ -64,7 +111,7 @@ public:
 };
 
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry);
-extern UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false);
+extern void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails, CJSONStream& out);
 extern void ScriptPubKeyToJSON(const CScript& scriptPubKey, UniValue& out, bool fIncludeHex);
 extern UniValue blockheaderToJSON(const CBlockIndex* blockindex);
 
@@ -113,11 +160,7 @@ static bool ParseHashStr(const string& strReq, uint256& v)
     return true;
 }
 
-static bool rest_headers(AcceptedConnection* conn,
-                         const std::string& strURIPart,
-                         const std::string& strRequest,
-                         const std::map<std::string, std::string>& mapHeaders,
-                         bool fRun)
+static bool rest_headers(HTTPRequest* req, const std::string& strURIPart)
 {
     vector<string> params;
     const RetFormat rf = ParseDataFormat(params, strURIPart);
@@ -158,13 +201,15 @@ static bool rest_headers(AcceptedConnection* conn,
     switch (rf) {
     case RF_BINARY: {
         string binaryHeader = ssHeader.str();
-        conn->stream() << HTTPReplyHeader(HTTP_OK, fRun, binaryHeader.size(), "application/octet-stream") << binaryHeader << std::flush;
+        req->WriteHeader("Content-Type", "application/octet-stream");
+        req->WriteReply(HTTP_OK, binaryHeader);
         return true;
     }
 
     case RF_HEX: {
         string strHex = HexStr(ssHeader.begin(), ssHeader.end()) + "\n";
-        conn->stream() << HTTPReply(HTTP_OK, strHex, fRun, false, "text/plain") << std::flush;
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(HTTP_OK, strHex);
         return true;
     }
 
@@ -174,7 +219,8 @@ static bool rest_headers(AcceptedConnection* conn,
             jsonHeaders.push_back(blockheaderToJSON(pindex));
         }
         string strJSON = jsonHeaders.write() + "\n";
-        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
         return true;
     }
 
@@ -187,11 +233,8 @@ static bool rest_headers(AcceptedConnection* conn,
     return true; // continue to process further HTTP reqs on this cxn
 }
 
-static bool rest_block(AcceptedConnection* conn,
+static bool rest_block(HTTPRequest* req,
                        const std::string& strURIPart,
-                       const std::string& strRequest,
-                       const std::map<std::string, std::string>& mapHeaders,
-                       bool fRun,
                        bool showTxDetails)
 {
     vector<string> params;
@@ -223,20 +266,23 @@ static bool rest_block(AcceptedConnection* conn,
     switch (rf) {
     case RF_BINARY: {
         string binaryBlock = ssBlock.str();
-        conn->stream() << HTTPReplyHeader(HTTP_OK, fRun, binaryBlock.size(), "application/octet-stream") << binaryBlock << std::flush;
+        req->WriteHeader("Content-Type", "application/octet-stream");
+        req->WriteReply(HTTP_OK, binaryBlock);
         return true;
     }
 
     case RF_HEX: {
         string strHex = HexStr(ssBlock.begin(), ssBlock.end()) + "\n";
-        conn->stream() << HTTPReply(HTTP_OK, strHex, fRun, false, "text/plain") << std::flush;
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(HTTP_OK, strHex);
         return true;
     }
 
     case RF_JSON: {
-        UniValue objBlock = blockToJSON(block, pblockindex, showTxDetails);
-        string strJSON = objBlock.write() + "\n";
-        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        HTTPJSONStream stream(req);
+        blockToJSON(block, pblockindex, showTxDetails, stream);
+        stream.Write("\n");
+        stream.Finish();
         return true;
     }
 
@@ -249,29 +295,222 @@ static bool rest_block(AcceptedConnection* conn,
     return true; // continue to process further HTTP reqs on this cxn
 }
 
-static bool rest_block_extended(AcceptedConnection* conn,
-                       const std::string& strURIPart,
-                       const std::string& strRequest,
-                       const std::map<std::string, std::string>& mapHeaders,
-                       bool fRun)
+static bool rest_block_extended(HTTPRequest* req, const std::string& strURIPart)
 {
-    return rest_block(conn, strURIPart, strRequest, mapHeaders, fRun, true);
+    return rest_block(req, strURIPart, true);
 }
 
-static bool rest_block_notxdetails(AcceptedConnection* conn,
-                       const std::string& strURIPart,
-                       const std::string& strRequest,
-                       const std::map<std::string, std::string>& mapHeaders,
-                       bool fRun)
+static bool rest_block_notxdetails(HTTPRequest* req, const std::string& strURIPart)
+{
+    return rest_block(req, strURIPart, false);
+}
+
+/**
+ * Reader for the records that block and undo files consist of (message start,
+ * 4-byte size, data). Keeps the current file open, and has the OS read ahead
+ * of the position being read, as ranges of blocks are mostly stored in order.
+ */
+class CDiskRecordReader
+{
+private:
+    FILE* (*openFile)(const CDiskBlockPos&, bool);
+    FILE* file;
+    int nFile;
+    unsigned int nReadAheadBegin;
+    unsigned int nReadAheadEnd;
+
+public:
+    CDiskRecordReader(FILE* (*openFileIn)(const CDiskBlockPos&, bool)) : openFile(openFileIn), file(NULL), nFile(-1), nReadAheadBegin(0), nReadAheadEnd(0) {}
+    ~CDiskRecordReader()
+    {
+        if (file)
+            fclose(file);
+    }
+
+    /** Append the data of the record at pos, and the nTrailer bytes that follow it, to str */
+    bool Read(const CDiskBlockPos& pos, unsigned int nTrailer, string& str, unsigned int& nSizeRet)
+    {
+        if (pos.nFile != nFile) {
+            if (file)
+                fclose(file);
+            file = openFile(CDiskBlockPos(pos.nFile, 0), true);
+            nFile = pos.nFile;
+            nReadAheadBegin = nReadAheadEnd = 0;
+        }
+        if (!file || pos.nPos < 4)
+            return false;
+        if (pos.nPos < nReadAheadBegin || pos.nPos + BLOCKRANGE_READAHEAD_SIZE / 2 > nReadAheadEnd) {
+            nReadAheadBegin = pos.nPos - 4;
+            nReadAheadEnd = nReadAheadBegin + BLOCKRANGE_READAHEAD_SIZE;
+            FileReadAhead(file, nReadAheadBegin, BLOCKRANGE_READAHEAD_SIZE);
+        }
+
+        unsigned char size[4];
+        if (fseek(file, pos.nPos - 4, SEEK_SET) != 0 || fread(size, 1, sizeof(size), file) != sizeof(size))
+            return false;
+        nSizeRet = ReadLE32(size);
+        if (nSizeRet > MAX_SIZE)
+            return false;
+        size_t nOffset = str.size();
+        str.resize(nOffset + nSizeRet + nTrailer);
+        if (fread(&str[nOffset], 1, nSizeRet + nTrailer, file) != nSizeRet + nTrailer) {
+            str.resize(nOffset);
+            return false;
+        }
+        return true;
+    }
+};
+
+/** Where a block of a requested range, and its undo data, are stored */
+struct CBlockRangeEntry {
+    int nHeight;
+    uint256 hash;
+    uint256 hashPrev;
+    CDiskBlockPos blockPos;
+    CDiskBlockPos undoPos;
+};
+
+/** Append a block, preceded by its size, to str. The data is copied as it is
+ * stored, only the hash of its header is checked. */
+static bool AppendRawBlock(CDiskRecordReader& reader, const CBlockRangeEntry& entry, string& str)
+{
+    size_t nOffset = str.size();
+    str.resize(nOffset + 4);
+    unsigned int nSize;
+    if (!reader.Read(entry.blockPos, 0, str, nSize) || nSize < 80) {
+        str.resize(nOffset);
+        return error("%s: cannot read block %s at %s", __func__, entry.hash.ToString(), entry.blockPos.ToString());
+    }
+    if (Hash(str.begin() + nOffset + 4, str.begin() + nOffset + 4 + 80) != entry.hash) {
+        str.resize(nOffset);
+        return error("%s: hash mismatch for block %s at %s", __func__, entry.hash.ToString(), entry.blockPos.ToString());
+    }
+    WriteLE32((unsigned char*)&str[nOffset], nSize);
+    return true;
+}
+
+/** Append the undo data of a block, preceded by its size, to str. The
+ * checksum that follows the data on disk is verified and left out. */
+static bool AppendRawUndo(CDiskRecordReader& reader, const CBlockRangeEntry& entry, string& str)
+{
+    size_t nOffset = str.size();
+    str.resize(nOffset + 4);
+    unsigned int nSize = 0;
+    if (!entry.undoPos.IsNull()) {
+        uint256 hashChecksum;
+        if (!reader.Read(entry.undoPos, hashChecksum.size(), str, nSize)) {
+            str.resize(nOffset);
+            return error("%s: cannot read undo data of block %s at %s", __func__, entry.hash.ToString(), entry.undoPos.ToString());
+        }
+        memcpy(hashChecksum.begin(), &str[str.size() - hashChecksum.size()], hashChecksum.size());
+        str.resize(str.size() - hashChecksum.size());
+
+        CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+        hasher << entry.hashPrev;
+        hasher.write(&str[nOffset + 4], nSize);
+        if (hasher.GetHash() != hashChecksum) {
+            str.resize(nOffset);
+            return error("%s: checksum mismatch for undo data of block %s", __func__, entry.hash.ToString());
+        }
+    }
+    WriteLE32((unsigned char*)&str[nOffset], nSize);
+    return true;
+}
+
+static bool rest_blockrange(HTTPRequest* req, const std::string& strURIPart, bool fUndo)
+{
+    vector<string> params;
+    const RetFormat rf = ParseDataFormat(params, strURIPart);
+    vector<string> path;
+    boost::split(path, params[0], boost::is_any_of("/"));
+
+    if (path.size() != 2)
+        throw RESTERR(HTTP_BAD_REQUEST, "No block count specified. Use /rest/blockrange/<height>/<count>.<ext>.");
+
+    int32_t nStart, nCount;
+    if (!ParseInt32(path[0], &nStart) || nStart < 0)
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid height: " + path[0]);
+    if (!ParseInt32(path[1], &nCount) || nCount < 1)
+        throw RESTERR(HTTP_BAD_REQUEST, "Block count out of range: " + path[1]);
+
+    if (rf != RF_BINARY)
+        throw RESTERR(HTTP_NOT_FOUND, "output format not found (available: .bin)");
+
+    // Without a way to wait for the client, everything it has not read yet
+    // stays buffered, so only short ranges are served
+    if (!HTTPRequest::CanWaitForClient())
+        nCount = std::min(nCount, BLOCKRANGE_MAX_COUNT_UNTHROTTLED);
+
+    CBlockRangeExportSlot slot;
+    if (!slot.Acquire())
+        throw RESTERR(HTTP_SERVICE_UNAVAILABLE, "Too many block range exports in progress, try again later");
+
+    // Note where the blocks are, and read them without holding cs_main. A
+    // range past the tip ends at the tip.
+    std::vector<CBlockRangeEntry> entries;
+    {
+        LOCK(cs_main);
+        if (nStart > chainActive.Height())
+            throw RESTERR(HTTP_NOT_FOUND, "Block height out of range: " + path[0]);
+        int nEnd = nStart + std::min(nCount - 1, chainActive.Height() - nStart);
+        entries.resize(nEnd - nStart + 1);
+        for (int nHeight = nStart; nHeight <= nEnd; nHeight++) {
+            const CBlockIndex* pindex = chainActive[nHeight];
+            if (!(pindex->nStatus & BLOCK_HAVE_DATA) || (fUndo && pindex->pprev && !(pindex->nStatus & BLOCK_HAVE_UNDO)))
+                throw RESTERR(HTTP_NOT_FOUND, strprintf("Block at height %d not available (pruned data)", nHeight));
+            CBlockRangeEntry& entry = entries[nHeight - nStart];
+            entry.nHeight = nHeight;
+            entry.hash = pindex->GetBlockHash();
+            if (pindex->pprev)
+                entry.hashPrev = pindex->pprev->GetBlockHash();
+            entry.blockPos = pindex->GetBlockPos();
+            entry.undoPos = pindex->GetUndoPos();
+        }
+    }
+
+    req->WriteHeader("Content-Type", "application/octet-stream");
+    req->StartChunkedReply(HTTP_OK);
+
+    // Blocks are copied as they are stored, instead of being deserialized
+    // and serialized again. The reply is sent in chunks while the next
+    // blocks are read, but only as fast as the client takes it.
+    CDiskRecordReader blockReader(OpenBlockFile);
+    CDiskRecordReader undoReader(OpenUndoFile);
+    string strChunk;
+    strChunk.reserve(BLOCKRANGE_CHUNK_SIZE + MAX_BLOCK_SIZE);
+    BOOST_FOREACH(const CBlockRangeEntry& entry, entries) {
+        if (!AppendRawBlock(blockReader, entry, strChunk) ||
+            (fUndo && !AppendRawUndo(undoReader, entry, strChunk))) {
+            // The status was sent already; close the connection instead
+            LogPrintf("%s: aborting block range reply at height %d\n", __func__, entry.nHeight);
+            req->AbortChunkedReply();
+            return true;
+        }
+        if (strChunk.size() >= BLOCKRANGE_CHUNK_SIZE) {
+            req->WriteReplyChunk(strChunk);
+            strChunk.clear();
+            if (!req->WaitForReplyChunks(BLOCKRANGE_MAX_PENDING)) {
+                LogPrint("http", "%s: client went away at height %d\n", __func__, entry.nHeight);
+                break;
+            }
+        }
+    }
+    req->WriteReplyChunk(strChunk);
+    req->EndChunkedReply();
+    return true;
+}
+
+static bool rest_blockrange_blocks(HTTPRequest* req, const std::string& strURIPart)
+{
+    return rest_blockrange(req, strURIPart, false);
+}
+
+static bool rest_blockrange_undo(HTTPRequest* req, const std::string& strURIPart)
 {
-    return rest_block(conn, strURIPart, strRequest, mapHeaders, fRun, false);
+    return rest_blockrange(req, strURIPart, true);
 }
 
-static bool rest_chaininfo(AcceptedConnection* conn,
-                           const std::string& strURIPart,
-                           const std::string& strRequest,
-                           const std::map<std::string, std::string>& mapHeaders,
-                           bool fRun)
+static bool rest_chaininfo(HTTPRequest* req, const std::string& strURIPart)
 {
     vector<string> params;
     const RetFormat rf = ParseDataFormat(params, strURIPart);
@@ -281,7 +520,8 @@ static bool rest_chaininfo(AcceptedConnection* conn,
         UniValue rpcParams(UniValue::VARR);
         UniValue chainInfoObject = getblockchaininfo(rpcParams, false);
         string strJSON = chainInfoObject.write() + "\n";
-        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
         return true;
     }
     default: {
@@ -293,11 +533,7 @@ static bool rest_chaininfo(AcceptedConnection* conn,
     return true; // continue to process further HTTP reqs on this cxn
 }
 
-static bool rest_tx(AcceptedConnection* conn,
-                    const std::string& strURIPart,
-                    const std::string& strRequest,
-                    const std::map<std::string, std::string>& mapHeaders,
-                    bool fRun)
+static bool rest_tx(HTTPRequest* req, const std::string& strURIPart)
 {
     vector<string> params;
     const RetFormat rf = ParseDataFormat(params, strURIPart);
@@ -318,13 +554,15 @@ static bool rest_tx(AcceptedConnection* conn,
     switch (rf) {
     case RF_BINARY: {
         string binaryTx = ssTx.str();
-        conn->stream() << HTTPReplyHeader(HTTP_OK, fRun, binaryTx.size(), "application/octet-stream") << binaryTx << std::flush;
+        req->WriteHeader("Content-Type", "application/octet-stream");
+        req->WriteReply(HTTP_OK, binaryTx);
         return true;
     }
 
     case RF_HEX: {
         string strHex = HexStr(ssTx.begin(), ssTx.end()) + "\n";
-        conn->stream() << HTTPReply(HTTP_OK, strHex, fRun, false, "text/plain") << std::flush;
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(HTTP_OK, strHex);
         return true;
     }
 
@@ -332,7 +570,8 @@ static bool rest_tx(AcceptedConnection* conn,
         UniValue objTx(UniValue::VOBJ);
         TxToJSON(tx, hashBlock, objTx);
         string strJSON = objTx.write() + "\n";
-        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
         return true;
     }
 
@@ -345,11 +584,86 @@ static bool rest_tx(AcceptedConnection* conn,
     return true; // continue to process further HTTP reqs on this cxn
 }
 
-static bool rest_getutxos(AcceptedConnection* conn,
-                          const std::string& strURIPart,
-                          const std::string& strRequest,
-                          const std::map<std::string, std::string>& mapHeaders,
-                          bool fRun)
+/** Fill coin with output n of coins, if it is unspent */
+static bool GetUTXOCoin(const CCoins& coins, uint32_t n, CCoin& coin)
+{
+    if (!coins.IsAvailable(n))
+        return false;
+    // Safe to index into vout here because IsAvailable checked if it's off the end of the array, or if
+    // n is valid but points to an already spent output (IsNull).
+    coin.nTxVer = coins.nVersion;
+    coin.nHeight = coins.nHeight;
+    coin.out = coins.vout.at(n);
+    assert(!coin.out.IsNull());
+    return true;
+}
+
+struct CompareOutPointHash
+{
+    const vector<COutPoint>& vOutPoints;
+    CompareOutPointHash(const vector<COutPoint>& vOutPointsIn) : vOutPoints(vOutPointsIn) {}
+    bool operator()(size_t a, size_t b) const { return vOutPoints[a].hash < vOutPoints[b].hash; }
+};
+
+/**
+ * Look up outpoints in the UTXO set, and optionally in the mempool, as of one
+ * chain tip. cs_main is only held to look at the coins cache and the mempool,
+ * and to take a snapshot of the coins database. The outpoints that were not
+ * cached are read from the snapshot afterwards, in key order, while
+ * validation goes on.
+ */
+static void GetUTXOs(const vector<COutPoint>& vOutPoints, bool fCheckMemPool,
+                     boost::dynamic_bitset<unsigned char>& hits, vector<CCoin>& outs,
+                     int& nHeightRet, uint256& hashTipRet)
+{
+    vector<CCoin> found(vOutPoints.size());
+    vector<size_t> vUncached;
+    boost::scoped_ptr<CCoinsView> snapshot;
+    {
+        LOCK2(cs_main, mempool.cs);
+        nHeightRet = chainActive.Height();
+        hashTipRet = chainActive.Tip()->GetBlockHash();
+        snapshot.reset(pcoinsTip->CreateSnapshot());
+
+        for (size_t i = 0; i < vOutPoints.size(); i++) {
+            const COutPoint& outpoint = vOutPoints[i];
+            CCoins coins;
+            CTransactionRef ptx;
+            if (fCheckMemPool && (ptx = mempool.get(outpoint.hash))) {
+                coins = CCoins(*ptx, MEMPOOL_HEIGHT);
+            } else if (!pcoinsTip->GetCachedCoins(outpoint.hash, coins)) {
+                if (snapshot) {
+                    if (!fCheckMemPool || !mempool.mapNextTx.count(outpoint))
+                        vUncached.push_back(i);
+                    continue;
+                }
+                if (!pcoinsTip->GetCoins(outpoint.hash, coins))
+                    continue;
+            }
+            if (fCheckMemPool)
+                mempool.pruneSpent(outpoint.hash, coins);
+            hits[i] = GetUTXOCoin(coins, outpoint.n, found[i]);
+        }
+    }
+
+    // Outputs of the same transaction share a database entry
+    std::sort(vUncached.begin(), vUncached.end(), CompareOutPointHash(vOutPoints));
+    CCoins coins;
+    bool fHaveCoins = false;
+    for (size_t j = 0; j < vUncached.size(); j++) {
+        const COutPoint& outpoint = vOutPoints[vUncached[j]];
+        if (j == 0 || outpoint.hash != vOutPoints[vUncached[j - 1]].hash)
+            fHaveCoins = snapshot->GetCoins(outpoint.hash, coins);
+        if (fHaveCoins)
+            hits[vUncached[j]] = GetUTXOCoin(coins, outpoint.n, found[vUncached[j]]);
+    }
+
+    for (size_t i = 0; i < vOutPoints.size(); i++)
+        if (hits[i])
+            outs.push_back(found[i]);
+}
+
+static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
 {
     vector<string> params;
     enum RetFormat rf = ParseDataFormat(params, strURIPart);
@@ -362,6 +676,7 @@ static bool rest_getutxos(AcceptedConnection* conn,
     }
 
     // throw exception in case of a empty request
+    std::string strRequest = req->ReadBody();
     if (strRequest.length() == 0 && uriParts.size() == 0)
         throw RESTERR(HTTP_INTERNAL_SERVER_ERROR, "Error: empty request");
 
@@ -416,8 +731,7 @@ static bool rest_getutxos(AcceptedConnection* conn,
                 if (fInputParsed) //don't allow sending input over URI and HTTP RAW DATA
                     throw RESTERR(HTTP_INTERNAL_SERVER_ERROR, "Combination of URI scheme inputs and raw post data is not allowed");
 
-                CDataStream oss(SER_NETWORK, PROTOCOL_VERSION);
-                oss << strRequestMutable;
+                CDataStream oss(strRequestMutable.data(), strRequestMutable.data() + strRequestMutable.size(), SER_NETWORK, PROTOCOL_VERSION);
                 oss >> fCheckMemPool;
                 oss >> vOutPoints;
             }
@@ -438,47 +752,22 @@ static bool rest_getutxos(AcceptedConnection* conn,
     }
     }
 
-    // limit max outpoints
-    if (vOutPoints.size() > MAX_GETUTXOS_OUTPOINTS)
-        throw RESTERR(HTTP_INTERNAL_SERVER_ERROR, strprintf("Error: max outpoints exceeded (max: %d, tried: %d)", MAX_GETUTXOS_OUTPOINTS, vOutPoints.size()));
+    // limit max outpoints; larger batches have to be posted in binary or hex
+    size_t nMaxOutPoints = fInputParsed ? MAX_GETUTXOS_OUTPOINTS : MAX_GETUTXOS_BATCH_OUTPOINTS;
+    if (vOutPoints.size() > nMaxOutPoints)
+        throw RESTERR(HTTP_INTERNAL_SERVER_ERROR, strprintf("Error: max outpoints exceeded (max: %d, tried: %d)", nMaxOutPoints, vOutPoints.size()));
 
     // check spentness and form a bitmap (as well as a JSON capable human-readable string representation)
     vector<unsigned char> bitmap;
     vector<CCoin> outs;
-    std::string bitmapStringRepresentation;
     boost::dynamic_bitset<unsigned char> hits(vOutPoints.size());
-    {
-        LOCK2(cs_main, mempool.cs);
-
-        CCoinsView viewDummy;
-        CCoinsViewCache view(&viewDummy);
-
-        CCoinsViewCache& viewChain = *pcoinsTip;
-        CCoinsViewMemPool viewMempool(&viewChain, mempool);
-
-        if (fCheckMemPool)
-            view.SetBackend(viewMempool); // switch cache backend to db+mempool in case user likes to query mempool
-
-        for (size_t i = 0; i < vOutPoints.size(); i++) {
-            CCoins coins;
-            uint256 hash = vOutPoints[i].hash;
-            if (view.GetCoins(hash, coins)) {
-                mempool.pruneSpent(hash, coins);
-                if (coins.IsAvailable(vOutPoints[i].n)) {
-                    hits[i] = true;
-                    // Safe to index into vout here because IsAvailable checked if it's off the end of the array, or if
-                    // n is valid but points to an already spent output (IsNull).
-                    CCoin coin;
-                    coin.nTxVer = coins.nVersion;
-                    coin.nHeight = coins.nHeight;
-                    coin.out = coins.vout.at(vOutPoints[i].n);
-                    assert(!coin.out.IsNull());
-                    outs.push_back(coin);
-                }
-            }
-
-            bitmapStringRepresentation.append(hits[i] ? "1" : "0"); // form a binary string representation (human-readable for json output)
-        }
+    int nHeight;
+    uint256 hashTip;
+    try {
+        GetUTXOs(vOutPoints, fCheckMemPool, hits, outs, nHeight, hashTip);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+        throw RESTERR(HTTP_INTERNAL_SERVER_ERROR, "Error reading the UTXO set");
     }
     boost::to_block_range(hits, std::back_inserter(bitmap));
 
@@ -487,19 +776,21 @@ static bool rest_getutxos(AcceptedConnection* conn,
         // serialize data
         // use exact same output as mentioned in Bip64
         CDataStream ssGetUTXOResponse(SER_NETWORK, PROTOCOL_VERSION);
-        ssGetUTXOResponse << chainActive.Height() << chainActive.Tip()->GetBlockHash() << bitmap << outs;
+        ssGetUTXOResponse << nHeight << hashTip << bitmap << outs;
         string ssGetUTXOResponseString = ssGetUTXOResponse.str();
 
-        conn->stream() << HTTPReplyHeader(HTTP_OK, fRun, ssGetUTXOResponseString.size(), "application/octet-stream") << ssGetUTXOResponseString << std::flush;
+        req->WriteHeader("Content-Type", "application/octet-stream");
+        req->WriteReply(HTTP_OK, ssGetUTXOResponseString);
         return true;
     }
 
     case RF_HEX: {
         CDataStream ssGetUTXOResponse(SER_NETWORK, PROTOCOL_VERSION);
-        ssGetUTXOResponse << chainActive.Height() << chainActive.Tip()->GetBlockHash() << bitmap << outs;
+        ssGetUTXOResponse << nHeight << hashTip << bitmap << outs;
         string strHex = HexStr(ssGetUTXOResponse.begin(), ssGetUTXOResponse.end()) + "\n";
 
-        conn->stream() << HTTPReply(HTTP_OK, strHex, fRun, false, "text/plain") << std::flush;
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(HTTP_OK, strHex);
         return true;
     }
 
@@ -508,8 +799,11 @@ static bool rest_getutxos(AcceptedConnection* conn,
 
         // pack in some essentials
         // use more or less the same output as mentioned in Bip64
-        objGetUTXOResponse.push_back(Pair("chainHeight", chainActive.Height()));
-        objGetUTXOResponse.push_back(Pair("chaintipHash", chainActive.Tip()->GetBlockHash().GetHex()));
+        std::string bitmapStringRepresentation;
+        for (size_t i = 0; i < vOutPoints.size(); i++)
+            bitmapStringRepresentation.append(hits[i] ? "1" : "0"); // form a binary string representation (human-readable for json output)
+        objGetUTXOResponse.push_back(Pair("chainHeight", nHeight));
+        objGetUTXOResponse.push_back(Pair("chaintipHash", hashTip.GetHex()));
         objGetUTXOResponse.push_back(Pair("bitmap", bitmapStringRepresentation));
 
         UniValue utxos(UniValue::VARR);
@@ -529,7 +823,8 @@ static bool rest_getutxos(AcceptedConnection* conn,
 
         // return json string
         string strJSON = objGetUTXOResponse.write() + "\n";
-        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
         return true;
     }
     default: {
@@ -543,43 +838,54 @@ static bool rest_getutxos(AcceptedConnection* conn,
 
 static const struct {
     const char* prefix;
-    bool (*handler)(AcceptedConnection* conn,
-                    const std::string& strURIPart,
-                    const std::string& strRequest,
-                    const std::map<std::string, std::string>& mapHeaders,
-                    bool fRun);
+    bool (*handler)(HTTPRequest* req, const std::string& strURIPart);
 } uri_prefixes[] = {
       {"/rest/tx/", rest_tx},
       {"/rest/block/notxdetails/", rest_block_notxdetails},
       {"/rest/block/", rest_block_extended},
+      {"/rest/blockrange/undo/", rest_blockrange_undo},
+      {"/rest/blockrange/", rest_blockrange_blocks},
       {"/rest/chaininfo", rest_chaininfo},
       {"/rest/headers/", rest_headers},
       {"/rest/getutxos", rest_getutxos},
 };
 
-bool HTTPReq_REST(AcceptedConnection* conn,
-                  const std::string& strURI,
-                  const string& strRequest,
-                  const std::map<std::string, std::string>& mapHeaders,
-                  bool fRun)
+static bool HTTPReq_REST(HTTPRequest* req, const std::string&)
 {
     try {
         std::string statusmessage;
         if (RPCIsInWarmup(&statusmessage))
             throw RESTERR(HTTP_SERVICE_UNAVAILABLE, "Service temporarily unavailable: " + statusmessage);
 
+        const std::string strURI = req->GetURI();
         for (unsigned int i = 0; i < ARRAYLEN(uri_prefixes); i++) {
             unsigned int plen = strlen(uri_prefixes[i].prefix);
             if (strURI.substr(0, plen) == uri_prefixes[i].prefix) {
                 string strURIPart = strURI.substr(plen);
-                return uri_prefixes[i].handler(conn, strURIPart, strRequest, mapHeaders, fRun);
+                return uri_prefixes[i].handler(req, strURIPart);
             }
         }
     } catch (const RestErr& re) {
-        conn->stream() << HTTPReply(re.status, re.message + "\r\n", false, false, "text/plain") << std::flush;
+        req->WriteHeader("Content-Type", "text/plain");
+        req->WriteReply(re.status, re.message + "\r\n");
         return false;
     }
 
-    conn->stream() << HTTPError(HTTP_NOT_FOUND, false) << std::flush;
+    req->WriteReply(HTTP_NOT_FOUND);
     return false;
 }
+
+bool StartREST()
+{
+    RegisterHTTPHandler("/rest/", false, HTTPReq_REST);
+    return true;
+}
+
+void InterruptREST()
+{
+}
+
+void StopREST()
+{
+    UnregisterHTTPHandler("/rest/", false);
+}
@@ -18,6 +18,7 @@
 #include "util.h"
 #include "utilstrencodings.h"
 
+#include <limits>
 #include <stdint.h>
 
 #include "univalue/univalue.h"
@@ -84,7 +85,8 @@ UniValue blockheaderToJSON(const CBlockIndex* blockindex)
     return result;
 }
 
-UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+/** Fields of blockToJSON that come before the transaction list */
+static UniValue blockToJSONHead(const CBlock& block, const CBlockIndex* blockindex)
 {
     UniValue result(UniValue::VOBJ);
     result.push_back(Pair("hash", block.GetHash().GetHex()));
@@ -97,19 +99,13 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     result.push_back(Pair("height", blockindex->nHeight));
     result.push_back(Pair("version", block.nVersion));
     result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
-    UniValue txs(UniValue::VARR);
-    BOOST_FOREACH(const CTransaction&tx, block.vtx)
-    {
-        if(txDetails)
-        {
-            UniValue objTx(UniValue::VOBJ);
-            TxToJSON(tx, uint256(), objTx);
-            txs.push_back(objTx);
-        }
-        else
-            txs.push_back(tx.GetHash().GetHex());
-    }
-    result.push_back(Pair("tx", txs));
+    return result;
+}
+
+/** Fields of blockToJSON that come after the transaction list */
+static UniValue blockToJSONTail(const CBlock& block, const CBlockIndex* blockindex)
+{
+    UniValue result(UniValue::VOBJ);
     result.push_back(Pair("time", block.GetBlockTime()));
     result.push_back(Pair("nonce", (uint64_t)block.nNonce));
     result.push_back(Pair("bits", strprintf("%08x", block.nBits)));
@@ -124,6 +120,50 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     return result;
 }
 
+static UniValue blockTxToJSON(const CTransaction& tx, bool txDetails)
+{
+    if (!txDetails)
+        return tx.GetHash().GetHex();
+    UniValue objTx(UniValue::VOBJ);
+    TxToJSON(tx, uint256(), objTx);
+    return objTx;
+}
+
+UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false)
+{
+    UniValue result = blockToJSONHead(block, blockindex);
+    UniValue txs(UniValue::VARR);
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx)
+        txs.push_back(blockTxToJSON(*ptx, txDetails));
+    result.push_back(Pair("tx", txs));
+    result.pushKVs(blockToJSONTail(block, blockindex));
+    return result;
+}
+
+/**
+ * Same output as blockToJSON, but only one transaction is held as a UniValue
+ * at a time. Takes cs_main only for the fields that depend on the chain, as
+ * writing to out may wait for the client; the caller must not hold it.
+ */
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails, CJSONStream& out)
+{
+    UniValue head, tail;
+    {
+        LOCK(cs_main);
+        head = blockToJSONHead(block, blockindex);
+        tail = blockToJSONTail(block, blockindex);
+    }
+    out.BeginObject();
+    out.Members(head);
+    out.Key("tx");
+    out.BeginArray();
+    BOOST_FOREACH(const CTransactionRef& ptx, block.vtx)
+        out.Value(blockTxToJSON(*ptx, txDetails));
+    out.EndArray();
+    out.Members(tail);
+    out.EndObject();
+}
+
 UniValue getblockcount(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -137,8 +177,7 @@ UniValue getblockcount(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getblockcount", "")
         );
 
-    LOCK(cs_main);
-    return chainActive.Height();
+    return GetChainTipSummary()->nHeight;
 }
 
 UniValue getbestblockhash(const UniValue& params, bool fHelp)
@@ -154,8 +193,7 @@ UniValue getbestblockhash(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getbestblockhash", "")
         );
 
-    LOCK(cs_main);
-    return chainActive.Tip()->GetBlockHash().GetHex();
+    return GetChainTipSummary()->hashBlock.GetHex();
 }
 
 UniValue getdifficulty(const UniValue& params, bool fHelp)
@@ -171,11 +209,38 @@ UniValue getdifficulty(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getdifficulty", "")
         );
 
-    LOCK(cs_main);
-    return GetDifficulty();
+    CChainTipSummaryRef tip = GetChainTipSummary();
+    return tip->pindex ? GetDifficulty(tip->pindex) : 1.0;
 }
 
 
+static UniValue mempoolEntryToJSON(const CTxMemPoolEntry& e, const CTxMemPoolSnapshot& snapshot, int nHeight)
+{
+    UniValue info(UniValue::VOBJ);
+    info.push_back(Pair("size", (int)e.GetTxSize()));
+    info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
+    info.push_back(Pair("time", e.GetTime()));
+    info.push_back(Pair("height", (int)e.GetHeight()));
+    info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
+    info.push_back(Pair("currentpriority", e.GetPriority(nHeight)));
+    const CTransaction& tx = e.GetTx();
+    set<string> setDepends;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        if (snapshot.exists(txin.prevout.hash))
+            setDepends.insert(txin.prevout.hash.ToString());
+    }
+
+    UniValue depends(UniValue::VARR);
+    BOOST_FOREACH(const string& dep, setDepends)
+    {
+        depends.push_back(dep);
+    }
+
+    info.push_back(Pair("depends", depends));
+    return info;
+}
+
 UniValue getrawmempool(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -208,59 +273,58 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getrawmempool", "true")
         );
 
-    LOCK(cs_main);
-
     bool fVerbose = false;
     if (params.size() > 0)
         fVerbose = params[0].get_bool();
 
+    // Build the response from a snapshot, so neither cs_main nor the
+    // mempool lock is held while it is serialized
+    CTxMemPoolSnapshotRef snapshot = mempool.GetSnapshot();
+
     if (fVerbose)
     {
-        LOCK(mempool.cs);
-        UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
+        int nHeight;
         {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
-            UniValue info(UniValue::VOBJ);
-            info.push_back(Pair("size", (int)e.GetTxSize()));
-            info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
-            info.push_back(Pair("time", e.GetTime()));
-            info.push_back(Pair("height", (int)e.GetHeight()));
-            info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
-            info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
-            const CTransaction& tx = e.GetTx();
-            set<string> setDepends;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                if (mempool.exists(txin.prevout.hash))
-                    setDepends.insert(txin.prevout.hash.ToString());
-            }
-
-            UniValue depends(UniValue::VARR);
-            BOOST_FOREACH(const string& dep, setDepends)
-            {
-                depends.push_back(dep);
-            }
-
-            info.push_back(Pair("depends", depends));
-            o.push_back(Pair(hash.ToString(), info));
+            LOCK(cs_main);
+            nHeight = chainActive.Height();
         }
+        UniValue o(UniValue::VOBJ);
+        BOOST_FOREACH(const CTxMemPoolEntry& e, snapshot->vEntries)
+            o.push_back(Pair(e.GetTx().GetHash().ToString(), mempoolEntryToJSON(e, *snapshot, nHeight)));
         return o;
     }
     else
     {
-        vector<uint256> vtxid;
-        mempool.queryHashes(vtxid);
-
         UniValue a(UniValue::VARR);
-        BOOST_FOREACH(const uint256& hash, vtxid)
-            a.push_back(hash.ToString());
+        BOOST_FOREACH(const CTxMemPoolEntry& e, snapshot->vEntries)
+            a.push_back(e.GetTx().GetHash().ToString());
 
         return a;
     }
 }
 
+/** getrawmempool true, written one entry at a time */
+bool getrawmempool_stream(const UniValue& params, CJSONStream& out)
+{
+    if (params.size() != 1 || !params[0].get_bool())
+        return false;
+
+    CTxMemPoolSnapshotRef snapshot = mempool.GetSnapshot();
+    int nHeight;
+    {
+        LOCK(cs_main);
+        nHeight = chainActive.Height();
+    }
+    out.BeginObject();
+    BOOST_FOREACH(const CTxMemPoolEntry& e, snapshot->vEntries)
+    {
+        out.Key(e.GetTx().GetHash().ToString());
+        out.Value(mempoolEntryToJSON(e, *snapshot, nHeight));
+    }
+    out.EndObject();
+    return true;
+}
+
 UniValue getblockhash(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -342,6 +406,25 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
     return blockheaderToJSON(pblockindex);
 }
 
+/** Look up and read the block with hex hash strHash. Requires cs_main. */
+static CBlockIndex* ReadBlockForRPC(const std::string& strHash, CBlock& block)
+{
+    uint256 hash(uint256S(strHash));
+
+    if (mapBlockIndex.count(hash) == 0)
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+
+    CBlockIndex* pblockindex = mapBlockIndex[hash];
+
+    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+
+    if(!ReadBlockFromDisk(block, pblockindex))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+
+    return pblockindex;
+}
+
 UniValue getblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -380,24 +463,12 @@ UniValue getblock(const UniValue& params, bool fHelp)
 
     LOCK(cs_main);
 
-    std::string strHash = params[0].get_str();
-    uint256 hash(uint256S(strHash));
-
     bool fVerbose = true;
     if (params.size() > 1)
         fVerbose = params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
-
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-
-    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
-
-    if(!ReadBlockFromDisk(block, pblockindex))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    CBlockIndex* pblockindex = ReadBlockForRPC(params[0].get_str(), block);
 
     if (!fVerbose)
     {
@@ -410,6 +481,24 @@ UniValue getblock(const UniValue& params, bool fHelp)
     return blockToJSON(block, pblockindex);
 }
 
+/** getblock with verbose output, written one transaction at a time */
+bool getblock_stream(const UniValue& params, CJSONStream& out)
+{
+    if (params.size() < 1 || params.size() > 2)
+        return false;
+    if (params.size() > 1 && !params[1].get_bool())
+        return false;
+
+    CBlock block;
+    CBlockIndex* pblockindex;
+    {
+        LOCK(cs_main);
+        pblockindex = ReadBlockForRPC(params[0].get_str(), block);
+    }
+    blockToJSON(block, pblockindex, false, out);
+    return true;
+}
+
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -557,10 +646,10 @@ UniValue verifychain(const UniValue& params, bool fHelp)
 }
 
 /** Implementation of IsSuperMajority with better feedback */
-static UniValue SoftForkMajorityDesc(int minVersion, CBlockIndex* pindex, int nRequired, const Consensus::Params& consensusParams)
+static UniValue SoftForkMajorityDesc(int minVersion, const CBlockIndex* pindex, int nRequired, const Consensus::Params& consensusParams)
 {
     int nFound = 0;
-    CBlockIndex* pstart = pindex;
+    const CBlockIndex* pstart = pindex;
     for (int i = 0; i < consensusParams.nMajorityWindow && pstart != NULL; i++)
     {
         if (pstart->nVersion >= minVersion)
@@ -576,7 +665,7 @@ static UniValue SoftForkMajorityDesc(int minVersion, CBlockIndex* pindex, int nR
     return rv;
 }
 
-static UniValue SoftForkDesc(const std::string &name, int version, CBlockIndex* pindex, const Consensus::Params& consensusParams)
+static UniValue SoftForkDesc(const std::string &name, int version, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
 {
     UniValue rv(UniValue::VOBJ);
     rv.push_back(Pair("id", name));
@@ -622,27 +711,29 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getblockchaininfo", "")
         );
 
-    LOCK(cs_main);
+    // Served from the published tip summary so that this does not wait for
+    // block validation; only the prune height below needs cs_main
+    CChainTipSummaryRef tip = GetChainTipSummary();
 
     UniValue obj(UniValue::VOBJ);
     obj.push_back(Pair("chain",                 Params().NetworkIDString()));
-    obj.push_back(Pair("blocks",                (int)chainActive.Height()));
-    obj.push_back(Pair("headers",               pindexBestHeader ? pindexBestHeader->nHeight : -1));
-    obj.push_back(Pair("bestblockhash",         chainActive.Tip()->GetBlockHash().GetHex()));
-    obj.push_back(Pair("difficulty",            (double)GetDifficulty()));
-    obj.push_back(Pair("verificationprogress",  Checkpoints::GuessVerificationProgress(Params().Checkpoints(), chainActive.Tip())));
-    obj.push_back(Pair("chainwork",             chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(Pair("blocks",                tip->nHeight));
+    obj.push_back(Pair("headers",               tip->nHeadersHeight));
+    obj.push_back(Pair("bestblockhash",         tip->hashBlock.GetHex()));
+    obj.push_back(Pair("difficulty",            tip->pindex ? GetDifficulty(tip->pindex) : 1.0));
+    obj.push_back(Pair("verificationprogress",  tip->dVerificationProgress));
+    obj.push_back(Pair("chainwork",             tip->nChainWork.GetHex()));
     obj.push_back(Pair("pruned",                fPruneMode));
 
     const Consensus::Params& consensusParams = Params().GetConsensus();
-    CBlockIndex* tip = chainActive.Tip();
     UniValue softforks(UniValue::VARR);
-    softforks.push_back(SoftForkDesc("bip34", 2, tip, consensusParams));
-    softforks.push_back(SoftForkDesc("bip66", 3, tip, consensusParams));
+    softforks.push_back(SoftForkDesc("bip34", 2, tip->pindex, consensusParams));
+    softforks.push_back(SoftForkDesc("bip66", 3, tip->pindex, consensusParams));
     obj.push_back(Pair("softforks",             softforks));
 
     if (fPruneMode)
     {
+        LOCK(cs_main);
         CBlockIndex *block = chainActive.Tip();
         while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA))
             block = block->pprev;
@@ -768,6 +859,14 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
             "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"admission\": {               (json object) Batched admission of relayed transactions\n"
+            "     \"batches\": xxxxx,          (numeric) Number of batches admitted\n"
+            "     \"transactions\": xxxxx,     (numeric) Number of relayed transactions considered\n"
+            "     \"accepted\": xxxxx,         (numeric) Number of those accepted\n"
+            "     \"busytime\": xxxxx,         (numeric) Milliseconds spent admitting batches\n"
+            "     \"latency_p50\": xxxxx,      (numeric) Median receive-to-decision latency bound in microseconds\n"
+            "     \"latency_p99\": xxxxx       (numeric) 99th percentile receive-to-decision latency bound in microseconds\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -779,6 +878,98 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
     ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
 
+    CTxAdmissionStats stats;
+    GetTxAdmissionStats(stats);
+    UniValue admission(UniValue::VOBJ);
+    admission.push_back(Pair("batches", (uint64_t) stats.nBatches));
+    admission.push_back(Pair("transactions", (uint64_t) stats.nTransactions));
+    admission.push_back(Pair("accepted", (uint64_t) stats.nAccepted));
+    admission.push_back(Pair("busytime", stats.nTimeBusy / 1000));
+    admission.push_back(Pair("latency_p50", stats.latency.GetPercentile(0.5)));
+    admission.push_back(Pair("latency_p99", stats.latency.GetPercentile(0.99)));
+    ret.push_back(Pair("admission", admission));
+
+    return ret;
+}
+
+UniValue getblockconnectstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "getblockconnectstats height ( count )\n"
+            "\nReturns how long connecting blocks of the active chain took, and what it cost.\n"
+            "Only blocks that were connected since startup are reported, and only the last "
+            + strprintf("%u", BLOCK_CONNECT_STATS_SIZE) + " of them.\n"
+            "\nArguments:\n"
+            "1. height         (numeric, required) The height of the first block\n"
+            "2. count          (numeric, optional, default=1) The number of blocks\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"height\": n,              (numeric) The block height\n"
+            "    \"hash\": \"hash\",           (string) The block hash\n"
+            "    \"connecttime\": ttt,       (numeric) When the block was connected, in seconds since epoch\n"
+            "    \"txs\": n,                 (numeric) The number of transactions\n"
+            "    \"inputs\": n,              (numeric) The number of inputs, not counting the coinbase\n"
+            "    \"times\": {                (json object) Microseconds spent in each phase\n"
+            "      \"load\": n,              (numeric) Reading the block from disk\n"
+            "      \"connect\": n,           (numeric) Checking and applying its transactions\n"
+            "      \"utxofetch\": n,         (numeric) Part of connect spent fetching the spent outputs\n"
+            "      \"scriptcheckwait\": n,   (numeric) Waiting for the script check threads after connect\n"
+            "      \"index\": n,             (numeric) Writing undo data and the transaction index\n"
+            "      \"callbacks\": n,         (numeric) Notifications\n"
+            "      \"flush\": n,             (numeric) Flushing the changes into the coins cache\n"
+            "      \"chainstate\": n,        (numeric) Writing the chain state to disk, if needed\n"
+            "      \"postconnect\": n,       (numeric) Updating the mempool and wallets\n"
+            "      \"total\": n              (numeric) All of the above\n"
+            "    },\n"
+            "    \"coinscachemisses\": n,    (numeric) Coins that were not in the coins cache and were read from disk\n"
+            "    \"sigcachehits\": n,        (numeric) Signatures found in the signature cache\n"
+            "    \"sigcachemisses\": n       (numeric) Signatures that had to be verified\n"
+            "  },...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockconnectstats", "1000 10")
+            + HelpExampleRpc("getblockconnectstats", "1000, 10")
+        );
+
+    int nHeight = params[0].get_int();
+    int nCount = params.size() > 1 ? params[1].get_int() : 1;
+    if (nHeight < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
+    if (nCount < 1 || nCount > (int)BLOCK_CONNECT_STATS_SIZE)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Count out of range");
+
+    // Heights near the int maximum cannot have been connected, but must not overflow
+    int nEndHeight = nHeight > std::numeric_limits<int>::max() - nCount ? std::numeric_limits<int>::max() : nHeight + nCount;
+    std::vector<CBlockConnectStats> vStats;
+    GetBlockConnectStats(nHeight, nEndHeight, vStats);
+
+    UniValue ret(UniValue::VARR);
+    BOOST_FOREACH(const CBlockConnectStats& stats, vStats) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("height", stats.nHeight));
+        obj.push_back(Pair("hash", stats.hash.GetHex()));
+        obj.push_back(Pair("connecttime", stats.nTimeConnected));
+        obj.push_back(Pair("txs", (int64_t)stats.nTx));
+        obj.push_back(Pair("inputs", (int64_t)stats.nInputs));
+        UniValue times(UniValue::VOBJ);
+        times.push_back(Pair("load", stats.nLoadMicros));
+        times.push_back(Pair("connect", stats.nConnectMicros));
+        times.push_back(Pair("utxofetch", stats.nUTXOFetchMicros));
+        times.push_back(Pair("scriptcheckwait", stats.nScriptCheckWaitMicros));
+        times.push_back(Pair("index", stats.nIndexMicros));
+        times.push_back(Pair("callbacks", stats.nCallbacksMicros));
+        times.push_back(Pair("flush", stats.nFlushMicros));
+        times.push_back(Pair("chainstate", stats.nChainStateMicros));
+        times.push_back(Pair("postconnect", stats.nPostConnectMicros));
+        times.push_back(Pair("total", stats.nTotalMicros));
+        obj.push_back(Pair("times", times));
+        obj.push_back(Pair("coinscachemisses", stats.nCoinsCacheMisses));
+        obj.push_back(Pair("sigcachehits", stats.nSigCacheHits));
+        obj.push_back(Pair("sigcachemisses", stats.nSigCacheMisses));
+        ret.push_back(obj);
+    }
     return ret;
 }
 
@@ -76,6 +76,18 @@ static void CopyNodeStats(std::vector<CNodeStats>& vstats)
     }
 }
 
+static UniValue MessageTrafficToJSON(const msgtrafficmap_t& mapTraffic)
+{
+    UniValue obj(UniValue::VOBJ);
+    for (msgtrafficmap_t::const_iterator it = mapTraffic.begin(); it != mapTraffic.end(); ++it) {
+        UniValue traffic(UniValue::VOBJ);
+        traffic.push_back(Pair("count", it->second.nMessages));
+        traffic.push_back(Pair("bytes", it->second.nBytes));
+        obj.push_back(Pair(it->first, traffic));
+    }
+    return obj;
+}
+
 UniValue getpeerinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -93,6 +105,7 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"lastrecv\": ttt,           (numeric) The time in seconds since epoch (Jan 1 1970 GMT) of the last receive\n"
             "    \"bytessent\": n,            (numeric) The total bytes sent\n"
             "    \"bytesrecv\": n,            (numeric) The total bytes received\n"
+            "    \"invknownbytes\": n,        (numeric) Memory used to track the inventory known to the peer\n"
             "    \"conntime\": ttt,           (numeric) The connection time in seconds since epoch (Jan 1 1970 GMT)\n"
             "    \"timeoffset\": ttt,         (numeric) The time offset in seconds\n"
             "    \"pingtime\": n,             (numeric) ping time\n"
@@ -107,7 +120,18 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"inflight_target\": n,      (numeric) The number of blocks we keep requested from this peer, from its download speed\n"
+            "    \"blockrate\": n,            (numeric) The rate in blocks per second at which this peer delivers requested blocks, or 0 if not known yet\n"
+            "    \"blocks_reassigned\": n,    (numeric) The number of blocks requested from faster peers instead, because this peer was holding back the download\n"
+            "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
+            "    \"sent_per_msg\": {          (json object) The messages sent, by type; unknown types are counted as \"other\"\n"
+            "      \"type\": {\n"
+            "        \"count\": n,            (numeric) The number of messages\n"
+            "        \"bytes\": n             (numeric) Their total size, headers included\n"
+            "      }, ...\n"
+            "    },\n"
+            "    \"recv_per_msg\": {...}      (json object) The messages received, by type, as above\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -136,6 +160,7 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
         obj.push_back(Pair("lastrecv", stats.nLastRecv));
         obj.push_back(Pair("bytessent", stats.nSendBytes));
         obj.push_back(Pair("bytesrecv", stats.nRecvBytes));
+        obj.push_back(Pair("invknownbytes", (uint64_t)stats.nInvKnownBytes));
         obj.push_back(Pair("conntime", stats.nTimeConnected));
         obj.push_back(Pair("timeoffset", stats.nTimeOffset));
         obj.push_back(Pair("pingtime", stats.dPingTime));
@@ -157,8 +182,13 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("inflight_target", statestats.nBlocksInTransitTarget));
+            obj.push_back(Pair("blockrate", statestats.dBlockDownloadRate));
+            obj.push_back(Pair("blocks_reassigned", statestats.nBlocksReassigned));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        obj.push_back(Pair("sent_per_msg", MessageTrafficToJSON(stats.mapSendTraffic)));
+        obj.push_back(Pair("recv_per_msg", MessageTrafficToJSON(stats.mapRecvTraffic)));
 
         ret.push_back(obj);
     }
@@ -365,7 +395,27 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"uploadtarget\": {\n"
+            "    \"timeframe\": n,                         (numeric) Length of the measuring timeframe in seconds\n"
+            "    \"target\": n,                            (numeric) Target in bytes\n"
+            "    \"target_reached\": true|false,           (boolean) True if target is reached\n"
+            "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
+            "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
+            "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "  },\n"
+            "  \"recvbuffers\": {       (json object) Buffers that larger received messages are read into\n"
+            "    \"reused\": n,         (numeric) Number of messages received into a buffer from the pool\n"
+            "    \"allocated\": n,      (numeric) Number of messages that needed a new buffer\n"
+            "    \"pooledbytes\": n     (numeric) Capacity of the buffers currently pooled for reuse\n"
+            "  },\n"
+            "  \"sent_per_msg\": {      (json object) The messages sent to all peers since startup, by type\n"
+            "    \"type\": {\n"
+            "      \"count\": n,        (numeric) The number of messages\n"
+            "      \"bytes\": n         (numeric) Their total size, headers included\n"
+            "    }, ...\n"
+            "  },\n"
+            "  \"recv_per_msg\": {...}  (json object) The messages received from all peers since startup, by type, as above\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getnettotals", "")
@@ -376,9 +426,92 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    UniValue outboundLimit(UniValue::VOBJ);
+    outboundLimit.push_back(Pair("timeframe", CNode::GetMaxOutboundTimeframe()));
+    outboundLimit.push_back(Pair("target", CNode::GetMaxOutboundTarget()));
+    outboundLimit.push_back(Pair("target_reached", CNode::OutboundTargetReached(false)));
+    outboundLimit.push_back(Pair("serve_historical_blocks", !CNode::OutboundTargetReached(true)));
+    outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
+    outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
+    obj.push_back(Pair("uploadtarget", outboundLimit));
+
+    uint64_t nReused, nAllocated;
+    size_t nPooledBytes;
+    recvBufferPool.GetStats(nReused, nAllocated, nPooledBytes);
+    UniValue recvBuffers(UniValue::VOBJ);
+    recvBuffers.push_back(Pair("reused", nReused));
+    recvBuffers.push_back(Pair("allocated", nAllocated));
+    recvBuffers.push_back(Pair("pooledbytes", (uint64_t)nPooledBytes));
+    obj.push_back(Pair("recvbuffers", recvBuffers));
+
+    msgtrafficmap_t mapSent, mapRecv;
+    GetTotalMessageTraffic(mapSent, mapRecv);
+    obj.push_back(Pair("sent_per_msg", MessageTrafficToJSON(mapSent)));
+    obj.push_back(Pair("recv_per_msg", MessageTrafficToJSON(mapRecv)));
     return obj;
 }
 
+static UniValue LatencyHistogramToJSON(const CLatencyHistogram& histogram)
+{
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("p50", histogram.GetPercentile(0.5)));
+    obj.push_back(Pair("p90", histogram.GetPercentile(0.9)));
+    obj.push_back(Pair("p99", histogram.GetPercentile(0.99)));
+    obj.push_back(Pair("max", histogram.GetMax()));
+    obj.push_back(Pair("total", histogram.GetTotal()));
+    // Counts per bucket, up to the last non-empty one
+    UniValue buckets(UniValue::VARR);
+    unsigned int nBuckets = CLatencyHistogram::BUCKETS;
+    while (nBuckets > 0 && histogram.GetBucket(nBuckets - 1) == 0)
+        nBuckets--;
+    for (unsigned int i = 0; i < nBuckets; i++)
+        buckets.push_back((uint64_t)histogram.GetBucket(i));
+    obj.push_back(Pair("histogram", buckets));
+    return obj;
+}
+
+UniValue getmessagelatency(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getmessagelatency\n"
+            "\nReturns how long messages from peers waited to be handled, and how long handling them took, by message type.\n"
+            "Times are in microseconds. Percentiles are upper bounds taken from power-of-two histograms.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"command\": {         (string) The message type, or \"other\" for unknown ones\n"
+            "    \"count\": n,        (numeric) The number of messages handled\n"
+            "    \"queued\": {        (json object) Time from receipt until handling started\n"
+            "      \"p50\": n,        (numeric) Median\n"
+            "      \"p90\": n,        (numeric) 90th percentile\n"
+            "      \"p99\": n,        (numeric) 99th percentile\n"
+            "      \"max\": n,        (numeric) Maximum\n"
+            "      \"total\": n,      (numeric) Sum over all messages\n"
+            "      \"histogram\": [n,...] (array) Message counts; entry i counts times below 2^i, and at least 2^(i-1)\n"
+            "    },\n"
+            "    \"handled\": {...}   (json object) Time spent handling the message, as above\n"
+            "  }, ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmessagelatency", "")
+            + HelpExampleRpc("getmessagelatency", "")
+       );
+
+    std::map<std::string, CMessageLatencyStats> mapStats;
+    GetMessageLatencyStats(mapStats);
+
+    UniValue ret(UniValue::VOBJ);
+    for (std::map<std::string, CMessageLatencyStats>::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("count", (uint64_t)it->second.handled.GetCount()));
+        obj.push_back(Pair("queued", LatencyHistogramToJSON(it->second.queued)));
+        obj.push_back(Pair("handled", LatencyHistogramToJSON(it->second.handled)));
+        ret.push_back(Pair(it->first, obj));
+    }
+    return ret;
+}
+
 static UniValue GetNetworksInfo()
 {
     UniValue networks(UniValue::VARR);
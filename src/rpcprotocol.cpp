@@ -204,6 +204,48 @@ int ReadHTTPHeaders(std::basic_istream<char>& stream, map<string, string>& mapHe
 }
 
 
+/** Append nLen bytes from stream to strMessage; returns false if the connection was lost */
+static bool ReadHTTPBytes(std::basic_istream<char>& stream, size_t nLen, string& strMessage)
+{
+    vector<char> vch;
+    size_t ptr = 0;
+    while (ptr < nLen)
+    {
+        size_t bytes_to_read = std::min(nLen - ptr, POST_READ_SIZE);
+        vch.resize(ptr + bytes_to_read);
+        stream.read(&vch[ptr], bytes_to_read);
+        if (!stream) // Connection lost while reading
+            return false;
+        ptr += bytes_to_read;
+    }
+    strMessage.append(vch.begin(), vch.end());
+    return true;
+}
+
+/** Read a body sent with "Transfer-Encoding: chunked", as large replies are */
+static bool ReadHTTPChunkedBody(std::basic_istream<char>& stream, string& strMessage, size_t max_size)
+{
+    while (true)
+    {
+        string str;
+        if (!std::getline(stream, str))
+            return false;
+        // Chunk size in hex, optionally followed by ";extension"
+        unsigned long nChunk = strtoul(str.c_str(), NULL, 16);
+        if (nChunk == 0)
+            break;
+        if (nChunk > max_size - strMessage.size())
+            return false;
+        if (!ReadHTTPBytes(stream, nChunk, strMessage))
+            return false;
+        std::getline(stream, str); // CRLF after the chunk data
+    }
+    // Skip trailer
+    map<string, string> mapTrailer;
+    ReadHTTPHeaders(stream, mapTrailer);
+    return !stream.fail();
+}
+
 int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
                     string>& mapHeadersRet, string& strMessageRet,
                     int nProto, size_t max_size)
@@ -217,20 +259,15 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
         return HTTP_INTERNAL_SERVER_ERROR;
 
     // Read message
-    if (nLen > 0)
+    if (boost::icontains(mapHeadersRet["transfer-encoding"], "chunked"))
     {
-        vector<char> vch;
-        size_t ptr = 0;
-        while (ptr < (size_t)nLen)
-        {
-            size_t bytes_to_read = std::min((size_t)nLen - ptr, POST_READ_SIZE);
-            vch.resize(ptr + bytes_to_read);
-            stream.read(&vch[ptr], bytes_to_read);
-            if (!stream) // Connection lost while reading
-                return HTTP_INTERNAL_SERVER_ERROR;
-            ptr += bytes_to_read;
-        }
-        strMessageRet = string(vch.begin(), vch.end());
+        if (!ReadHTTPChunkedBody(stream, strMessageRet, max_size))
+            return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    else if (nLen > 0)
+    {
+        if (!ReadHTTPBytes(stream, nLen, strMessageRet))
+            return HTTP_INTERNAL_SERVER_ERROR;
     }
 
     string sConHdr = mapHeadersRet["connection"];
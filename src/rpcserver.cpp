@@ -7,6 +7,7 @@
 
 #include "base58.h"
 #include "init.h"
+#include "metrics.h"
 #include "random.h"
 #include "sync.h"
 #include "ui_interface.h"
@@ -16,39 +17,28 @@
 #include "wallet/wallet.h"
 #endif
 
-#include <boost/algorithm/string.hpp>
-#include <boost/asio.hpp>
-#include <boost/asio/ssl.hpp>
+#include <boost/algorithm/string/case_conv.hpp> // for to_upper()
 #include <boost/bind.hpp>
-#include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
-#include <boost/iostreams/concepts.hpp>
-#include <boost/iostreams/stream.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <boost/thread.hpp>
 
 #include "univalue/univalue.h"
 
-using namespace boost::asio;
 using namespace RPCServer;
 using namespace std;
 
-static std::string strRPCUserColonPass;
-
 static bool fRPCRunning = false;
 static bool fRPCInWarmup = true;
 static std::string rpcWarmupStatus("RPC server started");
 static CCriticalSection cs_rpcWarmup;
 
-//! These are created by StartRPCThreads, destroyed in StopRPCThreads
-static boost::asio::io_service* rpc_io_service = NULL;
-static map<string, boost::shared_ptr<deadline_timer> > deadlineTimers;
-static ssl::context* rpc_ssl_context = NULL;
-static boost::thread_group* rpc_worker_group = NULL;
-static boost::asio::io_service::work *rpc_dummy_work = NULL;
-static std::vector<CSubNet> rpc_allow_subnets; //!< List of subnets to allow RPC connections from
-static std::vector< boost::shared_ptr<ip::tcp::acceptor> > rpc_acceptors;
+/* Timer-creating functions */
+static RPCTimerInterface* timerInterface = NULL;
+/* Map of name to timer.
+ * @note Can be changed to std::unique_ptr when C++11 */
+static std::map<std::string, boost::shared_ptr<RPCTimerBase> > deadlineTimers;
 
 static struct CRPCSignals
 {
@@ -267,125 +257,162 @@ UniValue stop(const UniValue& params, bool fHelp)
  * Call Table
  */
 static const CRPCCommand vRPCCommands[] =
-{ //  category              name                      actor (function)         okSafeMode
-  //  --------------------- ------------------------  -----------------------  ----------
+{ //  category              name                      actor (function)         okSafeMode okParallel
+  //  --------------------- ------------------------  -----------------------  ---------- ----------
     /* Overall control/query calls */
-    { "control",            "getinfo",                &getinfo,                true  }, /* uses wallet if enabled */
-    { "control",            "help",                   &help,                   true  },
-    { "control",            "stop",                   &stop,                   true  },
+    { "control",            "getinfo",                &getinfo,                true,  true  }, /* uses wallet if enabled */
+    { "control",            "help",                   &help,                   true,  true  },
+    { "control",            "stop",                   &stop,                   true,  false },
 
     /* P2P networking */
-    { "network",            "getnetworkinfo",         &getnetworkinfo,         true  },
-    { "network",            "addnode",                &addnode,                true  },
-    { "network",            "disconnectnode",         &disconnectnode,         true  },
-    { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true  },
-    { "network",            "getconnectioncount",     &getconnectioncount,     true  },
-    { "network",            "getnettotals",           &getnettotals,           true  },
-    { "network",            "getpeerinfo",            &getpeerinfo,            true  },
-    { "network",            "ping",                   &ping,                   true  },
-    { "network",            "setban",                 &setban,                 true  },
-    { "network",            "listbanned",             &listbanned,             true  },
-    { "network",            "clearbanned",            &clearbanned,            true  },
+    { "network",            "getnetworkinfo",         &getnetworkinfo,         true,  true  },
+    { "network",            "addnode",                &addnode,                true,  false },
+    { "network",            "disconnectnode",         &disconnectnode,         true,  false },
+    { "network",            "getaddednodeinfo",       &getaddednodeinfo,       true,  true  },
+    { "network",            "getconnectioncount",     &getconnectioncount,     true,  true  },
+    { "network",            "getnettotals",           &getnettotals,           true,  true  },
+    { "network",            "getmessagelatency",      &getmessagelatency,      true,  true  },
+    { "network",            "getpeerinfo",            &getpeerinfo,            true,  true  },
+    { "network",            "ping",                   &ping,                   true,  false },
+    { "network",            "setban",                 &setban,                 true,  false },
+    { "network",            "listbanned",             &listbanned,             true,  true  },
+    { "network",            "clearbanned",            &clearbanned,            true,  false },
 
     /* Block chain and UTXO */
-    { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true  },
-    { "blockchain",         "getbestblockhash",       &getbestblockhash,       true  },
-    { "blockchain",         "getblockcount",          &getblockcount,          true  },
-    { "blockchain",         "getblock",               &getblock,               true  },
-    { "blockchain",         "getblockhash",           &getblockhash,           true  },
-    { "blockchain",         "getblockheader",         &getblockheader,         true  },
-    { "blockchain",         "getchaintips",           &getchaintips,           true  },
-    { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
-    { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true  },
-    { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
-    { "blockchain",         "gettxout",               &gettxout,               true  },
-    { "blockchain",         "gettxoutproof",          &gettxoutproof,          true  },
-    { "blockchain",         "verifytxoutproof",       &verifytxoutproof,       true  },
-    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
-    { "blockchain",         "verifychain",            &verifychain,            true  },
+    { "blockchain",         "getblockchaininfo",      &getblockchaininfo,      true,  true  },
+    { "blockchain",         "getbestblockhash",       &getbestblockhash,       true,  true  },
+    { "blockchain",         "getblockcount",          &getblockcount,          true,  true  },
+    { "blockchain",         "getblock",               &getblock,               true,  true  },
+    { "blockchain",         "getblockconnectstats",   &getblockconnectstats,   true,  true  },
+    { "blockchain",         "getblockhash",           &getblockhash,           true,  true  },
+    { "blockchain",         "getblockheader",         &getblockheader,         true,  true  },
+    { "blockchain",         "getchaintips",           &getchaintips,           true,  true  },
+    { "blockchain",         "getdifficulty",          &getdifficulty,          true,  true  },
+    { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true,  true  },
+    { "blockchain",         "getrawmempool",          &getrawmempool,          true,  true  },
+    { "blockchain",         "gettxout",               &gettxout,               true,  true  },
+    { "blockchain",         "gettxoutproof",          &gettxoutproof,          true,  true  },
+    { "blockchain",         "verifytxoutproof",       &verifytxoutproof,       true,  true  },
+    { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true,  false },
+    { "blockchain",         "verifychain",            &verifychain,            true,  false },
 
     /* Mining */
-    { "mining",             "getblocktemplate",       &getblocktemplate,       true  },
-    { "mining",             "getmininginfo",          &getmininginfo,          true  },
-    { "mining",             "getnetworkhashps",       &getnetworkhashps,       true  },
-    { "mining",             "prioritisetransaction",  &prioritisetransaction,  true  },
-    { "mining",             "submitblock",            &submitblock,            true  },
+    { "mining",             "getblocktemplate",       &getblocktemplate,       true,  false },
+    { "mining",             "getmininginfo",          &getmininginfo,          true,  true  },
+    { "mining",             "getnetworkhashps",       &getnetworkhashps,       true,  true  },
+    { "mining",             "prioritisetransaction",  &prioritisetransaction,  true,  false },
+    { "mining",             "submitblock",            &submitblock,            true,  false },
 
     /* Coin generation */
-    { "generating",         "getgenerate",            &getgenerate,            true  },
-    { "generating",         "setgenerate",            &setgenerate,            true  },
-    { "generating",         "generate",               &generate,               true  },
+    { "generating",         "getgenerate",            &getgenerate,            true,  true  },
+    { "generating",         "setgenerate",            &setgenerate,            true,  false },
+    { "generating",         "generate",               &generate,               true,  false },
 
     /* Raw transactions */
-    { "rawtransactions",    "createrawtransaction",   &createrawtransaction,   true  },
-    { "rawtransactions",    "decoderawtransaction",   &decoderawtransaction,   true  },
-    { "rawtransactions",    "decodescript",           &decodescript,           true  },
-    { "rawtransactions",    "getrawtransaction",      &getrawtransaction,      true  },
-    { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     false },
-    { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     false }, /* uses wallet if enabled */
+    { "rawtransactions",    "createrawtransaction",   &createrawtransaction,   true,  true  },
+    { "rawtransactions",    "decoderawtransaction",   &decoderawtransaction,   true,  true  },
+    { "rawtransactions",    "decodescript",           &decodescript,           true,  true  },
+    { "rawtransactions",    "getrawtransaction",      &getrawtransaction,      true,  true  },
+    { "rawtransactions",    "sendrawtransaction",     &sendrawtransaction,     false, false },
+    { "rawtransactions",    "signrawtransaction",     &signrawtransaction,     false, false }, /* uses wallet if enabled */
 #ifdef ENABLE_WALLET
-    { "rawtransactions",    "fundrawtransaction",     &fundrawtransaction,     false },
+    { "rawtransactions",    "fundrawtransaction",     &fundrawtransaction,     false, false },
 #endif
 
     /* Utility functions */
-    { "util",               "createmultisig",         &createmultisig,         true  },
-    { "util",               "validateaddress",        &validateaddress,        true  }, /* uses wallet if enabled */
-    { "util",               "verifymessage",          &verifymessage,          true  },
-    { "util",               "estimatefee",            &estimatefee,            true  },
-    { "util",               "estimatepriority",       &estimatepriority,       true  },
+    { "util",               "createmultisig",         &createmultisig,         true,  true  },
+    { "util",               "validateaddress",        &validateaddress,        true,  true  }, /* uses wallet if enabled */
+    { "util",               "verifymessage",          &verifymessage,          true,  true  },
+    { "util",               "estimatefee",            &estimatefee,            true,  true  },
+    { "util",               "estimatepriority",       &estimatepriority,       true,  true  },
 
     /* Not shown in help */
-    { "hidden",             "invalidateblock",        &invalidateblock,        true  },
-    { "hidden",             "reconsiderblock",        &reconsiderblock,        true  },
-    { "hidden",             "setmocktime",            &setmocktime,            true  },
+    { "hidden",             "invalidateblock",        &invalidateblock,        true,  false },
+    { "hidden",             "reconsiderblock",        &reconsiderblock,        true,  false },
+    { "hidden",             "setmocktime",            &setmocktime,            true,  false },
 #ifdef ENABLE_WALLET
-    { "hidden",             "resendwallettransactions", &resendwallettransactions, true},
+    { "hidden",             "resendwallettransactions", &resendwallettransactions, true,  false },
 #endif
 
 #ifdef ENABLE_WALLET
     /* Wallet */
-    { "wallet",             "addmultisigaddress",     &addmultisigaddress,     true  },
-    { "wallet",             "backupwallet",           &backupwallet,           true  },
-    { "wallet",             "dumpprivkey",            &dumpprivkey,            true  },
-    { "wallet",             "dumpwallet",             &dumpwallet,             true  },
-    { "wallet",             "encryptwallet",          &encryptwallet,          true  },
-    { "wallet",             "getaccountaddress",      &getaccountaddress,      true  },
-    { "wallet",             "getaccount",             &getaccount,             true  },
-    { "wallet",             "getaddressesbyaccount",  &getaddressesbyaccount,  true  },
-    { "wallet",             "getbalance",             &getbalance,             false },
-    { "wallet",             "getnewaddress",          &getnewaddress,          true  },
-    { "wallet",             "getrawchangeaddress",    &getrawchangeaddress,    true  },
-    { "wallet",             "getreceivedbyaccount",   &getreceivedbyaccount,   false },
-    { "wallet",             "getreceivedbyaddress",   &getreceivedbyaddress,   false },
-    { "wallet",             "gettransaction",         &gettransaction,         false },
-    { "wallet",             "getunconfirmedbalance",  &getunconfirmedbalance,  false },
-    { "wallet",             "getwalletinfo",          &getwalletinfo,          false },
-    { "wallet",             "importprivkey",          &importprivkey,          true  },
-    { "wallet",             "importwallet",           &importwallet,           true  },
-    { "wallet",             "importaddress",          &importaddress,          true  },
-    { "wallet",             "keypoolrefill",          &keypoolrefill,          true  },
-    { "wallet",             "listaccounts",           &listaccounts,           false },
-    { "wallet",             "listaddressgroupings",   &listaddressgroupings,   false },
-    { "wallet",             "listlockunspent",        &listlockunspent,        false },
-    { "wallet",             "listreceivedbyaccount",  &listreceivedbyaccount,  false },
-    { "wallet",             "listreceivedbyaddress",  &listreceivedbyaddress,  false },
-    { "wallet",             "listsinceblock",         &listsinceblock,         false },
-    { "wallet",             "listtransactions",       &listtransactions,       false },
-    { "wallet",             "listunspent",            &listunspent,            false },
-    { "wallet",             "lockunspent",            &lockunspent,            true  },
-    { "wallet",             "move",                   &movecmd,                false },
-    { "wallet",             "sendfrom",               &sendfrom,               false },
-    { "wallet",             "sendmany",               &sendmany,               false },
-    { "wallet",             "sendtoaddress",          &sendtoaddress,          false },
-    { "wallet",             "setaccount",             &setaccount,             true  },
-    { "wallet",             "settxfee",               &settxfee,               true  },
-    { "wallet",             "signmessage",            &signmessage,            true  },
-    { "wallet",             "walletlock",             &walletlock,             true  },
-    { "wallet",             "walletpassphrasechange", &walletpassphrasechange, true  },
-    { "wallet",             "walletpassphrase",       &walletpassphrase,       true  },
+    { "wallet",             "addmultisigaddress",     &addmultisigaddress,     true,  false },
+    { "wallet",             "backupwallet",           &backupwallet,           true,  false },
+    { "wallet",             "dumpprivkey",            &dumpprivkey,            true,  false },
+    { "wallet",             "dumpwallet",             &dumpwallet,             true,  false },
+    { "wallet",             "encryptwallet",          &encryptwallet,          true,  false },
+    { "wallet",             "getaccountaddress",      &getaccountaddress,      true,  false },
+    { "wallet",             "getaccount",             &getaccount,             true,  false },
+    { "wallet",             "getaddressesbyaccount",  &getaddressesbyaccount,  true,  false },
+    { "wallet",             "getbalance",             &getbalance,             false, false },
+    { "wallet",             "getnewaddress",          &getnewaddress,          true,  false },
+    { "wallet",             "getrawchangeaddress",    &getrawchangeaddress,    true,  false },
+    { "wallet",             "getreceivedbyaccount",   &getreceivedbyaccount,   false, false },
+    { "wallet",             "getreceivedbyaddress",   &getreceivedbyaddress,   false, false },
+    { "wallet",             "gettransaction",         &gettransaction,         false, false },
+    { "wallet",             "getunconfirmedbalance",  &getunconfirmedbalance,  false, false },
+    { "wallet",             "getwalletinfo",          &getwalletinfo,          false, false },
+    { "wallet",             "importprivkey",          &importprivkey,          true,  false },
+    { "wallet",             "importwallet",           &importwallet,           true,  false },
+    { "wallet",             "importaddress",          &importaddress,          true,  false },
+    { "wallet",             "keypoolrefill",          &keypoolrefill,          true,  false },
+    { "wallet",             "listaccounts",           &listaccounts,           false, false },
+    { "wallet",             "listaddressgroupings",   &listaddressgroupings,   false, false },
+    { "wallet",             "listlockunspent",        &listlockunspent,        false, false },
+    { "wallet",             "listreceivedbyaccount",  &listreceivedbyaccount,  false, false },
+    { "wallet",             "listreceivedbyaddress",  &listreceivedbyaddress,  false, false },
+    { "wallet",             "listsinceblock",         &listsinceblock,         false, false },
+    { "wallet",             "listtransactions",       &listtransactions,       false, false },
+    { "wallet",             "listunspent",            &listunspent,            false, false },
+    { "wallet",             "lockunspent",            &lockunspent,            true,  false },
+    { "wallet",             "move",                   &movecmd,                false, false },
+    { "wallet",             "sendfrom",               &sendfrom,               false, false },
+    { "wallet",             "sendmany",               &sendmany,               false, false },
+    { "wallet",             "sendtoaddress",          &sendtoaddress,          false, false },
+    { "wallet",             "setaccount",             &setaccount,             true,  false },
+    { "wallet",             "settxfee",               &settxfee,               true,  false },
+    { "wallet",             "signmessage",            &signmessage,            true,  false },
+    { "wallet",             "walletlock",             &walletlock,             true,  false },
+    { "wallet",             "walletpassphrasechange", &walletpassphrasechange, true,  false },
+    { "wallet",             "walletpassphrase",       &walletpassphrase,       true,  false },
 #endif // ENABLE_WALLET
 };
 
+/** Methods that can write large results without building them as a UniValue first */
+static const struct {
+    const char* name;
+    rpcstreamfn_type actor;
+} vRPCStreamCommands[] =
+{ //  name                      actor (function)
+  //  ------------------------  -----------------------
+    { "getblock",               &getblock_stream         },
+    { "getrawmempool",          &getrawmempool_stream    },
+};
+
+static std::vector<std::string> GetRPCMethodNames()
+{
+    std::vector<std::string> vNames;
+    for (unsigned int i = 0; i < ARRAYLEN(vRPCCommands); i++)
+        vNames.push_back(vRPCCommands[i].name);
+    return vNames;
+}
+
+static const CMetricFamily<CMetricHistogram> metricRPCTime("bitcoin_rpc_seconds",
+    "Time spent executing RPC calls, by method", "method", GetRPCMethodNames());
+static const CMetricFamily<CMetricCounter> metricRPCErrors("bitcoin_rpc_errors_total",
+    "RPC calls that returned an error, by method", "method", GetRPCMethodNames());
+
+/** Record the duration of a call of a known method, and whether it failed */
+static void RecordRPCCall(const std::string& strMethod, int64_t nTimeStart, bool fError)
+{
+    CMetricHistogram* pmetricTime = metricRPCTime.Find(strMethod);
+    if (pmetricTime)
+        pmetricTime->Observe(GetTimeMicros() - nTimeStart);
+    CMetricCounter* pmetricErrors = fError ? metricRPCErrors.Find(strMethod) : NULL;
+    if (pmetricErrors)
+        pmetricErrors->Inc();
+}
+
 CRPCTable::CRPCTable()
 {
     unsigned int vcidx;
@@ -396,6 +423,8 @@ CRPCTable::CRPCTable()
         pcmd = &vRPCCommands[vcidx];
         mapCommands[pcmd->name] = pcmd;
     }
+    for (vcidx = 0; vcidx < (sizeof(vRPCStreamCommands) / sizeof(vRPCStreamCommands[0])); vcidx++)
+        mapStreamCommands[vRPCStreamCommands[vcidx].name] = vRPCStreamCommands[vcidx].actor;
 }
 
 const CRPCCommand *CRPCTable::operator[](const std::string& name) const
@@ -407,372 +436,26 @@ const CRPCCommand *CRPCTable::operator[](const std::string& name) const
 }
 
 
-bool HTTPAuthorized(map<string, string>& mapHeaders)
-{
-    string strAuth = mapHeaders["authorization"];
-    if (strAuth.substr(0,6) != "Basic ")
-        return false;
-    string strUserPass64 = strAuth.substr(6); boost::trim(strUserPass64);
-    string strUserPass = DecodeBase64(strUserPass64);
-    return TimingResistantEqual(strUserPass, strRPCUserColonPass);
-}
-
-void ErrorReply(std::ostream& stream, const UniValue& objError, const UniValue& id)
-{
-    // Send error reply from json-rpc error object
-    int nStatus = HTTP_INTERNAL_SERVER_ERROR;
-    int code = find_value(objError, "code").get_int();
-    if (code == RPC_INVALID_REQUEST) nStatus = HTTP_BAD_REQUEST;
-    else if (code == RPC_METHOD_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
-    string strReply = JSONRPCReply(NullUniValue, objError, id);
-    stream << HTTPReply(nStatus, strReply, false) << std::flush;
-}
-
-CNetAddr BoostAsioToCNetAddr(boost::asio::ip::address address)
+bool StartRPC()
 {
-    CNetAddr netaddr;
-    // Make sure that IPv4-compatible and IPv4-mapped IPv6 addresses are treated as IPv4 addresses
-    if (address.is_v6()
-     && (address.to_v6().is_v4_compatible()
-      || address.to_v6().is_v4_mapped()))
-        address = address.to_v6().to_v4();
-
-    if(address.is_v4())
-    {
-        boost::asio::ip::address_v4::bytes_type bytes = address.to_v4().to_bytes();
-        netaddr.SetRaw(NET_IPV4, &bytes[0]);
-    }
-    else
-    {
-        boost::asio::ip::address_v6::bytes_type bytes = address.to_v6().to_bytes();
-        netaddr.SetRaw(NET_IPV6, &bytes[0]);
-    }
-    return netaddr;
-}
-
-bool ClientAllowed(const boost::asio::ip::address& address)
-{
-    CNetAddr netaddr = BoostAsioToCNetAddr(address);
-    BOOST_FOREACH(const CSubNet &subnet, rpc_allow_subnets)
-        if (subnet.Match(netaddr))
-            return true;
-    return false;
-}
-
-template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
-{
-public:
-    AcceptedConnectionImpl(
-            boost::asio::io_service& io_service,
-            ssl::context &context,
-            bool fUseSSL) :
-        sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
-        _stream(_d)
-    {
-    }
-
-    virtual std::iostream& stream()
-    {
-        return _stream;
-    }
-
-    virtual std::string peer_address_to_string() const
-    {
-        return peer.address().to_string();
-    }
-
-    virtual void close()
-    {
-        _stream.close();
-    }
-
-    typename Protocol::endpoint peer;
-    boost::asio::ssl::stream<typename Protocol::socket> sslStream;
-
-private:
-    SSLIOStreamDevice<Protocol> _d;
-    boost::iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
-};
-
-void ServiceConnection(AcceptedConnection *conn);
-
-//! Forward declaration required for RPCListen
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
-                             ssl::context& context,
-                             bool fUseSSL,
-                             boost::shared_ptr< AcceptedConnection > conn,
-                             const boost::system::error_code& error);
-
-/**
- * Sets up I/O resources to accept and handle a new connection.
- */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
-                   ssl::context& context,
-                   const bool fUseSSL)
-{
-    // Accept connection
-    boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn(new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL));
-
-    acceptor->async_accept(
-            conn->sslStream.lowest_layer(),
-            conn->peer,
-            boost::bind(&RPCAcceptHandler<Protocol, SocketAcceptorService>,
-                acceptor,
-                boost::ref(context),
-                fUseSSL,
-                conn,
-                _1));
-}
-
-
-/**
- * Accept and handle incoming connection.
- */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
-                             ssl::context& context,
-                             const bool fUseSSL,
-                             boost::shared_ptr< AcceptedConnection > conn,
-                             const boost::system::error_code& error)
-{
-    // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
-    if (error != boost::asio::error::operation_aborted && acceptor->is_open())
-        RPCListen(acceptor, context, fUseSSL);
-
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn.get());
-
-    if (error)
-    {
-        // TODO: Actually handle errors
-        LogPrintf("%s: Error: %s\n", __func__, error.message());
-    }
-    // Restrict callers by IP.  It is important to
-    // do this before starting client thread, to filter out
-    // certain DoS and misbehaving clients.
-    else if (tcp_conn && !ClientAllowed(tcp_conn->peer.address()))
-    {
-        // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
-        if (!fUseSSL)
-            conn->stream() << HTTPError(HTTP_FORBIDDEN, false) << std::flush;
-        conn->close();
-    }
-    else {
-        ServiceConnection(conn.get());
-        conn->close();
-    }
-}
-
-static ip::tcp::endpoint ParseEndpoint(const std::string &strEndpoint, int defaultPort)
-{
-    std::string addr;
-    int port = defaultPort;
-    SplitHostPort(strEndpoint, port, addr);
-    return ip::tcp::endpoint(boost::asio::ip::address::from_string(addr), port);
-}
-
-void StartRPCThreads()
-{
-    rpc_allow_subnets.clear();
-    rpc_allow_subnets.push_back(CSubNet("127.0.0.0/8")); // always allow IPv4 local subnet
-    rpc_allow_subnets.push_back(CSubNet("::1")); // always allow IPv6 localhost
-    if (mapMultiArgs.count("-rpcallowip"))
-    {
-        const vector<string>& vAllow = mapMultiArgs["-rpcallowip"];
-        BOOST_FOREACH(string strAllow, vAllow)
-        {
-            CSubNet subnet(strAllow);
-            if(!subnet.IsValid())
-            {
-                uiInterface.ThreadSafeMessageBox(
-                    strprintf("Invalid -rpcallowip subnet specification: %s. Valid are a single IP (e.g. 1.2.3.4), a network/netmask (e.g. 1.2.3.4/255.255.255.0) or a network/CIDR (e.g. 1.2.3.4/24).", strAllow),
-                    "", CClientUIInterface::MSG_ERROR);
-                StartShutdown();
-                return;
-            }
-            rpc_allow_subnets.push_back(subnet);
-        }
-    }
-    std::string strAllowed;
-    BOOST_FOREACH(const CSubNet &subnet, rpc_allow_subnets)
-        strAllowed += subnet.ToString() + " ";
-    LogPrint("rpc", "Allowing RPC connections from: %s\n", strAllowed);
-
-    if (mapArgs["-rpcpassword"] == "")
-    {
-        LogPrintf("No rpcpassword set - using random cookie authentication\n");
-        if (!GenerateAuthCookie(&strRPCUserColonPass)) {
-            uiInterface.ThreadSafeMessageBox(
-                _("Error: A fatal internal error occured, see debug.log for details"), // Same message as AbortNode
-                "", CClientUIInterface::MSG_ERROR);
-            StartShutdown();
-            return;
-        }
-    } else {
-        strRPCUserColonPass = mapArgs["-rpcuser"] + ":" + mapArgs["-rpcpassword"];
-    }
-
-    assert(rpc_io_service == NULL);
-    rpc_io_service = new boost::asio::io_service();
-    rpc_ssl_context = new ssl::context(*rpc_io_service, ssl::context::sslv23);
-
-    const bool fUseSSL = GetBoolArg("-rpcssl", false);
-
-    if (fUseSSL)
-    {
-        rpc_ssl_context->set_options(ssl::context::no_sslv2 | ssl::context::no_sslv3);
-
-        boost::filesystem::path pathCertFile(GetArg("-rpcsslcertificatechainfile", "server.cert"));
-        if (!pathCertFile.is_complete()) pathCertFile = boost::filesystem::path(GetDataDir()) / pathCertFile;
-        if (boost::filesystem::exists(pathCertFile)) rpc_ssl_context->use_certificate_chain_file(pathCertFile.string());
-        else LogPrintf("ThreadRPCServer ERROR: missing server certificate file %s\n", pathCertFile.string());
-
-        boost::filesystem::path pathPKFile(GetArg("-rpcsslprivatekeyfile", "server.pem"));
-        if (!pathPKFile.is_complete()) pathPKFile = boost::filesystem::path(GetDataDir()) / pathPKFile;
-        if (boost::filesystem::exists(pathPKFile)) rpc_ssl_context->use_private_key_file(pathPKFile.string(), ssl::context::pem);
-        else LogPrintf("ThreadRPCServer ERROR: missing server private key file %s\n", pathPKFile.string());
-
-        string strCiphers = GetArg("-rpcsslciphers", "TLSv1.2+HIGH:TLSv1+HIGH:!SSLv2:!aNULL:!eNULL:!3DES:@STRENGTH");
-        SSL_CTX_set_cipher_list(rpc_ssl_context->impl(), strCiphers.c_str());
-    }
-
-    std::vector<ip::tcp::endpoint> vEndpoints;
-    bool bBindAny = false;
-    int defaultPort = GetArg("-rpcport", BaseParams().RPCPort());
-    if (!mapArgs.count("-rpcallowip")) // Default to loopback if not allowing external IPs
-    {
-        vEndpoints.push_back(ip::tcp::endpoint(boost::asio::ip::address_v6::loopback(), defaultPort));
-        vEndpoints.push_back(ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), defaultPort));
-        if (mapArgs.count("-rpcbind"))
-        {
-            LogPrintf("WARNING: option -rpcbind was ignored because -rpcallowip was not specified, refusing to allow everyone to connect\n");
-        }
-    } else if (mapArgs.count("-rpcbind")) // Specific bind address
-    {
-        BOOST_FOREACH(const std::string &addr, mapMultiArgs["-rpcbind"])
-        {
-            try {
-                vEndpoints.push_back(ParseEndpoint(addr, defaultPort));
-            }
-            catch (const boost::system::system_error&)
-            {
-                uiInterface.ThreadSafeMessageBox(
-                    strprintf(_("Could not parse -rpcbind value %s as network address"), addr),
-                    "", CClientUIInterface::MSG_ERROR);
-                StartShutdown();
-                return;
-            }
-        }
-    } else { // No specific bind address specified, bind to any
-        vEndpoints.push_back(ip::tcp::endpoint(boost::asio::ip::address_v6::any(), defaultPort));
-        vEndpoints.push_back(ip::tcp::endpoint(boost::asio::ip::address_v4::any(), defaultPort));
-        // Prefer making the socket dual IPv6/IPv4 instead of binding
-        // to both addresses seperately.
-        bBindAny = true;
-    }
-
-    bool fListening = false;
-    std::string strerr;
-    std::string straddress;
-    BOOST_FOREACH(const ip::tcp::endpoint &endpoint, vEndpoints)
-    {
-        try {
-            boost::asio::ip::address bindAddress = endpoint.address();
-            straddress = bindAddress.to_string();
-            LogPrintf("Binding RPC on address %s port %i (IPv4+IPv6 bind any: %i)\n", straddress, endpoint.port(), bBindAny);
-            boost::system::error_code v6_only_error;
-            boost::shared_ptr<ip::tcp::acceptor> acceptor(new ip::tcp::acceptor(*rpc_io_service));
-
-            acceptor->open(endpoint.protocol());
-            acceptor->set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
-
-            // Try making the socket dual IPv6/IPv4 when listening on the IPv6 "any" address
-            acceptor->set_option(boost::asio::ip::v6_only(
-                !bBindAny || bindAddress != boost::asio::ip::address_v6::any()), v6_only_error);
-
-            acceptor->bind(endpoint);
-            acceptor->listen(socket_base::max_connections);
-
-            RPCListen(acceptor, *rpc_ssl_context, fUseSSL);
-
-            fListening = true;
-            rpc_acceptors.push_back(acceptor);
-            // If dual IPv6/IPv4 bind successful, skip binding to IPv4 separately
-            if(bBindAny && bindAddress == boost::asio::ip::address_v6::any() && !v6_only_error)
-                break;
-        }
-        catch (const boost::system::system_error& e)
-        {
-            LogPrintf("ERROR: Binding RPC on address %s port %i failed: %s\n", straddress, endpoint.port(), e.what());
-            strerr = strprintf(_("An error occurred while setting up the RPC address %s port %u for listening: %s"), straddress, endpoint.port(), e.what());
-        }
-    }
-
-    if (!fListening) {
-        uiInterface.ThreadSafeMessageBox(strerr, "", CClientUIInterface::MSG_ERROR);
-        StartShutdown();
-        return;
-    }
-
-    rpc_worker_group = new boost::thread_group();
-    for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
-        rpc_worker_group->create_thread(boost::bind(&boost::asio::io_service::run, rpc_io_service));
+    LogPrint("rpc", "Starting RPC\n");
     fRPCRunning = true;
     g_rpcSignals.Started();
+    return true;
 }
 
-void StartDummyRPCThread()
+void InterruptRPC()
 {
-    if(rpc_io_service == NULL)
-    {
-        rpc_io_service = new boost::asio::io_service();
-        /* Create dummy "work" to keep the thread from exiting when no timeouts active,
-         * see http://www.boost.org/doc/libs/1_51_0/doc/html/boost_asio/reference/io_service.html#boost_asio.reference.io_service.stopping_the_io_service_from_running_out_of_work */
-        rpc_dummy_work = new boost::asio::io_service::work(*rpc_io_service);
-        rpc_worker_group = new boost::thread_group();
-        rpc_worker_group->create_thread(boost::bind(&boost::asio::io_service::run, rpc_io_service));
-        fRPCRunning = true;
-    }
+    LogPrint("rpc", "Interrupting RPC\n");
+    // Interrupt e.g. running longpolls
+    fRPCRunning = false;
 }
 
-void StopRPCThreads()
+void StopRPC()
 {
-    if (rpc_io_service == NULL) return;
-    // Set this to false first, so that longpolling loops will exit when woken up
-    fRPCRunning = false;
-
-    // First, cancel all timers and acceptors
-    // This is not done automatically by ->stop(), and in some cases the destructor of
-    // boost::asio::io_service can hang if this is skipped.
-    boost::system::error_code ec;
-    BOOST_FOREACH(const boost::shared_ptr<ip::tcp::acceptor> &acceptor, rpc_acceptors)
-    {
-        acceptor->cancel(ec);
-        if (ec)
-            LogPrintf("%s: Warning: %s when cancelling acceptor\n", __func__, ec.message());
-    }
-    rpc_acceptors.clear();
-    BOOST_FOREACH(const PAIRTYPE(std::string, boost::shared_ptr<deadline_timer>) &timer, deadlineTimers)
-    {
-        timer.second->cancel(ec);
-        if (ec)
-            LogPrintf("%s: Warning: %s when cancelling timer\n", __func__, ec.message());
-    }
+    LogPrint("rpc", "Stopping RPC\n");
     deadlineTimers.clear();
-
-    DeleteAuthCookie();
-
-    rpc_io_service->stop();
     g_rpcSignals.Stopped();
-    if (rpc_worker_group != NULL)
-        rpc_worker_group->join_all();
-    delete rpc_dummy_work; rpc_dummy_work = NULL;
-    delete rpc_worker_group; rpc_worker_group = NULL;
-    delete rpc_ssl_context; rpc_ssl_context = NULL;
-    delete rpc_io_service; rpc_io_service = NULL;
 }
 
 bool IsRPCRunning()
@@ -801,36 +484,6 @@ bool RPCIsInWarmup(std::string *outStatus)
     return fRPCInWarmup;
 }
 
-void RPCRunHandler(const boost::system::error_code& err, boost::function<void(void)> func)
-{
-    if (!err)
-        func();
-}
-
-void RPCRunLater(const std::string& name, boost::function<void(void)> func, int64_t nSeconds)
-{
-    assert(rpc_io_service != NULL);
-
-    if (deadlineTimers.count(name) == 0)
-    {
-        deadlineTimers.insert(make_pair(name,
-                                        boost::shared_ptr<deadline_timer>(new deadline_timer(*rpc_io_service))));
-    }
-    deadlineTimers[name]->expires_from_now(boost::posix_time::seconds(nSeconds));
-    deadlineTimers[name]->async_wait(boost::bind(RPCRunHandler, _1, func));
-}
-
-class JSONRequest
-{
-public:
-    UniValue id;
-    string strMethod;
-    UniValue params;
-
-    JSONRequest() { id = NullUniValue; }
-    void parse(const UniValue& valRequest);
-};
-
 void JSONRequest::parse(const UniValue& valRequest)
 {
     // Parse request
@@ -861,7 +514,6 @@ void JSONRequest::parse(const UniValue& valRequest)
         throw JSONRPCError(RPC_INVALID_REQUEST, "Params must be an array");
 }
 
-
 static UniValue JSONRPCExecOne(const UniValue& req)
 {
     UniValue rpc_result(UniValue::VOBJ);
@@ -886,117 +538,124 @@ static UniValue JSONRPCExecOne(const UniValue& req)
     return rpc_result;
 }
 
-static string JSONRPCExecBatch(const UniValue& vReq)
+/** Whether a batch element may run concurrently with its okParallel neighbours */
+static bool IsParallelRequest(const UniValue& req)
 {
-    UniValue ret(UniValue::VARR);
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
-
-    return ret.write() + "\n";
+    if (!req.isObject())
+        return false;
+    const UniValue& method = find_value(req.get_obj(), "method");
+    if (!method.isStr())
+        return false;
+    const CRPCCommand *pcmd = tableRPC[method.get_str()];
+    return pcmd && pcmd->okParallel;
 }
 
-static bool HTTPReq_JSONRPC(AcceptedConnection *conn,
-                            string& strRequest,
-                            map<string, string>& mapHeaders,
-                            bool fRun)
+/**
+ * Shared state of a batch that is being executed by several threads.
+ * The batch owner publishes a run [nNext, nEnd) of parallel elements; the
+ * owner and any helper tasks claim elements one at a time. Helpers that are
+ * only dequeued after the run has been drained find nothing to claim and
+ * return, so the owner never waits for a task that has not started.
+ */
+class CRPCBatchState
 {
-    // Check authorization
-    if (mapHeaders.count("authorization") == 0)
+public:
+    CRPCBatchState(const UniValue& vReqIn, int64_t nDeadlineIn) :
+        vReq(vReqIn), vReplies(vReqIn.size()), nNext(0), nEnd(0), nRunning(0), nDeadline(nDeadlineIn)
     {
-        conn->stream() << HTTPError(HTTP_UNAUTHORIZED, false) << std::flush;
-        return false;
     }
 
-    if (!HTTPAuthorized(mapHeaders))
+    /** Execute element idx, or answer it with an error if the batch ran out of time */
+    void ExecOne(size_t idx)
     {
-        LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string());
-        /* Deter brute-forcing
-           We don't support exposing the RPC port, so this shouldn't result
-           in a DoS. */
-        MilliSleep(250);
-
-        conn->stream() << HTTPError(HTTP_UNAUTHORIZED, false) << std::flush;
-        return false;
+        if (nDeadline && GetTimeMillis() > nDeadline) {
+            UniValue id;
+            if (vReq[idx].isObject())
+                id = find_value(vReq[idx].get_obj(), "id");
+            vReplies[idx] = JSONRPCReplyObj(NullUniValue, JSONRPCError(RPC_MISC_ERROR, "Batch time limit exceeded"), id);
+        } else {
+            vReplies[idx] = JSONRPCExecOne(vReq[idx]);
+        }
     }
 
-    JSONRequest jreq;
-    try
-    {
-        // Parse request
-        UniValue valRequest;
-        if (!valRequest.read(strRequest))
-            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
-
-        string strReply;
-
-        // singleton request
-        if (valRequest.isObject()) {
-            jreq.parse(valRequest);
-
-            UniValue result = tableRPC.execute(jreq.strMethod, jreq.params);
-
-            // Send reply
-            strReply = JSONRPCReply(result, NullUniValue, jreq.id);
-
-        // array of requests
-        } else if (valRequest.isArray())
-            strReply = JSONRPCExecBatch(valRequest.get_array());
-        else
-            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
-
-        conn->stream() << HTTPReplyHeader(HTTP_OK, fRun, strReply.size()) << strReply << std::flush;
-    }
-    catch (const UniValue& objError)
+    /** Claim and execute elements of the current run until it is drained */
+    void Work()
     {
-        ErrorReply(conn->stream(), objError, jreq.id);
-        return false;
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (nNext < nEnd) {
+            size_t idx = nNext++;
+            nRunning++;
+            lock.unlock();
+            ExecOne(idx);
+            lock.lock();
+            if (--nRunning == 0 && nNext == nEnd)
+                cond.notify_all();
+        }
     }
-    catch (const std::exception& e)
+
+    /** Execute elements [nBegin, nEndIn) with the help of other threads */
+    void RunParallel(size_t nBegin, size_t nEndIn)
     {
-        ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-        return false;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            nNext = nBegin;
+            nEnd = nEndIn;
+        }
+        Work();
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (nRunning > 0)
+            cond.wait(lock);
     }
-    return true;
-}
 
-void ServiceConnection(AcceptedConnection *conn)
-{
-    bool fRun = true;
-    while (fRun && !ShutdownRequested())
-    {
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
+    const UniValue& vReq;
+    std::vector<UniValue> vReplies;
 
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
+private:
+    boost::mutex cs;
+    boost::condition_variable cond;
+    size_t nNext;
+    size_t nEnd;
+    int nRunning;
+    int64_t nDeadline;
+};
 
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto, MAX_SIZE);
+static void RPCBatchHelper(boost::shared_ptr<CRPCBatchState> state)
+{
+    state->Work();
+}
 
-        // HTTP Keep-Alive is false; close connection immediately
-        if ((mapHeaders["connection"] == "close") || (!GetBoolArg("-rpckeepalive", true)))
-            fRun = false;
+std::string JSONRPCExecBatch(const UniValue& vReq, const RPCTaskDispatcher& dispatcher, int nHelpers, int64_t nTimeout)
+{
+    boost::shared_ptr<CRPCBatchState> state(new CRPCBatchState(vReq, nTimeout > 0 ? GetTimeMillis() + nTimeout * 1000 : 0));
 
-        // Process via JSON-RPC API
-        if (strURI == "/") {
-            if (!HTTPReq_JSONRPC(conn, strRequest, mapHeaders, fRun))
+    size_t reqIdx = 0;
+    while (reqIdx < vReq.size()) {
+        size_t runEnd = reqIdx;
+        if (dispatcher && nHelpers > 0)
+            while (runEnd < vReq.size() && IsParallelRequest(vReq[runEnd]))
+                runEnd++;
+        if (runEnd - reqIdx < 2) {
+            state->ExecOne(reqIdx++);
+            continue;
+        }
+        // Helpers left over from an earlier run may pick up this one; that is fine
+        int nDispatch = std::min((size_t)nHelpers, runEnd - reqIdx - 1);
+        for (int i = 0; i < nDispatch; i++)
+            if (!dispatcher(boost::bind(RPCBatchHelper, state)))
                 break;
+        state->RunParallel(reqIdx, runEnd);
+        reqIdx = runEnd;
+    }
 
-        // Process via HTTP REST API
-        } else if (strURI.substr(0, 6) == "/rest/" && GetBoolArg("-rest", false)) {
-            if (!HTTPReq_REST(conn, strURI, strRequest, mapHeaders, fRun))
-                break;
+    UniValue ret(UniValue::VARR);
+    BOOST_FOREACH(const UniValue& reply, state->vReplies)
+        ret.push_back(reply);
 
-        } else {
-            conn->stream() << HTTPError(HTTP_NOT_FOUND, false) << std::flush;
-            break;
-        }
-    }
+    return ret.write() + "\n";
 }
 
-UniValue CRPCTable::execute(const std::string &strMethod, const UniValue &params) const
+/** Find a method for execution, unless the server is still warming up */
+static const CRPCCommand* FindRPCCommand(const std::string &strMethod)
 {
     // Return immediately if in warmup
     {
@@ -1009,20 +668,161 @@ UniValue CRPCTable::execute(const std::string &strMethod, const UniValue &params
     const CRPCCommand *pcmd = tableRPC[strMethod];
     if (!pcmd)
         throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
+    return pcmd;
+}
+
+UniValue CRPCTable::execute(const std::string &strMethod, const UniValue &params) const
+{
+    const CRPCCommand *pcmd = FindRPCCommand(strMethod);
 
     g_rpcSignals.PreCommand(*pcmd);
 
+    int64_t nTimeStart = GetTimeMicros();
+    UniValue result;
     try
     {
         // Execute
-        return pcmd->actor(params, false);
+        result = pcmd->actor(params, false);
     }
     catch (const std::exception& e)
     {
+        RecordRPCCall(strMethod, nTimeStart, true);
+        g_rpcSignals.PostCommand(*pcmd);
         throw JSONRPCError(RPC_MISC_ERROR, e.what());
     }
+    catch (...)
+    {
+        RecordRPCCall(strMethod, nTimeStart, true);
+        g_rpcSignals.PostCommand(*pcmd);
+        throw;
+    }
+    RecordRPCCall(strMethod, nTimeStart, false);
+    g_rpcSignals.PostCommand(*pcmd);
+    return result;
+}
+
+bool CRPCTable::executeStream(const std::string &strMethod, const UniValue &params, CJSONStream& out) const
+{
+    const CRPCCommand *pcmd = FindRPCCommand(strMethod);
+    std::map<std::string, rpcstreamfn_type>::const_iterator it = mapStreamCommands.find(strMethod);
 
+    g_rpcSignals.PreCommand(*pcmd);
+
+    int64_t nTimeStart = GetTimeMicros();
+    bool fStreamed = false;
+    try
+    {
+        if (it != mapStreamCommands.end())
+            fStreamed = (*it->second)(params, out);
+        // The actor's result is complete before anything is written
+        if (!fStreamed)
+            out.Value(pcmd->actor(params, false));
+    }
+    catch (const std::exception& e)
+    {
+        RecordRPCCall(strMethod, nTimeStart, true);
+        g_rpcSignals.PostCommand(*pcmd);
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+    catch (...)
+    {
+        RecordRPCCall(strMethod, nTimeStart, true);
+        g_rpcSignals.PostCommand(*pcmd);
+        throw;
+    }
+    RecordRPCCall(strMethod, nTimeStart, false);
     g_rpcSignals.PostCommand(*pcmd);
+    return fStreamed;
+}
+
+void CJSONStream::Separator()
+{
+    if (fAfterKey) {
+        fAfterKey = false;
+        return;
+    }
+    if (!vEmpty.empty()) {
+        if (!vEmpty.back())
+            Write(",");
+        vEmpty.back() = false;
+    }
+}
+
+void CJSONStream::BeginObject()
+{
+    Separator();
+    Write("{");
+    vEmpty.push_back(true);
+}
+
+void CJSONStream::EndObject()
+{
+    assert(!vEmpty.empty() && !fAfterKey);
+    vEmpty.pop_back();
+    Write("}");
+}
+
+void CJSONStream::BeginArray()
+{
+    Separator();
+    Write("[");
+    vEmpty.push_back(true);
+}
+
+void CJSONStream::EndArray()
+{
+    assert(!vEmpty.empty() && !fAfterKey);
+    vEmpty.pop_back();
+    Write("]");
+}
+
+void CJSONStream::Key(const std::string& key)
+{
+    assert(!vEmpty.empty() && !fAfterKey);
+    Separator();
+    Write(UniValue(key).write() + ":");
+    fAfterKey = true;
+}
+
+void CJSONStream::Value(const UniValue& val)
+{
+    Separator();
+    Write(val.write());
+}
+
+void CJSONStream::Members(const UniValue& obj)
+{
+    const std::vector<std::string>& keys = obj.getKeys();
+    for (unsigned int i = 0; i < keys.size(); i++) {
+        Key(keys[i]);
+        Value(obj[i]);
+    }
+}
+
+void RPCSetTimerInterfaceIfUnset(RPCTimerInterface *iface)
+{
+    if (!timerInterface)
+        timerInterface = iface;
+}
+
+void RPCSetTimerInterface(RPCTimerInterface *iface)
+{
+    timerInterface = iface;
+}
+
+void RPCUnsetTimerInterface(RPCTimerInterface *iface)
+{
+    if (timerInterface == iface)
+        timerInterface = NULL;
+}
+
+void RPCRunLater(const std::string& name, boost::function<void(void)> func, int64_t nSeconds)
+{
+    if (!timerInterface)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "No timer handler registered for RPC");
+    deadlineTimers.erase(name);
+    LogPrint("rpc", "queue run of timer %s in %i seconds (using %s)\n", name, nSeconds, timerInterface->Name());
+    deadlineTimers.insert(std::make_pair(name, boost::shared_ptr<RPCTimerBase>(timerInterface->NewTimer(func, nSeconds*1000))));
 }
 
 std::string HelpExampleCli(const std::string& methodname, const std::string& args)
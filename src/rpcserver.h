@@ -14,6 +14,7 @@
 #include <map>
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #include <boost/function.hpp>
 
@@ -32,26 +33,17 @@ namespace RPCServer
 class CBlockIndex;
 class CNetAddr;
 
-class AcceptedConnection
+class JSONRequest
 {
 public:
-    virtual ~AcceptedConnection() {}
+    UniValue id;
+    std::string strMethod;
+    UniValue params;
 
-    virtual std::iostream& stream() = 0;
-    virtual std::string peer_address_to_string() const = 0;
-    virtual void close() = 0;
+    JSONRequest() { id = NullUniValue; }
+    void parse(const UniValue& valRequest);
 };
 
-/** Start RPC threads */
-void StartRPCThreads();
-/**
- * Alternative to StartRPCThreads for the GUI, when no server is
- * used. The RPC thread in this case is only used to handle timeouts.
- * If real RPC threads have already been started this is a no-op.
- */
-void StartDummyRPCThread();
-/** Stop RPC threads */
-void StopRPCThreads();
 /** Query whether RPC is running */
 bool IsRPCRunning();
 
@@ -81,15 +73,47 @@ void RPCTypeCheck(const UniValue& params,
 void RPCTypeCheckObj(const UniValue& o,
                   const std::map<std::string, UniValue::VType>& typesExpected, bool fAllowNull=false);
 
+/** Opaque base class for timers returned by NewTimerFunc.
+ * This provides no methods at the moment, but makes sure that delete
+ * cleans up the whole state.
+ */
+class RPCTimerBase
+{
+public:
+    virtual ~RPCTimerBase() {}
+};
+
+/**
+ * RPC timer "driver".
+ */
+class RPCTimerInterface
+{
+public:
+    virtual ~RPCTimerInterface() {}
+    /** Implementation name */
+    virtual const char *Name() = 0;
+    /** Factory function for timers.
+     * RPC will call the function to create a timer that will call func in *millis* milliseconds.
+     * @note As the RPC mechanism is backend-neutral, it can use different implementations of timers.
+     * This is needed to cope with the case in which there is no HTTP server, but
+     * only GUI RPC console, and to break the dependency of rpcserver on httprpc.
+     */
+    virtual RPCTimerBase* NewTimer(boost::function<void(void)>& func, int64_t millis) = 0;
+};
+
+/** Set the factory function for timers */
+void RPCSetTimerInterface(RPCTimerInterface *iface);
+/** Set the factory function for timers, but only if unset */
+void RPCSetTimerInterfaceIfUnset(RPCTimerInterface *iface);
+/** Unset factory function for timers */
+void RPCUnsetTimerInterface(RPCTimerInterface *iface);
+
 /**
- * Run func nSeconds from now. Uses boost deadline timers.
+ * Run func nSeconds from now.
  * Overrides previous timer <name> (if any).
  */
 void RPCRunLater(const std::string& name, boost::function<void(void)> func, int64_t nSeconds);
 
-//! Convert boost::asio address to CNetAddr
-extern CNetAddr BoostAsioToCNetAddr(boost::asio::ip::address address);
-
 typedef UniValue(*rpcfn_type)(const UniValue& params, bool fHelp);
 
 class CRPCCommand
@@ -99,8 +123,50 @@ public:
     std::string name;
     rpcfn_type actor;
     bool okSafeMode;
+    bool okParallel; //! Only reads state; may run concurrently with other elements of a batch
 };
 
+/**
+ * Writer for JSON text that is produced piece by piece, so that large
+ * results reach their destination without first being built as one UniValue
+ * tree and one string. Subclasses decide where the text goes.
+ */
+class CJSONStream
+{
+public:
+    CJSONStream() : fAfterKey(false) {}
+    virtual ~CJSONStream() {}
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    /** Write the key of the next member of the current object */
+    void Key(const std::string& key);
+    /** Write a complete value: an array element, or the value after Key */
+    void Value(const UniValue& val);
+    /** Write all members of obj into the current object */
+    void Members(const UniValue& obj);
+
+    /** Append raw JSON text */
+    virtual void Write(const std::string& str) = 0;
+
+private:
+    //! For each open object or array, whether nothing has been written into it yet
+    std::vector<bool> vEmpty;
+    bool fAfterKey;
+
+    void Separator();
+};
+
+/**
+ * Streaming variant of an RPC method. Writes the result to out and returns
+ * true, or returns false without writing anything if it does not handle
+ * these params, in which case the regular actor is used. Errors in params
+ * must be thrown before the first write.
+ */
+typedef bool(*rpcstreamfn_type)(const UniValue& params, CJSONStream& out);
+
 /**
  * Bitcoin RPC command dispatcher.
  */
@@ -108,6 +174,7 @@ class CRPCTable
 {
 private:
     std::map<std::string, const CRPCCommand*> mapCommands;
+    std::map<std::string, rpcstreamfn_type> mapStreamCommands;
 public:
     CRPCTable();
     const CRPCCommand* operator[](const std::string& name) const;
@@ -121,6 +188,15 @@ public:
      * @throws an exception (UniValue) when an error happens.
      */
     UniValue execute(const std::string &method, const UniValue &params) const;
+
+    /**
+     * Execute a method and write its result to out, through the method's
+     * streaming variant if it has one for these params.
+     * @returns whether the streaming variant was used.
+     * @throws an exception (UniValue) when an error happens. If out has
+     * already been written to, its content is incomplete.
+     */
+    bool executeStream(const std::string &method, const UniValue &params, CJSONStream& out) const;
 };
 
 extern const CRPCTable tableRPC;
@@ -154,6 +230,7 @@ extern UniValue addnode(const UniValue& params, bool fHelp);
 extern UniValue disconnectnode(const UniValue& params, bool fHelp);
 extern UniValue getaddednodeinfo(const UniValue& params, bool fHelp);
 extern UniValue getnettotals(const UniValue& params, bool fHelp);
+extern UniValue getmessagelatency(const UniValue& params, bool fHelp);
 extern UniValue setban(const UniValue& params, bool fHelp);
 extern UniValue listbanned(const UniValue& params, bool fHelp);
 extern UniValue clearbanned(const UniValue& params, bool fHelp);
@@ -233,21 +310,37 @@ extern UniValue getdifficulty(const UniValue& params, bool fHelp);
 extern UniValue settxfee(const UniValue& params, bool fHelp);
 extern UniValue getmempoolinfo(const UniValue& params, bool fHelp);
 extern UniValue getrawmempool(const UniValue& params, bool fHelp);
+extern bool getrawmempool_stream(const UniValue& params, CJSONStream& out);
 extern UniValue getblockhash(const UniValue& params, bool fHelp);
 extern UniValue getblockheader(const UniValue& params, bool fHelp);
 extern UniValue getblock(const UniValue& params, bool fHelp);
+extern bool getblock_stream(const UniValue& params, CJSONStream& out);
 extern UniValue gettxoutsetinfo(const UniValue& params, bool fHelp);
 extern UniValue gettxout(const UniValue& params, bool fHelp);
 extern UniValue verifychain(const UniValue& params, bool fHelp);
 extern UniValue getchaintips(const UniValue& params, bool fHelp);
+extern UniValue getblockconnectstats(const UniValue& params, bool fHelp);
 extern UniValue invalidateblock(const UniValue& params, bool fHelp);
 extern UniValue reconsiderblock(const UniValue& params, bool fHelp);
 
-// in rest.cpp
-extern bool HTTPReq_REST(AcceptedConnection *conn,
-                  const std::string& strURI,
-                  const std::string& strRequest,
-                  const std::map<std::string, std::string>& mapHeaders,
-                  bool fRun);
+bool StartRPC();
+void InterruptRPC();
+void StopRPC();
+/** Hand a task to another thread. Returns false if it could not be queued. */
+typedef boost::function<bool(const boost::function<void(void)>&)> RPCTaskDispatcher;
+
+static const unsigned int DEFAULT_RPC_BATCH_MAXSIZE = 5000;
+static const int64_t DEFAULT_RPC_BATCH_TIMEOUT = 60;
+
+/**
+ * Execute a JSON-RPC batch and return the serialized reply array.
+ * Runs of consecutive okParallel calls are spread over up to nHelpers extra
+ * tasks handed to dispatcher; everything else runs in order on the calling
+ * thread. Replies are always in request order. Calls not started within
+ * nTimeout seconds (0 = no limit) of the batch start are answered with an
+ * error instead of being executed.
+ */
+std::string JSONRPCExecBatch(const UniValue& vReq, const RPCTaskDispatcher& dispatcher = RPCTaskDispatcher(),
+                             int nHelpers = 0, int64_t nTimeout = 0);
 
 #endif // BITCOIN_RPCSERVER_H
@@ -5,6 +5,7 @@
 
 #include "sigcache.h"
 
+#include "metrics.h"
 #include "pubkey.h"
 #include "random.h"
 #include "uint256.h"
@@ -74,12 +75,20 @@ public:
 
 }
 
+static CMetricCounter& metricSigCacheHits = RegisterMetric<CMetricCounter>("bitcoin_sigcache_lookups_total",
+    "Lookups in the signature cache, by whether they found the signature", "result=\"hit\"");
+static CMetricCounter& metricSigCacheMisses = RegisterMetric<CMetricCounter>("bitcoin_sigcache_lookups_total",
+    "Lookups in the signature cache, by whether they found the signature", "result=\"miss\"");
+
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
     static CSignatureCache signatureCache;
 
-    if (signatureCache.Get(sighash, vchSig, pubkey))
+    if (signatureCache.Get(sighash, vchSig, pubkey)) {
+        metricSigCacheHits.Inc();
         return true;
+    }
+    metricSigCacheMisses.Inc();
 
     if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
         return false;
@@ -88,3 +97,9 @@ bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsig
         signatureCache.Set(sighash, vchSig, pubkey);
     return true;
 }
+
+void GetSignatureCacheStats(uint64_t& nHits, uint64_t& nMisses)
+{
+    nHits = metricSigCacheHits.Get();
+    nMisses = metricSigCacheMisses.Get();
+}
@@ -8,6 +8,7 @@
 
 #include "script/interpreter.h"
 
+#include <stdint.h>
 #include <vector>
 
 class CPubKey;
@@ -23,4 +24,7 @@ public:
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
+/** Get the number of signature cache lookups so far that found the signature, and that did not */
+void GetSignatureCacheStats(uint64_t& nHits, uint64_t& nMisses);
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
@@ -15,6 +15,7 @@
 
 #include "test/test_bitcoin.h"
 
+#include <limits>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp> // for 'map_list_of()'
@@ -23,15 +24,25 @@
 #include <boost/test/unit_test.hpp>
 
 // Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
+extern bool AddOrphanTx(const CTransactionRef& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphanBytes);
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+};
+struct IteratorComparator
+{
+    template<typename I>
+    bool operator()(const I& a, const I& b) const
+    {
+        return &(*a) < &(*b);
+    }
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern std::map<COutPoint, std::set<std::map<uint256, COrphanTx>::iterator, IteratorComparator> > mapOrphanTransactionsByPrev;
+extern size_t nOrphanTransactionsSize;
 
 CService ip(uint32_t i)
 {
@@ -111,7 +122,7 @@ CTransaction RandomOrphan()
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    return *it->second.tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -133,7 +144,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx, i);
+        AddOrphanTx(MakeTransactionRef(tx), i);
     }
 
     // ... and 50 that depend on other orphans:
@@ -150,7 +161,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        AddOrphanTx(tx, i);
+        AddOrphanTx(MakeTransactionRef(tx), i);
     }
 
     // This really-big orphan should be ignored:
@@ -174,7 +185,7 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx, i));
+        BOOST_CHECK(!AddOrphanTx(MakeTransactionRef(tx), i));
     }
 
     // Test EraseOrphansFor:
@@ -186,13 +197,63 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, std::numeric_limits<size_t>::max());
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, std::numeric_limits<size_t>::max());
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, std::numeric_limits<size_t>::max());
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsSize, 0U);
+}
+
+static CTransactionRef SimpleOrphan()
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return MakeTransactionRef(tx);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphans_limits)
+{
+    int64_t nStartTime = GetTime();
+    SetMockTime(nStartTime);
+
+    // One peer floods the pool, another contributes a single orphan:
+    CTransactionRef txVictim = SimpleOrphan();
+    BOOST_CHECK(AddOrphanTx(txVictim, 2));
+    size_t nTxSize = txVictim->GetTotalSize();
+    for (int i = 0; i < 20; i++)
+        BOOST_CHECK(AddOrphanTx(SimpleOrphan(), 1));
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 21U);
+    BOOST_CHECK_EQUAL(nOrphanTransactionsSize, 21 * nTxSize);
+
+    // The byte limit is enforced by evicting from the heaviest peer first:
+    LimitOrphanTxSize(100, 5 * nTxSize);
+    BOOST_CHECK(nOrphanTransactionsSize <= 5 * nTxSize);
+    BOOST_CHECK(mapOrphanTransactions.count(txVictim->GetHash()));
+
+    // Parents are indexed by outpoint:
+    BOOST_CHECK(mapOrphanTransactionsByPrev.count(txVictim->vin[0].prevout));
+    BOOST_CHECK(!mapOrphanTransactionsByPrev.count(COutPoint(txVictim->vin[0].prevout.hash, 1)));
+
+    // Entries expire after ORPHAN_TX_EXPIRE_TIME:
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME - 1);
+    LimitOrphanTxSize(100, std::numeric_limits<size_t>::max());
+    BOOST_CHECK(!mapOrphanTransactions.empty());
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL);
+    LimitOrphanTxSize(100, std::numeric_limits<size_t>::max());
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsSize, 0U);
+
+    SetMockTime(0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,180 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockencodings_tests, BasicTestingSetup)
+
+static CBlock BuildBlockTestCase() {
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    block.vtx.resize(3);
+    block.vtx[0] = MakeTransactionRef(tx);
+    block.nVersion = 42;
+    block.hashPrevBlock = GetRandHash();
+    block.nBits = 0x207fffff;
+
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    block.vtx[1] = MakeTransactionRef(tx);
+
+    tx.vin.resize(10);
+    for (size_t i = 0; i < tx.vin.size(); i++) {
+        tx.vin[i].prevout.hash = GetRandHash();
+        tx.vin[i].prevout.n = 0;
+    }
+    block.vtx[2] = MakeTransactionRef(tx);
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+/** Send a compact block over the wire, as the receiving peer would see it */
+static CBlockHeaderAndShortTxIDs RoundTrip(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << cmpctblock;
+    CBlockHeaderAndShortTxIDs cmpctblockRead;
+    stream >> cmpctblockRead;
+    BOOST_CHECK(stream.empty());
+    return cmpctblockRead;
+}
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    pool.addUnchecked(block.vtx[2]->GetHash(), CTxMemPoolEntry(block.vtx[2], 0, 0, 0.0, 1));
+
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+    BOOST_CHECK_EQUAL(shortIDs.vShortTxIDs.size(), 2U);
+    BOOST_CHECK_EQUAL(shortIDs.vPrefilledTxn.size(), 1U);
+    BOOST_CHECK(shortIDs.vShortTxIDs[0] <= 0xffffffffffffULL);
+
+    // The short IDs, and the key they are derived with, survive serialization
+    CBlockHeaderAndShortTxIDs shortIDs2 = RoundTrip(shortIDs);
+    BOOST_CHECK(shortIDs2.vShortTxIDs == shortIDs.vShortTxIDs);
+    BOOST_CHECK_EQUAL(shortIDs2.GetShortID(block.vtx[1]->GetHash()), shortIDs.vShortTxIDs[0]);
+
+    CPartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(shortIDs2, pool) == READ_STATUS_OK);
+    BOOST_CHECK( partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK( partialBlock.IsTxAvailable(2));
+    BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 1U);
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 1U);
+
+    CBlock block2;
+    std::vector<CTransactionRef> vtxMissing;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtxMissing) == READ_STATUS_INVALID); // No transactions given
+
+    // A wrong transaction fails the merkle root check
+    vtxMissing.push_back(block.vtx[2]);
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtxMissing) == READ_STATUS_FAILED);
+
+    vtxMissing[0] = block.vtx[1];
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtxMissing) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().ToString(), block.GetHash().ToString());
+    // Shared with the mempool rather than copied
+    BOOST_CHECK(block2.vtx[2] == block.vtx[2]);
+
+    // Too many transactions given
+    vtxMissing.push_back(block.vtx[1]);
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtxMissing) == READ_STATUS_INVALID);
+}
+
+BOOST_AUTO_TEST_CASE(EmptyMempoolTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    CBlockHeaderAndShortTxIDs shortIDs = RoundTrip(CBlockHeaderAndShortTxIDs(block));
+
+    CPartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(shortIDs, pool) == READ_STATUS_OK);
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(2));
+    BOOST_CHECK_EQUAL(partialBlock.GetMempoolCount(), 0U);
+
+    std::vector<CTransactionRef> vtxMissing;
+    vtxMissing.push_back(block.vtx[1]);
+    vtxMissing.push_back(block.vtx[2]);
+    CBlock block2;
+    BOOST_CHECK(partialBlock.FillBlock(block2, vtxMissing) == READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(block2.GetHash().ToString(), block.GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(MalformedCompactBlockTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    // Duplicate short IDs can't be resolved: the block must be fetched in full
+    CBlockHeaderAndShortTxIDs shortIDs(block);
+    shortIDs.vShortTxIDs[1] = shortIDs.vShortTxIDs[0];
+    CPartiallyDownloadedBlock partialBlock;
+    BOOST_CHECK(partialBlock.InitData(RoundTrip(shortIDs), pool) == READ_STATUS_FAILED);
+
+    // A prefilled transaction beyond the end of the block is invalid
+    shortIDs = CBlockHeaderAndShortTxIDs(block);
+    shortIDs.vPrefilledTxn[0].nIndex = 3;
+    CPartiallyDownloadedBlock partialBlock2;
+    BOOST_CHECK(partialBlock2.InitData(RoundTrip(shortIDs), pool) == READ_STATUS_INVALID);
+
+    // As is one with nothing in it
+    shortIDs = CBlockHeaderAndShortTxIDs(block);
+    shortIDs.vShortTxIDs.clear();
+    shortIDs.vPrefilledTxn.clear();
+    CPartiallyDownloadedBlock partialBlock3;
+    BOOST_CHECK(partialBlock3.InitData(RoundTrip(shortIDs), pool) == READ_STATUS_INVALID);
+}
+
+BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest)
+{
+    CBlockTransactionsRequest req1;
+    req1.hashBlock = GetRandHash();
+    req1.vIndexes.resize(4);
+    req1.vIndexes[0] = 0;
+    req1.vIndexes[1] = 1;
+    req1.vIndexes[2] = 3;
+    req1.vIndexes[3] = 4;
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req1;
+    // Hash, count, then the differences 0, 0, 1, 0 as one byte each
+    BOOST_CHECK_EQUAL(stream.size(), 32U + 1U + 4U);
+    BOOST_CHECK_EQUAL(stream[33], 0);
+    BOOST_CHECK_EQUAL(stream[35], 1);
+
+    CBlockTransactionsRequest req2;
+    stream >> req2;
+
+    BOOST_CHECK_EQUAL(req1.hashBlock.ToString(), req2.hashBlock.ToString());
+    BOOST_CHECK(req1.vIndexes == req2.vIndexes);
+
+    // Indexes that add up past 16 bits are rejected
+    CDataStream streamBad(SER_NETWORK, PROTOCOL_VERSION);
+    streamBad << req1.hashBlock;
+    WriteCompactSize(streamBad, 2);
+    WriteCompactSize(streamBad, 60000);
+    WriteCompactSize(streamBad, 60000);
+    CBlockTransactionsRequest req3;
+    BOOST_CHECK_THROW(streamBad >> req3, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
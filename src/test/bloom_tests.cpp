@@ -537,4 +537,44 @@ BOOST_AUTO_TEST_CASE(rolling_bloom)
     }
 }
 
+BOOST_AUTO_TEST_CASE(rolling_bloom_fp_budget)
+{
+    // Sized like a peer's inventory filter, scaled down
+    CRollingBloomFilter rb(10000, 0.0001);
+    size_t nMemoryUsage = rb.DynamicMemoryUsage();
+    BOOST_CHECK(nMemoryUsage > 0);
+
+    // The filter is at its fullest just before a generation is wiped,
+    // after three generations of 5000 entries
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 15000; i++) {
+        vHashes.push_back(GetRandHash());
+        rb.insert(vHashes.back());
+    }
+    for (int i = 5000; i < 15000; i++) {
+        BOOST_CHECK(rb.contains(vHashes[i]));
+    }
+
+    // About 10 false positives are expected; even 30 is insanely unlikely
+    unsigned int nHits = 0;
+    for (int i = 0; i < 100000; i++) {
+        if (rb.contains(GetRandHash()))
+            ++nHits;
+    }
+    BOOST_TEST_MESSAGE("RollingBloomFilter got " << nHits << " false positives (~10 expected)");
+    BOOST_CHECK(nHits < 30);
+
+    // Rolling on forgets the oldest entries without using more memory
+    for (int i = 0; i < 30000; i++) {
+        rb.insert(GetRandHash());
+    }
+    nHits = 0;
+    for (int i = 0; i < 15000; i++) {
+        if (rb.contains(vHashes[i]))
+            ++nHits;
+    }
+    BOOST_CHECK(nHits < 30);
+    BOOST_CHECK_EQUAL(rb.DynamicMemoryUsage(), nMemoryUsage);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -4,12 +4,14 @@
 
 #include "coins.h"
 #include "random.h"
+#include "txdb.h"
 #include "uint256.h"
 #include "test/test_bitcoin.h"
 
 #include <vector>
 #include <map>
 
+#include <boost/scoped_ptr.hpp>
 #include <boost/test/unit_test.hpp>
 
 namespace
@@ -197,4 +199,52 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+static void WriteCoins(CCoinsView& view, const uint256& txid, const CCoins& coins, const uint256& hashBlock)
+{
+    CCoinsMap map;
+    map[txid].coins = coins;
+    map[txid].flags = CCoinsCacheEntry::DIRTY;
+    BOOST_CHECK(view.BatchWrite(map, hashBlock));
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_snapshot_test, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true);
+    uint256 txid1 = GetRandHash();
+    uint256 txid2 = GetRandHash();
+    uint256 hashBlock1 = GetRandHash();
+    uint256 hashBlock2 = GetRandHash();
+    CCoins coins;
+    coins.vout.resize(1);
+    coins.vout[0].nValue = 1;
+    WriteCoins(db, txid1, coins, hashBlock1);
+
+    // Later writes do not show in the snapshot
+    boost::scoped_ptr<CCoinsView> snapshot(db.CreateSnapshot());
+    BOOST_REQUIRE(snapshot);
+    WriteCoins(db, txid2, coins, hashBlock2);
+    WriteCoins(db, txid1, CCoins(), hashBlock2);
+
+    CCoins result;
+    BOOST_CHECK(!db.GetCoins(txid1, result));
+    BOOST_CHECK(db.GetCoins(txid2, result));
+    BOOST_CHECK(db.GetBestBlock() == hashBlock2);
+    BOOST_CHECK(snapshot->GetCoins(txid1, result) && result == coins);
+    BOOST_CHECK(!snapshot->HaveCoins(txid2));
+    BOOST_CHECK(snapshot->GetBestBlock() == hashBlock1);
+
+    // A cache hands out a snapshot of its backend, and can be asked for what
+    // it holds itself
+    CCoinsViewCache cache(&db);
+    snapshot.reset(cache.CreateSnapshot());
+    BOOST_REQUIRE(snapshot);
+    BOOST_CHECK(snapshot->HaveCoins(txid2));
+    BOOST_CHECK(!cache.GetCachedCoins(txid2, result));
+    BOOST_CHECK(cache.HaveCoins(txid2));
+    BOOST_CHECK(cache.GetCachedCoins(txid2, result) && result == coins);
+    cache.ModifyCoins(txid2)->Spend(0);
+    BOOST_CHECK(cache.GetCachedCoins(txid2, result) && result.IsPruned());
+    BOOST_CHECK(snapshot->GetCoins(txid2, result) && result == coins);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
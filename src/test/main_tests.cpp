@@ -3,13 +3,21 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "chainparams.h"
+#include "consensus/validation.h"
+#include "key.h"
 #include "main.h"
+#include "script/standard.h"
+#include "txmempool.h"
 
 #include "test/test_bitcoin.h"
 
 #include <boost/signals2/signal.hpp>
 #include <boost/test/unit_test.hpp>
 
+extern int64_t UpdateBlockServiceTime(int64_t nAverage, int64_t nStart, int64_t nNow);
+extern int GetBlocksInTransitTarget(int64_t nBlockServiceTime, int64_t nPingUsecTime);
+extern bool ShouldReassignStalledBlock(int64_t nServiceTime, int64_t nStallerServiceTime, int64_t nStallerLastReceived, int64_t nRequested, int64_t nNow);
+
 BOOST_FIXTURE_TEST_SUITE(main_tests, TestingSetup)
 
 static void TestBlockSubsidyHalvings(const Consensus::Params& consensusParams)
@@ -56,6 +64,120 @@ BOOST_AUTO_TEST_CASE(subsidy_limit_test)
     BOOST_CHECK_EQUAL(nSum, 2099999997690000ULL);
 }
 
+BOOST_AUTO_TEST_CASE(block_service_time)
+{
+    // The first block sets the average, later ones move it by an eighth
+    BOOST_CHECK_EQUAL(UpdateBlockServiceTime(0, 0, 800000), 800000);
+    BOOST_CHECK_EQUAL(UpdateBlockServiceTime(800000, 0, 1600000), 900000);
+    BOOST_CHECK_EQUAL(UpdateBlockServiceTime(900000, 5000000, 5100000), 800000);
+    // Never less than a microsecond, so a known peer is never mistaken for an unknown one
+    BOOST_CHECK_EQUAL(UpdateBlockServiceTime(0, 100, 100), 1);
+    BOOST_CHECK_EQUAL(UpdateBlockServiceTime(0, 200, 100), 1);
+}
+
+BOOST_AUTO_TEST_CASE(blocks_in_transit_target)
+{
+    // Peers we have no blocks from yet get the fixed window
+    BOOST_CHECK_EQUAL(GetBlocksInTransitTarget(0, 0), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetBlocksInTransitTarget(0, 5000000), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    // Enough blocks to cover the pipeline time, plus the one being received
+    BOOST_CHECK_EQUAL(GetBlocksInTransitTarget(1000000, 0), 1 + (int)BLOCK_DOWNLOAD_PIPELINE_TIME);
+    BOOST_CHECK_EQUAL(GetBlocksInTransitTarget(500000, 0), 1 + 2 * (int)BLOCK_DOWNLOAD_PIPELINE_TIME);
+    // and the ping time
+    BOOST_CHECK_EQUAL(GetBlocksInTransitTarget(1000000, 2000000), 3 + (int)BLOCK_DOWNLOAD_PIPELINE_TIME);
+    // Bounded on both sides
+    BOOST_CHECK_EQUAL(GetBlocksInTransitTarget(60000000, 0), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetBlocksInTransitTarget(1, 0), MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetBlocksInTransitTarget(10000, 1000000), MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
+BOOST_AUTO_TEST_CASE(reassign_stalled_block)
+{
+    const int64_t nHalfTimeout = 500000 * BLOCK_STALLING_TIMEOUT;
+
+    // A peer without a delivered block never takes over
+    BOOST_CHECK(!ShouldReassignStalledBlock(0, 5000000, 0, 0, 10 * nHalfTimeout));
+
+    // The staller gets half the stalling timeout
+    BOOST_CHECK(!ShouldReassignStalledBlock(100000, 300000, 0, 0, nHalfTimeout - 1));
+    BOOST_CHECK(ShouldReassignStalledBlock(100000, 300000, 0, 0, nHalfTimeout));
+
+    // and twice what the faster peer would need, when that is longer
+    BOOST_CHECK(!ShouldReassignStalledBlock(800000, 5000000, 0, 0, nHalfTimeout));
+    BOOST_CHECK(!ShouldReassignStalledBlock(800000, 5000000, 0, 0, 1600000 - 1));
+    BOOST_CHECK(ShouldReassignStalledBlock(800000, 5000000, 0, 0, 1600000));
+
+    // The staller must be at least twice as slow, judging by its average
+    // or by how long it has had since its last delivery
+    BOOST_CHECK(!ShouldReassignStalledBlock(100000, 150000, nHalfTimeout - 100000, 0, nHalfTimeout));
+    BOOST_CHECK(ShouldReassignStalledBlock(100000, 200000, nHalfTimeout - 100000, 0, nHalfTimeout));
+    BOOST_CHECK(ShouldReassignStalledBlock(100000, 150000, nHalfTimeout - 200000, 0, nHalfTimeout));
+    BOOST_CHECK(ShouldReassignStalledBlock(100000, 150000, 0, 0, nHalfTimeout));
+}
+
+static CMutableTransaction
+SpendP2PK(const uint256& hashPrev, const CScript& scriptPubKey, const CKey& key, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = hashPrev;
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return tx;
+}
+
+BOOST_FIXTURE_TEST_CASE(block_connect_stats, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    // The genesis block and the 100 blocks of the fixture
+    std::vector<CBlockConnectStats> vStats;
+    GetBlockConnectStats(0, 1000, vStats);
+    BOOST_CHECK_EQUAL(vStats.size(), 101U);
+    for (unsigned int i = 0; i < vStats.size(); i++) {
+        BOOST_CHECK_EQUAL(vStats[i].nHeight, (int)i);
+        BOOST_CHECK(vStats[i].hash == chainActive[i]->GetBlockHash());
+    }
+
+    std::vector<CMutableTransaction> vtx(1, SpendP2PK(coinbaseTxns[0].GetHash(), scriptPubKey, coinbaseKey, 11*CENT));
+    CBlock block = CreateAndProcessBlock(vtx, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+
+    GetBlockConnectStats(101, 102, vStats);
+    BOOST_CHECK_EQUAL(vStats.size(), 1U);
+    const CBlockConnectStats& stats = vStats[0];
+    BOOST_CHECK_EQUAL(stats.nHeight, 101);
+    BOOST_CHECK(stats.hash == block.GetHash());
+    BOOST_CHECK_EQUAL(stats.nTx, 2U);
+    BOOST_CHECK_EQUAL(stats.nInputs, 1U);
+    // The signature was never verified before
+    BOOST_CHECK_EQUAL(stats.nSigCacheHits, 0U);
+    BOOST_CHECK_EQUAL(stats.nSigCacheMisses, 1U);
+    // The txids of the new transactions are looked up in the database
+    BOOST_CHECK(stats.nCoinsCacheMisses > 0);
+    BOOST_CHECK(stats.nUTXOFetchMicros <= stats.nConnectMicros);
+    BOOST_CHECK(stats.nConnectMicros + stats.nScriptCheckWaitMicros + stats.nFlushMicros <= stats.nTotalMicros);
+
+    // Disconnected blocks are forgotten
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, chainActive[100]));
+    }
+    GetBlockConnectStats(99, 102, vStats);
+    BOOST_CHECK_EQUAL(vStats.size(), 1U);
+    BOOST_CHECK_EQUAL(vStats[0].nHeight, 99);
+    mempool.clear();
+}
+
 bool ReturnFalse() { return false; }
 bool ReturnTrue() { return true; }
 
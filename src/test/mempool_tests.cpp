@@ -52,7 +52,7 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
 
 
     CTxMemPool testPool(CFeeRate(0));
-    std::list<CTransaction> removed;
+    std::list<CTransactionRef> removed;
 
     // Nothing in pool, remove should do nothing:
     testPool.remove(txParent, removed, true);
@@ -100,4 +100,87 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolSharedTxTest)
+{
+    // Transactions added by reference are shared, not copied, by the pool
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 33000LL;
+    CTransactionRef ptx = MakeTransactionRef(txParent);
+    BOOST_CHECK_EQUAL(ptx->GetTotalSize(), ::GetSerializeSize(*ptx, SER_NETWORK, PROTOCOL_VERSION));
+
+    CTxMemPool testPool(CFeeRate(0));
+    testPool.addUnchecked(ptx->GetHash(), CTxMemPoolEntry(ptx, 0, 0, 0.0, 1));
+    BOOST_CHECK(testPool.get(ptx->GetHash()) == ptx);
+    BOOST_CHECK_EQUAL(testPool.mapTx[ptx->GetHash()].GetTxSize(), ptx->GetTotalSize());
+
+    // Removal hands back the same object
+    std::vector<CTransactionRef> vtx(1, ptx);
+    std::list<CTransactionRef> conflicts;
+    testPool.removeForBlock(vtx, 1, conflicts);
+    BOOST_CHECK_EQUAL(testPool.size(), 0);
+    BOOST_CHECK(conflicts.empty());
+    BOOST_CHECK(!testPool.get(ptx->GetHash()));
+    vtx.clear();
+    BOOST_CHECK(ptx.unique());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSnapshotTest)
+{
+    CTxMemPool testPool(CFeeRate(0));
+    std::vector<CTransactionRef> vtx;
+    for (int i = 0; i < 3; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << OP_11 << i;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[0].nValue = 33000LL;
+        vtx.push_back(MakeTransactionRef(tx));
+    }
+    testPool.addUnchecked(vtx[0]->GetHash(), CTxMemPoolEntry(vtx[0], 0, 0, 0.0, 1));
+    testPool.addUnchecked(vtx[1]->GetHash(), CTxMemPoolEntry(vtx[1], 0, 0, 0.0, 1));
+
+    CTxMemPoolSnapshotRef snapshot = testPool.GetSnapshot();
+    BOOST_CHECK_EQUAL(snapshot->size(), 2U);
+    BOOST_CHECK_EQUAL(snapshot->nTotalTxSize, testPool.GetTotalTxSize());
+    BOOST_CHECK(snapshot->vEntries[0].GetTx().GetHash() < snapshot->vEntries[1].GetTx().GetHash());
+    BOOST_CHECK(snapshot->exists(vtx[0]->GetHash()));
+    BOOST_CHECK(snapshot->exists(vtx[1]->GetHash()));
+    BOOST_CHECK(!snapshot->exists(vtx[2]->GetHash()));
+    BOOST_CHECK(snapshot->find(vtx[1]->GetHash())->GetSharedTx() == vtx[1]);
+
+    // Unchanged pools hand out the same snapshot
+    BOOST_CHECK(testPool.GetSnapshot() == snapshot);
+
+    // A snapshot doesn't see later changes, but the next one does
+    std::list<CTransactionRef> removed;
+    testPool.remove(*vtx[0], removed);
+    testPool.addUnchecked(vtx[2]->GetHash(), CTxMemPoolEntry(vtx[2], 0, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(snapshot->size(), 2U);
+    BOOST_CHECK(snapshot->exists(vtx[0]->GetHash()));
+    BOOST_CHECK(!snapshot->exists(vtx[2]->GetHash()));
+
+    CTxMemPoolSnapshotRef snapshotNew = testPool.GetSnapshot();
+    BOOST_CHECK(snapshotNew != snapshot);
+    BOOST_CHECK_EQUAL(snapshotNew->size(), 2U);
+    BOOST_CHECK(!snapshotNew->exists(vtx[0]->GetHash()));
+    BOOST_CHECK(snapshotNew->exists(vtx[2]->GetHash()));
+
+    // Once the readers let go, the pool keeps no removed transaction alive
+    removed.clear();
+    snapshot.reset();
+    snapshotNew.reset();
+    testPool.remove(*vtx[1], removed);
+    removed.clear();
+    BOOST_CHECK_EQUAL(vtx[0].use_count(), 1);
+    BOOST_CHECK_EQUAL(vtx[1].use_count(), 1);
+    testPool.GetSnapshot();
+    testPool.clear();
+    BOOST_CHECK_EQUAL(vtx[2].use_count(), 1);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,104 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "metrics.h"
+
+#include "coins.h"
+#include "random.h"
+#include "test/test_bitcoin.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(metrics_tests, BasicTestingSetup)
+
+static bool Contains(const std::string& str, const std::string& strPart)
+{
+    return str.find(strPart) != std::string::npos;
+}
+
+BOOST_AUTO_TEST_CASE(metrics_counter_gauge)
+{
+    CMetricCounter& counter = RegisterMetric<CMetricCounter>("test_events_total", "Events");
+    CMetricGauge& gauge = RegisterMetric<CMetricGauge>("test_level", "Level", "kind=\"a\"");
+    counter.Inc();
+    counter.Inc(41);
+    BOOST_CHECK_EQUAL(counter.Get(), 42U);
+    gauge.Set(10);
+    gauge.Add(-15);
+    BOOST_CHECK_EQUAL(gauge.Get(), -5);
+
+    std::string strMetrics = RenderMetrics();
+    BOOST_CHECK(Contains(strMetrics, "# HELP test_events_total Events\n# TYPE test_events_total counter\ntest_events_total 42\n"));
+    BOOST_CHECK(Contains(strMetrics, "# TYPE test_level gauge\ntest_level{kind=\"a\"} -5\n"));
+}
+
+BOOST_AUTO_TEST_CASE(metrics_histogram)
+{
+    CMetricHistogram& histogram = RegisterMetric<CMetricHistogram>("test_duration_seconds", "Durations", "path=\"x\"");
+    histogram.Observe(10);       // on the bound of the first bucket
+    histogram.Observe(11);
+    histogram.Observe(1500000);
+    histogram.Observe(60000000); // past the last bucket
+    histogram.Observe(-1);       // clock going backwards counts as zero
+    BOOST_CHECK_EQUAL(histogram.GetCount(), 5U);
+
+    std::string strMetrics = RenderMetrics();
+    BOOST_CHECK(Contains(strMetrics, "# TYPE test_duration_seconds histogram\n"));
+    BOOST_CHECK(Contains(strMetrics, "test_duration_seconds_bucket{path=\"x\",le=\"0.00001\"} 2\n"));
+    BOOST_CHECK(Contains(strMetrics, "test_duration_seconds_bucket{path=\"x\",le=\"0.000025\"} 3\n"));
+    BOOST_CHECK(Contains(strMetrics, "test_duration_seconds_bucket{path=\"x\",le=\"1\"} 3\n"));
+    BOOST_CHECK(Contains(strMetrics, "test_duration_seconds_bucket{path=\"x\",le=\"2.5\"} 4\n"));
+    BOOST_CHECK(Contains(strMetrics, "test_duration_seconds_bucket{path=\"x\",le=\"10\"} 4\n"));
+    BOOST_CHECK(Contains(strMetrics, "test_duration_seconds_bucket{path=\"x\",le=\"+Inf\"} 5\n"));
+    BOOST_CHECK(Contains(strMetrics, "test_duration_seconds_sum{path=\"x\"} 61.500021\n"));
+    BOOST_CHECK(Contains(strMetrics, "test_duration_seconds_count{path=\"x\"} 5\n"));
+}
+
+BOOST_AUTO_TEST_CASE(metrics_family)
+{
+    std::vector<std::string> vValues;
+    vValues.push_back("ping");
+    vValues.push_back("pong");
+    CMetricFamily<CMetricCounter> family("test_messages_total", "Messages", "command", vValues);
+    family[0].Inc();
+    family.Find("pong")->Inc(2);
+    BOOST_CHECK(family.Find("other") == NULL);
+    BOOST_CHECK_EQUAL(family[1].Get(), 2U);
+
+    // One HELP and TYPE header for all members
+    std::string strMetrics = RenderMetrics();
+    BOOST_CHECK(Contains(strMetrics, "# TYPE test_messages_total counter\n"
+                                     "test_messages_total{command=\"ping\"} 1\n"
+                                     "test_messages_total{command=\"pong\"} 2\n"));
+}
+
+BOOST_AUTO_TEST_CASE(metrics_coins_cache_lookups)
+{
+    CCoinsView base;
+    CCoinsViewCache cache(&base);
+    CMetricCounter hits, misses;
+    cache.SetLookupMetrics(&hits, &misses);
+
+    uint256 txid = GetRandHash();
+    BOOST_CHECK(!cache.HaveCoins(txid));
+    BOOST_CHECK_EQUAL(misses.Get(), 1U);
+    {
+        CCoinsModifier coins = cache.ModifyCoins(txid);
+        coins->vout.resize(1);
+        coins->vout[0].nValue = 1;
+    }
+    BOOST_CHECK_EQUAL(misses.Get(), 2U);
+    BOOST_CHECK(cache.HaveCoins(txid));
+    BOOST_CHECK(cache.AccessCoins(txid) != NULL);
+    BOOST_CHECK_EQUAL(hits.Get(), 2U);
+
+    cache.SetLookupMetrics(NULL, NULL);
+    BOOST_CHECK(cache.HaveCoins(txid));
+    BOOST_CHECK_EQUAL(hits.Get(), 2U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,303 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "consensus/consensus.h"
+#include "hash.h"
+#include "net.h"
+#include "random.h"
+#include "serialize.h"
+#include "streams.h"
+#include "utiltime.h"
+#include "test/test_bitcoin.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+BOOST_FIXTURE_TEST_SUITE(net_tests, BasicTestingSetup)
+
+/** Serialize a message, header included, as sent on the wire */
+static vector<char> MakeMessage(const char* pszCommand, const vector<char>& vPayload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, vPayload.size());
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    ss << hdr;
+    ss.insert(ss.end(), vPayload.begin(), vPayload.end());
+    return vector<char>(ss.begin(), ss.end());
+}
+
+static vector<char> RandomPayload(size_t nSize)
+{
+    vector<char> vPayload(nSize);
+    for (size_t i = 0; i < nSize; i++)
+        vPayload[i] = insecure_rand();
+    return vPayload;
+}
+
+/** Feed a message to a node as the socket handler would: buffered until its payload starts, then in place */
+static void ReceiveMessage(CNode& node, const vector<char>& vMsg, unsigned int nFirstChunk)
+{
+    BOOST_CHECK(node.ReceiveMsgBytes(&vMsg[0], nFirstChunk));
+    size_t nPos = nFirstChunk;
+    while (nPos < vMsg.size()) {
+        unsigned int nWindow = 0;
+        char* pchWindow = node.GetReceiveWindow(nWindow);
+        BOOST_REQUIRE(pchWindow != NULL);
+        BOOST_REQUIRE(nWindow > 0);
+        unsigned int nBytes = std::min((size_t)std::min(nWindow, 5000U), vMsg.size() - nPos);
+        memcpy(pchWindow, &vMsg[nPos], nBytes);
+        node.ReceivedInPlace(nBytes);
+        nPos += nBytes;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(net_receive_in_place)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    // Nothing to read in place before a header has been received
+    unsigned int nWindow = 0;
+    BOOST_CHECK(node.GetReceiveWindow(nWindow) == NULL);
+
+    vector<char> vPayload = RandomPayload(300000);
+    vector<char> vMsg = MakeMessage("block", vPayload);
+    ReceiveMessage(node, vMsg, CMessageHeader::HEADER_SIZE + 100);
+
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+    CNetMessage& msg = node.vRecvMsg.front();
+    BOOST_CHECK(msg.complete());
+    BOOST_CHECK(msg.nTime != 0);
+    BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), "block");
+    BOOST_CHECK_EQUAL(msg.hdr.nMessageSize, vPayload.size());
+    BOOST_CHECK(msg.hdr.IsValid(Params().MessageStart()));
+    BOOST_CHECK(vector<char>(msg.vRecv.begin(), msg.vRecv.end()) == vPayload);
+    BOOST_CHECK(node.GetReceiveWindow(nWindow) == NULL);
+
+    // A header split over reads, and messages back to back in one read
+    vector<char> vPing = MakeMessage("ping", RandomPayload(8));
+    vector<char> vPong = MakeMessage("pong", RandomPayload(8));
+    BOOST_CHECK(node.ReceiveMsgBytes(&vPing[0], 10));
+    vector<char> vRest(vPing.begin() + 10, vPing.end());
+    vRest.insert(vRest.end(), vPong.begin(), vPong.end());
+    BOOST_CHECK(node.ReceiveMsgBytes(&vRest[0], vRest.size()));
+    BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 3U);
+    BOOST_CHECK_EQUAL(node.vRecvMsg[1].hdr.GetCommand(), "ping");
+    BOOST_CHECK(node.vRecvMsg[1].complete());
+    BOOST_CHECK_EQUAL(node.vRecvMsg[2].hdr.GetCommand(), "pong");
+    BOOST_CHECK(node.vRecvMsg[2].complete());
+}
+
+BOOST_AUTO_TEST_CASE(net_message_traffic)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    unsigned int nBlock = GetMessageTypeIndex("block");
+    unsigned int nOther = GetMessageTypeIndex("nosuchcmd");
+    BOOST_CHECK_EQUAL(GetMessageTypeName(nBlock), "block");
+    BOOST_CHECK_EQUAL(GetMessageTypeName(nOther), "other");
+    BOOST_CHECK_EQUAL(nOther, GetMessageTypeCount() - 1);
+    BOOST_CHECK_EQUAL(GetMessageTypeIndex("blocktxn"), GetMessageTypeIndex("blocktxn\0\0\0\0"));
+
+    // Messages are counted once complete, whether read in place or not
+    vector<char> vBlock = MakeMessage("block", RandomPayload(100000));
+    ReceiveMessage(node, vBlock, CMessageHeader::HEADER_SIZE);
+    ReceiveMessage(node, vBlock, CMessageHeader::HEADER_SIZE + 10);
+    vector<char> vUnknown = MakeMessage("nosuchcmd", RandomPayload(20));
+    BOOST_CHECK(node.ReceiveMsgBytes(&vUnknown[0], vUnknown.size() - 1));
+    BOOST_CHECK_EQUAL(node.vRecvTraffic[nOther].nMessages.Get(), 0U);
+    BOOST_CHECK(node.ReceiveMsgBytes(&vUnknown[vUnknown.size() - 1], 1));
+
+    BOOST_CHECK_EQUAL(node.vRecvTraffic[nBlock].nMessages.Get(), 2U);
+    BOOST_CHECK_EQUAL(node.vRecvTraffic[nBlock].nBytes.Get(), 2 * vBlock.size());
+    BOOST_CHECK_EQUAL(node.vRecvTraffic[nOther].nMessages.Get(), 1U);
+    BOOST_CHECK_EQUAL(node.vRecvTraffic[nOther].nBytes.Get(), vUnknown.size());
+
+    CNodeStats stats;
+    node.copyStats(stats);
+    BOOST_CHECK_EQUAL(stats.mapRecvTraffic.size(), 2U);
+    BOOST_CHECK_EQUAL(stats.mapRecvTraffic["block"].nBytes, 2 * vBlock.size());
+    BOOST_CHECK(stats.mapSendTraffic.empty());
+}
+
+BOOST_AUTO_TEST_CASE(net_recv_buffer_pool)
+{
+    CRecvBufferPool pool;
+    uint64_t nReused, nAllocated;
+    size_t nPooledBytes;
+
+    CSerializeData vch;
+    BOOST_CHECK(!pool.Take(vch, 5000));
+
+    // Buffers are filed by the size they are guaranteed to have room for
+    vch.reserve(5000);
+    pool.Give(vch);
+    BOOST_CHECK(vch.empty() && vch.capacity() == 0);
+    pool.GetStats(nReused, nAllocated, nPooledBytes);
+    BOOST_CHECK_EQUAL(nPooledBytes, 5000U);
+    BOOST_CHECK(!pool.Take(vch, 5000));
+    BOOST_CHECK(pool.Take(vch, 4096));
+    BOOST_CHECK(vch.capacity() >= 5000);
+    pool.GetStats(nReused, nAllocated, nPooledBytes);
+    BOOST_CHECK_EQUAL(nReused, 1U);
+    BOOST_CHECK_EQUAL(nAllocated, 2U);
+    BOOST_CHECK_EQUAL(nPooledBytes, 0U);
+
+    // Small buffers are not kept, and neither is anything beyond the limit
+    CSerializeData vchSmall(100);
+    pool.Give(vchSmall);
+    for (int i = 0; i < 10; i++) {
+        CSerializeData vchLarge;
+        vchLarge.reserve(MAX_PROTOCOL_MESSAGE_LENGTH);
+        pool.Give(vchLarge);
+    }
+    pool.GetStats(nReused, nAllocated, nPooledBytes);
+    BOOST_CHECK_EQUAL(nPooledBytes, RECV_BUFFER_POOL_MAX_BYTES / MAX_PROTOCOL_MESSAGE_LENGTH * MAX_PROTOCOL_MESSAGE_LENGTH);
+
+    // Requests beyond the largest size class are not served
+    BOOST_CHECK(!pool.Take(vch, MAX_PROTOCOL_MESSAGE_LENGTH + 1));
+}
+
+BOOST_AUTO_TEST_CASE(net_receive_reuses_buffers)
+{
+    CNode node(INVALID_SOCKET, CAddress(), "", true);
+    LOCK(node.cs_vRecvMsg);
+
+    vector<char> vPayload = RandomPayload(100000);
+    vector<char> vMsg = MakeMessage("tx", vPayload);
+    uint64_t nReusedBefore, nReusedAfter, nAllocated;
+    size_t nPooledBytes;
+
+    // Once handled, a message's buffer is used for the next one
+    for (int i = 0; i < 2; i++) {
+        ReceiveMessage(node, vMsg, CMessageHeader::HEADER_SIZE);
+        node.vRecvMsg.clear();
+    }
+    recvBufferPool.GetStats(nReusedBefore, nAllocated, nPooledBytes);
+    BOOST_CHECK(nPooledBytes >= vPayload.size());
+    for (int i = 0; i < 10; i++) {
+        ReceiveMessage(node, vMsg, CMessageHeader::HEADER_SIZE + 1);
+        BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+        BOOST_CHECK(vector<char>(node.vRecvMsg[0].vRecv.begin(), node.vRecvMsg[0].vRecv.end()) == vPayload);
+        node.vRecvMsg.clear();
+    }
+    recvBufferPool.GetStats(nReusedAfter, nAllocated, nPooledBytes);
+    BOOST_CHECK_EQUAL(nReusedAfter - nReusedBefore, 10U);
+}
+
+BOOST_AUTO_TEST_CASE(net_max_outbound_target)
+{
+    SetMockTime(1000000);
+    CNode::SetMaxOutboundTimeframe(MAX_UPLOAD_TIMEFRAME);
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), 0U);
+
+    // Enough to relay a full block every 10 minutes, and 100MB more
+    uint64_t nBuffer = MAX_UPLOAD_TIMEFRAME / 600 * MAX_BLOCK_SIZE;
+    uint64_t nTarget = nBuffer + 100 * 1000 * 1000;
+    CNode::SetMaxOutboundTarget(nTarget);
+    CNode::RecordBytesSent(1);
+    BOOST_CHECK_EQUAL(CNode::GetMaxOutboundTimeLeftInCycle(), MAX_UPLOAD_TIMEFRAME);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), nTarget - 1);
+
+    // Historical blocks stop once the buffer is all that's left...
+    CNode::RecordBytesSent(100 * 1000 * 1000);
+    BOOST_CHECK(CNode::OutboundTargetReached(true));
+    BOOST_CHECK(!CNode::OutboundTargetReached(false));
+
+    // ...which shrinks as the cycle goes on, letting them resume
+    SetMockTime(1000000 + MAX_UPLOAD_TIMEFRAME / 2);
+    BOOST_CHECK_EQUAL(CNode::GetMaxOutboundTimeLeftInCycle(), MAX_UPLOAD_TIMEFRAME / 2);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+
+    CNode::RecordBytesSent(nBuffer);
+    BOOST_CHECK(CNode::OutboundTargetReached(false));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), 0U);
+
+    // A new cycle starts from nothing
+    SetMockTime(1000000 + MAX_UPLOAD_TIMEFRAME + 1);
+    CNode::RecordBytesSent(1);
+    BOOST_CHECK(!CNode::OutboundTargetReached(true));
+    BOOST_CHECK_EQUAL(CNode::GetOutboundTargetBytesLeft(), nTarget - 1);
+
+    CNode::SetMaxOutboundTarget(0);
+    SetMockTime(0);
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(net_send_shared_messages)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CNode node(fds[0], CAddress(), "", true);
+
+    vector<char> vBig = RandomPayload(1000000);
+    vector<char> vTx = RandomPayload(300);
+    CSerializedMessageRef msgTx = MakeSharedMessage("tx", vTx);
+    CDataStream ssBig(SER_NETWORK, PROTOCOL_VERSION), ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssBig << vBig;
+    ssTx << vTx;
+    BOOST_CHECK(vector<char>(msgTx->begin(), msgTx->end()) == MakeMessage("tx", vector<char>(ssTx.begin(), ssTx.end())));
+
+    // Too big for the socket buffer, so what follows is queued behind it
+    node.PushMessage("block", vBig);
+    node.PushSharedMessage(msgTx);
+    node.PushMessage("ping", (uint64_t)42);
+    node.PushSharedMessage(msgTx);
+    {
+        LOCK(node.cs_vSend);
+        BOOST_REQUIRE(node.vSendMsg.size() >= 4U);
+        // Queued by reference, not copied
+        BOOST_CHECK_EQUAL(msgTx.use_count(), 3);
+        BOOST_CHECK(&node.vSendMsg.back().GetData() == msgTx.get());
+        // Accounted as queued, shared or not
+        BOOST_CHECK_EQUAL(node.vSendTraffic[GetMessageTypeIndex("tx")].nMessages.Get(), 2U);
+        BOOST_CHECK_EQUAL(node.vSendTraffic[GetMessageTypeIndex("tx")].nBytes.Get(), 2 * msgTx->size());
+        BOOST_CHECK_EQUAL(node.vSendTraffic[GetMessageTypeIndex("ping")].nMessages.Get(), 1U);
+        // The ping does not keep the buffer the block was serialized in
+        const CSerializeData& vchPing = node.vSendMsg[node.vSendMsg.size() - 2].vchOwned;
+        BOOST_CHECK(!vchPing.empty());
+        BOOST_CHECK(vchPing.capacity() <= 2 * vchPing.size());
+        BOOST_CHECK(node.ssSend.capacity() <= 2 * vchPing.size());
+    }
+
+    vector<char> vExpected = MakeMessage("block", vector<char>(ssBig.begin(), ssBig.end()));
+    vExpected.insert(vExpected.end(), msgTx->begin(), msgTx->end());
+    CDataStream ssPing(SER_NETWORK, PROTOCOL_VERSION);
+    ssPing << (uint64_t)42;
+    vector<char> vPing = MakeMessage("ping", vector<char>(ssPing.begin(), ssPing.end()));
+    vExpected.insert(vExpected.end(), vPing.begin(), vPing.end());
+    vExpected.insert(vExpected.end(), msgTx->begin(), msgTx->end());
+
+    // Drain the other end while the node keeps sending
+    vector<char> vReceived;
+    char buf[65536];
+    for (int i = 0; i < 10000 && vReceived.size() < vExpected.size(); i++) {
+        ssize_t nBytes = recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT);
+        if (nBytes > 0)
+            vReceived.insert(vReceived.end(), buf, buf + nBytes);
+        LOCK(node.cs_vSend);
+        SocketSendData(&node);
+    }
+    BOOST_CHECK(vReceived == vExpected);
+    {
+        LOCK(node.cs_vSend);
+        BOOST_CHECK(node.vSendMsg.empty());
+        BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+    }
+    BOOST_CHECK_EQUAL(msgTx.use_count(), 1);
+    BOOST_CHECK_EQUAL(node.nSendBytes, vExpected.size());
+    close(fds[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
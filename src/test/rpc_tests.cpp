@@ -6,12 +6,18 @@
 #include "rpcclient.h"
 
 #include "base58.h"
+#include "chainparams.h"
+#include "main.h"
 #include "netbase.h"
+#include "txmempool.h"
 
 #include "test/test_bitcoin.h"
 
 #include <boost/algorithm/string.hpp>
+#include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 #include "univalue/univalue.h"
 
@@ -224,19 +230,19 @@ BOOST_AUTO_TEST_CASE(json_parse_errors)
     BOOST_CHECK_THROW(ParseNonRFCJSONValue("3J98t1WpEZ73CNmQviecrnyiWrnqRhWNL"), std::runtime_error);
 }
 
-BOOST_AUTO_TEST_CASE(rpc_boostasiotocnetaddr)
+BOOST_AUTO_TEST_CASE(rpc_peeraddress)
 {
+    // The HTTP server gets peer addresses as numeric strings from libevent
     // Check IPv4 addresses
-    BOOST_CHECK_EQUAL(BoostAsioToCNetAddr(boost::asio::ip::address::from_string("1.2.3.4")).ToString(), "1.2.3.4");
-    BOOST_CHECK_EQUAL(BoostAsioToCNetAddr(boost::asio::ip::address::from_string("127.0.0.1")).ToString(), "127.0.0.1");
+    BOOST_CHECK_EQUAL(CService("1.2.3.4", 8332).ToStringIP(), "1.2.3.4");
+    BOOST_CHECK_EQUAL(CService("127.0.0.1", 8332).ToStringIP(), "127.0.0.1");
     // Check IPv6 addresses
-    BOOST_CHECK_EQUAL(BoostAsioToCNetAddr(boost::asio::ip::address::from_string("::1")).ToString(), "::1");
-    BOOST_CHECK_EQUAL(BoostAsioToCNetAddr(boost::asio::ip::address::from_string("123:4567:89ab:cdef:123:4567:89ab:cdef")).ToString(),
-                                         "123:4567:89ab:cdef:123:4567:89ab:cdef");
-    // v4 compatible must be interpreted as IPv4
-    BOOST_CHECK_EQUAL(BoostAsioToCNetAddr(boost::asio::ip::address::from_string("::0:127.0.0.1")).ToString(), "127.0.0.1");
-    // v4 mapped must be interpreted as IPv4
-    BOOST_CHECK_EQUAL(BoostAsioToCNetAddr(boost::asio::ip::address::from_string("::ffff:127.0.0.1")).ToString(), "127.0.0.1");
+    BOOST_CHECK_EQUAL(CService("::1", 8332).ToStringIP(), "::1");
+    BOOST_CHECK_EQUAL(CService("123:4567:89ab:cdef:123:4567:89ab:cdef", 8332).ToStringIP(),
+                                "123:4567:89ab:cdef:123:4567:89ab:cdef");
+    // v4 mapped must be interpreted as IPv4, so that it matches -rpcallowip subnets
+    BOOST_CHECK_EQUAL(CService("::ffff:127.0.0.1", 8332).ToStringIP(), "127.0.0.1");
+    BOOST_CHECK(CSubNet("127.0.0.0/8").Match(CService("::ffff:127.0.0.1", 8332)));
 }
 
 BOOST_AUTO_TEST_CASE(rpc_ban)
@@ -322,4 +328,176 @@ BOOST_AUTO_TEST_CASE(rpc_ban)
     BOOST_CHECK_EQUAL(adr.get_str(), "2001:4d48:ac57:400:cacf:e9ff:fe1d:9c63/ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff");
 }
 
+static bool RunOnNewThread(boost::thread_group* threads, const boost::function<void(void)>& func)
+{
+    threads->create_thread(func);
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(rpc_batch)
+{
+    if (RPCIsInWarmup(NULL))
+        SetRPCWarmupFinished();
+
+    // Runs of read-only calls separated by calls that must run on their own
+    UniValue batch(UniValue::VARR);
+    for (int i = 0; i < 40; i++) {
+        UniValue req(UniValue::VOBJ);
+        req.push_back(Pair("id", i));
+        if (i % 10 == 9) {
+            req.push_back(Pair("method", "nosuchmethod"));
+        } else if (i % 2) {
+            req.push_back(Pair("method", "getblockcount"));
+        } else {
+            req.push_back(Pair("method", "getblockhash"));
+            UniValue params(UniValue::VARR);
+            params.push_back(UniValue(0));
+            req.push_back(Pair("params", params));
+        }
+        batch.push_back(req);
+    }
+    batch.push_back("not an object");
+
+    UniValue serial, parallel;
+    BOOST_CHECK(serial.read(JSONRPCExecBatch(batch)));
+    boost::thread_group threads;
+    BOOST_CHECK(parallel.read(JSONRPCExecBatch(batch, boost::bind(RunOnNewThread, &threads, _1), 3)));
+    threads.join_all();
+
+    BOOST_CHECK_EQUAL(serial.write(), parallel.write());
+    BOOST_CHECK_EQUAL(parallel.size(), batch.size());
+    for (int i = 0; i < 40; i++) {
+        const UniValue& reply = parallel[i];
+        BOOST_CHECK_EQUAL(find_value(reply, "id").get_int(), i);
+        if (i % 10 == 9)
+            BOOST_CHECK_EQUAL(find_value(find_value(reply, "error"), "code").get_int(), (int)RPC_METHOD_NOT_FOUND);
+        else if (i % 2)
+            BOOST_CHECK_EQUAL(find_value(reply, "result").get_int(), 0);
+        else
+            BOOST_CHECK_EQUAL(find_value(reply, "result").get_str(), Params().GenesisBlock().GetHash().GetHex());
+    }
+    BOOST_CHECK(find_value(parallel[40], "error").isObject());
+}
+
+class StringJSONStream : public CJSONStream
+{
+public:
+    std::string str;
+    void Write(const std::string& s) { str += s; }
+};
+
+BOOST_AUTO_TEST_CASE(rpc_stream)
+{
+    if (RPCIsInWarmup(NULL))
+        SetRPCWarmupFinished();
+
+    // A parent and two children in the mempool, so that "depends" is filled in
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(2);
+    txParent.vout[0].nValue = txParent.vout[1].nValue = 33000LL;
+    mempool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0.0, 1));
+    for (int i = 0; i < 2; i++) {
+        CMutableTransaction txChild;
+        txChild.vin.resize(1);
+        txChild.vin[0].prevout = COutPoint(txParent.GetHash(), i);
+        txChild.vout.resize(1);
+        txChild.vout[0].nValue = 11000LL;
+        mempool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 2000, 0, 0.0, 1));
+    }
+
+    // Streaming variants write exactly what the regular actors return
+    StringJSONStream mempoolStream;
+    BOOST_CHECK(tableRPC.executeStream("getrawmempool", RPCConvertValues("getrawmempool", boost::assign::list_of("true")), mempoolStream));
+    BOOST_CHECK_EQUAL(mempoolStream.str, CallRPC("getrawmempool true").write());
+    BOOST_CHECK_EQUAL(CallRPC("getrawmempool true").size(), 3);
+
+    std::string strGenesis = Params().GenesisBlock().GetHash().GetHex();
+    StringJSONStream blockStream;
+    BOOST_CHECK(tableRPC.executeStream("getblock", RPCConvertValues("getblock", boost::assign::list_of(strGenesis)), blockStream));
+    BOOST_CHECK_EQUAL(blockStream.str, CallRPC("getblock " + strGenesis).write());
+
+    // Calls the streaming variants do not handle are left to the regular actors
+    StringJSONStream txids, hex, count;
+    BOOST_CHECK(!tableRPC.executeStream("getrawmempool", UniValue(UniValue::VARR), txids));
+    BOOST_CHECK_EQUAL(txids.str, CallRPC("getrawmempool").write());
+    BOOST_CHECK(!tableRPC.executeStream("getblock", RPCConvertValues("getblock", boost::assign::list_of(strGenesis)("false")), hex));
+    BOOST_CHECK_EQUAL(hex.str, CallRPC("getblock " + strGenesis + " false").write());
+    BOOST_CHECK(!tableRPC.executeStream("getblockcount", UniValue(UniValue::VARR), count));
+    BOOST_CHECK_EQUAL(count.str, "0");
+
+    // Errors are thrown before anything is written
+    StringJSONStream unused;
+    BOOST_CHECK_THROW(tableRPC.executeStream("getblock", RPCConvertValues("getblock", boost::assign::list_of("00")), unused), UniValue);
+    BOOST_CHECK_THROW(tableRPC.executeStream("getblockcount", RPCConvertValues("getblockcount", boost::assign::list_of("1")), unused), UniValue);
+    BOOST_CHECK_THROW(tableRPC.executeStream("nosuchmethod", UniValue(UniValue::VARR), unused), UniValue);
+    BOOST_CHECK(unused.str.empty());
+
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(rpc_read_chunked_reply)
+{
+    std::map<std::string, std::string> mapHeaders;
+    std::string strReply;
+
+    std::istringstream chunked("Content-Type: application/json\r\nTransfer-Encoding: chunked\r\n\r\n"
+                               "a\r\n{\"result\":\r\n4;ext=1\r\ntrue\r\n1\r\n}\r\n0\r\n\r\n");
+    BOOST_CHECK_EQUAL(ReadHTTPMessage(chunked, mapHeaders, strReply, 1, 1000), HTTP_OK);
+    BOOST_CHECK_EQUAL(strReply, "{\"result\":true}");
+    BOOST_CHECK_EQUAL(mapHeaders["connection"], "keep-alive");
+
+    std::istringstream tooLarge("Transfer-Encoding: chunked\r\n\r\n10\r\n0123456789abcdef\r\n0\r\n\r\n");
+    BOOST_CHECK_EQUAL(ReadHTTPMessage(tooLarge, mapHeaders, strReply, 1, 15), HTTP_INTERNAL_SERVER_ERROR);
+
+    std::istringstream truncated("Transfer-Encoding: chunked\r\n\r\n10\r\n0123");
+    BOOST_CHECK_EQUAL(ReadHTTPMessage(truncated, mapHeaders, strReply, 1, 1000), HTTP_INTERNAL_SERVER_ERROR);
+}
+
+static void HoldMainLock(CSemaphore* locked, CSemaphore* release)
+{
+    LOCK(cs_main);
+    locked->post();
+    release->wait();
+}
+
+BOOST_AUTO_TEST_CASE(rpc_tip_summary)
+{
+    std::string strGenesis = Params().GenesisBlock().GetHash().GetHex();
+    CChainTipSummaryRef tip = GetChainTipSummary();
+    BOOST_CHECK(tip->pindex == chainActive.Tip());
+    BOOST_CHECK_EQUAL(tip->nHeight, 0);
+    BOOST_CHECK_EQUAL(tip->hashBlock.GetHex(), strGenesis);
+    BOOST_CHECK(tip->nChainWork == chainActive.Tip()->nChainWork);
+    BOOST_CHECK_EQUAL(tip->nHeadersHeight, 0);
+
+    // Chain state RPCs answer while another thread holds cs_main
+    CSemaphore locked(0), release(0);
+    boost::thread holder(boost::bind(HoldMainLock, &locked, &release));
+    locked.wait();
+    BOOST_CHECK_EQUAL(CallRPC("getblockcount").get_int(), 0);
+    BOOST_CHECK_EQUAL(CallRPC("getbestblockhash").get_str(), strGenesis);
+    BOOST_CHECK_EQUAL(CallRPC("getdifficulty").get_real(), GetDifficulty(tip->pindex));
+    UniValue info = CallRPC("getblockchaininfo");
+    BOOST_CHECK_EQUAL(find_value(info, "blocks").get_int(), 0);
+    BOOST_CHECK_EQUAL(find_value(info, "headers").get_int(), 0);
+    BOOST_CHECK_EQUAL(find_value(info, "bestblockhash").get_str(), strGenesis);
+    BOOST_CHECK_EQUAL(find_value(info, "softforks").size(), 2);
+    BOOST_CHECK_EQUAL(find_value(CallRPC("getmininginfo"), "blocks").get_int(), 0);
+    release.post();
+    holder.join();
+}
+
+BOOST_AUTO_TEST_CASE(rpc_blockconnectstats)
+{
+    BOOST_CHECK_EQUAL(CallRPC("getblockconnectstats 0").size(), 1);
+    BOOST_CHECK_EQUAL(CallRPC("getblockconnectstats 0 10").size(), 1);
+    BOOST_CHECK_EQUAL(CallRPC("getblockconnectstats 1 10").size(), 0);
+    // The end of the range is clamped rather than overflowing
+    BOOST_CHECK_EQUAL(CallRPC("getblockconnectstats 2147483647 10").size(), 0);
+    BOOST_CHECK_THROW(CallRPC("getblockconnectstats -1"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("getblockconnectstats 0 0"), runtime_error);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
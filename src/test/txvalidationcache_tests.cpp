@@ -9,10 +9,12 @@
 #include "pubkey.h"
 #include "txmempool.h"
 #include "random.h"
+#include "script/sigcache.h"
 #include "script/standard.h"
 #include "test/test_bitcoin.h"
 #include "utiltime.h"
 
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
 BOOST_AUTO_TEST_SUITE(tx_validationcache_tests)
@@ -23,7 +25,7 @@ ToMemPool(CMutableTransaction& tx)
     LOCK(cs_main);
 
     CValidationState state;
-    return AcceptToMemoryPool(mempool, state, tx, false, NULL, false);
+    return AcceptToMemoryPool(mempool, state, MakeTransactionRef(tx), false, NULL, false);
 }
 
 BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
@@ -83,4 +85,178 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+static CMutableTransaction
+SpendP2PK(const uint256& hashPrev, const CScript& scriptPubKey, const CKey& key, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = hashPrev;
+    tx.vin[0].prevout.n = 0;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return tx;
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_batch_admission, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    CMutableTransaction parent = SpendP2PK(coinbaseTxns[0].GetHash(), scriptPubKey, coinbaseKey, 11*CENT);
+    CMutableTransaction child = SpendP2PK(parent.GetHash(), scriptPubKey, coinbaseKey, 10*CENT);
+    CMutableTransaction doubleSpend = SpendP2PK(coinbaseTxns[0].GetHash(), scriptPubKey, coinbaseKey, 12*CENT);
+    CMutableTransaction badSig = SpendP2PK(child.GetHash(), scriptPubKey, coinbaseKey, 9*CENT);
+    badSig.vout[0].nValue = 8*CENT; // invalidates the signature
+    CMutableTransaction orphan = SpendP2PK(GetRandHash(), scriptPubKey, coinbaseKey, 11*CENT);
+
+    // The child comes before its parent, the parent is double-spent within
+    // the batch, and the grandchild has a bad signature
+    std::vector<CTxAdmission> vBatch;
+    vBatch.push_back(CTxAdmission(MakeTransactionRef(child), 0, 0));
+    vBatch.push_back(CTxAdmission(MakeTransactionRef(parent), 0, 0));
+    vBatch.push_back(CTxAdmission(MakeTransactionRef(doubleSpend), 0, 0));
+    vBatch.push_back(CTxAdmission(MakeTransactionRef(badSig), 0, 0));
+    vBatch.push_back(CTxAdmission(MakeTransactionRef(orphan), 0, 0));
+
+    {
+        LOCK(cs_main);
+        BOOST_CHECK_EQUAL(AcceptToMemoryPoolBatch(mempool, vBatch, true), 2U);
+    }
+
+    BOOST_CHECK(vBatch[0].fAccepted);
+    BOOST_CHECK(vBatch[1].fAccepted);
+    BOOST_CHECK(mempool.exists(child.GetHash()));
+    BOOST_CHECK(mempool.exists(parent.GetHash()));
+
+    BOOST_CHECK(!vBatch[2].fAccepted);
+    BOOST_CHECK_EQUAL(vBatch[2].state.GetRejectReason(), "txn-mempool-conflict");
+
+    int nDoS = 0;
+    BOOST_CHECK(!vBatch[3].fAccepted);
+    BOOST_CHECK(vBatch[3].state.IsInvalid(nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 100);
+
+    BOOST_CHECK(!vBatch[4].fAccepted);
+    BOOST_CHECK(vBatch[4].fMissingInputs);
+    BOOST_CHECK(vBatch[4].state.IsValid());
+
+    BOOST_CHECK_EQUAL(mempool.size(), 2U);
+    mempool.clear();
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_batch_sigcache, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    CMutableTransaction parent = SpendP2PK(coinbaseTxns[0].GetHash(), scriptPubKey, coinbaseKey, 11*CENT);
+    CMutableTransaction child = SpendP2PK(parent.GetHash(), scriptPubKey, coinbaseKey, 10*CENT);
+    std::vector<CTxAdmission> vBatch;
+    vBatch.push_back(CTxAdmission(MakeTransactionRef(parent), 0, 0));
+    vBatch.push_back(CTxAdmission(MakeTransactionRef(child), 0, 0));
+
+    // Each signature is verified once, under the standard flags; the
+    // mandatory flags find it in the signature cache
+    uint64_t nHitsBefore, nMissesBefore, nHits, nMisses;
+    GetSignatureCacheStats(nHitsBefore, nMissesBefore);
+    {
+        LOCK(cs_main);
+        BOOST_CHECK_EQUAL(AcceptToMemoryPoolBatch(mempool, vBatch, true), 2U);
+    }
+    GetSignatureCacheStats(nHits, nMisses);
+    BOOST_CHECK_EQUAL(nMisses - nMissesBefore, 2U);
+    BOOST_CHECK_EQUAL(nHits - nHitsBefore, 2U);
+    mempool.clear();
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_batch_chain, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    // A chain of 25 transactions, given to the batch youngest first, then a
+    // second chain whose first transaction has a bad signature
+    std::vector<CMutableTransaction> chain;
+    uint256 hashPrev = coinbaseTxns[0].GetHash();
+    for (int i = 0; i < 25; i++) {
+        chain.push_back(SpendP2PK(hashPrev, scriptPubKey, coinbaseKey, (40 - i) * CENT));
+        hashPrev = chain.back().GetHash();
+    }
+    CMutableTransaction badSig = SpendP2PK(coinbaseTxns[1].GetHash(), scriptPubKey, coinbaseKey, 11*CENT);
+    badSig.vout[0].nValue = 12*CENT; // invalidates the signature
+    CMutableTransaction badSigChild = SpendP2PK(badSig.GetHash(), scriptPubKey, coinbaseKey, 10*CENT);
+
+    std::vector<CTxAdmission> vBatch;
+    BOOST_REVERSE_FOREACH(const CMutableTransaction& tx, chain)
+        vBatch.push_back(CTxAdmission(MakeTransactionRef(tx), 0, 0));
+    vBatch.push_back(CTxAdmission(MakeTransactionRef(badSigChild), 0, 0));
+    vBatch.push_back(CTxAdmission(MakeTransactionRef(badSig), 0, 0));
+
+    {
+        LOCK(cs_main);
+        BOOST_CHECK_EQUAL(AcceptToMemoryPoolBatch(mempool, vBatch, false), 25U);
+    }
+    for (int i = 0; i < 25; i++)
+        BOOST_CHECK(vBatch[i].fAccepted);
+    BOOST_CHECK_EQUAL(mempool.size(), 25U);
+
+    // The child of the rejected transaction is only tried after it, and
+    // finds its input missing
+    BOOST_CHECK(!vBatch[25].fAccepted);
+    BOOST_CHECK(vBatch[25].fMissingInputs);
+    BOOST_CHECK(!vBatch[26].fAccepted);
+    BOOST_CHECK(!vBatch[26].fMissingInputs);
+    mempool.clear();
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_reorg, TestChain100Setup)
+{
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    CMutableTransaction parent = SpendP2PK(coinbaseTxns[0].GetHash(), scriptPubKey, coinbaseKey, 11*CENT);
+    CMutableTransaction child = SpendP2PK(parent.GetHash(), scriptPubKey, coinbaseKey, 10*CENT);
+    CMutableTransaction grandchild = SpendP2PK(child.GetHash(), scriptPubKey, coinbaseKey, 9*CENT);
+
+    // Confirm parent and child in two consecutive blocks, leaving the
+    // grandchild in the mempool
+    std::vector<CMutableTransaction> vtx(1, parent);
+    CreateAndProcessBlock(vtx, scriptPubKey);
+    CBlockIndex* pindexFirst = chainActive.Tip();
+    vtx[0] = child;
+    CreateAndProcessBlock(vtx, scriptPubKey);
+    BOOST_CHECK(ToMemPool(grandchild));
+    BOOST_CHECK_EQUAL(mempool.size(), 1U);
+
+    // Disconnecting both blocks returns their transactions to the mempool,
+    // in an order the grandchild can still depend on
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, pindexFirst));
+    }
+    BOOST_CHECK(chainActive.Tip() == pindexFirst->pprev);
+    BOOST_CHECK_EQUAL(mempool.size(), 3U);
+    BOOST_CHECK(mempool.exists(parent.GetHash()));
+    BOOST_CHECK(mempool.exists(child.GetHash()));
+    BOOST_CHECK(mempool.exists(grandchild.GetHash()));
+
+    // Reconnecting them confirms the resurrected transactions again,
+    // without touching their unconfirmed descendant
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(ReconsiderBlock(state, pindexFirst));
+    }
+    CValidationState state;
+    BOOST_CHECK(ActivateBestChain(state));
+    BOOST_CHECK_EQUAL(chainActive.Height(), pindexFirst->nHeight + 1);
+    BOOST_CHECK_EQUAL(mempool.size(), 1U);
+    BOOST_CHECK(mempool.exists(grandchild.GetHash()));
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
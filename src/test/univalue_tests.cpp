@@ -3,12 +3,17 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <stdint.h>
+#include <algorithm>
+#include <limits>
 #include <vector>
 #include <string>
 #include <map>
 #include "univalue/univalue.h"
 #include "test/test_bitcoin.h"
+#include "tinyformat.h"
+#include "utiltime.h"
 
+#include <boost/lexical_cast.hpp>
 #include <boost/test/unit_test.hpp>
 
 using namespace std;
@@ -316,5 +321,149 @@ BOOST_AUTO_TEST_CASE(univalue_readwrite)
     BOOST_CHECK_EQUAL(strJson1, v.write());
 }
 
+BOOST_AUTO_TEST_CASE(univalue_keyindex)
+{
+    // Large enough for the key index to be built
+    UniValue obj(UniValue::VOBJ);
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(obj.pushKV("key" + boost::lexical_cast<string>(i), i));
+    BOOST_CHECK(obj.pushKV("key5", "dup"));
+
+    BOOST_CHECK_EQUAL(obj.size(), 101);
+    BOOST_CHECK(obj.exists("key99"));
+    BOOST_CHECK(!obj.exists("key100"));
+    BOOST_CHECK_EQUAL(find_value(obj, "key42").get_int(), 42);
+    BOOST_CHECK(find_value(obj, "nokey").isNull());
+    // The first of duplicate keys is found, as without the index
+    BOOST_CHECK_EQUAL(obj["key5"].get_int(), 5);
+
+    UniValue objCopy(obj);
+    UniValue objAssigned;
+    objAssigned = obj;
+    obj.clear();
+    BOOST_CHECK(!obj.exists("key42"));
+    BOOST_CHECK_EQUAL(objCopy["key42"].get_int(), 42);
+    BOOST_CHECK_EQUAL(objAssigned["key42"].get_int(), 42);
+
+    UniValue objMerged(UniValue::VOBJ);
+    BOOST_CHECK(objMerged.pushKVs(objCopy));
+    BOOST_CHECK_EQUAL(objMerged["key77"].get_int(), 77);
+
+    // Objects read from JSON are indexed as well
+    UniValue v;
+    BOOST_CHECK(v.read(objCopy.write()));
+    BOOST_CHECK_EQUAL(v.write(), objCopy.write());
+    BOOST_CHECK_EQUAL(v["key5"].get_int(), 5);
+    BOOST_CHECK_EQUAL(find_value(v, "key63").get_int(), 63);
+}
+
+BOOST_AUTO_TEST_CASE(univalue_push_own_element)
+{
+    // Pushing an element of the same array or object, while the push grows it
+    UniValue arr(UniValue::VARR);
+    arr.push_back("first element, long enough to live on the heap");
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(arr.push_back(arr[0]));
+    BOOST_CHECK_EQUAL(arr.size(), 101);
+    BOOST_CHECK_EQUAL(arr[100].get_str(), arr[0].get_str());
+
+    UniValue obj(UniValue::VOBJ);
+    obj.pushKV("a", arr);
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(obj.pushKV("key" + boost::lexical_cast<string>(i), obj["a"]));
+    BOOST_CHECK_EQUAL(obj.size(), 101);
+    BOOST_CHECK_EQUAL(obj["key99"].write(), arr.write());
+}
+
+/** Best time in microseconds of nRuns calls to f */
+template <typename F>
+static int64_t TimeBest(int nRuns, const F& f)
+{
+    int64_t nBest = std::numeric_limits<int64_t>::max();
+    for (int i = 0; i < nRuns; i++) {
+        int64_t nStart = GetTimeMicros();
+        f();
+        nBest = std::min(nBest, GetTimeMicros() - nStart);
+    }
+    return nBest;
+}
+
+struct ReadJSON
+{
+    const string& str;
+    ReadJSON(const string& str) : str(str) {}
+    void operator()() const { UniValue v; v.read(str); }
+};
+
+struct WriteJSON
+{
+    const UniValue& val;
+    WriteJSON(const UniValue& val) : val(val) {}
+    void operator()() const { val.write(); }
+};
+
+struct FindEveryKey
+{
+    const UniValue& obj;
+    mutable unsigned int nFound;
+    FindEveryKey(const UniValue& obj) : obj(obj), nFound(0) {}
+    void operator()() const
+    {
+        const vector<string>& keys = obj.getKeys();
+        nFound = 0;
+        for (unsigned int i = 0; i < keys.size(); i++)
+            nFound += !find_value(obj, keys[i]).isNull();
+    }
+};
+
+BOOST_AUTO_TEST_CASE(univalue_timing)
+{
+    // RPC requests of the shape that large createrawtransaction and
+    // signrawtransaction calls send. Run test_bitcoin with
+    // --run_test=univalue_tests/univalue_timing --log_level=message to see
+    // the timings.
+    const int nInputs = 5000;
+    UniValue inputs(UniValue::VARR), outputs(UniValue::VOBJ), prevtxs(UniValue::VARR);
+    for (int i = 0; i < nInputs; i++) {
+        string strHash = string(56, 'a' + i % 6) + strprintf("%08x", i);
+        UniValue input(UniValue::VOBJ);
+        input.pushKV("txid", strHash);
+        input.pushKV("vout", i % 4);
+        inputs.push_back(input);
+        outputs.pushKV(strprintf("mq%032x", i), UniValue(UniValue::VNUM, "0.00100000"));
+
+        input.pushKV("scriptPubKey", "76a914" + strHash.substr(0, 40) + "88ac");
+        input.pushKV("amount", UniValue(UniValue::VNUM, "0.01000000"));
+        prevtxs.push_back(input);
+    }
+    UniValue create(UniValue::VOBJ), createParams(UniValue::VARR);
+    createParams.push_back(inputs);
+    createParams.push_back(outputs);
+    create.pushKV("method", "createrawtransaction");
+    create.pushKV("params", createParams);
+    create.pushKV("id", 1);
+    UniValue sign(UniValue::VOBJ), signParams(UniValue::VARR);
+    signParams.push_back(string(nInputs * 82, 'f')); // unsigned transaction hex
+    signParams.push_back(prevtxs);
+    sign.pushKV("method", "signrawtransaction");
+    sign.pushKV("params", signParams);
+    sign.pushKV("id", 1);
+
+    string strCreate = create.write(), strSign = sign.write();
+    UniValue v;
+    BOOST_CHECK(v.read(strCreate));
+    BOOST_CHECK_EQUAL(v.write(), strCreate);
+    BOOST_CHECK(v.read(strSign));
+    BOOST_CHECK_EQUAL(v.write(), strSign);
+
+    BOOST_TEST_MESSAGE(strprintf("read %u byte createrawtransaction request: %d us", strCreate.size(), TimeBest(5, ReadJSON(strCreate))));
+    BOOST_TEST_MESSAGE(strprintf("write %u byte createrawtransaction request: %d us", strCreate.size(), TimeBest(5, WriteJSON(create))));
+    BOOST_TEST_MESSAGE(strprintf("read %u byte signrawtransaction request: %d us", strSign.size(), TimeBest(5, ReadJSON(strSign))));
+    BOOST_TEST_MESSAGE(strprintf("write %u byte signrawtransaction request: %d us", strSign.size(), TimeBest(5, WriteJSON(sign))));
+    FindEveryKey findEveryKey(outputs);
+    BOOST_TEST_MESSAGE(strprintf("find_value of each key of a %d key object: %d us", outputs.size(), TimeBest(5, findEveryKey)));
+    BOOST_CHECK_EQUAL(findEveryKey.nFound, outputs.size());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
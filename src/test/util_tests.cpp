@@ -5,6 +5,7 @@
 #include "util.h"
 
 #include "clientversion.h"
+#include "latencyhistogram.h"
 #include "primitives/transaction.h"
 #include "random.h"
 #include "sync.h"
@@ -12,6 +13,7 @@
 #include "utilmoneystr.h"
 #include "test/test_bitcoin.h"
 
+#include <limits>
 #include <stdint.h>
 #include <vector>
 
@@ -484,4 +486,32 @@ BOOST_AUTO_TEST_CASE(test_ParseFixedPoint)
     BOOST_CHECK(!ParseFixedPoint("1.", 8, &amount));
 }
 
+BOOST_AUTO_TEST_CASE(util_LatencyHistogram)
+{
+    CLatencyHistogram histogram;
+    BOOST_CHECK_EQUAL(histogram.GetCount(), 0U);
+    BOOST_CHECK_EQUAL(histogram.GetPercentile(0.5), 0);
+
+    histogram.Add(0);       // bucket 0
+    histogram.Add(1);       // bucket 1: [1, 2)
+    histogram.Add(3);       // bucket 2: [2, 4)
+    histogram.Add(1000);    // bucket 10: [512, 1024)
+    BOOST_CHECK_EQUAL(histogram.GetCount(), 4U);
+    BOOST_CHECK_EQUAL(histogram.GetTotal(), 1004);
+    BOOST_CHECK_EQUAL(histogram.GetMax(), 1000);
+    BOOST_CHECK_EQUAL(histogram.GetBucket(0), 1U);
+    BOOST_CHECK_EQUAL(histogram.GetBucket(1), 1U);
+    BOOST_CHECK_EQUAL(histogram.GetBucket(2), 1U);
+    BOOST_CHECK_EQUAL(histogram.GetBucket(10), 1U);
+    BOOST_CHECK_EQUAL(histogram.GetPercentile(0.5), 2);
+    BOOST_CHECK_EQUAL(histogram.GetPercentile(0.75), 4);
+    // Bucket bounds are capped by the largest latency seen
+    BOOST_CHECK_EQUAL(histogram.GetPercentile(1.0), 1000);
+
+    // Latencies beyond the last bucket are counted in it
+    histogram.Add(std::numeric_limits<int64_t>::max() / 2);
+    BOOST_CHECK_EQUAL(histogram.GetBucket(CLatencyHistogram::BUCKETS - 1), 1U);
+    BOOST_CHECK_EQUAL(histogram.GetPercentile(1.0), std::numeric_limits<int64_t>::max() / 2);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
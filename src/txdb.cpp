@@ -58,6 +58,42 @@ uint256 CCoinsViewDB::GetBestBlock() const {
     return hashBestChain;
 }
 
+namespace {
+
+/** Read-only view on a LevelDB snapshot of the coin database */
+class CCoinsViewDBSnapshot : public CCoinsView
+{
+private:
+    const CLevelDBWrapper& db;
+    const leveldb::Snapshot* snapshot;
+
+public:
+    CCoinsViewDBSnapshot(const CLevelDBWrapper& dbIn) : db(dbIn), snapshot(dbIn.GetSnapshot()) {}
+    ~CCoinsViewDBSnapshot() { db.ReleaseSnapshot(snapshot); }
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) const {
+        return db.Read(make_pair(DB_COINS, txid), coins, snapshot);
+    }
+
+    bool HaveCoins(const uint256 &txid) const {
+        CCoins coins;
+        return GetCoins(txid, coins);
+    }
+
+    uint256 GetBestBlock() const {
+        uint256 hashBestChain;
+        if (!db.Read(DB_BEST_BLOCK, hashBestChain, snapshot))
+            return uint256();
+        return hashBestChain;
+    }
+};
+
+}
+
+CCoinsView* CCoinsViewDB::CreateSnapshot() const {
+    return new CCoinsViewDBSnapshot(db);
+}
+
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CLevelDBBatch batch;
     size_t count = 0;
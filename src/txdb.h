@@ -39,6 +39,7 @@ public:
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+    CCoinsView* CreateSnapshot() const;
 };
 
 /** Access to the block database (blocks/index/) */
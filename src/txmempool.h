@@ -13,6 +13,8 @@
 #include "primitives/transaction.h"
 #include "sync.h"
 
+#include <boost/shared_ptr.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -36,7 +38,7 @@ static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 class CTxMemPoolEntry
 {
 private:
-    CTransaction tx;
+    CTransactionRef tx;
     CAmount nFee; //! Cached to avoid expensive parent-transaction lookups
     size_t nTxSize; //! ... and avoid recomputing tx size
     size_t nModSize; //! ... and modified size for priority
@@ -47,12 +49,15 @@ private:
     bool hadNoDependencies; //! Not dependent on any other txs when it entered the mempool
 
 public:
+    CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
+                    int64_t _nTime, double _dPriority, unsigned int _nHeight, bool poolHasNoInputsOf = false);
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                     int64_t _nTime, double _dPriority, unsigned int _nHeight, bool poolHasNoInputsOf = false);
     CTxMemPoolEntry();
     CTxMemPoolEntry(const CTxMemPoolEntry& other);
 
-    const CTransaction& GetTx() const { return this->tx; }
+    const CTransaction& GetTx() const { return *this->tx; }
+    const CTransactionRef& GetSharedTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
     CAmount GetFee() const { return nFee; }
     size_t GetTxSize() const { return nTxSize; }
@@ -78,6 +83,31 @@ public:
     size_t DynamicMemoryUsage() const { return 0; }
 };
 
+/**
+ * An immutable copy of the mempool's entries at one point in time. Readers
+ * iterate and search it without holding any lock, while the mempool itself
+ * moves on; entries share their transactions with the pool, so taking one
+ * costs a copy of the entry metadata, not of the transactions.
+ */
+class CTxMemPoolSnapshot
+{
+public:
+    //! Entries in txid order
+    std::vector<CTxMemPoolEntry> vEntries;
+    //! CTxMemPool::GetTransactionsUpdated() when the snapshot was taken
+    unsigned int nTransactionsUpdated;
+    uint64_t nTotalTxSize;
+
+    CTxMemPoolSnapshot() : nTransactionsUpdated(0), nTotalTxSize(0) {}
+
+    size_t size() const { return vEntries.size(); }
+    /** Return the entry for hash, or NULL if it wasn't in the pool */
+    const CTxMemPoolEntry* find(const uint256& hash) const;
+    bool exists(const uint256& hash) const { return find(hash) != NULL; }
+};
+
+typedef boost::shared_ptr<const CTxMemPoolSnapshot> CTxMemPoolSnapshotRef;
+
 /**
  * CTxMemPool stores valid-according-to-the-current-best-chain
  * transactions that may be included in the next block.
@@ -97,6 +127,7 @@ private:
 
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
     uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+    mutable CTxMemPoolSnapshotRef snapshot; //! Latest snapshot handed out, dropped when the pool changes so that it keeps no removed transaction alive
 
 public:
     mutable CCriticalSection cs;
@@ -117,11 +148,11 @@ public:
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate = true);
-    void remove(const CTransaction &tx, std::list<CTransaction>& removed, bool fRecursive = false);
+    void remove(const CTransaction &tx, std::list<CTransactionRef>& removed, bool fRecursive = false);
     void removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight);
-    void removeConflicts(const CTransaction &tx, std::list<CTransaction>& removed);
-    void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
-                        std::list<CTransaction>& conflicts, bool fCurrentEstimate = true);
+    void removeConflicts(const CTransaction &tx, std::list<CTransactionRef>& removed);
+    void removeForBlock(const std::vector<CTransactionRef>& vtx, unsigned int nBlockHeight,
+                        std::list<CTransactionRef>& conflicts, bool fCurrentEstimate = true);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     void pruneSpent(const uint256& hash, CCoins &coins);
@@ -157,6 +188,14 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+    /** Return a shared reference to a mempool transaction, or NULL if it is not in the pool. */
+    CTransactionRef get(const uint256& hash) const;
+    /**
+     * Return a snapshot of the current contents of the pool. Only the (cheap)
+     * copy of the entries, done once per change to the pool, holds cs; use it
+     * instead of iterating mapTx for anything slow, like building responses.
+     */
+    CTxMemPoolSnapshotRef GetSnapshot() const;
 
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
@@ -12,16 +12,83 @@
 
 #include "utilstrencodings.h" // ParseXX
 
+#include <boost/unordered_map.hpp>
+
 using namespace std;
 
 const UniValue NullUniValue;
 
+struct UniValue::KeyIndex
+{
+    boost::unordered_map<std::string, unsigned int> pos;
+};
+
+UniValue::UniValue(const UniValue& other) :
+    typ(other.typ), val(other.val), keys(other.keys), values(other.values), keyIndex(NULL)
+{
+    if (other.keyIndex)
+        keyIndex = new KeyIndex(*other.keyIndex);
+}
+
+UniValue& UniValue::operator=(const UniValue& other)
+{
+    if (this != &other) {
+        UniValue tmp(other);
+        swap(tmp);
+    }
+    return *this;
+}
+
+UniValue::~UniValue()
+{
+    delete keyIndex;
+}
+
+void UniValue::swap(UniValue& other)
+{
+    std::swap(typ, other.typ);
+    val.swap(other.val);
+    keys.swap(other.keys);
+    values.swap(other.values);
+    std::swap(keyIndex, other.keyIndex);
+}
+
 void UniValue::clear()
 {
     typ = VNULL;
     val.clear();
     keys.clear();
     values.clear();
+    delete keyIndex;
+    keyIndex = NULL;
+}
+
+/** Build the key index once the object is large enough to need one */
+void UniValue::indexKeys()
+{
+    if (keyIndex || keys.size() <= INDEX_MIN_KEYS)
+        return;
+    keyIndex = new KeyIndex();
+    keyIndex->pos.rehash(keys.size());
+    for (unsigned int i = 0; i < keys.size(); i++)
+        keyIndex->pos.insert(std::make_pair(keys[i], i)); // keeps the first occurrence
+}
+
+/** Append a null value, growing the vector by swapping rather than copying
+ * the existing elements, which may be large subtrees. References to the
+ * existing elements are invalidated. */
+UniValue& UniValue::appendValue()
+{
+    if (values.size() == values.capacity()) {
+        std::vector<UniValue> grown;
+        grown.reserve(values.empty() ? 4 : values.size() * 2);
+        grown.resize(values.size());
+        for (unsigned int i = 0; i < values.size(); i++)
+            grown[i].swap(values[i]);
+        values.swap(grown);
+    }
+    values.push_back(NullUniValue);
+    return values.back();
 }
 
 bool UniValue::setNull()
@@ -117,7 +184,9 @@ bool UniValue::push_back(const UniValue& val)
     if (typ != VARR)
         return false;
 
-    values.push_back(val);
+    // val may be one of our own elements, which growing would free
+    UniValue copy(val);
+    appendValue().swap(copy);
     return true;
 }
 
@@ -136,8 +205,13 @@ bool UniValue::pushKV(const std::string& key, const UniValue& val)
     if (typ != VOBJ)
         return false;
 
+    UniValue copy(val);
     keys.push_back(key);
-    values.push_back(val);
+    appendValue().swap(copy);
+    if (keyIndex)
+        keyIndex->pos.insert(std::make_pair(key, (unsigned int)(keys.size() - 1)));
+    else
+        indexKeys();
     return true;
 }
 
@@ -146,16 +220,20 @@ bool UniValue::pushKVs(const UniValue& obj)
     if (typ != VOBJ || obj.typ != VOBJ)
         return false;
 
-    for (unsigned int i = 0; i < obj.keys.size(); i++) {
-        keys.push_back(obj.keys[i]);
-        values.push_back(obj.values[i]);
-    }
+    keys.reserve(keys.size() + obj.keys.size());
+    for (unsigned int i = 0; i < obj.keys.size(); i++)
+        pushKV(obj.keys[i], obj.values[i]);
 
     return true;
 }
 
 int UniValue::findKey(const std::string& key) const
 {
+    if (keyIndex) {
+        boost::unordered_map<std::string, unsigned int>::const_iterator it = keyIndex->pos.find(key);
+        return it == keyIndex->pos.end() ? -1 : (int) it->second;
+    }
+
     for (unsigned int i = 0; i < keys.size(); i++) {
         if (keys[i] == key)
             return (int) i;
@@ -218,15 +296,11 @@ const char *uvTypeName(UniValue::VType t)
 
 const UniValue& find_value( const UniValue& obj, const std::string& name)
 {
-    for (unsigned int i = 0; i < obj.keys.size(); i++)
-    {
-        if( obj.keys[i] == name )
-        {
-            return obj.values[i];
-        }
-    }
+    int index = obj.findKey(name);
+    if (index < 0)
+        return NullUniValue;
 
-    return NullUniValue;
+    return obj.values[index];
 }
 
 std::vector<std::string> UniValue::getKeys() const
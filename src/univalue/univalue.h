@@ -18,34 +18,39 @@ class UniValue {
 public:
     enum VType { VNULL, VOBJ, VARR, VSTR, VNUM, VBOOL, };
 
-    UniValue() { typ = VNULL; }
-    UniValue(UniValue::VType initialType, const std::string& initialStr = "") {
+    UniValue() : keyIndex(NULL) { typ = VNULL; }
+    UniValue(UniValue::VType initialType, const std::string& initialStr = "") : keyIndex(NULL) {
         typ = initialType;
         val = initialStr;
     }
-    UniValue(uint64_t val_) {
+    UniValue(uint64_t val_) : keyIndex(NULL) {
         setInt(val_);
     }
-    UniValue(int64_t val_) {
+    UniValue(int64_t val_) : keyIndex(NULL) {
         setInt(val_);
     }
-    UniValue(bool val_) {
+    UniValue(bool val_) : keyIndex(NULL) {
         setBool(val_);
     }
-    UniValue(int val_) {
+    UniValue(int val_) : keyIndex(NULL) {
         setInt(val_);
     }
-    UniValue(double val_) {
+    UniValue(double val_) : keyIndex(NULL) {
         setFloat(val_);
     }
-    UniValue(const std::string& val_) {
+    UniValue(const std::string& val_) : keyIndex(NULL) {
         setStr(val_);
     }
-    UniValue(const char *val_) {
+    UniValue(const char *val_) : keyIndex(NULL) {
         std::string s(val_);
         setStr(s);
     }
-    ~UniValue() {}
+    UniValue(const UniValue& other);
+    UniValue& operator=(const UniValue& other);
+    ~UniValue();
+
+    /** Exchange contents with other without copying */
+    void swap(UniValue& other);
 
     void clear();
 
@@ -133,7 +138,18 @@ private:
     std::vector<std::string> keys;
     std::vector<UniValue> values;
 
+    /** Hash index from key to position of its first occurrence in keys.
+     * Objects get one once they have more than INDEX_MIN_KEYS keys, below
+     * that a linear scan is cheaper. It is maintained on every change, so
+     * that lookups stay read-only and safe to run concurrently.
+     */
+    struct KeyIndex;
+    KeyIndex* keyIndex;
+    static const size_t INDEX_MIN_KEYS = 16;
+
     int findKey(const std::string& key) const;
+    void indexKeys();
+    UniValue& appendValue();
     void writeArray(unsigned int prettyIndent, unsigned int indentLevel, std::string& s) const;
     void writeObject(unsigned int prettyIndent, unsigned int indentLevel, std::string& s) const;
 
@@ -108,8 +108,6 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
     case '8':
     case '9': {
         // part 1: int
-        string numStr;
-
         const char *first = raw;
 
         const char *firstDigit = first;
@@ -118,49 +116,39 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
         if ((*firstDigit == '0') && isdigit(firstDigit[1]))
             return JTOK_ERR;
 
-        numStr += *raw;                       // copy first char
-        raw++;
+        raw++;                                // first char
 
         if ((*first == '-') && (!isdigit(*raw)))
             return JTOK_ERR;
 
-        while ((*raw) && isdigit(*raw)) {     // copy digits
-            numStr += *raw;
+        while ((*raw) && isdigit(*raw))       // digits
             raw++;
-        }
 
         // part 2: frac
         if (*raw == '.') {
-            numStr += *raw;                   // copy .
-            raw++;
+            raw++;                            // .
 
             if (!isdigit(*raw))
                 return JTOK_ERR;
-            while ((*raw) && isdigit(*raw)) { // copy digits
-                numStr += *raw;
+            while ((*raw) && isdigit(*raw))   // digits
                 raw++;
-            }
         }
 
         // part 3: exp
         if (*raw == 'e' || *raw == 'E') {
-            numStr += *raw;                   // copy E
-            raw++;
+            raw++;                            // E
 
-            if (*raw == '-' || *raw == '+') { // copy +/-
-                numStr += *raw;
+            if (*raw == '-' || *raw == '+')   // +/-
                 raw++;
-            }
 
             if (!isdigit(*raw))
                 return JTOK_ERR;
-            while ((*raw) && isdigit(*raw)) { // copy digits
-                numStr += *raw;
+            while ((*raw) && isdigit(*raw))   // digits
                 raw++;
-            }
         }
 
-        tokenVal = numStr;
+        // The token is a verbatim copy of the input
+        tokenVal.assign(first, raw);
         consumed = (raw - rawStart);
         return JTOK_NUMBER;
         }
@@ -168,24 +156,31 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
     case '"': {
         raw++;                                // skip "
 
-        string valStr;
-
         while (*raw) {
-            if (*raw < 0x20)
+            // Copy runs of plain characters in one go
+            const char *run = raw;
+            while (*raw >= 0x20 && *raw != '"' && *raw != '\\')
+                raw++;
+            tokenVal.append(run, raw);
+
+            if (!*raw)
+                break;
+
+            else if (*raw < 0x20)
                 return JTOK_ERR;
 
             else if (*raw == '\\') {
                 raw++;                        // skip backslash
 
                 switch (*raw) {
-                case '"':  valStr += "\""; break;
-                case '\\': valStr += "\\"; break;
-                case '/':  valStr += "/"; break;
-                case 'b':  valStr += "\b"; break;
-                case 'f':  valStr += "\f"; break;
-                case 'n':  valStr += "\n"; break;
-                case 'r':  valStr += "\r"; break;
-                case 't':  valStr += "\t"; break;
+                case '"':  tokenVal += '"'; break;
+                case '\\': tokenVal += '\\'; break;
+                case '/':  tokenVal += '/'; break;
+                case 'b':  tokenVal += '\b'; break;
+                case 'f':  tokenVal += '\f'; break;
+                case 'n':  tokenVal += '\n'; break;
+                case 'r':  tokenVal += '\r'; break;
+                case 't':  tokenVal += '\t'; break;
 
                 case 'u': {
                     unsigned int codepoint;
@@ -194,14 +189,14 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
                         return JTOK_ERR;
 
                     if (codepoint <= 0x7f)
-                        valStr.push_back((char)codepoint);
+                        tokenVal.push_back((char)codepoint);
                     else if (codepoint <= 0x7FF) {
-                        valStr.push_back((char)(0xC0 | (codepoint >> 6)));
-                        valStr.push_back((char)(0x80 | (codepoint & 0x3F)));
+                        tokenVal.push_back((char)(0xC0 | (codepoint >> 6)));
+                        tokenVal.push_back((char)(0x80 | (codepoint & 0x3F)));
                     } else if (codepoint <= 0xFFFF) {
-                        valStr.push_back((char)(0xE0 | (codepoint >> 12)));
-                        valStr.push_back((char)(0x80 | ((codepoint >> 6) & 0x3F)));
-                        valStr.push_back((char)(0x80 | (codepoint & 0x3F)));
+                        tokenVal.push_back((char)(0xE0 | (codepoint >> 12)));
+                        tokenVal.push_back((char)(0x80 | ((codepoint >> 6) & 0x3F)));
+                        tokenVal.push_back((char)(0x80 | (codepoint & 0x3F)));
                     }
 
                     raw += 4;
@@ -215,18 +210,12 @@ enum jtokentype getJsonToken(string& tokenVal, unsigned int& consumed,
                 raw++;                        // skip esc'd char
             }
 
-            else if (*raw == '"') {
+            else {                            // closing "
                 raw++;                        // skip "
                 break;                        // stop scanning
             }
-
-            else {
-                valStr += *raw;
-                raw++;
-            }
         }
 
-        tokenVal = valStr;
         consumed = (raw - rawStart);
         return JTOK_STRING;
         }
@@ -246,10 +235,11 @@ bool UniValue::read(const char *raw)
 
     enum jtokentype tok = JTOK_NONE;
     enum jtokentype last_tok = JTOK_NONE;
+    // Token text is swapped into the tree instead of being copied
+    string tokenVal;
     while (1) {
         last_tok = tok;
 
-        string tokenVal;
         unsigned int consumed;
         tok = getJsonToken(tokenVal, consumed, raw);
         if (tok == JTOK_NONE || tok == JTOK_ERR)
@@ -268,11 +258,9 @@ bool UniValue::read(const char *raw)
                     setArray();
                 stack.push_back(this);
             } else {
-                UniValue tmpVal(utyp);
                 UniValue *top = stack.back();
-                top->values.push_back(tmpVal);
-
-                UniValue *newTop = &(top->values.back());
+                UniValue *newTop = &top->appendValue();
+                newTop->typ = utyp;
                 stack.push_back(newTop);
             }
 
@@ -291,6 +279,8 @@ bool UniValue::read(const char *raw)
             if (utyp != top->getType())
                 return false;
 
+            if (utyp == VOBJ)
+                top->indexKeys();
             stack.pop_back();
             expectName = false;
             break;
@@ -325,23 +315,20 @@ bool UniValue::read(const char *raw)
             if (!stack.size() || expectName || expectColon)
                 return false;
 
-            UniValue tmpVal;
+            UniValue& newVal = stack.back()->appendValue();
             switch (tok) {
             case JTOK_KW_NULL:
                 // do nothing more
                 break;
             case JTOK_KW_TRUE:
-                tmpVal.setBool(true);
+                newVal.setBool(true);
                 break;
             case JTOK_KW_FALSE:
-                tmpVal.setBool(false);
+                newVal.setBool(false);
                 break;
             default: /* impossible */ break;
             }
 
-            UniValue *top = stack.back();
-            top->values.push_back(tmpVal);
-
             break;
             }
 
@@ -349,9 +336,9 @@ bool UniValue::read(const char *raw)
             if (!stack.size() || expectName || expectColon)
                 return false;
 
-            UniValue tmpVal(VNUM, tokenVal);
-            UniValue *top = stack.back();
-            top->values.push_back(tmpVal);
+            UniValue& newVal = stack.back()->appendValue();
+            newVal.typ = VNUM;
+            newVal.val.swap(tokenVal);
 
             break;
             }
@@ -363,12 +350,14 @@ bool UniValue::read(const char *raw)
             UniValue *top = stack.back();
 
             if (expectName) {
-                top->keys.push_back(tokenVal);
+                top->keys.push_back(string());
+                top->keys.back().swap(tokenVal);
                 expectName = false;
                 expectColon = true;
             } else {
-                UniValue tmpVal(VSTR, tokenVal);
-                top->values.push_back(tmpVal);
+                UniValue& newVal = top->appendValue();
+                newVal.typ = VSTR;
+                newVal.val.swap(tokenVal);
             }
 
             break;
@@ -24,7 +24,7 @@
 #endif
 
 #ifndef WIN32
-// for posix_fallocate
+// for posix_fallocate and posix_fadvise
 #ifdef __linux__
 
 #ifdef _POSIX_C_SOURCE
@@ -689,6 +689,21 @@ void AllocateFileRange(FILE *file, unsigned int offset, unsigned int length) {
 #endif
 }
 
+/**
+ * this function tells the OS that a range of a file will be read soon, so that it can
+ * start reading it into the page cache in the background. It is advisory as well
+ */
+void FileReadAhead(FILE *file, unsigned int offset, unsigned int length) {
+#if defined(MAC_OSX)
+    struct radvisory ra;
+    ra.ra_offset = offset;
+    ra.ra_count = length;
+    fcntl(fileno(file), F_RDADVISE, &ra);
+#elif defined(__linux__)
+    posix_fadvise(fileno(file), offset, length, POSIX_FADV_WILLNEED);
+#endif
+}
+
 void ShrinkDebugFile()
 {
     // Scroll debug.log if it's getting too big
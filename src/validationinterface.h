@@ -10,6 +10,7 @@
 #include <boost/shared_ptr.hpp>
 
 class CBlock;
+class CBlockIndex;
 struct CBlockLocator;
 class CReserveScript;
 class CTransaction;
@@ -29,7 +30,11 @@ void UnregisterAllValidationInterfaces();
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock = NULL);
 
 class CValidationInterface {
+public:
+    virtual ~CValidationInterface() {}
+
 protected:
+    virtual void UpdatedBlockTip(const CBlockIndex *pindexNew, const CBlockIndex *pindexFork) {}
     virtual void SyncTransaction(const CTransaction &tx, const CBlock *pblock) {}
     virtual void SetBestChain(const CBlockLocator &locator) {}
     virtual void UpdatedTransaction(const uint256 &hash) {}
@@ -44,6 +49,8 @@ protected:
 };
 
 struct CMainSignals {
+    /** Notifies listeners of a new active chain tip, and of the last block it shares with the previous one (NULL if there was none). Not sent during initial block download. */
+    boost::signals2::signal<void (const CBlockIndex *, const CBlockIndex *)> UpdatedBlockTip;
     /** Notifies listeners of updated transaction data (transaction, and optionally the block it is found in. */
     boost::signals2::signal<void (const CTransaction &, const CBlock *)> SyncTransaction;
     /** Notifies listeners of an updated transaction without new data (for now: a coinbase potentially becoming visible). */